@@ -0,0 +1,117 @@
+#include "../toxcore/bloom_filter.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define WINDOW 60
+#define NUM_ITEMS 1400
+#define NUM_CHECKS 10000
+
+/* Make it look like filter was last rotated seconds earlier. */
+static void age(Bloom_Filter *filter, uint64_t seconds)
+{
+    filter->rotated -= seconds;
+}
+
+static void random_item(uint8_t *item)
+{
+    uint32_t i;
+
+    for (i = 0; i < crypto_box_PUBLICKEYBYTES; ++i)
+        item[i] = rand();
+}
+
+START_TEST(test_rotation)
+{
+    Bloom_Filter filter;
+    uint8_t a[crypto_box_PUBLICKEYBYTES], b[crypto_box_PUBLICKEYBYTES];
+
+    random_item(a);
+    random_item(b);
+
+    bloom_filter_init(&filter, WINDOW);
+    ck_assert_msg(!bloom_filter_check(&filter, a, sizeof(a)), "found in an empty filter");
+    bloom_filter_add(&filter, a, sizeof(a));
+    ck_assert_msg(bloom_filter_check(&filter, a, sizeof(a)), "not found right after adding it");
+
+    /* Still there in the previous generation. */
+    age(&filter, WINDOW);
+    ck_assert_msg(bloom_filter_check(&filter, a, sizeof(a)), "forgotten after one window");
+    bloom_filter_add(&filter, b, sizeof(b));
+
+    /* Its generation is cleared after two windows, the newer item is still there. */
+    age(&filter, WINDOW);
+    ck_assert_msg(!bloom_filter_check(&filter, a, sizeof(a)), "remembered for more than two windows");
+    ck_assert_msg(bloom_filter_check(&filter, b, sizeof(b)), "newer item forgotten after one window");
+
+    /* Adding it again makes it last longer. */
+    bloom_filter_add(&filter, b, sizeof(b));
+    age(&filter, WINDOW);
+    ck_assert_msg(bloom_filter_check(&filter, b, sizeof(b)), "added again but forgotten");
+
+    /* Both generations are too old after a long pause. */
+    age(&filter, WINDOW * 5);
+    ck_assert_msg(!bloom_filter_check(&filter, b, sizeof(b)), "remembered after a long pause");
+}
+END_TEST
+
+START_TEST(test_false_positives)
+{
+    Bloom_Filter filter;
+    static uint8_t items[NUM_ITEMS][crypto_box_PUBLICKEYBYTES];
+    uint8_t item[crypto_box_PUBLICKEYBYTES];
+    uint32_t i, false_positives = 0;
+
+    bloom_filter_init(&filter, WINDOW);
+
+    for (i = 0; i < NUM_ITEMS; ++i) {
+        random_item(items[i]);
+        bloom_filter_add(&filter, items[i], sizeof(items[i]));
+    }
+
+    for (i = 0; i < NUM_ITEMS; ++i)
+        ck_assert_msg(bloom_filter_check(&filter, items[i], sizeof(items[i])), "item %u not found", i);
+
+    for (i = 0; i < NUM_CHECKS; ++i) {
+        random_item(item);
+        false_positives += bloom_filter_check(&filter, item, sizeof(item));
+    }
+
+    /* Less than 1% is expected, leave some room for bad luck. */
+    ck_assert_msg(false_positives * 50 < NUM_CHECKS, "%u false positives out of %u", false_positives, NUM_CHECKS);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *bloom_filter_suite(void)
+{
+    Suite *s = suite_create("Bloom_Filter");
+
+    DEFTESTCASE(rotation);
+    DEFTESTCASE(false_positives);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *bloom_filter = bloom_filter_suite();
+    SRunner *test_runner = srunner_create(bloom_filter);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
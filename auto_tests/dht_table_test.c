@@ -0,0 +1,291 @@
+#include "../toxcore/DHT.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Nodes of the tests each get their own address. */
+static uint32_t next_ip = 0x0A000100;
+
+static DHT *make_dht(void)
+{
+    IP ip;
+
+    ip_init_v4(&ip, 0);
+    Networking_Core *net = new_networking(ip, 0);
+    ck_assert_msg(net != NULL, "could not create networking");
+    Net_Crypto *c = new_net_crypto(net);
+    ck_assert_msg(c != NULL, "could not create net_crypto");
+    new_keys(c);
+    DHT *dht = new_DHT(c);
+    ck_assert_msg(dht != NULL, "could not create DHT");
+    return dht;
+}
+
+static void free_dht(DHT *dht)
+{
+    Net_Crypto *c = dht->c;
+    Networking_Core *net = c->lossless_udp->net;
+
+    kill_DHT(dht);
+    kill_net_crypto(c);
+    kill_networking(net);
+}
+
+/* return the number of leading bits id1 and id2 have in common. */
+static uint32_t common_bits(uint8_t *id1, uint8_t *id2)
+{
+    uint32_t i;
+
+    for (i = 0; i < CLIENT_ID_SIZE * 8; ++i)
+        if ((id1[i / 8] ^ id2[i / 8]) & (0x80 >> (i % 8)))
+            break;
+
+    return i;
+}
+
+/* return 1 if id1 is closer to id than id2.
+ * return 0 if not.
+ */
+static int closer(uint8_t *id, uint8_t *id1, uint8_t *id2)
+{
+    uint32_t i;
+
+    for (i = 0; i < CLIENT_ID_SIZE; ++i)
+        if ((id[i] ^ id1[i]) != (id[i] ^ id2[i]))
+            return (id[i] ^ id1[i]) < (id[i] ^ id2[i]);
+
+    return 0;
+}
+
+/* Make a random id that goes in the bucket index of the routing table of dht. */
+static void id_in_bucket(DHT *dht, uint32_t index, uint8_t *client_id)
+{
+    uint32_t i;
+
+    memcpy(client_id, dht->c->self_public_key, CLIENT_ID_SIZE);
+    client_id[index / 8] ^= 0x80 >> (index % 8);
+
+    for (i = index + 1; i < CLIENT_ID_SIZE * 8; ++i)
+        if (rand() % 2)
+            client_id[i / 8] ^= 0x80 >> (i % 8);
+}
+
+/* Hear from the num nodes with ids, so that they go in the routing table. */
+static void add_nodes(DHT *dht, uint8_t (*ids)[CLIENT_ID_SIZE], uint32_t num)
+{
+    IP_Port ip_port;
+    uint32_t i;
+
+    memset(&ip_port, 0, sizeof(ip_port));
+
+    for (i = 0; i < num; ++i) {
+        ip_init_v4(&ip_port.ip, htonl(next_ip++));
+        ip_port.port = htons(33445);
+        addto_lists(dht, ip_port, ids[i]);
+    }
+}
+
+/* return 1 if the routing table of dht has a node with client_id, 0 if not. */
+static int table_has(DHT *dht, uint8_t *client_id)
+{
+    Client_data list[DHT_MAX_NODES];
+    uint32_t num = DHT_get_close_list(dht, list, DHT_MAX_NODES), i;
+
+    for (i = 0; i < num; ++i)
+        if (memcmp(list[i].client_id, client_id, CLIENT_ID_SIZE) == 0)
+            return 1;
+
+    return 0;
+}
+
+START_TEST(test_bucket_size)
+{
+    DHT *dht = make_dht();
+    uint8_t ids[20][CLIENT_ID_SIZE];
+    uint32_t i, j;
+
+    ck_assert(DHT_set_routing_table(dht, 4, DHT_MAX_NODES) == 0);
+
+    for (i = 0; i < 20; ++i)
+        id_in_bucket(dht, 10, ids[i]);
+
+    add_nodes(dht, ids, 20);
+    ck_assert_msg(dht->buckets[10].num == 4, "bucket has %u nodes instead of 4", dht->buckets[10].num);
+    ck_assert_msg(dht->num_nodes == 4, "table has %u nodes instead of 4", dht->num_nodes);
+
+    /* A full bucket keeps the nodes closest to us. */
+    for (i = 0; i < 20; ++i) {
+        if (table_has(dht, ids[i]))
+            continue;
+
+        for (j = 0; j < dht->buckets[10].num; ++j)
+            ck_assert_msg(closer(dht->c->self_public_key, dht->buckets[10].clients[j].client_id, ids[i]),
+                          "node %u was dropped for a further one", i);
+    }
+
+    free_dht(dht);
+}
+END_TEST
+
+START_TEST(test_make_room)
+{
+    DHT *dht = make_dht();
+    uint8_t ids[16][CLIENT_ID_SIZE];
+    uint32_t i;
+
+    ck_assert(DHT_set_routing_table(dht, 8, 16) == 0);
+
+    for (i = 0; i < 16; ++i)
+        id_in_bucket(dht, i < 8 ? 1 : 2, ids[i]);
+
+    add_nodes(dht, ids, 16);
+    ck_assert_msg(dht->num_nodes == 16, "table has %u nodes instead of 16", dht->num_nodes);
+
+    /* A full table makes room in the bucket furthest from us for closer nodes. */
+    for (i = 0; i < 4; ++i)
+        id_in_bucket(dht, 7, ids[i]);
+
+    add_nodes(dht, ids, 4);
+    ck_assert_msg(dht->num_nodes == 16, "table has %u nodes instead of 16", dht->num_nodes);
+    ck_assert_msg(dht->buckets[7].num == 4, "closer bucket has %u nodes instead of 4", dht->buckets[7].num);
+    ck_assert_msg(dht->buckets[1].num == 4, "furthest bucket has %u nodes instead of 4", dht->buckets[1].num);
+    ck_assert_msg(dht->buckets[2].num == 8, "other bucket has %u nodes instead of 8", dht->buckets[2].num);
+
+    /* But not for nodes further than all the ones it holds. */
+    for (i = 0; i < 4; ++i)
+        id_in_bucket(dht, 0, ids[i]);
+
+    add_nodes(dht, ids, 4);
+    ck_assert_msg(dht->buckets[0].num == 0, "further node took the place of a closer one");
+    ck_assert_msg(dht->num_nodes == 16, "table has %u nodes instead of 16", dht->num_nodes);
+
+    free_dht(dht);
+}
+END_TEST
+
+START_TEST(test_close_list)
+{
+    DHT *dht = make_dht();
+    uint8_t ids[32][CLIENT_ID_SIZE];
+    Client_data list[DHT_MAX_NODES];
+    uint32_t round, i, j;
+
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < 32; ++i)
+            id_in_bucket(dht, rand() % 24, ids[i]);
+
+        add_nodes(dht, ids, 32);
+    }
+
+    uint32_t num = DHT_get_close_list(dht, list, DHT_MAX_NODES);
+    ck_assert_msg(num == dht->num_nodes, "DHT_get_close_list() returned %u of %u nodes", num, dht->num_nodes);
+
+    for (i = 0; i < num; ++i)
+        ck_assert_msg(table_has(dht, list[i].client_id), "node %u is not in the table", i);
+
+    /* A shorter list has the nodes of the buckets closest to us. */
+    Client_data close_list[16];
+    uint32_t close_num = DHT_get_close_list(dht, close_list, 16);
+    ck_assert_msg(close_num == MIN(num, 16), "DHT_get_close_list() returned %u nodes", close_num);
+
+    for (i = 0; i < num; ++i) {
+        for (j = 0; j < close_num; ++j)
+            if (memcmp(close_list[j].client_id, list[i].client_id, CLIENT_ID_SIZE) == 0)
+                break;
+
+        if (j != close_num)
+            continue;
+
+        for (j = 0; j < close_num; ++j)
+            ck_assert_msg(common_bits(dht->c->self_public_key, close_list[j].client_id)
+                          >= common_bits(dht->c->self_public_key, list[i].client_id),
+                          "a closer node was left out");
+    }
+
+    free_dht(dht);
+}
+END_TEST
+
+START_TEST(test_close_nodes)
+{
+    DHT *dht = make_dht();
+    uint8_t ids[32][CLIENT_ID_SIZE];
+    uint8_t target[CLIENT_ID_SIZE];
+    Client_data list[DHT_MAX_NODES];
+    Node_format nodes[MAX_SENT_NODES];
+    uint32_t round, i, j, k;
+
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < 32; ++i)
+            id_in_bucket(dht, rand() % 24, ids[i]);
+
+        add_nodes(dht, ids, 32);
+    }
+
+    uint32_t num = DHT_get_close_list(dht, list, DHT_MAX_NODES);
+
+    /* The buckets looked at must give the closest nodes of the whole table, for targets in
+     * each bucket and for ours.
+     */
+    for (round = 0; round < 32; ++round) {
+        if (round < 24)
+            id_in_bucket(dht, round, target);
+        else
+            memcpy(target, dht->c->self_public_key, CLIENT_ID_SIZE);
+
+        int found = get_close_nodes(dht, target, nodes);
+        ck_assert_msg(found == MIN(num, MAX_SENT_NODES), "found %d nodes", found);
+
+        for (i = 0; i < num; ++i) {
+            for (j = 0; j < found; ++j)
+                if (memcmp(nodes[j].client_id, list[i].client_id, CLIENT_ID_SIZE) == 0)
+                    break;
+
+            if (j != found)
+                continue;
+
+            for (k = 0; k < found; ++k)
+                ck_assert_msg(!closer(target, list[i].client_id, nodes[k].client_id),
+                              "a closer node was left out for target %u", round);
+        }
+    }
+
+    free_dht(dht);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *dht_table_suite(void)
+{
+    Suite *s = suite_create("DHT_Table");
+
+    DEFTESTCASE(bucket_size);
+    DEFTESTCASE(make_room);
+    DEFTESTCASE(close_list);
+    DEFTESTCASE(close_nodes);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *dht_table = dht_table_suite();
+    SRunner *test_runner = srunner_create(dht_table);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
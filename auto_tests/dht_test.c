@@ -0,0 +1,157 @@
+#include "../toxcore/DHT.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_SENT 64
+
+/* The packets the DHTs of a test sent, without a socket. */
+typedef struct {
+    IP_Port from;
+    IP_Port to;
+    uint8_t data[NET_BATCH_PACKET_SIZE];
+    uint32_t length;
+} Sent_Packet;
+
+static Sent_Packet sent[MAX_SENT];
+static uint32_t num_sent;
+
+static int queue_packet(void *object, IP_Port ip_port, uint8_t *data, uint32_t length)
+{
+    IP_Port *from = object;
+
+    if (num_sent == MAX_SENT || length > NET_BATCH_PACKET_SIZE)
+        return -1;
+
+    sent[num_sent].from = *from;
+    sent[num_sent].to = ip_port;
+    memcpy(sent[num_sent].data, data, length);
+    sent[num_sent].length = length;
+    ++num_sent;
+    return length;
+}
+
+static IP_Port make_ip_port_v6(uint8_t last)
+{
+    IP_Port ip_port;
+
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip.uint8[0] = 0xFD;
+    ip_port.ip.uint8[15] = last;
+    ip_port.port = htons(33445);
+    return ip_port;
+}
+
+/* A DHT reached at *ip_port, that sends its packets with queue_packet(). */
+static DHT *make_dht(IP_Port *ip_port)
+{
+    Networking_Core *net = new_networking_transport(ip_port->ip, &queue_packet, ip_port);
+    ck_assert_msg(net != NULL, "could not create networking");
+    Net_Crypto *c = new_net_crypto(net);
+    ck_assert_msg(c != NULL, "could not create net_crypto");
+    new_keys(c);
+    DHT *dht = new_DHT(c);
+    ck_assert_msg(dht != NULL, "could not create DHT");
+    return dht;
+}
+
+static void free_dht(DHT *dht)
+{
+    Net_Crypto *c = dht->c;
+    Networking_Core *net = c->lossless_udp->net;
+
+    kill_DHT(dht);
+    kill_net_crypto(c);
+    kill_networking(net);
+}
+
+static void random_id(uint8_t *client_id)
+{
+    uint32_t i;
+
+    for (i = 0; i < CLIENT_ID_SIZE; ++i)
+        client_id[i] = rand();
+}
+
+/* A reply with both IPv4 and IPv6 nodes comes in two packets with the same ping_id, the
+ * nodes of both must be used.
+ */
+START_TEST(test_mixed_reply)
+{
+    IP_Port address_a = make_ip_port_v6(0xA), address_b = make_ip_port_v6(0xB);
+    IP_Port node4, node6 = make_ip_port_v6(6);
+    uint8_t id4[CLIENT_ID_SIZE], id6[CLIENT_ID_SIZE];
+    int pinged4 = 0, pinged6 = 0, replies = 0;
+    uint32_t i;
+
+    memset(&node4, 0, sizeof(node4));
+    ip_init_v4(&node4.ip, htonl(0x0A000004));
+    node4.port = htons(33445);
+    random_id(id4);
+    random_id(id6);
+    num_sent = 0;
+
+    DHT *a = make_dht(&address_a), *b = make_dht(&address_b);
+    addto_lists(b, node4, id4);
+    addto_lists(b, node6, id6);
+
+    DHT_bootstrap(a, address_b, b->c->self_public_key);
+
+    /* Handing packets over can send more of them. */
+    for (i = 0; i < num_sent; ++i) {
+        Sent_Packet *packet = &sent[i];
+
+        if (ipport_equal(packet->to, address_a)) {
+            if (packet->data[0] == NET_PACKET_SEND_NODES || packet->data[0] == NET_PACKET_SEND_NODES_IPV6)
+                ++replies;
+
+            networking_receive(a->c->lossless_udp->net, packet->from, packet->data, packet->length);
+        } else if (ipport_equal(packet->to, address_b)) {
+            networking_receive(b->c->lossless_udp->net, packet->from, packet->data, packet->length);
+        } else if (packet->data[0] == NET_PACKET_PING_REQUEST) {
+            pinged4 |= ipport_equal(packet->to, node4);
+            pinged6 |= ipport_equal(packet->to, node6);
+        }
+    }
+
+    ck_assert_msg(replies == 2, "%d send nodes packets instead of 2", replies);
+    ck_assert_msg(pinged4, "the IPv4 node was not used");
+    ck_assert_msg(pinged6, "the IPv6 node was not used");
+
+    free_dht(a);
+    free_dht(b);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *dht_suite(void)
+{
+    Suite *s = suite_create("DHT");
+
+    DEFTESTCASE(mixed_reply);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *dht = dht_suite();
+    SRunner *test_runner = srunner_create(dht);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -0,0 +1,151 @@
+#include "../toxcore/key_index.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_KEYS 1000
+
+static void random_key(uint8_t *key)
+{
+    uint32_t i;
+
+    for (i = 0; i < KEY_INDEX_KEY_SIZE; ++i)
+        key[i] = rand();
+}
+
+START_TEST(test_empty)
+{
+    Key_Index key_index;
+    uint8_t key[KEY_INDEX_KEY_SIZE];
+
+    key_index_init(&key_index);
+    random_key(key);
+    ck_assert_msg(key_index_find(&key_index, key) == -1, "found a key in an empty index");
+    key_index_remove(&key_index, key, 0);
+    ck_assert_msg(key_index_find(&key_index, key) == -1, "found a removed key");
+    key_index_free(&key_index);
+}
+END_TEST
+
+START_TEST(test_rehash)
+{
+    Key_Index key_index;
+    static uint8_t keys[NUM_KEYS][KEY_INDEX_KEY_SIZE];
+    uint32_t i;
+
+    key_index_init(&key_index);
+
+    /* Added one at a time the index is resized many times on the way. */
+    for (i = 0; i < NUM_KEYS; ++i) {
+        random_key(keys[i]);
+        ck_assert_msg(key_index_add(&key_index, keys[i], i) == 0, "could not add key %u", i);
+        ck_assert_msg(key_index_find(&key_index, keys[i]) == (int)i, "key %u lost right after adding it", i);
+    }
+
+    ck_assert_msg(key_index.used * 2 <= key_index.size, "index more than half full: %u of %u",
+                  key_index.used, key_index.size);
+
+    for (i = 0; i < NUM_KEYS; ++i)
+        ck_assert_msg(key_index_find(&key_index, keys[i]) == (int)i, "key %u lost after growing", i);
+
+    key_index_free(&key_index);
+}
+END_TEST
+
+START_TEST(test_duplicates)
+{
+    Key_Index key_index;
+    uint8_t key[KEY_INDEX_KEY_SIZE];
+
+    key_index_init(&key_index);
+    random_key(key);
+
+    ck_assert(key_index_add(&key_index, key, 7) == 0);
+    ck_assert(key_index_add(&key_index, key, 3) == 0);
+    ck_assert(key_index_add(&key_index, key, 5) == 0);
+    ck_assert_msg(key_index_find(&key_index, key) == 3, "not the lowest index");
+
+    /* Only the entry with that index goes. */
+    key_index_remove(&key_index, key, 3);
+    ck_assert_msg(key_index_find(&key_index, key) == 5, "wrong index after removing the lowest");
+    key_index_remove(&key_index, key, 4);
+    ck_assert_msg(key_index_find(&key_index, key) == 5, "removed an index that was not added");
+    key_index_remove(&key_index, key, 5);
+    key_index_remove(&key_index, key, 7);
+    ck_assert_msg(key_index_find(&key_index, key) == -1, "key still found after removing every index");
+
+    key_index_free(&key_index);
+}
+END_TEST
+
+START_TEST(test_tombstones)
+{
+    Key_Index key_index;
+    static uint8_t keys[NUM_KEYS][KEY_INDEX_KEY_SIZE];
+    uint32_t i, round, size;
+
+    key_index_init(&key_index);
+
+    for (i = 0; i < 64; ++i) {
+        random_key(keys[i]);
+        ck_assert(key_index_add(&key_index, keys[i], i) == 0);
+    }
+
+    size = key_index.size;
+
+    /* Keep replacing keys: the deleted slots must be reused instead of growing the index,
+     * and keys behind a deleted slot must still be found.
+     */
+    for (round = 0; round < 50; ++round) {
+        for (i = 0; i < 64; i += 2) {
+            key_index_remove(&key_index, keys[i], i);
+            ck_assert_msg(key_index_find(&key_index, keys[i]) == -1, "removed key %u found", i);
+            random_key(keys[i]);
+            ck_assert(key_index_add(&key_index, keys[i], i) == 0);
+        }
+
+        for (i = 0; i < 64; ++i)
+            ck_assert_msg(key_index_find(&key_index, keys[i]) == (int)i, "key %u lost in round %u", i, round);
+    }
+
+    ck_assert_msg(key_index.size == size, "index grew from %u to %u with the same number of keys", size,
+                  key_index.size);
+    key_index_free(&key_index);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *key_index_suite(void)
+{
+    Suite *s = suite_create("Key_Index");
+
+    DEFTESTCASE(empty);
+    DEFTESTCASE(rehash);
+    DEFTESTCASE(duplicates);
+    DEFTESTCASE(tombstones);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *key_index = key_index_suite();
+    SRunner *test_runner = srunner_create(key_index);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -64,6 +64,26 @@ START_TEST(test_m_sendmesage)
 }
 END_TEST
 
+START_TEST(test_m_sendmessage_multi)
+{
+    char *message = "h-hi :3";
+    int good_len = strlen(message);
+    int friendnumbers[] = {-1, REALLY_BIG_NUMBER, 17, friend_id_num};
+    uint32_t ids[] = {1, 1, 1, 1};
+    uint8_t accepted[] = {1, 1, 1, 1};
+    int i;
+
+    /* None of them are online. */
+    ck_assert(m_sendmessage_multi(m, friendnumbers, 4, (uint8_t *)message, good_len, ids) == 0);
+    ck_assert(m_sendaction_multi(m, friendnumbers, 4, (uint8_t *)message, good_len, accepted) == 0);
+
+    for (i = 0; i < 4; ++i)
+        ck_assert(ids[i] == 0 && accepted[i] == 0);
+
+    ck_assert(m_sendmessage_multi(m, friendnumbers, 4, (uint8_t *)message, MAX_DATA_SIZE, ids) == 0);
+}
+END_TEST
+
 START_TEST(test_m_get_userstatus_size)
 {
     int rc = 0;
@@ -212,6 +232,51 @@ START_TEST(test_getname)
 }
 END_TEST
 
+START_TEST(test_save_changes)
+{
+    Messenger *saved = initMessenger(), *loaded = initMessenger();
+    uint8_t name[MAX_NAME_LENGTH] = "bar";
+
+    ck_assert(m_addfriend_norequest(saved, good_id_a) == 0);
+    memcpy(saved->friendlist[0].name, name, sizeof(name));
+    ck_assert(Messenger_changes_size(saved) != 0);
+
+    uint32_t size = Messenger_size(saved);
+    uint8_t *data = malloc(size);
+    Messenger_save(saved, data);
+    ck_assert_msg(Messenger_changes_size(saved) == 0, "Messenger_save() did not clear the changes");
+
+    /* Only what changed since is appended. */
+    ck_assert(m_addfriend_norequest(saved, good_id_b) == 1);
+    ck_assert(m_delfriend(saved, 0) == 0);
+
+    uint32_t changes_size = Messenger_changes_size(saved);
+    ck_assert(changes_size != 0 && changes_size < size);
+    data = realloc(data, size + changes_size);
+    Messenger_save_changes(saved, data + size);
+    ck_assert(Messenger_changes_size(saved) == 0);
+
+    ck_assert(Messenger_load(loaded, data, size + changes_size) == 0);
+    ck_assert(memcmp(loaded->net_crypto->self_public_key, saved->net_crypto->self_public_key,
+                     crypto_box_PUBLICKEYBYTES) == 0);
+    ck_assert_msg(getfriend_id(loaded, good_id_a) == -1, "removed friend was loaded");
+    ck_assert_msg(getfriend_id(loaded, good_id_b) != -1, "added friend was not loaded");
+    ck_assert(Messenger_changes_size(loaded) == 0);
+
+    /* Without the changes the friend is still there, with its name. */
+    Messenger *old = initMessenger();
+    ck_assert(Messenger_load(old, data, size) == 0);
+    int friendnumber = getfriend_id(old, good_id_a);
+    ck_assert(friendnumber != -1);
+    ck_assert(strcmp((char *)old->friendlist[friendnumber].name, "bar") == 0);
+
+    free(data);
+    cleanupMessenger(old);
+    cleanupMessenger(loaded);
+    cleanupMessenger(saved);
+}
+END_TEST
+
 Suite *messenger_suite(void)
 {
     Suite *s = suite_create("Messenger");
@@ -225,16 +290,19 @@ Suite *messenger_suite(void)
     //TCase *addfriend = tcase_create("addfriend");
     TCase *setname = tcase_create("setname");
     TCase *getname = tcase_create("getname");
+    TCase *save_changes = tcase_create("save_changes");
 
     tcase_add_test(userstatus_size, test_m_get_userstatus_size);
     tcase_add_test(set_userstatus, test_m_set_userstatus);
     tcase_add_test(friendstatus, test_m_friendstatus);
     tcase_add_test(getself_name, test_getself_name);
     tcase_add_test(send_message, test_m_sendmesage);
+    tcase_add_test(send_message, test_m_sendmessage_multi);
     tcase_add_test(delfriend, test_m_delfriend);
     //tcase_add_test(addfriend, test_m_addfriend);
     tcase_add_test(setname, test_getname);
     tcase_add_test(setname, test_setname);
+    tcase_add_test(save_changes, test_save_changes);
 
     suite_add_tcase(s, userstatus_size);
     suite_add_tcase(s, set_userstatus);
@@ -245,6 +313,7 @@ Suite *messenger_suite(void)
     //suite_add_tcase(s, addfriend);
     suite_add_tcase(s, getname);
     suite_add_tcase(s, setname);
+    suite_add_tcase(s, save_changes);
 
     return s;
 }
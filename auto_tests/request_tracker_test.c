@@ -0,0 +1,145 @@
+#include "../toxcore/request_tracker.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+static IP_Port make_ip_port(uint32_t i)
+{
+    IP_Port ip_port;
+
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_init_v4(&ip_port.ip, htonl(0x0A000000 + i));
+    ip_port.port = htons(33445);
+    return ip_port;
+}
+
+/* Take a response of kind 0. */
+static int take(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id)
+{
+    uint64_t sent_time;
+
+    return request_tracker_take(tracker, ip_port, ping_id, 0, &sent_time);
+}
+
+START_TEST(test_take_once)
+{
+    Request_Tracker tracker;
+    IP_Port ip_port = make_ip_port(1);
+
+    ck_assert_msg(request_tracker_init(&tracker, 8, 5) == 0, "could not init tracker");
+
+    uint64_t ping_id = request_tracker_add(&tracker, ip_port);
+    ck_assert_msg(ping_id != 0, "ping_id is 0");
+    ck_assert_msg(request_tracker_find(&tracker, ip_port, 0), "request not found");
+    ck_assert_msg(take(&tracker, ip_port, 0) == 0, "ping_id 0 matched a response");
+    ck_assert_msg(take(&tracker, make_ip_port(2), ping_id) == 0, "response from someone else accepted");
+    ck_assert_msg(take(&tracker, ip_port, ping_id + 1) == 0, "wrong ping_id accepted");
+
+    ck_assert_msg(take(&tracker, ip_port, ping_id) != 0, "response rejected");
+    ck_assert_msg(take(&tracker, ip_port, ping_id) == 0, "second identical response accepted");
+    ck_assert_msg(!request_tracker_find(&tracker, ip_port, 0), "answered request still found");
+
+    request_tracker_free(&tracker);
+}
+END_TEST
+
+START_TEST(test_ring)
+{
+    Request_Tracker tracker;
+    uint64_t ping_ids[32];
+    uint32_t i;
+
+    ck_assert_msg(request_tracker_init(&tracker, 16, 5) == 0, "could not init tracker");
+
+    /* Answer some of them in the middle of the ring, then wrap it around. */
+    for (i = 0; i < 16; ++i)
+        ping_ids[i] = request_tracker_add(&tracker, make_ip_port(i % 4));
+
+    for (i = 0; i < 16; i += 3)
+        ck_assert_msg(take(&tracker, make_ip_port(i % 4), ping_ids[i]) != 0, "response %u rejected", i);
+
+    for (i = 16; i < 32; ++i)
+        ping_ids[i] = request_tracker_add(&tracker, make_ip_port(i % 4));
+
+    for (i = 0; i < 16; ++i)
+        ck_assert_msg(take(&tracker, make_ip_port(i % 4), ping_ids[i]) == 0, "forgotten request %u found", i);
+
+    ck_assert_msg(request_tracker_set_capacity(&tracker, 8) == 0, "could not change capacity");
+
+    for (i = 16; i < 24; ++i)
+        ck_assert_msg(take(&tracker, make_ip_port(i % 4), ping_ids[i]) == 0, "dropped request %u found", i);
+
+    for (i = 24; i < 32; ++i) {
+        ck_assert_msg(take(&tracker, make_ip_port(i % 4), ping_ids[i]) != 0, "request %u lost", i);
+        ck_assert_msg(take(&tracker, make_ip_port(i % 4), ping_ids[i]) == 0, "request %u answered twice", i);
+    }
+
+    request_tracker_free(&tracker);
+}
+END_TEST
+
+START_TEST(test_kinds)
+{
+    Request_Tracker tracker;
+    IP_Port ip_port = make_ip_port(1);
+    uint64_t sent_time = 0;
+
+    ck_assert_msg(request_tracker_init(&tracker, 8, 5) == 0, "could not init tracker");
+
+    /* A response in two packets of different kinds, in any order. */
+    uint64_t ping_id = request_tracker_add(&tracker, ip_port);
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 1, &sent_time) == 1, "first response rejected");
+    ck_assert_msg(sent_time != 0, "no sent time");
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 1, &sent_time) == 0,
+                  "second response of the same kind accepted");
+    ck_assert_msg(!request_tracker_find(&tracker, ip_port, 0), "answered request still found");
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 0, &sent_time) == 2,
+                  "response of another kind rejected");
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 0, &sent_time) == 0,
+                  "second response of the other kind accepted");
+
+    /* The kinds answered so far survive a change of capacity. */
+    ping_id = request_tracker_add(&tracker, ip_port);
+    ck_assert(request_tracker_take(&tracker, ip_port, ping_id, 0, &sent_time) == 1);
+    ck_assert_msg(request_tracker_set_capacity(&tracker, 16) == 0, "could not change capacity");
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 0, &sent_time) == 0, "answered kind forgotten");
+    ck_assert_msg(request_tracker_take(&tracker, ip_port, ping_id, 1, &sent_time) == 2, "other kind lost");
+
+    request_tracker_free(&tracker);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *request_tracker_suite(void)
+{
+    Suite *s = suite_create("Request_Tracker");
+
+    DEFTESTCASE(take_once);
+    DEFTESTCASE(ring);
+    DEFTESTCASE(kinds);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *request_tracker = request_tracker_suite();
+    SRunner *test_runner = srunner_create(request_tracker);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -0,0 +1,181 @@
+#include "../toxcore/shared_key_cache.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CAPACITY 4
+
+static uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+static uint8_t public_keys[CAPACITY + 2][crypto_box_PUBLICKEYBYTES];
+static uint8_t shared_keys[CAPACITY + 2][crypto_box_BEFORENMBYTES];
+
+/* Our secret key, and random public keys with the shared keys they give with it. */
+static void make_keys(void)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES], other_secret_key[crypto_box_SECRETKEYBYTES];
+    uint32_t i;
+
+    crypto_box_keypair(public_key, secret_key);
+
+    for (i = 0; i < CAPACITY + 2; ++i) {
+        crypto_box_keypair(public_keys[i], other_secret_key);
+        crypto_box_beforenm(shared_keys[i], public_keys[i], secret_key);
+    }
+}
+
+/* Get the shared key for public_keys[i] from cache and check it.
+ * return 1 if it was a hit.
+ * return 0 if it was a miss.
+ */
+static int get_key(Shared_Key_Cache *cache, uint32_t i)
+{
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint64_t hits = cache->hits;
+
+    memset(shared_key, 0, sizeof(shared_key));
+    shared_key_cache_get(cache, shared_key, secret_key, public_keys[i]);
+    ck_assert_msg(memcmp(shared_key, shared_keys[i], sizeof(shared_key)) == 0, "wrong shared key %u", i);
+    return cache->hits != hits;
+}
+
+START_TEST(test_lru)
+{
+    Shared_Key_Cache cache;
+    uint32_t i;
+
+    make_keys();
+    ck_assert(shared_key_cache_init(&cache, CAPACITY) == 0);
+
+    for (i = 0; i < CAPACITY; ++i)
+        ck_assert_msg(!get_key(&cache, i), "hit for key %u before it was computed", i);
+
+    ck_assert_msg(cache.num == CAPACITY, "%u keys instead of %u", cache.num, CAPACITY);
+
+    /* Using the oldest one makes the next one the least recently used. */
+    ck_assert_msg(get_key(&cache, 0), "key 0 not remembered");
+    ck_assert(!get_key(&cache, CAPACITY));
+    ck_assert_msg(cache.num == CAPACITY, "%u keys instead of %u", cache.num, CAPACITY);
+    ck_assert_msg(get_key(&cache, 0), "recently used key evicted");
+    ck_assert_msg(!get_key(&cache, 1), "least recently used key kept");
+
+    /* Key 2 made room for key 1, the others are still there. */
+    for (i = 0; i < CAPACITY + 1; ++i) {
+        if (i == 2)
+            continue;
+
+        ck_assert_msg(get_key(&cache, i), "key %u lost", i);
+    }
+
+    ck_assert(cache.hits == 2 + CAPACITY && cache.misses == CAPACITY + 2);
+    shared_key_cache_free(&cache);
+}
+END_TEST
+
+START_TEST(test_miss)
+{
+    Shared_Key_Cache cache;
+
+    make_keys();
+    ck_assert(shared_key_cache_init(&cache, CAPACITY) == 0);
+
+    /* Computed then remembered. */
+    ck_assert(!get_key(&cache, 0));
+    ck_assert(get_key(&cache, 0));
+    ck_assert(cache.misses == 1 && cache.hits == 1);
+
+    /* The counters survive a clear, the keys don't. */
+    shared_key_cache_clear(&cache);
+    ck_assert(cache.misses == 1 && cache.hits == 1);
+    ck_assert_msg(!get_key(&cache, 0), "key kept after a clear");
+    shared_key_cache_free(&cache);
+
+    /* A cache of size 0 computes every time. */
+    ck_assert(shared_key_cache_init(&cache, 0) == 0);
+    ck_assert(!get_key(&cache, 0));
+    ck_assert_msg(!get_key(&cache, 0), "empty cache kept a key");
+    ck_assert(cache.num == 0);
+    shared_key_cache_free(&cache);
+}
+END_TEST
+
+START_TEST(test_add)
+{
+    Shared_Key_Cache cache;
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t made_up[CAPACITY + 2][crypto_box_BEFORENMBYTES];
+    uint32_t i;
+
+    /* Made up shared keys, to tell which entry a hit comes from. */
+    make_keys();
+
+    for (i = 0; i < CAPACITY + 2; ++i)
+        memset(made_up[i], i + 1, crypto_box_BEFORENMBYTES);
+
+    ck_assert(shared_key_cache_init(&cache, CAPACITY) == 0);
+
+    for (i = 0; i < CAPACITY; ++i)
+        shared_key_cache_add(&cache, public_keys[i], made_up[i]);
+
+    /* Adding it again changes nothing. */
+    shared_key_cache_add(&cache, public_keys[2], made_up[3]);
+    ck_assert_msg(cache.num == CAPACITY, "%u keys instead of %u", cache.num, CAPACITY);
+
+    /* Added keys are used and evicted like computed ones. */
+    shared_key_cache_get(&cache, shared_key, secret_key, public_keys[0]);
+    ck_assert_msg(memcmp(shared_key, made_up[0], sizeof(shared_key)) == 0, "wrong shared key for a hit");
+    ck_assert(cache.hits == 1 && cache.misses == 0);
+
+    shared_key_cache_add(&cache, public_keys[CAPACITY], made_up[CAPACITY]);
+    ck_assert_msg(!shared_key_cache_has(&cache, public_keys[1]), "least recently used key kept");
+    ck_assert_msg(shared_key_cache_has(&cache, public_keys[0]), "recently used key evicted");
+
+    shared_key_cache_add(&cache, public_keys[CAPACITY + 1], made_up[CAPACITY + 1]);
+    ck_assert_msg(!shared_key_cache_has(&cache, public_keys[2]), "least recently used key kept");
+
+    for (i = 0; i < CAPACITY + 2; ++i) {
+        if (i == 1 || i == 2)
+            continue;
+
+        ck_assert_msg(shared_key_cache_has(&cache, public_keys[i]), "key %u lost", i);
+        shared_key_cache_get(&cache, shared_key, secret_key, public_keys[i]);
+        ck_assert_msg(memcmp(shared_key, made_up[i], sizeof(shared_key)) == 0, "wrong shared key %u", i);
+    }
+
+    shared_key_cache_free(&cache);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *shared_key_cache_suite(void)
+{
+    Suite *s = suite_create("Shared_Key_Cache");
+
+    DEFTESTCASE(lru);
+    DEFTESTCASE(miss);
+    DEFTESTCASE(add);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *shared_key_cache = shared_key_cache_suite();
+    SRunner *test_runner = srunner_create(shared_key_cache);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -0,0 +1,92 @@
+#include "../toxcore/timer.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_TIMERS 500
+
+START_TEST(test_order)
+{
+    Timer_Heap timers;
+    uint64_t deadlines[NUM_TIMERS];
+    uint32_t i;
+
+    timer_heap_init(&timers);
+    ck_assert_msg(timer_next(&timers) == (uint64_t)~0, "empty heap has a deadline");
+    ck_assert_msg(timer_pop(&timers, ~0) == -1, "popped a timer from an empty heap");
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        deadlines[i] = rand() % 10000;
+        ck_assert_msg(timer_set(&timers, i, deadlines[i]) == 0, "could not set timer");
+    }
+
+    /* Move some of them around and remove some others. */
+    for (i = 0; i < NUM_TIMERS; i += 3) {
+        deadlines[i] = rand() % 10000;
+        timer_set(&timers, i, deadlines[i]);
+    }
+
+    for (i = 1; i < NUM_TIMERS; i += 7) {
+        timer_unset(&timers, i);
+        deadlines[i] = ~0;
+    }
+
+    uint64_t last = 0;
+    uint32_t popped = 0;
+    int id;
+
+    while ((id = timer_pop(&timers, 5000)) != -1) {
+        ck_assert_msg(deadlines[id] >= last, "timers popped out of order");
+        ck_assert_msg(deadlines[id] <= 5000, "popped a timer that was not due");
+        last = deadlines[id];
+        deadlines[id] = ~0;
+        ++popped;
+    }
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        if (deadlines[i] <= 5000)
+            ck_abort_msg("timer %u was due but not popped", i);
+    }
+
+    ck_assert_msg(timer_next(&timers) > 5000 || timers.length == 0, "earliest deadline is wrong");
+
+    while ((id = timer_pop(&timers, ~0)) != -1)
+        ++popped;
+
+    ck_assert_msg(popped == NUM_TIMERS - (NUM_TIMERS + 5) / 7, "wrong number of timers popped: %u", popped);
+    timer_heap_free(&timers);
+}
+END_TEST
+
+#define DEFTESTCASE(NAME) \
+    TCase *NAME = tcase_create(#NAME); \
+    tcase_add_test(NAME, test_##NAME); \
+    suite_add_tcase(s, NAME);
+
+Suite *timer_suite(void)
+{
+    Suite *s = suite_create("Timer");
+
+    DEFTESTCASE(order);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *timer = timer_suite();
+    SRunner *test_runner = srunner_create(timer);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
@@ -29,6 +29,7 @@
 
 #include "../toxcore/DHT.h"
 #include "../toxcore/friend_requests.h"
+#include "../toxcore/crypto_workers.h"
 #include "../testing/misc_tools.c"
 
 /* Sleep function (x = milliseconds) */
@@ -42,6 +43,9 @@
 
 #define PORT 33445
 
+/* Maximum number of seconds to sleep in the main loop. */
+#define MAX_WAIT 10
+
 
 
 void manage_keys(DHT *dht)
@@ -81,12 +85,33 @@ void manage_keys(DHT *dht)
 
 int main(int argc, char *argv[])
 {
+    uint32_t workers = 0;
+
+    /* -w threads: check the crypto of new peers in that many threads. */
+    if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+        workers = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
     /* Initialize networking -
-       Bind to ip 0.0.0.0:PORT */
-    IP ip;
-    ip.uint32 = 0;
+       Bind to ip :: (IPv4 and IPv6):PORT */
+    IP ip = {{0}};
     DHT *dht = new_DHT(new_net_crypto(new_networking(ip, PORT)));
+    /* networking_poll() flushes the queue every iteration of the main loop. */
+    networking_set_batching(dht->c->lossless_udp->net, 1);
     manage_keys(dht);
+
+    if (workers != 0) {
+        if (crypto_workers_start(dht->c, workers) == -1) {
+            printf("Couldn't start the crypto workers.\n");
+        } else {
+            /* A busy node talks to many more peers than a client. */
+            set_shared_key_cache_size(dht->c, SHARED_KEY_CACHE_SIZE * 16);
+            printf("Crypto workers: %u\n", workers);
+        }
+    }
+
     printf("Public key: ");
     uint32_t i;
 
@@ -111,7 +136,7 @@ int main(int argc, char *argv[])
     if (argc > 3) {
         printf("Trying to bootstrap into the network...\n");
         IP_Port bootstrap_info;
-        bootstrap_info.ip.uint32 = inet_addr(argv[1]);
+        ip_init_v4(&bootstrap_info.ip, inet_addr(argv[1]));
         bootstrap_info.port = htons(atoi(argv[2]));
         uint8_t *bootstrap_key = hex_string_to_bin(argv[3]);
         DHT_bootstrap(dht, bootstrap_info, bootstrap_key);
@@ -130,7 +155,10 @@ int main(int argc, char *argv[])
 
         networking_poll(dht->c->lossless_udp->net);
 
-        c_sleep(1);
+        /* Sleep until a packet arrives or the DHT has something to do. */
+        uint64_t next_run = DHT_next_run(dht);
+        uint64_t now = unix_time();
+        networking_wait(dht->c->lossless_udp->net, (MIN(next_run, now + MAX_WAIT) - now) * 1000);
     }
 
     return 0;
@@ -34,11 +34,18 @@
 
 #include "../../toxcore/DHT.h"
 #include "../../toxcore/friend_requests.h"
+#include "../../toxcore/crypto_workers.h"
 
 #define DEFAULT_PORT 33445
 #define DEFAULT_PID_FILE "bootstrap_server.pid"
 #define DEFAULT_KEYS_FILE "bootstrap_server.keys"
 
+/* Maximum number of seconds to sleep in the main loop. */
+#define MAX_WAIT 10
+
+/* Default number of seconds between two writes of the stats file. */
+#define DEFAULT_STATS_INTERVAL 60
+
 /* Server info struct */
 struct server_info_s {
     int valid;
@@ -50,8 +57,11 @@ struct server_info_s {
 struct server_conf_s {
     int err;
     int port;
+    int crypto_workers;
+    int stats_interval;
     char pid_file[512];
     char keys_file[512];
+    char stats_file[512]; /* Empty if there is none. */
     struct server_info_s info[32];
 };
 
@@ -76,7 +86,7 @@ int b16_to_key(char b16_string[], uint8_t *bs_pubkey)
   resolve_addr():
     address should represent IPv4 or a hostname with a record
 
-    returns a data in network byte order that can be used to set IP.i or IP_Port.ip.i
+    returns a data in network byte order that can be passed to ip_init_v4()
     returns 0 on failure
 
     TODO: Fix ipv6 support
@@ -195,6 +205,64 @@ void manage_keys(DHT *dht, char *keys_file)
     fclose(keysf);
 }
 
+static void write_histogram(FILE *statsf, char *name, Stats_Histogram *histogram)
+{
+    int i;
+
+    fprintf(statsf, "%s_count %llu\n", name, (unsigned long long)histogram->count);
+    fprintf(statsf, "%s_sum %llu\n", name, (unsigned long long)histogram->sum);
+
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i)
+        fprintf(statsf, "%s_bucket_%d %llu\n", name, i, (unsigned long long)histogram->buckets[i]);
+}
+
+/* Write the stats of dht to stats_file, one "name value" line each.
+ * The file is replaced at once so that readers never see half of it.
+ */
+void write_stats(DHT *dht, char *stats_file)
+{
+    char tmp_file[512 + 4]; /* stats_file and ".tmp" */
+    Stats stats;
+    FILE *statsf;
+    int i;
+
+    DHT_get_stats(dht, &stats);
+    sprintf(tmp_file, "%s.tmp", stats_file);
+    statsf = fopen(tmp_file, "w");
+
+    if (statsf == NULL)
+        return;
+
+    for (i = 0; i < 256; ++i)
+        if (stats.packets_received[i] != 0)
+            fprintf(statsf, "packets_received_%d %llu\n", i, (unsigned long long)stats.packets_received[i]);
+
+#define WRITE_STAT(name) fprintf(statsf, #name " %llu\n", (unsigned long long)stats.name)
+    WRITE_STAT(bytes_received);
+    WRITE_STAT(packets_dropped);
+    WRITE_STAT(packets_sent);
+    WRITE_STAT(bytes_sent);
+    WRITE_STAT(send_errors);
+    WRITE_STAT(data_sent);
+    WRITE_STAT(data_resent);
+    WRITE_STAT(handshakes_refused);
+    WRITE_STAT(connections_timed_out);
+    WRITE_STAT(decrypt_failures);
+    WRITE_STAT(pings_sent);
+    WRITE_STAT(ping_responses);
+    WRITE_STAT(pings_missed);
+    WRITE_STAT(dht_nodes);
+    WRITE_STAT(dht_good_nodes);
+    WRITE_STAT(dht_friends);
+    WRITE_STAT(connections);
+#undef WRITE_STAT
+    write_histogram(statsf, "connection_rtt", &stats.connection_rtt);
+    write_histogram(statsf, "dht_rtt", &stats.dht_rtt);
+
+    if (fclose(statsf) == 0)
+        rename(tmp_file, stats_file);
+}
+
 /* This reads the configuration file, and returns a struct server_conf_s with:
  *an error number:
     *-1 = file wasn't read, for whatever reason
@@ -212,6 +280,7 @@ struct server_conf_s configure_server(char *cfg_file)
     /* This one will be strcpy'd into the pid_file array in server_conf */
     const char *pid_file_tmp;
     const char *keys_file_tmp;
+    const char *stats_file_tmp;
 
     /* Remote bootstrap server variables */
     int bs_port;
@@ -224,8 +293,11 @@ struct server_conf_s configure_server(char *cfg_file)
     /* Set both to their default values. If there's an error
     with opening/reading the config file, we return right away */
     server_conf.port = DEFAULT_PORT;
+    server_conf.crypto_workers = 0;
+    server_conf.stats_interval = DEFAULT_STATS_INTERVAL;
     strcpy(server_conf.pid_file, DEFAULT_PID_FILE);
     strcpy(server_conf.keys_file, DEFAULT_KEYS_FILE);
+    server_conf.stats_file[0] = '\0';
 
     config_init(&cfg);
 
@@ -245,6 +317,11 @@ struct server_conf_s configure_server(char *cfg_file)
         fprintf(stderr, "No 'port' setting in configuration file.\n");
     }
 
+    /* Get the number of crypto worker threads, none by default */
+    if (config_lookup_int(&cfg, "crypto_workers", &server_conf.crypto_workers)) {
+        //printf("Crypto workers: %d\n", server_conf.crypto_workers);
+    }
+
     /* Get PID file location */
     if (config_lookup_string(&cfg, "pid_file", &pid_file_tmp)) {
         //printf("PID file: %s\n", pid_file_tmp);
@@ -261,6 +338,20 @@ struct server_conf_s configure_server(char *cfg_file)
         fprintf(stderr, "No 'keys_file' setting in configuration file.\n");
     }
 
+    /* Get the stats file location, no stats file by default */
+    if (config_lookup_string(&cfg, "stats_file", &stats_file_tmp)
+            && strlen(stats_file_tmp) < sizeof(server_conf.stats_file)) {
+        //printf("Stats file: %s\n", stats_file_tmp);
+        strcpy(server_conf.stats_file, stats_file_tmp);
+    }
+
+    if (config_lookup_int(&cfg, "stats_interval", &server_conf.stats_interval)) {
+        //printf("Stats interval: %d\n", server_conf.stats_interval);
+    }
+
+    if (server_conf.stats_interval <= 0)
+        server_conf.stats_interval = DEFAULT_STATS_INTERVAL;
+
     /* Get all the servers in the list */
     server_list = config_lookup(&cfg, "bootstrap_servers");
 
@@ -301,7 +392,7 @@ struct server_conf_s configure_server(char *cfg_file)
                 printf("bootstrap_server %d: Invalid port.\n", i);
             }
 
-            server_conf.info[i].conn.ip.uint32 = resolve_addr(strcpy(tmp_ip, bs_ip));
+            ip_init_v4(&server_conf.info[i].conn.ip, resolve_addr(strcpy(tmp_ip, bs_ip)));
             server_conf.info[i].conn.port = htons(bs_port);
             b16_to_key(strcpy(tmp_pk, bs_pk), bs_pk_p);
         }
@@ -338,10 +429,11 @@ int main(int argc, char *argv[])
     server_conf = configure_server(argv[1]);
 
     /* Initialize networking
-    bind to ip 0.0.0.0:PORT */
-    IP ip;
-    ip.uint32 = 0;
+    bind to ip :: (IPv4 and IPv6):PORT */
+    IP ip = {{0}};
     DHT *dht = new_DHT(new_net_crypto(new_networking(ip, server_conf.port)));
+    /* networking_poll() flushes the queue every iteration of the main loop. */
+    networking_set_batching(dht->c->lossless_udp->net, 1);
     /* Read the config file */
     printf("PID file: %s\n", server_conf.pid_file);
     printf("Key file: %s\n", server_conf.keys_file);
@@ -443,11 +535,34 @@ int main(int argc, char *argv[])
     close(STDIN_FILENO);
     close(STDERR_FILENO);
 
+    /* Threads don't survive fork(), start the workers in the child. */
+    if (server_conf.crypto_workers > 0
+            && crypto_workers_start(dht->c, server_conf.crypto_workers) == 0) {
+        /* A busy node talks to many more peers than a client. */
+        set_shared_key_cache_size(dht->c, SHARED_KEY_CACHE_SIZE * 16);
+    }
+
+    uint64_t next_stats = unix_time();
+
     while (1) {
         do_DHT(dht);
 
         networking_poll(dht->c->lossless_udp->net);
-        usleep(10000);
+
+        /* Sleep until a packet arrives or the DHT has something to do. */
+        uint64_t next_run = DHT_next_run(dht);
+        uint64_t now = unix_time();
+
+        if (server_conf.stats_file[0] != '\0') {
+            if (next_stats <= now) {
+                write_stats(dht, server_conf.stats_file);
+                next_stats = now + server_conf.stats_interval;
+            }
+
+            next_run = MIN(next_run, next_stats);
+        }
+
+        networking_wait(dht->c->lossless_udp->net, (MIN(next_run, now + MAX_WAIT) - now) * 1000);
     }
 
     shutdown_networking();
@@ -0,0 +1,589 @@
+/* DHT_sim.c
+ *
+ * Runs many DHT nodes in one process on a simulated network and clock, to see how the DHT does
+ * as the network grows.
+ *
+ * Usage: ./DHT_sim [nodes] [seconds] [seed] [loss]
+ * EX: ./DHT_sim 10000 900 1
+ *
+ * Runs nodes (default 1000) for seconds (default 600) of simulated time. The nodes join one
+ * after the other during the first quarter, each bootstrapping from a node that joined before
+ * it. Packets take 10 to 110 ms and loss out of 1000 of them (default 0) are lost.
+ * Every minute it prints how many nodes are connected and how good their routing tables are,
+ * at the end the lookup hop counts, the bandwidth per node and the convergence times.
+ *
+ * Everything (keys and nonces included) comes from a generator seeded with seed, so a run
+ * can be repeated exactly.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/id_distance.h"
+#include "../toxcore/misc_tools.h"
+
+#include <stdio.h>
+
+#define SIM_PORT 33445
+
+/* Simulated time starts at some fixed point, in microseconds. */
+#define SIM_EPOCH (1380000000ULL * 1000000)
+
+/* Every how many seconds the state of the network is printed. */
+#define SIM_REPORT_INTERVAL 60
+
+/* Random lookups and routing table checks done for each report. */
+#define SIM_SAMPLES 200
+
+/* Most nodes a lookup asks before giving up. */
+#define SIM_MAX_HOPS 32
+
+typedef struct {
+    DHT *dht;
+    IP_Port ip_port;
+    uint32_t latency; /* Half the round trip time to anyone, in microseconds. */
+    uint64_t join_time;
+    uint64_t connected_time; /* When DHT_isconnected() was first true, 0 until then. */
+    uint64_t next_run; /* When do_DHT() has work to do, in unix_time() units. */
+    uint8_t dirty; /* Got packets since next_run was computed. */
+} Sim_Node;
+
+typedef struct {
+    uint64_t time; /* Of arrival. */
+    uint32_t to;
+    IP_Port from;
+    uint16_t length;
+    uint8_t *data;
+} Sim_Packet;
+
+/* Packets on their way, a heap by time of arrival. */
+static Sim_Packet *packets;
+static uint32_t num_packets, packets_capacity;
+
+static Sim_Node *nodes;
+static uint32_t num_nodes, joined;
+static uint64_t sim_time = SIM_EPOCH;
+static uint64_t random_state;
+static uint32_t loss;
+
+/* xorshift64* */
+static uint64_t sim_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ULL;
+}
+
+static uint64_t sim_clock(void *object)
+{
+    return sim_time;
+}
+
+#ifndef VANILLA_NACL
+
+/* Make libsodium (the keys, the nonces and random_int()) use sim_random() too. */
+static const char *sim_randombytes_name(void)
+{
+    return "DHT_sim";
+}
+
+static uint32_t sim_randombytes_random(void)
+{
+    return sim_random() >> 32;
+}
+
+static void sim_randombytes_stir(void)
+{
+}
+
+static uint32_t sim_randombytes_uniform(const uint32_t upper_bound)
+{
+    return upper_bound < 2 ? 0 : sim_randombytes_random() % upper_bound;
+}
+
+static void sim_randombytes_buf(void *const buf, const size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; ++i)
+        ((uint8_t *)buf)[i] = sim_random() >> 56;
+}
+
+static int sim_randombytes_close(void)
+{
+    return 0;
+}
+
+static randombytes_implementation sim_randombytes = {
+    .implementation_name = sim_randombytes_name,
+    .random = sim_randombytes_random,
+    .stir = sim_randombytes_stir,
+    .uniform = sim_randombytes_uniform,
+    .buf = sim_randombytes_buf,
+    .close = sim_randombytes_close
+};
+
+#endif
+
+static Networking_Core *node_net(Sim_Node *node)
+{
+    return node->dht->c->lossless_udp->net;
+}
+
+/* return the index of the node at ip_port, -1 if there is none. */
+static int32_t node_index(IP_Port ip_port)
+{
+    if (!ip_is_v4(ip_port.ip) || ip_port.port != htons(SIM_PORT))
+        return -1;
+
+    uint32_t index = ntohl(ip_get_v4(ip_port.ip).uint32) & 0xFFFFFF;
+
+    if (index >= joined)
+        return -1;
+
+    return index;
+}
+
+static int packet_before(uint32_t a, uint32_t b)
+{
+    return packets[a].time < packets[b].time;
+}
+
+static void swap_packets(uint32_t a, uint32_t b)
+{
+    Sim_Packet temp = packets[a];
+    packets[a] = packets[b];
+    packets[b] = temp;
+}
+
+/* Transport of all the nodes: put the packet on its way. */
+static int sim_send(void *object, IP_Port ip_port, uint8_t *data, uint32_t length)
+{
+    Sim_Node *from = object;
+    int32_t to = node_index(ip_port);
+
+    if (to == -1 || sim_random() % 1000 < loss)
+        return length;
+
+    if (num_packets == packets_capacity) {
+        uint32_t capacity = MAX(packets_capacity * 2, 1024);
+        Sim_Packet *temp = realloc(packets, capacity * sizeof(Sim_Packet));
+
+        if (temp == NULL)
+            return -1;
+
+        packets = temp;
+        packets_capacity = capacity;
+    }
+
+    Sim_Packet *packet = &packets[num_packets];
+    packet->data = malloc(length);
+
+    if (packet->data == NULL)
+        return -1;
+
+    memcpy(packet->data, data, length);
+    packet->length = length;
+    packet->from = from->ip_port;
+    packet->to = to;
+    packet->time = sim_time + from->latency + nodes[to].latency;
+
+    uint32_t i = num_packets++;
+
+    for (; i > 0 && packet_before(i, (i - 1) / 2); i = (i - 1) / 2)
+        swap_packets(i, (i - 1) / 2);
+
+    return length;
+}
+
+static void pop_packet(Sim_Packet *packet)
+{
+    uint32_t i = 0;
+
+    *packet = packets[0];
+    packets[0] = packets[--num_packets];
+
+    while (1) {
+        uint32_t smallest = i, left = i * 2 + 1, right = i * 2 + 2;
+
+        if (left < num_packets && packet_before(left, smallest))
+            smallest = left;
+
+        if (right < num_packets && packet_before(right, smallest))
+            smallest = right;
+
+        if (smallest == i)
+            break;
+
+        swap_packets(i, smallest);
+        i = smallest;
+    }
+}
+
+static int join(uint32_t index)
+{
+    Sim_Node *node = &nodes[index];
+    IP ip;
+
+    ip_init_v4(&ip, htonl((10 << 24) | index));
+    node->ip_port.ip = ip;
+    node->ip_port.port = htons(SIM_PORT);
+    node->ip_port.padding = 0;
+    node->latency = 5000 + sim_random() % 50000;
+    node->join_time = sim_time;
+
+    Networking_Core *net = new_networking_transport(ip, &sim_send, node);
+
+    if (net == NULL)
+        return -1;
+
+    Net_Crypto *c = new_net_crypto(net);
+
+    if (c == NULL)
+        return -1;
+
+    new_keys(c);
+    node->dht = new_DHT(c);
+
+    if (node->dht == NULL)
+        return -1;
+
+    joined = index + 1;
+
+    if (index != 0) {
+        Sim_Node *bootstrap = &nodes[sim_random() % index];
+        DHT_bootstrap(node->dht, bootstrap->ip_port, bootstrap->dht->c->self_public_key);
+        node->dirty = 1;
+    }
+
+    return 0;
+}
+
+/* Insert id in closest (of length num < max, sorted by distance to target), if it is closer than the others.
+ * return the new length of closest.
+ */
+static uint32_t insert_closest(uint8_t (*closest)[CLIENT_ID_SIZE], ID_Distance *distances, uint32_t num,
+                               uint32_t max, uint8_t *target, uint8_t *id)
+{
+    ID_Distance distance;
+    uint32_t i;
+
+    id_distance(&distance, target, id);
+
+    for (i = 0; i < num; ++i)
+        if (id_distance_cmp(&distance, &distances[i]) == 0)
+            return num;
+
+    for (i = num; i > 0 && id_distance_cmp(&distance, &distances[i - 1]) < 0; --i) {
+        if (i < max) {
+            memcpy(closest[i], closest[i - 1], CLIENT_ID_SIZE);
+            distances[i] = distances[i - 1];
+        }
+    }
+
+    if (i < max) {
+        memcpy(closest[i], id, CLIENT_ID_SIZE);
+        distances[i] = distance;
+        num = MIN(num + 1, max);
+    }
+
+    return num;
+}
+
+/* return the share (out of 1) of the MAX_SENT_NODES nodes closest to node that get_close_nodes()
+ * of node returns for its own id: how well it knows its part of the network, where the lookups
+ * for the nodes in there end.
+ */
+static double close_nodes_quality(Sim_Node *node)
+{
+    uint8_t *target = node->dht->c->self_public_key;
+    uint8_t closest[MAX_SENT_NODES][CLIENT_ID_SIZE];
+    ID_Distance distances[MAX_SENT_NODES];
+    Node_format list[MAX_SENT_NODES];
+    uint32_t i, j, num = 0, found = 0;
+
+    for (i = 0; i < joined; ++i)
+        if (&nodes[i] != node)
+            num = insert_closest(closest, distances, num, MAX_SENT_NODES, target, nodes[i].dht->c->self_public_key);
+
+    int num_list = get_close_nodes(node->dht, target, list);
+
+    for (i = 0; i < num; ++i)
+        for (j = 0; j < num_list; ++j)
+            if (memcmp(closest[i], list[j].client_id, CLIENT_ID_SIZE) == 0) {
+                ++found;
+                break;
+            }
+
+    return num == 0 ? 1 : (double)found / num;
+}
+
+typedef struct {
+    Node_format node;
+    ID_Distance distance;
+    uint8_t asked;
+} Lookup_Node;
+
+/* Add node to the (at most MAX_SENT_NODES * 2) nodes of the lookup, sorted by distance to target,
+ * if it is closer than the others.
+ * return the new number of nodes.
+ */
+static uint32_t lookup_add(Lookup_Node *list, uint32_t num, uint8_t *target, Node_format *node)
+{
+    Lookup_Node new;
+    uint32_t i;
+
+    new.node = *node;
+    new.asked = 0;
+    id_distance(&new.distance, target, node->client_id);
+
+    for (i = 0; i < num; ++i)
+        if (memcmp(list[i].node.client_id, node->client_id, CLIENT_ID_SIZE) == 0)
+            return num;
+
+    for (i = num; i > 0 && id_distance_cmp(&new.distance, &list[i - 1].distance) < 0; --i)
+        if (i < MAX_SENT_NODES * 2)
+            list[i] = list[i - 1];
+
+    if (i < MAX_SENT_NODES * 2) {
+        list[i] = new;
+        num = MIN(num + 1, MAX_SENT_NODES * 2);
+    }
+
+    return num;
+}
+
+/* Look target up from source the way a node looking for a friend does: ask the closest node
+ * we know of that we have not asked yet for the nodes it knows closest to target, until one of
+ * them answers with target itself.
+ * return the number of nodes asked, -1 if target was not found.
+ */
+static int lookup(Sim_Node *source, uint8_t *target)
+{
+    Lookup_Node closest[MAX_SENT_NODES * 2];
+    Node_format list[MAX_SENT_NODES];
+    uint32_t num = 0, i;
+    int hops = 0, num_list = get_close_nodes(source->dht, target, list);
+
+    while (1) {
+        for (i = 0; i < num_list; ++i) {
+            if (memcmp(list[i].client_id, target, CLIENT_ID_SIZE) == 0)
+                return hops;
+
+            num = lookup_add(closest, num, target, &list[i]);
+        }
+
+        for (i = 0; i < num && closest[i].asked; ++i);
+
+        if (i == num || hops == SIM_MAX_HOPS)
+            return -1;
+
+        closest[i].asked = 1;
+        ++hops;
+        int32_t index = node_index(closest[i].node.ip_port);
+        num_list = index == -1 ? 0 : get_close_nodes(nodes[index].dht, target, list);
+    }
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort values and print their median, 90th percentile and maximum. */
+static void print_distribution(const char *name, uint64_t *values, uint32_t num, double scale, const char *unit)
+{
+    if (num == 0) {
+        printf("%s: none\n", name);
+        return;
+    }
+
+    qsort(values, num, sizeof(uint64_t), cmp_uint64);
+    printf("%s: median %.1f%s, 90%% %.1f%s, max %.1f%s\n", name, values[num / 2] / scale, unit,
+           values[num * 9 / 10] / scale, unit, values[num - 1] / scale, unit);
+}
+
+/* Print how many nodes are connected and how good their routing tables are.
+ * return the average quality of the routing tables.
+ */
+static double report(void)
+{
+    uint32_t i, connected = 0;
+    double quality = 0;
+
+    for (i = 0; i < joined; ++i)
+        connected += nodes[i].connected_time != 0;
+
+    for (i = 0; i < SIM_SAMPLES; ++i)
+        quality += close_nodes_quality(&nodes[sim_random() % joined]);
+
+    quality /= SIM_SAMPLES;
+    printf("%5llus: %u/%u nodes joined, %u connected, close nodes quality %.1f%%, %u packets in flight\n",
+           (unsigned long long)((sim_time - SIM_EPOCH) / 1000000), joined, num_nodes, connected, quality * 100,
+           num_packets);
+    return quality;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seconds = 600, i;
+    uint64_t seed = 1;
+
+    num_nodes = 1000;
+
+    if (argc > 1)
+        num_nodes = atoi(argv[1]);
+
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+
+    if (argc > 3)
+        seed = strtoull(argv[3], NULL, 10);
+
+    if (argc > 4)
+        loss = atoi(argv[4]);
+
+    if (num_nodes < 2 || num_nodes > 0xFFFFFF || seconds == 0) {
+        printf("usage: %s [nodes] [seconds] [seed] [loss]\n", argv[0]);
+        return 1;
+    }
+
+    random_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    networking_set_clock(&sim_clock, NULL);
+#ifndef VANILLA_NACL
+    randombytes_set_implementation(&sim_randombytes);
+#endif
+
+    nodes = calloc(num_nodes, sizeof(Sim_Node));
+
+    if (nodes == NULL)
+        return 1;
+
+    uint64_t end = SIM_EPOCH + seconds * 1000000ULL;
+    uint64_t join_spread = MAX(seconds * 1000000ULL / 4, 1);
+    uint64_t converged = 0;
+
+    while (sim_time < end) {
+        uint64_t second = sim_time / 1000000;
+
+        while (joined < num_nodes && SIM_EPOCH + join_spread * joined / num_nodes <= sim_time) {
+            if (join(joined) == -1) {
+                printf("Out of memory at %u nodes\n", joined);
+                return 1;
+            }
+        }
+
+        for (i = 0; i < joined; ++i) {
+            Sim_Node *node = &nodes[i];
+
+            if (node->dirty) {
+                node->next_run = DHT_next_run(node->dht);
+                node->dirty = 0;
+            }
+
+            if (node->next_run <= second) {
+                do_DHT(node->dht);
+                node->next_run = DHT_next_run(node->dht);
+            }
+
+            if (node->connected_time == 0 && DHT_isconnected(node->dht))
+                node->connected_time = sim_time;
+        }
+
+        /* Hand out the packets of this second in the order they arrive. */
+        uint64_t next = (second + 1) * 1000000;
+
+        while (num_packets != 0 && packets[0].time < next) {
+            Sim_Packet packet;
+            pop_packet(&packet);
+            sim_time = packet.time;
+            networking_receive(node_net(&nodes[packet.to]), packet.from, packet.data, packet.length);
+            nodes[packet.to].dirty = 1;
+            free(packet.data);
+        }
+
+        sim_time = next;
+
+        if ((sim_time - SIM_EPOCH) % (SIM_REPORT_INTERVAL * 1000000ULL) == 0) {
+            double quality = report();
+
+            if (converged == 0 && joined == num_nodes && quality >= 0.9)
+                converged = sim_time;
+        }
+    }
+
+    uint64_t *values = malloc(MAX(num_nodes, SIM_SAMPLES) * sizeof(uint64_t));
+
+    if (values == NULL)
+        return 1;
+
+    uint32_t num = 0, found = 0;
+    uint64_t hops = 0;
+
+    for (i = 0; i < SIM_SAMPLES; ++i) {
+        Sim_Node *source = &nodes[sim_random() % joined];
+        Sim_Node *target = &nodes[sim_random() % joined];
+
+        if (source == target)
+            continue;
+
+        int ret = lookup(source, target->dht->c->self_public_key);
+        ++num;
+
+        if (ret != -1) {
+            values[found++] = ret;
+            hops += ret;
+        }
+    }
+
+    printf("\nLookups: %u/%u found, %.2f hops on average\n", found, num, found ? (double)hops / found : 0.0);
+    print_distribution("Lookup hops", values, found, 1, "");
+
+    Stats stats;
+    uint64_t bytes_sent = 0, bytes_received = 0;
+
+    for (i = 0, num = 0; i < joined; ++i) {
+        uint64_t lifetime = MAX((sim_time - nodes[i].join_time) / 1000000, 1);
+        DHT_get_stats(nodes[i].dht, &stats);
+        bytes_sent += stats.bytes_sent;
+        bytes_received += stats.bytes_received;
+        values[num++] = (stats.bytes_sent + stats.bytes_received) / lifetime;
+    }
+
+    printf("Bandwidth: %.1f kB sent and %.1f kB received per node\n", bytes_sent / 1000.0 / joined,
+           bytes_received / 1000.0 / joined);
+    print_distribution("Bandwidth per node (in + out)", values, num, 1000, " kB/s");
+
+    for (i = 0, num = 0; i < joined; ++i)
+        if (nodes[i].connected_time != 0)
+            values[num++] = nodes[i].connected_time - nodes[i].join_time;
+
+    printf("Connected: %u/%u nodes\n", num, joined);
+    print_distribution("Time to connect", values, num, 1000000, "s");
+
+    if (converged != 0)
+        printf("Converged (close nodes quality >= 90%% with every node joined) at %llus\n",
+               (unsigned long long)((converged - SIM_EPOCH) / 1000000));
+    else
+        printf("Did not converge (close nodes quality >= 90%% with every node joined)\n");
+
+    return 0;
+}
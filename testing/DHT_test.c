@@ -52,24 +52,28 @@ void print_clientlist(DHT *dht)
 {
     uint32_t i, j;
     IP_Port p_ip;
+    Client_data close_list[LCLIENT_LIST];
+    uint32_t num = DHT_get_close_list(dht, close_list, LCLIENT_LIST);
     printf("___________________CLOSE________________________________\n");
 
-    for (i = 0; i < LCLIENT_LIST; i++) {
+    for (i = 0; i < num; i++) {
         printf("ClientID: ");
 
         for (j = 0; j < CLIENT_ID_SIZE; j++) {
-            printf("%02hhX", dht->close_clientlist[i].client_id[j]);
+            printf("%02hhX", close_list[i].client_id[j]);
         }
 
-        p_ip = dht->close_clientlist[i].ip_port;
-        printf("\nIP: %u.%u.%u.%u Port: %u", p_ip.ip.uint8[0], p_ip.ip.uint8[1], p_ip.ip.uint8[2], p_ip.ip.uint8[3],
+        p_ip = close_list[i].ip_port;
+        printf("\nIP: %u.%u.%u.%u Port: %u",
+               ip_get_v4(p_ip.ip).uint8[0], ip_get_v4(p_ip.ip).uint8[1], ip_get_v4(p_ip.ip).uint8[2], ip_get_v4(p_ip.ip).uint8[3],
                ntohs(p_ip.port));
-        printf("\nTimestamp: %llu", (long long unsigned int) dht->close_clientlist[i].timestamp);
-        printf("\nLast pinged: %llu\n", (long long unsigned int) dht->close_clientlist[i].last_pinged);
-        p_ip = dht->close_clientlist[i].ret_ip_port;
-        printf("OUR IP: %u.%u.%u.%u Port: %u\n", p_ip.ip.uint8[0], p_ip.ip.uint8[1], p_ip.ip.uint8[2], p_ip.ip.uint8[3],
+        printf("\nTimestamp: %llu", (long long unsigned int) close_list[i].timestamp);
+        printf("\nLast pinged: %llu\n", (long long unsigned int) close_list[i].last_pinged);
+        p_ip = close_list[i].ret_ip_port;
+        printf("OUR IP: %u.%u.%u.%u Port: %u\n",
+               ip_get_v4(p_ip.ip).uint8[0], ip_get_v4(p_ip.ip).uint8[1], ip_get_v4(p_ip.ip).uint8[2], ip_get_v4(p_ip.ip).uint8[3],
                ntohs(p_ip.port));
-        printf("Timestamp: %llu\n", (long long unsigned int) dht->close_clientlist[i].ret_timestamp);
+        printf("Timestamp: %llu\n", (long long unsigned int) close_list[i].ret_timestamp);
     }
 }
 
@@ -88,7 +92,8 @@ void print_friendlist(DHT *dht)
         }
 
         p_ip = DHT_getfriendip(dht, dht->friends_list[k].client_id);
-        printf("\nIP: %u.%u.%u.%u:%u", p_ip.ip.uint8[0], p_ip.ip.uint8[1], p_ip.ip.uint8[2], p_ip.ip.uint8[3],
+        printf("\nIP: %u.%u.%u.%u:%u",
+               ip_get_v4(p_ip.ip).uint8[0], ip_get_v4(p_ip.ip).uint8[1], ip_get_v4(p_ip.ip).uint8[2], ip_get_v4(p_ip.ip).uint8[3],
                ntohs(p_ip.port));
 
         printf("\nCLIENTS IN LIST:\n\n");
@@ -104,12 +109,14 @@ void print_friendlist(DHT *dht)
             }
 
             p_ip = dht->friends_list[k].client_list[i].ip_port;
-            printf("\nIP: %u.%u.%u.%u:%u", p_ip.ip.uint8[0], p_ip.ip.uint8[1], p_ip.ip.uint8[2], p_ip.ip.uint8[3],
+            printf("\nIP: %u.%u.%u.%u:%u",
+                   ip_get_v4(p_ip.ip).uint8[0], ip_get_v4(p_ip.ip).uint8[1], ip_get_v4(p_ip.ip).uint8[2], ip_get_v4(p_ip.ip).uint8[3],
                    ntohs(p_ip.port));
             printf("\nTimestamp: %llu", (long long unsigned int) dht->friends_list[k].client_list[i].timestamp);
             printf("\nLast pinged: %llu\n", (long long unsigned int) dht->friends_list[k].client_list[i].last_pinged);
             p_ip = dht->friends_list[k].client_list[i].ret_ip_port;
-            printf("ret IP: %u.%u.%u.%u:%u\n", p_ip.ip.uint8[0], p_ip.ip.uint8[1], p_ip.ip.uint8[2], p_ip.ip.uint8[3],
+            printf("ret IP: %u.%u.%u.%u:%u\n",
+                   ip_get_v4(p_ip.ip).uint8[0], ip_get_v4(p_ip.ip).uint8[1], ip_get_v4(p_ip.ip).uint8[2], ip_get_v4(p_ip.ip).uint8[3],
                    ntohs(p_ip.port));
             printf("Timestamp: %llu\n", (long long unsigned int)dht->friends_list[k].client_list[i].ret_timestamp);
         }
@@ -136,9 +143,8 @@ int main(int argc, char *argv[])
 {
     //memcpy(self_client_id, "qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqq", 32);
     /* initialize networking */
-    /* bind to ip 0.0.0.0:PORT */
-    IP ip;
-    ip.uint32 = 0;
+    /* bind to ip :: (IPv4 and IPv6):PORT */
+    IP ip = {{0}};
 
     DHT *dht = new_DHT(new_net_crypto(new_networking(ip, PORT)));
 
@@ -174,7 +180,7 @@ int main(int argc, char *argv[])
      * bootstrap_ip_port.ip.c[1] = 0;
      * bootstrap_ip_port.ip.c[2] = 0;
      * bootstrap_ip_port.ip.c[3] = 1; */
-    bootstrap_ip_port.ip.uint32 = inet_addr(argv[1]);
+    ip_init_v4(&bootstrap_ip_port.ip, inet_addr(argv[1]));
     DHT_bootstrap(dht, bootstrap_ip_port, hex_string_to_bin(argv[3]));
 
     /*
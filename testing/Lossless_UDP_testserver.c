@@ -158,9 +158,8 @@ int main(int argc, char *argv[])
 
 
     //initialize networking
-    //bind to ip 0.0.0.0:PORT
-    IP ip;
-    ip.uint32 = 0;
+    //bind to ip :: (IPv4 and IPv6):PORT
+    IP ip = {{0}};
     Lossless_UDP *ludp = new_lossless_udp(new_networking(ip, PORT));
     perror("Initialization");
 
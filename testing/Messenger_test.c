@@ -106,7 +106,7 @@ int main(int argc, char *argv[])
     if (argc > 3) {
         IP_Port bootstrap_ip_port;
         bootstrap_ip_port.port = htons(atoi(argv[2]));
-        bootstrap_ip_port.ip.uint32 = inet_addr(argv[1]);
+        ip_init_v4(&bootstrap_ip_port.ip, inet_addr(argv[1]));
         DHT_bootstrap(m->dht, bootstrap_ip_port, hex_string_to_bin(argv[3]));
     } else {
         FILE *file = fopen(argv[1], "rb");
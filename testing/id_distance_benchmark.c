@@ -0,0 +1,231 @@
+/* client_id distance benchmark
+ * Times the XOR distance functions of toxcore/id_distance.h against the byte at a
+ * time versions the DHT used before, and checks that both give the same answers:
+ *  - id_closest() on random pairs of ids that share a prefix with the target
+ *    (like the nodes of the DHT close to us do),
+ *  - sorting lists of nodes by distance the way sort_list() in DHT.c does (and did).
+ *
+ * EX: ./id_distance_benchmark 2000000
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/id_distance.h"
+#include "../toxcore/misc_tools.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_IDS 4096
+
+/* Nodes sorted per list, like the client lists of friends. */
+#define SORT_LENGTH MAX_FRIEND_CLIENTS
+
+/* The byte at a time id_closest() the DHT had before. */
+static int byte_id_closest(uint8_t *id, uint8_t *id1, uint8_t *id2)
+{
+    size_t   i;
+    uint8_t distance1, distance2;
+
+    for (i = 0; i < CLIENT_ID_SIZE; ++i) {
+
+        distance1 = id[i] ^ id1[i];
+        distance2 = id[i] ^ id2[i];
+
+        if (distance1 < distance2)
+            return 1;
+
+        if (distance1 > distance2)
+            return 2;
+    }
+
+    return 0;
+}
+
+/* The pairs the DHT sorted before: a copy of the target with every node. */
+typedef struct {
+    Client_data c1;
+    Client_data c2;
+} BytePair;
+
+declare_quick_sort(BytePair);
+make_quick_sort(BytePair);
+
+static int byte_pair_cmp(BytePair p1, BytePair p2)
+{
+    int c = byte_id_closest(p1.c1.client_id, p1.c2.client_id, p2.c2.client_id);
+
+    if (c == 2)
+        return -1;
+
+    return c;
+}
+
+typedef struct {
+    ID_Distance distance;
+    Client_data c;
+} DistancePair;
+
+declare_quick_sort(DistancePair);
+make_quick_sort(DistancePair);
+
+static int distance_pair_cmp(DistancePair p1, DistancePair p2)
+{
+    return id_distance_cmp(&p2.distance, &p1.distance);
+}
+
+static uint8_t target[CLIENT_ID_SIZE];
+static Client_data nodes[NUM_IDS];
+
+static void make_ids(void)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < CLIENT_ID_SIZE; ++i)
+        target[i] = rand();
+
+    for (i = 0; i < NUM_IDS; ++i) {
+        /* Up to 3 bytes in common with target, sometimes all but one bit. */
+        uint32_t prefix = (i % 64 == 0) ? CLIENT_ID_SIZE : rand() % 4;
+
+        memset(&nodes[i], 0, sizeof(Client_data));
+
+        for (j = 0; j < CLIENT_ID_SIZE; ++j)
+            nodes[i].client_id[j] = j < prefix ? target[j] : rand();
+
+        if (prefix == CLIENT_ID_SIZE)
+            nodes[i].client_id[CLIENT_ID_SIZE - 1] ^= 1 << (rand() % 8);
+    }
+}
+
+static int check(void)
+{
+    DistancePair pairs[NUM_IDS];
+    uint32_t i, j;
+
+    for (i = 0; i < NUM_IDS; ++i) {
+        pairs[i].c = nodes[i];
+        id_distance(&pairs[i].distance, target, nodes[i].client_id);
+    }
+
+    DistancePair_quick_sort(pairs, NUM_IDS, distance_pair_cmp);
+
+    for (i = 1; i < NUM_IDS; ++i)
+        if (byte_id_closest(target, pairs[i - 1].c.client_id, pairs[i].c.client_id) == 1) {
+            printf("sorting by id_distance() puts node %u out of order\n", i);
+            return -1;
+        }
+
+    for (i = 0; i < NUM_IDS; ++i)
+        for (j = 0; j < 64; ++j) {
+            uint8_t *id1 = nodes[i].client_id, *id2 = nodes[(i + j) % NUM_IDS].client_id;
+
+            if (id_closest(target, id1, id2) != byte_id_closest(target, id1, id2)) {
+                printf("id_closest() disagrees for nodes %u and %u\n", i, (i + j) % NUM_IDS);
+                return -1;
+            }
+
+            if (id_closest(id1, target, id2) != byte_id_closest(id1, target, id2)) {
+                printf("id_closest() disagrees for target %u\n", i);
+                return -1;
+            }
+        }
+
+    return 0;
+}
+
+static double bench_closest(int (*closest)(uint8_t *, uint8_t *, uint8_t *), uint32_t num, int *sum)
+{
+    uint64_t start = current_time();
+    uint32_t i;
+
+    for (i = 0; i < num; ++i)
+        *sum += closest(target, nodes[i % NUM_IDS].client_id, nodes[(i * 7 + 1) % NUM_IDS].client_id);
+
+    return (current_time() - start) * 1000.0 / num;
+}
+
+static double bench_byte_sort(uint32_t num)
+{
+    BytePair pairs[SORT_LENGTH];
+    uint64_t start = current_time();
+    uint32_t i, j;
+
+    for (i = 0; i < num; ++i) {
+        for (j = 0; j < SORT_LENGTH; ++j) {
+            memcpy(pairs[j].c1.client_id, target, CLIENT_ID_SIZE);
+            pairs[j].c2 = nodes[(i + j * 13) % NUM_IDS];
+        }
+
+        BytePair_quick_sort(pairs, SORT_LENGTH, byte_pair_cmp);
+    }
+
+    return (current_time() - start) * 1000.0 / num;
+}
+
+static double bench_distance_sort(uint32_t num)
+{
+    DistancePair pairs[SORT_LENGTH];
+    uint64_t start = current_time();
+    uint32_t i, j;
+
+    for (i = 0; i < num; ++i) {
+        for (j = 0; j < SORT_LENGTH; ++j) {
+            pairs[j].c = nodes[(i + j * 13) % NUM_IDS];
+            id_distance(&pairs[j].distance, target, pairs[j].c.client_id);
+        }
+
+        DistancePair_quick_sort(pairs, SORT_LENGTH, distance_pair_cmp);
+    }
+
+    return (current_time() - start) * 1000.0 / num;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num = 2000000;
+    int sum = 0;
+    double byte_time, time;
+
+    if (argc > 1)
+        num = atoi(argv[1]);
+
+    if (num == 0) {
+        printf("usage: %s [number of comparisons]\n", argv[0]);
+        return 1;
+    }
+
+    srand(current_time());
+    make_ids();
+
+    if (check() != 0)
+        return 1;
+
+    byte_time = bench_closest(byte_id_closest, num, &sum);
+    time = bench_closest(id_closest, num, &sum);
+    printf("id_closest():    %7.2f ns (byte at a time: %7.2f ns) x%.2f\n", time, byte_time, byte_time / time);
+
+    byte_time = bench_byte_sort(num / SORT_LENGTH);
+    time = bench_distance_sort(num / SORT_LENGTH);
+    printf("sort %u nodes:   %7.2f ns (byte at a time: %7.2f ns) x%.2f\n", SORT_LENGTH, time, byte_time,
+           byte_time / time);
+
+    return sum == -1;
+}
@@ -71,7 +71,7 @@ uint8_t num_requests = 0;
   resolve_addr():
     address should represent IPv4 or a hostname with A record
 
-    returns a data in network byte order that can be used to set IP.i or IP_Port.ip.i
+    returns a data in network byte order that can be passed to tox_ip_init_v4()
     returns 0 on failure
 
     TODO: Fix ipv6 support
@@ -595,7 +595,7 @@ int main(int argc, char *argv[])
     int resolved_address = resolve_addr(argv[1]);
 
     if (resolved_address != 0)
-        bootstrap_ip_port.ip.i = resolved_address;
+        tox_ip_init_v4(&bootstrap_ip_port.ip, resolved_address);
     else
         exit(1);
 
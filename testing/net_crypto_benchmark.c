@@ -0,0 +1,474 @@
+/* Net_Crypto benchmark
+ * Brings up pairs of Net_Crypto instances over loopback and streams messages from the
+ * first instance of every pair to the second one through the whole stack
+ * (net_crypto, Lossless_UDP and the UDP sockets).
+ *
+ * With -l or -d the two ends of every pair don't talk directly but through a relay
+ * that drops (-l) or delays (-d) the packets going through it in both directions.
+ *
+ * Reports messages and bytes per second once every pair is connected, the latency from
+ * write_cryptpacket() to read_cryptpacket() (p50/p99) and the CPU time (both ends,
+ * they run in this process) per message.
+ *
+ * EX: ./net_crypto_benchmark -p 4 -n 5000 -s 512 -l 2 -d 20
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "../toxcore/net_crypto.h"
+
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#endif
+
+#define BASE_PORT 34500
+
+/* Biggest message write_cryptpacket() takes. */
+#define MAX_MESSAGE_SIZE (MAX_DATA_SIZE - 1 - ENCRYPTION_PADDING)
+
+/* Sequence number and time of sending at the start of every message. */
+#define MESSAGE_HEADER_SIZE (4 + 8)
+
+/* Packets the relay can hold at once, more are dropped. */
+#define RELAY_QUEUE 8192
+
+/* Packets the relay forwards are at most this big (Lossless_UDP data packets are smaller). */
+#define RELAY_PACKET_SIZE 2048
+
+typedef struct {
+    Networking_Core *net[2];
+    Net_Crypto *c[2];
+    int connection[2];
+
+    /* Relay sockets, [0] is the one the first instance talks to and [1] the second. */
+    int relay_sock[2];
+
+    uint32_t sent;
+    uint32_t received;
+} Pair;
+
+typedef struct {
+    uint64_t due;
+    int sock;
+    IP_Port to;
+    uint16_t length;
+    uint8_t data[RELAY_PACKET_SIZE];
+} Delayed_Packet;
+
+/* All relays delay packets by the same time so they leave in the order they came. */
+static Delayed_Packet *relay_queue;
+static uint32_t relay_start, relay_num, relay_dropped;
+static uint32_t loss_percent, delay_us;
+
+static uint32_t *latencies;
+static uint32_t num_latencies;
+
+static IP_Port loopback(uint16_t port)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_init_v4(&ip_port.ip, inet_addr("127.0.0.1"));
+    ip_port.port = htons(port);
+    return ip_port;
+}
+
+static int relay_socket(uint16_t port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {0};
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("relay socket");
+        exit(1);
+    }
+
+#ifdef WIN32
+    u_long mode = 1;
+    ioctlsocket(sock, FIONBIO, &mode);
+#else
+    fcntl(sock, F_SETFL, O_NONBLOCK, 1);
+#endif
+    return sock;
+}
+
+static void relay_send(int sock, IP_Port to, uint8_t *data, uint16_t length)
+{
+    struct sockaddr_in addr = {0};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip_get_v4(to.ip).uint32;
+    addr.sin_port = to.port;
+    sendto(sock, (char *)data, length, 0, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+/* Move the packets that reached the relay of pair to the other end, dropping or delaying them. */
+static void relay_pair(Pair *pair, int pair_num)
+{
+    uint8_t data[RELAY_PACKET_SIZE];
+    int side;
+    int length;
+
+    for (side = 0; side < 2; ++side) {
+        IP_Port to = loopback(BASE_PORT + 4 * pair_num + !side);
+
+        while ((length = recv(pair->relay_sock[side], (char *)data, sizeof(data), 0)) > 0) {
+            if (rand() % 100 < loss_percent)
+                continue;
+
+            if (delay_us == 0) {
+                relay_send(pair->relay_sock[!side], to, data, length);
+                continue;
+            }
+
+            if (relay_num == RELAY_QUEUE) {
+                ++relay_dropped;
+                continue;
+            }
+
+            Delayed_Packet *packet = &relay_queue[(relay_start + relay_num) % RELAY_QUEUE];
+            packet->due = current_time() + delay_us;
+            packet->sock = pair->relay_sock[!side];
+            packet->to = to;
+            packet->length = length;
+            memcpy(packet->data, data, length);
+            ++relay_num;
+        }
+    }
+}
+
+static void relay_delayed(void)
+{
+    uint64_t temp_time = current_time();
+
+    while (relay_num != 0 && relay_queue[relay_start].due <= temp_time) {
+        Delayed_Packet *packet = &relay_queue[relay_start];
+        relay_send(packet->sock, packet->to, packet->data, packet->length);
+        relay_start = (relay_start + 1) % RELAY_QUEUE;
+        --relay_num;
+    }
+}
+
+/* Wait for at most timeout_us or until one of the sockets has something. */
+static void wait_sockets(Pair *pairs, int num_pairs, uint32_t timeout_us)
+{
+    fd_set readfds;
+    struct timeval timeout;
+    int max = 0;
+    int i, j;
+
+    FD_ZERO(&readfds);
+
+    for (i = 0; i < num_pairs; ++i) {
+        for (j = 0; j < 2; ++j) {
+            FD_SET(pairs[i].net[j]->sock, &readfds);
+            max = MAX(max, pairs[i].net[j]->sock);
+
+            if (pairs[i].relay_sock[j] != -1) {
+                FD_SET(pairs[i].relay_sock[j], &readfds);
+                max = MAX(max, pairs[i].relay_sock[j]);
+            }
+        }
+    }
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = timeout_us;
+    select(max + 1, &readfds, NULL, NULL, &timeout);
+}
+
+/* CPU time used by the process in us. */
+static uint64_t cpu_time(void)
+{
+#ifdef WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    return ((((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+            (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 10;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000UL +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(uint32_t percent)
+{
+    if (num_latencies == 0)
+        return 0;
+
+    return latencies[(uint64_t)(num_latencies - 1) * percent / 100];
+}
+
+/* Write as many messages as the connection takes. */
+static void send_messages(Pair *pair, uint32_t num_messages, uint32_t size)
+{
+    uint8_t data[MAX_MESSAGE_SIZE];
+
+    memset(data, 0xAB, size);
+
+    while (pair->sent < num_messages) {
+        uint64_t temp_time = current_time();
+        memcpy(data, &pair->sent, 4);
+        memcpy(data + 4, &temp_time, 8);
+
+        if (!write_cryptpacket(pair->c[0], pair->connection[0], data, size))
+            break;
+
+        ++pair->sent;
+    }
+}
+
+/* return -1 if a message was lost, reordered or corrupted. */
+static int receive_messages(Pair *pair, uint32_t size)
+{
+    uint8_t data[MAX_DATA_SIZE];
+    int length;
+
+    while ((length = read_cryptpacket(pair->c[1], pair->connection[1], data)) > 0) {
+        uint32_t number;
+        uint64_t sent_time;
+        memcpy(&number, data, 4);
+        memcpy(&sent_time, data + 4, 8);
+
+        if (number != pair->received || (uint32_t)length != size)
+            return -1;
+
+        latencies[num_latencies++] = current_time() - sent_time;
+        ++pair->received;
+    }
+
+    return 0;
+}
+
+static void usage(char *name)
+{
+    printf("Usage: %s [-p pairs] [-n messages per pair] [-s message size] [-l loss %%] [-d delay ms]\n"
+           "          [-w Lossless_UDP window] [-t timeout s]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_pairs = 1;
+    uint32_t num_messages = 10000;
+    uint32_t size = 512;
+    uint32_t window = 0;
+    uint32_t timeout = 60;
+    int i, j;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0)
+            usage(argv[0]);
+
+        uint32_t value = atoi(argv[i + 1]);
+
+        switch (argv[i][1]) {
+            case 'p':
+                num_pairs = value;
+                break;
+
+            case 'n':
+                num_messages = value;
+                break;
+
+            case 's':
+                size = value;
+                break;
+
+            case 'l':
+                loss_percent = value;
+                break;
+
+            case 'd':
+                delay_us = value * 1000;
+                break;
+
+            case 'w':
+                window = value;
+                break;
+
+            case 't':
+                timeout = value;
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (i != argc || num_pairs < 1)
+        usage(argv[0]);
+
+    if (size < MESSAGE_HEADER_SIZE || size > MAX_MESSAGE_SIZE) {
+        printf("message size must be between %u and %u\n", MESSAGE_HEADER_SIZE, MAX_MESSAGE_SIZE);
+        return 1;
+    }
+
+    int relayed = loss_percent != 0 || delay_us != 0;
+    Pair *pairs = calloc(num_pairs, sizeof(Pair));
+    latencies = malloc((uint64_t)num_pairs * num_messages * sizeof(uint32_t));
+    relay_queue = malloc(RELAY_QUEUE * sizeof(Delayed_Packet));
+
+    if (pairs == NULL || latencies == NULL || relay_queue == NULL) {
+        printf("out of memory\n");
+        return 1;
+    }
+
+    IP ip = {{0}};
+
+    for (i = 0; i < num_pairs; ++i) {
+        for (j = 0; j < 2; ++j) {
+            pairs[i].net[j] = new_networking(ip, BASE_PORT + 4 * i + j);
+            pairs[i].c[j] = pairs[i].net[j] == NULL ? NULL : new_net_crypto(pairs[i].net[j]);
+
+            if (pairs[i].c[j] == NULL) {
+                printf("could not bring up pair %i (port %u in use?)\n", i, BASE_PORT + 4 * i + j);
+                return 1;
+            }
+
+            new_keys(pairs[i].c[j]);
+
+            if (window != 0 && lossless_udp_set_window(pairs[i].c[j]->lossless_udp, window) == -1) {
+                printf("bad window %u\n", window);
+                return 1;
+            }
+
+            pairs[i].relay_sock[j] = relayed ? relay_socket(BASE_PORT + 4 * i + 2 + j) : -1;
+        }
+
+        /* The first instance sees the relay as the second one. */
+        IP_Port to = loopback(BASE_PORT + 4 * i + (relayed ? 2 : 1));
+        pairs[i].connection[0] = crypto_connect(pairs[i].c[0], pairs[i].c[1]->self_public_key, to);
+        pairs[i].connection[1] = -1;
+    }
+
+    uint64_t start_time = current_time(), bench_time = 0, bench_cpu = 0, end_time;
+    uint64_t total = (uint64_t)num_pairs * num_messages, received = 0;
+    int connected = 0;
+
+    while (received < total && current_time() < start_time + timeout * 1000000ULL) {
+        for (i = 0; i < num_pairs; ++i) {
+            Pair *pair = &pairs[i];
+
+            for (j = 0; j < 2; ++j)
+                networking_poll(pair->net[j]);
+
+            if (relayed)
+                relay_pair(pair, i);
+
+            for (j = 0; j < 2; ++j)
+                do_net_crypto(pair->c[j]);
+
+            if (pair->connection[1] == -1) {
+                uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+                uint8_t secret_nonce[crypto_box_NONCEBYTES];
+                uint8_t session_key[crypto_box_PUBLICKEYBYTES];
+                int inbound = crypto_inbound(pair->c[1], public_key, secret_nonce, session_key);
+
+                if (inbound != -1)
+                    pair->connection[1] = accept_crypto_inbound(pair->c[1], inbound, public_key, secret_nonce,
+                                          session_key);
+            }
+
+            if (pair->connection[1] == -1 || is_cryptoconnected(pair->c[0], pair->connection[0]) != 3
+                    || is_cryptoconnected(pair->c[1], pair->connection[1]) != 3)
+                continue;
+
+            if (!connected)
+                continue;
+
+            send_messages(pair, num_messages, size);
+
+            uint32_t old_received = pair->received;
+
+            if (receive_messages(pair, size) == -1) {
+                printf("pair %i: message %u lost or corrupted\n", i, pair->received);
+                return 1;
+            }
+
+            received += pair->received - old_received;
+        }
+
+        if (!connected) {
+            for (i = 0; i < num_pairs; ++i)
+                if (pairs[i].connection[1] == -1 || is_cryptoconnected(pairs[i].c[0], pairs[i].connection[0]) != 3
+                        || is_cryptoconnected(pairs[i].c[1], pairs[i].connection[1]) != 3)
+                    break;
+
+            if (i == num_pairs) {
+                connected = 1;
+                bench_time = current_time();
+                bench_cpu = cpu_time();
+                printf("%i pair(s) connected in %.2fs\n", num_pairs, (bench_time - start_time) / 1000000.0);
+            }
+        }
+
+        if (relayed)
+            relay_delayed();
+
+        wait_sockets(pairs, num_pairs, 1000);
+    }
+
+    end_time = current_time();
+
+    if (!connected) {
+        printf("timed out before every pair was connected\n");
+        return 1;
+    }
+
+    double seconds = (end_time - bench_time) / 1000000.0;
+    uint64_t cpu = cpu_time() - bench_cpu;
+
+    qsort(latencies, num_latencies, sizeof(uint32_t), compare_uint32);
+
+    printf("pairs: %i, message size: %u, loss: %u%%, delay: %ums%s\n", num_pairs, size, loss_percent,
+           delay_us / 1000, relay_dropped ? " (relay overflowed)" : "");
+    printf("received %llu/%llu messages in %.2fs\n", (unsigned long long)received, (unsigned long long)total,
+           seconds);
+    printf("%.0f messages/s, %.0f bytes/s\n", received / seconds, received * size / seconds);
+    printf("latency p50: %.2fms, p99: %.2fms\n", percentile(50) / 1000.0, percentile(99) / 1000.0);
+    printf("CPU: %.2fus per message\n", received ? (double)cpu / received : 0.0);
+
+    for (i = 0; i < num_pairs; ++i) {
+        for (j = 0; j < 2; ++j) {
+            kill_net_crypto(pairs[i].c[j]);
+            kill_networking(pairs[i].net[j]);
+        }
+    }
+
+    free(relay_queue);
+    free(latencies);
+    free(pairs);
+    return received == total ? 0 : 1;
+}
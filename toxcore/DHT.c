@@ -26,13 +26,11 @@
 #include "DHT.h"
 #include "ping.h"
 #include "misc_tools.h"
+#include "id_distance.h"
 
 /* The number of seconds for a non responsive node to become bad. */
 #define BAD_NODE_TIMEOUT 70
 
-/* The max number of nodes to send with send nodes. */
-#define MAX_SENT_NODES 8
-
 /* Ping timeout in seconds */
 #define PING_TIMEOUT 5
 
@@ -45,21 +43,41 @@
 /* Ping interval in seconds for each random sending of a get nodes request. */
 #define GET_NODE_INTERVAL 10
 
-#define MAX_PUNCHING_PORTS 32
-
 /* Interval in seconds between punching attempts*/
 #define PUNCH_INTERVAL 10
 
+/* A punching attempt is PUNCH_BURSTS bursts of PUNCH_BURST_SIZE pings, one burst per second. */
+#define PUNCH_BURSTS 8
+#define PUNCH_BURST_SIZE 16
+
+/* Most hole punching pings sent per second, for all friends together. */
+#define MAX_PUNCH_PINGS_PER_SECOND 64
+
+/* Biggest step between the ports a NAT hands out that port prediction believes in. */
+#define PUNCH_MAX_DELTA 64
+
 /* Ping newly announced nodes to ping per TIME_TOPING seconds*/
 #define TIME_TOPING 5
 
+/* reliability of a node we know nothing about yet, see DHT_node_responded(). */
+#define RELIABILITY_INITIAL 128
+
+/* Number of the best nodes route_tofriend() sends through, doubled for every request to the
+ * friend that got no answer, up to ROUTE_MAX_UNANSWERED times.
+ */
+#define ROUTE_PATHS 2
+#define ROUTE_MAX_UNANSWERED 2
+
+/* Seconds a saved DHT is recent enough for its good nodes to be used before they answer. */
+#define PROVISIONAL_MAX_AGE 3600
+
 #define NAT_PING_REQUEST    0
 #define NAT_PING_RESPONSE   1
 
 /* Used in the comparison function for sorting lists of Client_data. */
 typedef struct {
-    Client_data c1;
-    Client_data c2;
+    ID_Distance distance; /* Of c to the client_id the list is sorted by. */
+    Client_data c;
 } ClientPair;
 
 /* Create the declaration for a quick sort for ClientPair structures. */
@@ -67,52 +85,10 @@ declare_quick_sort(ClientPair);
 /* Create the quicksort function. See misc_tools.h for the definition. */
 make_quick_sort(ClientPair);
 
-Client_data *DHT_get_close_list(DHT *dht)
-{
-    return dht->close_clientlist;
-}
-
-/* Compares client_id1 and client_id2 with client_id
- * return 0 if both are same distance
- * return 1 if client_id1 is closer
- * return 2 if client_id2 is closer
- */
-static int id_closest(uint8_t *id, uint8_t *id1, uint8_t *id2)
-{
-    size_t   i;
-    uint8_t distance1, distance2;
-
-    for (i = 0; i < CLIENT_ID_SIZE; ++i) {
-
-        distance1 = abs(((int8_t *)id)[i] ^ ((int8_t *)id1)[i]);
-        distance2 = abs(((int8_t *)id)[i] ^ ((int8_t *)id2)[i]);
-
-        if (distance1 < distance2)
-            return 1;
-
-        if (distance1 > distance2)
-            return 2;
-    }
-
-    return 0;
-}
-
-/* Turns the result of id_closest into something quick_sort can use.
- * Assumes p1->c1 == p2->c1.
- */
+/* Compares the distances of the pairs so quick_sort puts the furthest first. */
 static int client_id_cmp(ClientPair p1, ClientPair p2)
 {
-    int c = id_closest(p1.c1.client_id, p1.c2.client_id, p2.c2.client_id);
-
-    if (c == 2)
-        return -1;
-
-    return c;
-}
-
-static int ipport_equal(IP_Port a, IP_Port b)
-{
-    return (a.ip.uint32 == b.ip.uint32) && (a.port == b.port);
+    return id_distance_cmp(&p2.distance, &p1.distance);
 }
 
 static int id_equal(uint8_t *a, uint8_t *b)
@@ -146,8 +122,7 @@ static int client_in_list(Client_data *list, uint32_t length, uint8_t *client_id
         if (id_equal(list[i].client_id, client_id)) {
             /* Refresh the client timestamp. */
             list[i].timestamp = temp_time;
-            list[i].ip_port.ip.uint32 = ip_port.ip.uint32;
-            list[i].ip_port.port = ip_port.port;
+            list[i].ip_port = ip_port;
             return 1;
         }
     }
@@ -155,123 +130,299 @@ static int client_in_list(Client_data *list, uint32_t length, uint8_t *client_id
     return 0;
 }
 
-/* Check if client with client_id is already in node format list of length length.
- * return True(1) or False(0)
+/* Returns the friend number from the client_id, or -1 if a failure occurs
  */
-static int client_in_nodelist(Node_format *list, uint32_t length, uint8_t *client_id)
+static int friend_number(DHT *dht, uint8_t *client_id)
 {
+    return key_index_find(&dht->friend_keys, client_id);
+}
+
+/*----------------------------------------------------------------------------------*/
+/*------------------------------ROUTING TABLE---------------------------------------*/
+
+/* return the bucket of the routing table client_id belongs in (the number of its first
+ * bits in common with ours), DHT_NUM_BUCKETS if client_id is ours.
+ */
+static uint32_t bucket_index(DHT *dht, uint8_t *client_id)
+{
+    return id_common_bits(dht->c->self_public_key, client_id);
+}
+
+/* return the node with client_id in the routing table, NULL if there is none. */
+static Client_data *table_find(DHT *dht, uint8_t *client_id)
+{
+    uint32_t index = bucket_index(dht, client_id);
     uint32_t i;
 
-    for (i = 0; i < length; ++i) {
-        if (id_equal(list[i].client_id, client_id))
-            return 1;
+    if (index == DHT_NUM_BUCKETS)
+        return NULL;
+
+    DHT_Bucket *bucket = &dht->buckets[index];
+
+    for (i = 0; i < bucket->num; ++i)
+        if (id_equal(bucket->clients[i].client_id, client_id))
+            return &bucket->clients[i];
+
+    return NULL;
+}
+
+static void set_client(Client_data *client, uint8_t *client_id, IP_Port ip_port, uint64_t temp_time)
+{
+    memset(client, 0, sizeof(Client_data));
+    memcpy(client->client_id, client_id, CLIENT_ID_SIZE);
+    client->ip_port = ip_port;
+    client->timestamp = temp_time;
+    client->reliability = RELIABILITY_INITIAL;
+}
+
+/* return a free entry at the end of bucket, NULL if it is full or if we are out of memory. */
+static Client_data *bucket_append(DHT *dht, DHT_Bucket *bucket)
+{
+    if (bucket->num == dht->bucket_size)
+        return NULL;
+
+    if (bucket->num == bucket->capacity) {
+        uint16_t capacity = MIN(MAX(bucket->capacity * 2, 4), dht->bucket_size);
+        Client_data *temp = realloc(bucket->clients, sizeof(Client_data) * capacity);
+
+        if (temp == NULL)
+            return NULL;
+
+        bucket->clients = temp;
+        bucket->capacity = capacity;
     }
 
-    return 0;
+    ++dht->num_nodes;
+    return &bucket->clients[bucket->num++];
 }
 
-/* Returns the friend number from the client_id, or -1 if a failure occurs
+/* Remove a node from the bucket furthest from us (a bad one if it has one), as long
+ * as that bucket is further than the one at index.
+ * return 0 if a node was removed.
+ * return -1 if there was none.
  */
-static int friend_number(DHT *dht, uint8_t *client_id)
+static int table_make_room(DHT *dht, uint32_t index)
 {
-    uint32_t i;
+    uint64_t temp_time = unix_time();
+    uint32_t i, j;
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        if (id_equal(dht->friends_list[i].client_id, client_id))
-            return i;
+    for (i = 0; i < index; ++i) {
+        DHT_Bucket *bucket = &dht->buckets[i];
+
+        if (bucket->num == 0)
+            continue;
+
+        for (j = 0; j + 1 < bucket->num; ++j)
+            if (is_timeout(temp_time, bucket->clients[j].timestamp, BAD_NODE_TIMEOUT))
+                break;
+
+        bucket->clients[j] = bucket->clients[bucket->num - 1];
+        --bucket->num;
+        --dht->num_nodes;
+        return 0;
     }
 
     return -1;
 }
 
-/* Find MAX_SENT_NODES nodes closest to the client_id for the send nodes request:
- * put them in the nodes_list and return how many were found.
- *
- * TODO: For the love of based Allah make this function cleaner and much more efficient.
+/* Add the node to the routing table or refresh it if it is already there.
+ * A full bucket only takes a node in place of a bad one or of one further from us,
+ * a full table only for a node in a bucket closer to us than some other one.
  */
-static int get_close_nodes(DHT *dht, uint8_t *client_id, Node_format *nodes_list)
+static void table_add(DHT *dht, uint8_t *client_id, IP_Port ip_port)
 {
-    uint32_t    i, j, k;
-    uint64_t    temp_time = unix_time();
-    int         num_nodes = 0, closest, tout, inlist;
+    uint64_t temp_time = unix_time();
+    uint32_t index = bucket_index(dht, client_id);
+    uint32_t i;
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        tout = is_timeout(temp_time, dht->close_clientlist[i].timestamp, BAD_NODE_TIMEOUT);
-        inlist = client_in_nodelist(nodes_list, MAX_SENT_NODES, dht->close_clientlist[i].client_id);
+    if (index == DHT_NUM_BUCKETS)
+        return;
 
-        /* If node isn't good or is already in list. */
-        if (tout || inlist)
-            continue;
+    DHT_Bucket *bucket = &dht->buckets[index];
+    Client_data *client = table_find(dht, client_id);
 
-        if (num_nodes < MAX_SENT_NODES) {
+    if (client != NULL) {
+        /* A node that comes back to life may have to be pinged or asked for nodes sooner. */
+        if (is_timeout(temp_time, client->timestamp, BAD_NODE_TIMEOUT))
+            dht->close_next_run = 0;
 
-            memcpy( nodes_list[num_nodes].client_id,
-                    dht->close_clientlist[i].client_id,
-                    CLIENT_ID_SIZE );
+        client->timestamp = temp_time;
+        client->ip_port = ip_port;
+        return;
+    }
 
-            nodes_list[num_nodes].ip_port = dht->close_clientlist[i].ip_port;
-            num_nodes++;
+    for (i = 0; i < bucket->num; ++i) {
+        if (is_timeout(temp_time, bucket->clients[i].timestamp, BAD_NODE_TIMEOUT)) {
+            client = &bucket->clients[i];
+            break;
+        }
+    }
 
-        } else {
+    if (client == NULL && bucket->num < dht->bucket_size
+            && (dht->num_nodes < dht->max_nodes || table_make_room(dht, index) == 0))
+        client = bucket_append(dht, bucket);
 
-            for (j = 0; j < MAX_SENT_NODES; ++j) {
-                closest = id_closest(   client_id,
-                                        nodes_list[j].client_id,
-                                        dht->close_clientlist[i].client_id );
+    if (client == NULL) {
+        /* Replace the node of the bucket furthest from us if this one is closer. */
+        Client_data *furthest = NULL;
 
-                if (closest == 2) {
-                    memcpy( nodes_list[j].client_id,
-                            dht->close_clientlist[i].client_id,
-                            CLIENT_ID_SIZE);
+        for (i = 0; i < bucket->num; ++i)
+            if (furthest == NULL || id_closest(dht->c->self_public_key, furthest->client_id,
+                                               bucket->clients[i].client_id) == 1)
+                furthest = &bucket->clients[i];
 
-                    nodes_list[j].ip_port = dht->close_clientlist[i].ip_port;
-                    break;
-                }
-            }
-        }
+        if (furthest == NULL || id_closest(dht->c->self_public_key, furthest->client_id, client_id) != 2)
+            return;
+
+        client = furthest;
     }
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+    set_client(client, client_id, ip_port, temp_time);
+    dht->close_next_run = 0;
+}
 
-            tout = is_timeout(temp_time, dht->friends_list[i].client_list[j].timestamp, BAD_NODE_TIMEOUT);
-            inlist = client_in_nodelist(    nodes_list,
-                                            MAX_SENT_NODES,
-                                            dht->friends_list[i].client_list[j].client_id);
+uint32_t DHT_get_close_list(DHT *dht, Client_data *list, uint32_t length)
+{
+    uint32_t num = 0;
+    int32_t i;
 
-            /* If node isn't good or is already in list. */
-            if (tout || inlist)
-                continue;
+    for (i = DHT_NUM_BUCKETS - 1; i >= 0 && num < length; --i) {
+        uint32_t copy = MIN(dht->buckets[i].num, length - num);
+        memcpy(list + num, dht->buckets[i].clients, copy * sizeof(Client_data));
+        num += copy;
+    }
 
-            if (num_nodes < MAX_SENT_NODES) {
+    return num;
+}
 
-                memcpy( nodes_list[num_nodes].client_id,
-                        dht->friends_list[i].client_list[j].client_id,
-                        CLIENT_ID_SIZE);
+int DHT_set_routing_table(DHT *dht, uint16_t bucket_size, uint32_t max_nodes)
+{
+    if (dht->num_nodes != 0 || bucket_size == 0 || max_nodes == 0)
+        return -1;
 
-                nodes_list[num_nodes].ip_port = dht->friends_list[i].client_list[j].ip_port;
-                num_nodes++;
-            } else  {
-                for (k = 0; k < MAX_SENT_NODES; ++k) {
+    dht->bucket_size = bucket_size;
+    dht->max_nodes = max_nodes;
+    return 0;
+}
 
-                    closest = id_closest(   client_id,
-                                            nodes_list[k].client_id,
-                                            dht->friends_list[i].client_list[j].client_id );
+int DHT_set_request_capacity(DHT *dht, uint32_t max_requests)
+{
+    if (max_requests == 0 || ping_set_capacity(dht->ping, max_requests) == -1)
+        return -1;
 
-                    if (closest == 2) {
-                        memcpy( nodes_list[k].client_id,
-                                dht->friends_list[i].client_list[j].client_id,
-                                CLIENT_ID_SIZE );
+    return request_tracker_set_capacity(&dht->getnodes_requests, max_requests);
+}
 
-                        nodes_list[k].ip_port = dht->friends_list[i].client_list[j].ip_port;
-                        break;
-                    }
-                }
-            }
-        }
+/*----------------------------------------------------------------------------------*/
+
+/* The MAX_SENT_NODES nodes closest to target seen so far. */
+typedef struct {
+    uint8_t     *target;
+    Node_format *nodes;
+    ID_Distance  distance[MAX_SENT_NODES]; /* Distance of each of the nodes to target. */
+    uint32_t     num;
+    uint32_t     furthest; /* Index of the node furthest from target. */
+
+    /* Set of the nodes in the list: bit (last word of the distance % 64) is set for each.
+     * Two nodes are the same if they are at the same distance so this is all dedup needs. */
+    uint64_t     seen;
+} Close_Nodes;
+
+static uint64_t seen_bit(ID_Distance *distance)
+{
+    return 1ULL << (distance->word[ID_DISTANCE_WORDS - 1] % 64);
+}
+
+/* Put client in the close nodes if it is good, not already there and one of the closest. */
+static void add_close_node(Close_Nodes *close, Client_data *client, uint64_t temp_time)
+{
+    ID_Distance distance;
+    uint32_t i;
+
+    if (is_timeout(temp_time, client->timestamp, BAD_NODE_TIMEOUT))
+        return;
+
+    id_distance(&distance, close->target, client->client_id);
+
+    if (close->seen & seen_bit(&distance)) {
+        for (i = 0; i < close->num; ++i)
+            if (id_distance_cmp(&close->distance[i], &distance) == 0)
+                return;
+    }
+
+    if (close->num < MAX_SENT_NODES) {
+        i = close->num++;
+
+        if (i == 0 || id_distance_cmp(&distance, &close->distance[close->furthest]) > 0)
+            close->furthest = i;
+    } else {
+        if (id_distance_cmp(&distance, &close->distance[close->furthest]) >= 0)
+            return;
+
+        i = close->furthest;
+    }
+
+    close->distance[i] = distance;
+    memcpy(close->nodes[i].client_id, client->client_id, CLIENT_ID_SIZE);
+    close->nodes[i].ip_port = client->ip_port;
+
+    if (close->num < MAX_SENT_NODES) {
+        close->seen |= seen_bit(&distance);
+        return;
+    }
+
+    /* The furthest one was replaced, find the new one. */
+    close->seen = 0;
+
+    for (i = 0; i < MAX_SENT_NODES; ++i) {
+        close->seen |= seen_bit(&close->distance[i]);
+
+        if (id_distance_cmp(&close->distance[i], &close->distance[close->furthest]) > 0)
+            close->furthest = i;
     }
+}
 
-    return num_nodes;
+static void add_bucket_nodes(DHT *dht, uint32_t index, Close_Nodes *close, uint64_t temp_time)
+{
+    DHT_Bucket *bucket = &dht->buckets[index];
+    uint32_t i;
+
+    for (i = 0; i < bucket->num; ++i)
+        add_close_node(close, &bucket->clients[i], temp_time);
+}
+
+/* Only the buckets of the routing table that can hold the closest nodes are looked at:
+ * the one client_id is in has those with more bits in common with it than all the others,
+ * then come the closer buckets (as many bits in common) and then each further bucket.
+ */
+int get_close_nodes(DHT *dht, uint8_t *client_id, Node_format *nodes_list)
+{
+    uint32_t    i, j;
+    uint64_t    temp_time = unix_time();
+    uint32_t    index = bucket_index(dht, client_id);
+    Close_Nodes close;
+
+    close.target = client_id;
+    close.nodes = nodes_list;
+    close.num = 0;
+    close.furthest = 0;
+    close.seen = 0;
+
+    if (index != DHT_NUM_BUCKETS)
+        add_bucket_nodes(dht, index, &close, temp_time);
+
+    if (close.num < MAX_SENT_NODES)
+        for (i = index + 1; i < DHT_NUM_BUCKETS; ++i)
+            add_bucket_nodes(dht, i, &close, temp_time);
+
+    for (i = index; i-- > 0 && close.num < MAX_SENT_NODES;)
+        add_bucket_nodes(dht, i, &close, temp_time);
+
+    for (i = 0; i < dht->num_friends; ++i)
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j)
+            add_close_node(&close, &dht->friends_list[i].client_list[j], temp_time);
+
+    return close.num;
 }
 
 /* Replace first bad (or empty) node with this one
@@ -292,9 +443,10 @@ static int replace_bad(    Client_data    *list,
             memcpy(list[i].client_id, client_id, CLIENT_ID_SIZE);
             list[i].ip_port = ip_port;
             list[i].timestamp = temp_time;
-            list[i].ret_ip_port.ip.uint32 = 0;
-            list[i].ret_ip_port.port = 0;
+            memset(&list[i].ret_ip_port, 0, sizeof(IP_Port));
             list[i].ret_timestamp = 0;
+            list[i].rtt = 0;
+            list[i].reliability = RELIABILITY_INITIAL;
             return 0;
         }
     }
@@ -307,21 +459,18 @@ static int replace_bad(    Client_data    *list,
  */
 static void sort_list(Client_data *list, uint32_t length, uint8_t *comp_client_id)
 {
-    Client_data cd;
     ClientPair pairs[length];
     uint32_t i;
 
-    memcpy(cd.client_id, comp_client_id, CLIENT_ID_SIZE);
-
     for (i = 0; i < length; ++i) {
-        pairs[i].c1 = cd;
-        pairs[i].c2 = list[i];
+        id_distance(&pairs[i].distance, comp_client_id, list[i].client_id);
+        pairs[i].c = list[i];
     }
 
     ClientPair_quick_sort(pairs, length, client_id_cmp);
 
     for (i = 0; i < length; ++i)
-        list[i] = pairs[i].c2;
+        list[i] = pairs[i].c;
 }
 
 /* Replace the first good node that is further to the comp_client_id than that of the client_id in the list */
@@ -340,37 +489,54 @@ static int replace_good(   Client_data    *list,
             memcpy(list[i].client_id, client_id, CLIENT_ID_SIZE);
             list[i].ip_port = ip_port;
             list[i].timestamp = temp_time;
-            list[i].ret_ip_port.ip.uint32 = 0;
-            list[i].ret_ip_port.port = 0;
+            memset(&list[i].ret_ip_port, 0, sizeof(IP_Port));
             list[i].ret_timestamp = 0;
+            list[i].rtt = 0;
+            list[i].reliability = RELIABILITY_INITIAL;
             return 0;
         }
 
     return 1;
 }
 
+#define NODE_KEY_SIZE (CLIENT_ID_SIZE + sizeof(IP) + sizeof(uint16_t))
+
+/* Key of a node for dht->announced. */
+static void node_key(uint8_t *key, uint8_t *client_id, IP_Port ip_port)
+{
+    memcpy(key, client_id, CLIENT_ID_SIZE);
+    memcpy(key + CLIENT_ID_SIZE, &ip_port.ip, sizeof(IP));
+    memcpy(key + CLIENT_ID_SIZE + sizeof(IP), &ip_port.port, sizeof(uint16_t));
+}
+
 /* Attempt to add client with ip_port and client_id to the friends client list
- * and close_clientlist
+ * and the routing table.
  */
 void addto_lists(DHT *dht, IP_Port ip_port, uint8_t *client_id)
 {
     uint32_t i;
+    uint8_t key[NODE_KEY_SIZE];
+
+    /* Heard from it, no need to ping it when it is sent to us. */
+    node_key(key, client_id, ip_port);
+    bloom_filter_add(&dht->announced, key, sizeof(key));
 
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    if (!client_in_list(dht->close_clientlist, LCLIENT_LIST, client_id, ip_port)) {
-        if (replace_bad(dht->close_clientlist, LCLIENT_LIST, client_id, ip_port)) {
-            /* If we can't replace bad nodes we try replacing good ones */
-            replace_good(   dht->close_clientlist,
-                            LCLIENT_LIST,
-                            client_id,
-                            ip_port,
-                            dht->c->self_public_key );
-        }
-    }
+    table_add(dht, client_id, ip_port);
 
     for (i = 0; i < dht->num_friends; ++i) {
+        DHT_Friend *friend = &dht->friends_list[i];
+
+        /* The friend answered us directly while we were punching holes to it. */
+        if (friend->punch_start != 0 && id_equal(client_id, friend->client_id)) {
+            Stats *stats = &dht->c->lossless_udp->net->stats;
+            ++stats->punch_successes;
+            stats_histogram_add(&stats->punch_time, (current_time() - friend->punch_start) / 1000);
+            friend->punch_start = 0;
+        }
+
         if (!client_in_list(    dht->friends_list[i].client_list,
                                 MAX_FRIEND_CLIENTS,
                                 client_id,
@@ -391,6 +557,44 @@ void addto_lists(DHT *dht, IP_Port ip_port, uint8_t *client_id)
     }
 }
 
+static void client_responded(Client_data *client, uint32_t rtt)
+{
+    client->rtt = client->rtt == 0 ? rtt : (client->rtt * 7 + rtt) / 8;
+    client->reliability += (255 - client->reliability + 3) / 4;
+}
+
+/* Nothing from client since the last ping. */
+static int client_missed_ping(Client_data *client)
+{
+    if (client->last_pinged == 0 || client->timestamp >= client->last_pinged)
+        return 0;
+
+    client->reliability -= client->reliability / 4;
+    return 1;
+}
+
+void DHT_node_responded(DHT *dht, uint8_t *client_id, uint64_t sent_time)
+{
+    Client_data *client = table_find(dht, client_id);
+    uint64_t temp_time = current_time();
+    uint32_t i, j;
+
+    if (sent_time > temp_time)
+        return;
+
+    uint32_t rtt = MAX((temp_time - sent_time) / 1000, 1);
+    stats_histogram_add(&dht->c->lossless_udp->net->stats.dht_rtt, rtt);
+
+    if (client != NULL)
+        client_responded(client, rtt);
+
+    /* The friends lists have their own copy of the nodes, route_tofriend() ranks them by it. */
+    for (i = 0; i < dht->num_friends; ++i)
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j)
+            if (id_equal(dht->friends_list[i].client_list[j].client_id, client_id))
+                client_responded(&dht->friends_list[i].client_list[j], rtt);
+}
+
 /* If client_id is a friend or us, update ret_ip_port
  * nodeclient_id is the id of the node that sent us this info.
  */
@@ -400,13 +604,11 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, uint8_t *client_id, uint
     uint64_t temp_time = unix_time();
 
     if (id_equal(client_id, dht->c->self_public_key)) {
+        Client_data *client = table_find(dht, nodeclient_id);
 
-        for (i = 0; i < LCLIENT_LIST; ++i) {
-            if (id_equal(nodeclient_id, dht->close_clientlist[i].client_id)) {
-                dht->close_clientlist[i].ret_ip_port = ip_port;
-                dht->close_clientlist[i].ret_timestamp = temp_time;
-                return;
-            }
+        if (client != NULL) {
+            client->ret_ip_port = ip_port;
+            client->ret_timestamp = temp_time;
         }
 
     } else {
@@ -427,131 +629,157 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, uint8_t *client_id, uint
     }
 }
 
-/* Same as last function but for get_node requests. */
-static int is_gettingnodes(DHT *dht, IP_Port ip_port, uint64_t ping_id)
+/* Send a getnodes request. */
+static int getnodes(DHT *dht, IP_Port ip_port, uint8_t *public_key, uint8_t *client_id)
 {
-    uint32_t i;
-    uint8_t pinging;
-    uint64_t temp_time = unix_time();
+    /* Check if packet is going to be sent to ourself. */
+    if (id_equal(public_key, dht->c->self_public_key) || request_tracker_find(&dht->getnodes_requests, ip_port, 0))
+        return 1;
+
+    uint64_t ping_id = request_tracker_add(&dht->getnodes_requests, ip_port);
 
-    for (i = 0; i < LSEND_NODES_ARRAY; ++i ) {
-        if (!is_timeout(temp_time, dht->send_nodes[i].timestamp, PING_TIMEOUT)) {
-            pinging = 0;
+    uint8_t data[1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING];
+    uint8_t plain[sizeof(ping_id) + CLIENT_ID_SIZE];
+    uint8_t encrypt[sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    random_nonce(nonce);
 
-            if (ip_port.ip.uint32 != 0 && ipport_equal(dht->send_nodes[i].ip_port, ip_port))
-                ++pinging;
+    memcpy(plain, &ping_id, sizeof(ping_id));
+    memcpy(plain + sizeof(ping_id), client_id, CLIENT_ID_SIZE);
 
-            if (ping_id != 0 && dht->send_nodes[i].ping_id == ping_id)
-                ++pinging;
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(dht->c, shared_key, public_key);
+    int len = encrypt_data_fast( shared_key,
+                                 nonce,
+                                 plain,
+                                 sizeof(ping_id) + CLIENT_ID_SIZE,
+                                 encrypt );
 
-            if (pinging == (ping_id != 0) + (ip_port.ip.uint32 != 0))
-                return 1;
-        }
-    }
+    if (len != sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING)
+        return -1;
 
-    return 0;
+    data[0] = NET_PACKET_GET_NODES;
+    memcpy(data + 1, dht->c->self_public_key, CLIENT_ID_SIZE);
+    memcpy(data + 1 + CLIENT_ID_SIZE, nonce, crypto_box_NONCEBYTES);
+    memcpy(data + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES, encrypt, len);
+
+    return sendpacket(dht->c->lossless_udp->net, ip_port, data, sizeof(data));
 }
 
-/* Same but for get node requests. */
-static uint64_t add_gettingnodes(DHT *dht, IP_Port ip_port)
-{
-    uint32_t i, j;
-    uint64_t ping_id = ((uint64_t)random_int() << 32) + random_int();
-    uint64_t temp_time = unix_time();
+/* Size of a node in a NET_PACKET_SEND_NODES packet: client_id and IP4_Port, for IPv4 nodes only. */
+#define NODE_SIZE_V4 (CLIENT_ID_SIZE + sizeof(IP4_Port))
 
-    for (i = 0; i < PING_TIMEOUT; ++i ) {
-        for (j = 0; j < LSEND_NODES_ARRAY; ++j ) {
-            if (is_timeout(temp_time, dht->send_nodes[j].timestamp, PING_TIMEOUT - i)) {
-                dht->send_nodes[j].timestamp = temp_time;
-                dht->send_nodes[j].ip_port = ip_port;
-                dht->send_nodes[j].ping_id = ping_id;
-                return ping_id;
-            }
-        }
-    }
+/* Size of a node in a NET_PACKET_SEND_NODES_IPV6 packet: client_id, IP and port (network order). */
+#define NODE_SIZE_V6 (CLIENT_ID_SIZE + sizeof(IP) + sizeof(uint16_t))
 
-    return 0;
+static uint32_t node_size(uint8_t packet_id)
+{
+    return packet_id == NET_PACKET_SEND_NODES ? NODE_SIZE_V4 : NODE_SIZE_V6;
 }
 
-/* Send a getnodes request. */
-static int getnodes(DHT *dht, IP_Port ip_port, uint8_t *public_key, uint8_t *client_id)
+/* Put node in data the way packets of type packet_id carry it. */
+static void pack_node(uint8_t *data, Node_format *node, uint8_t packet_id)
 {
-    /* Check if packet is going to be sent to ourself. */
-    if (id_equal(public_key, dht->c->self_public_key) || is_gettingnodes(dht, ip_port, 0))
-        return 1;
+    memcpy(data, node->client_id, CLIENT_ID_SIZE);
 
-    uint64_t ping_id = add_gettingnodes(dht, ip_port);
+    if (packet_id == NET_PACKET_SEND_NODES) {
+        IP4_Port ip4_port;
+        ipport_to_v4(node->ip_port, &ip4_port);
+        memcpy(data + CLIENT_ID_SIZE, &ip4_port, sizeof(ip4_port));
+    } else {
+        memcpy(data + CLIENT_ID_SIZE, node->ip_port.ip.uint8, sizeof(IP));
+        memcpy(data + CLIENT_ID_SIZE + sizeof(IP), &node->ip_port.port, sizeof(uint16_t));
+    }
+}
 
-    if (ping_id == 0)
-        return 1;
+static void unpack_node(Node_format *node, uint8_t *data, uint8_t packet_id)
+{
+    memcpy(node->client_id, data, CLIENT_ID_SIZE);
 
-    uint8_t data[1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING];
-    uint8_t plain[sizeof(ping_id) + CLIENT_ID_SIZE];
-    uint8_t encrypt[sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING];
+    if (packet_id == NET_PACKET_SEND_NODES) {
+        IP4_Port ip4_port;
+        memcpy(&ip4_port, data + CLIENT_ID_SIZE, sizeof(ip4_port));
+        node->ip_port = ipport_from_v4(ip4_port);
+    } else {
+        memcpy(node->ip_port.ip.uint8, data + CLIENT_ID_SIZE, sizeof(IP));
+        memcpy(&node->ip_port.port, data + CLIENT_ID_SIZE + sizeof(IP), sizeof(uint16_t));
+        node->ip_port.padding = 0;
+    }
+}
+
+/* Send the nodes of nodes_list that packets of type packet_id carry: the IPv4 ones in
+ * NET_PACKET_SEND_NODES, the others in NET_PACKET_SEND_NODES_IPV6.
+ */
+static int send_nodes_packet(DHT *dht, IP_Port ip_port, uint8_t *public_key, uint64_t ping_id, uint8_t packet_id,
+                             Node_format *nodes_list, uint32_t num_nodes)
+{
+    uint8_t data[1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + sizeof(ping_id)
+                 + NODE_SIZE_V6 * MAX_SENT_NODES + ENCRYPTION_PADDING];
+    uint8_t plain[sizeof(ping_id) + NODE_SIZE_V6 * MAX_SENT_NODES];
+    uint8_t encrypt[sizeof(ping_id) + NODE_SIZE_V6 * MAX_SENT_NODES + ENCRYPTION_PADDING];
     uint8_t nonce[crypto_box_NONCEBYTES];
-    random_nonce(nonce);
+    uint32_t i, size = sizeof(ping_id);
 
     memcpy(plain, &ping_id, sizeof(ping_id));
-    memcpy(plain + sizeof(ping_id), client_id, CLIENT_ID_SIZE);
 
-    int len = encrypt_data( public_key,
-                            dht->c->self_secret_key,
-                            nonce,
-                            plain,
-                            sizeof(ping_id) + CLIENT_ID_SIZE,
-                            encrypt );
+    for (i = 0; i < num_nodes; ++i) {
+        if (ip_is_v4(nodes_list[i].ip_port.ip) == (packet_id == NET_PACKET_SEND_NODES)) {
+            pack_node(plain + size, &nodes_list[i], packet_id);
+            size += node_size(packet_id);
+        }
+    }
 
-    if (len != sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING)
+    if (size == sizeof(ping_id))
+        return 0;
+
+    random_nonce(nonce);
+
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(dht->c, shared_key, public_key);
+    int len = encrypt_data_fast( shared_key,
+                                 nonce,
+                                 plain,
+                                 size,
+                                 encrypt );
+
+    if (len != size + ENCRYPTION_PADDING)
         return -1;
 
-    data[0] = NET_PACKET_GET_NODES;
+    data[0] = packet_id;
     memcpy(data + 1, dht->c->self_public_key, CLIENT_ID_SIZE);
     memcpy(data + 1 + CLIENT_ID_SIZE, nonce, crypto_box_NONCEBYTES);
     memcpy(data + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES, encrypt, len);
 
-    return sendpacket(dht->c->lossless_udp->net->sock, ip_port, data, sizeof(data));
+    return sendpacket(dht->c->lossless_udp->net, ip_port, data, 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + len);
 }
 
-/* Send a send nodes response. */
+/* Send a send nodes response.
+ * Versions before IPv6 only understand NET_PACKET_SEND_NODES, so the IPv4 nodes are sent in
+ * one of those and the IPv6 ones (if any) in a NET_PACKET_SEND_NODES_IPV6 that they ignore.
+ */
 static int sendnodes(DHT *dht, IP_Port ip_port, uint8_t *public_key, uint8_t *client_id, uint64_t ping_id)
 {
     /* Check if packet is going to be sent to ourself. */
     if (id_equal(public_key, dht->c->self_public_key))
         return 1;
 
-    uint8_t data[1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + sizeof(ping_id)
-                 + sizeof(Node_format) * MAX_SENT_NODES + ENCRYPTION_PADDING];
-
     Node_format nodes_list[MAX_SENT_NODES];
     int num_nodes = get_close_nodes(dht, client_id, nodes_list);
 
     if (num_nodes == 0)
         return 0;
 
-    uint8_t plain[sizeof(ping_id) + sizeof(Node_format) * MAX_SENT_NODES];
-    uint8_t encrypt[sizeof(ping_id) + sizeof(Node_format) * MAX_SENT_NODES + ENCRYPTION_PADDING];
-    uint8_t nonce[crypto_box_NONCEBYTES];
-    random_nonce(nonce);
-
-    memcpy(plain, &ping_id, sizeof(ping_id));
-    memcpy(plain + sizeof(ping_id), nodes_list, num_nodes * sizeof(Node_format));
-
-    int len = encrypt_data( public_key,
-                            dht->c->self_secret_key,
-                            nonce,
-                            plain,
-                            sizeof(ping_id) + num_nodes * sizeof(Node_format),
-                            encrypt );
+    int sent = send_nodes_packet(dht, ip_port, public_key, ping_id, NET_PACKET_SEND_NODES, nodes_list, num_nodes);
 
-    if (len != sizeof(ping_id) + num_nodes * sizeof(Node_format) + ENCRYPTION_PADDING)
+    if (sent == -1)
         return -1;
 
-    data[0] = NET_PACKET_SEND_NODES;
-    memcpy(data + 1, dht->c->self_public_key, CLIENT_ID_SIZE);
-    memcpy(data + 1 + CLIENT_ID_SIZE, nonce, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES, encrypt, len);
+    /* Nobody without IPv6 can use those. */
+    if (ip_is_v4(ip_port.ip) && dht->c->lossless_udp->net->family != AF_INET6)
+        return sent;
 
-    return sendpacket(dht->c->lossless_udp->net->sock, ip_port, data, 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + len);
+    int sent6 = send_nodes_packet(dht, ip_port, public_key, ping_id, NET_PACKET_SEND_NODES_IPV6, nodes_list, num_nodes);
+    return sent6 == -1 ? -1 : sent + sent6;
 }
 
 static int handle_getnodes(void *object, IP_Port source, uint8_t *packet, uint32_t length)
@@ -569,12 +797,13 @@ static int handle_getnodes(void *object, IP_Port source, uint8_t *packet, uint32
 
     uint8_t plain[sizeof(ping_id) + CLIENT_ID_SIZE];
 
-    int len = decrypt_data( packet + 1,
-                            dht->c->self_secret_key,
-                            packet + 1 + CLIENT_ID_SIZE,
-                            packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
-                            sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING,
-                            plain );
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(dht->c, shared_key, packet + 1);
+    int len = decrypt_data_fast( shared_key,
+                                 packet + 1 + CLIENT_ID_SIZE,
+                                 packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
+                                 sizeof(ping_id) + CLIENT_ID_SIZE + ENCRYPTION_PADDING,
+                                 plain );
 
     if (len != sizeof(ping_id) + CLIENT_ID_SIZE)
         return 1;
@@ -587,46 +816,71 @@ static int handle_getnodes(void *object, IP_Port source, uint8_t *packet, uint32
     return 0;
 }
 
+/* Handler of NET_PACKET_SEND_NODES and NET_PACKET_SEND_NODES_IPV6. */
 static int handle_sendnodes(void *object, IP_Port source, uint8_t *packet, uint32_t length)
 {
     DHT *dht = object;
     uint64_t ping_id;
     uint32_t cid_size = 1 + CLIENT_ID_SIZE;
     cid_size += crypto_box_NONCEBYTES + sizeof(ping_id) + ENCRYPTION_PADDING;
+    uint32_t size = node_size(packet[0]);
 
-    if (length > (cid_size + sizeof(Node_format) * MAX_SENT_NODES) ||
-            ((length - cid_size) % sizeof(Node_format)) != 0 ||
-            (length < cid_size + sizeof(Node_format)))
+    if (length > (cid_size + size * MAX_SENT_NODES) ||
+            ((length - cid_size) % size) != 0 ||
+            (length < cid_size + size))
         return 1;
 
-    uint32_t num_nodes = (length - cid_size) / sizeof(Node_format);
-    uint8_t plain[sizeof(ping_id) + sizeof(Node_format) * MAX_SENT_NODES];
+    uint32_t num_nodes = (length - cid_size) / size;
+    uint8_t plain[sizeof(ping_id) + NODE_SIZE_V6 * MAX_SENT_NODES];
 
-    int len = decrypt_data(
-                  packet + 1,
-                  dht->c->self_secret_key,
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(dht->c, shared_key, packet + 1);
+    int len = decrypt_data_fast(
+                  shared_key,
                   packet + 1 + CLIENT_ID_SIZE,
                   packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
-                  sizeof(ping_id) + num_nodes * sizeof(Node_format) + ENCRYPTION_PADDING, plain );
+                  sizeof(ping_id) + num_nodes * size + ENCRYPTION_PADDING, plain );
 
-    if (len != sizeof(ping_id) + num_nodes * sizeof(Node_format))
+    if (len != sizeof(ping_id) + num_nodes * size)
         return 1;
 
     memcpy(&ping_id, plain, sizeof(ping_id));
 
-    if (!is_gettingnodes(dht, source, ping_id))
-        return 1;
+    /* The IPv4 and the IPv6 nodes of a response come in two packets with the same ping_id,
+     * each is taken once but only the first one says the node responded.
+     */
+    uint64_t sent_time;
+    int taken = request_tracker_take(&dht->getnodes_requests, source, ping_id,
+                                     packet[0] == NET_PACKET_SEND_NODES_IPV6, &sent_time);
 
-    Node_format nodes_list[MAX_SENT_NODES];
-    memcpy(nodes_list, plain + sizeof(ping_id), num_nodes * sizeof(Node_format));
+    if (taken == 0)
+        return 1;
 
     addto_lists(dht, source, packet + 1);
 
+    if (taken == 1)
+        DHT_node_responded(dht, packet + 1, sent_time);
+
     uint32_t i;
+    int has_ipv6 = dht->c->lossless_udp->net->family == AF_INET6;
 
     for (i = 0; i < num_nodes; ++i)  {
-        send_ping_request(dht->ping, dht->c, nodes_list[i].ip_port, nodes_list[i].client_id);
-        returnedip_ports(dht, nodes_list[i].ip_port, nodes_list[i].client_id, packet + 1);
+        Node_format node;
+        unpack_node(&node, plain + sizeof(ping_id) + i * size, packet[0]);
+
+        if (!has_ipv6 && !ip_is_v4(node.ip_port.ip))
+            continue;
+
+        /* Many nodes send us the same ones, ping those only once in a while. */
+        uint8_t key[NODE_KEY_SIZE];
+        node_key(key, node.client_id, node.ip_port);
+
+        if (!bloom_filter_check(&dht->announced, key, sizeof(key))) {
+            bloom_filter_add(&dht->announced, key, sizeof(key));
+            send_ping_request(dht->ping, dht->c, node.ip_port, node.client_id);
+        }
+
+        returnedip_ports(dht, node.ip_port, node.client_id, packet + 1);
     }
 
     return 0;
@@ -640,13 +894,23 @@ int DHT_addfriend(DHT *dht, uint8_t *client_id)
     if (friend_number(dht, client_id) != -1) /* Is friend already in DHT? */
         return 1;
 
-    DHT_Friend *temp;
-    temp = realloc(dht->friends_list, sizeof(DHT_Friend) * (dht->num_friends + 1));
+    if (dht->num_friends == dht->friends_list_capacity) {
+        if (dht->num_friends == (uint16_t)~0)
+            return 1;
+
+        uint16_t capacity = MIN((uint32_t)MAX(dht->friends_list_capacity * 2, 4), (uint16_t)~0);
+        DHT_Friend *temp = realloc(dht->friends_list, sizeof(DHT_Friend) * capacity);
+
+        if (temp == NULL)
+            return 1;
+
+        dht->friends_list = temp;
+        dht->friends_list_capacity = capacity;
+    }
 
-    if (temp == NULL)
+    if (key_index_add(&dht->friend_keys, client_id, dht->num_friends) == -1)
         return 1;
 
-    dht->friends_list = temp;
     memset(&dht->friends_list[dht->num_friends], 0, sizeof(DHT_Friend));
     memcpy(dht->friends_list[dht->num_friends].client_id, client_id, CLIENT_ID_SIZE);
 
@@ -657,63 +921,67 @@ int DHT_addfriend(DHT *dht, uint8_t *client_id)
 
 int DHT_delfriend(DHT *dht, uint8_t *client_id)
 {
-    uint32_t i;
-    DHT_Friend *temp;
+    int i = friend_number(dht, client_id);
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        /* Equal */
-        if (id_equal(dht->friends_list[i].client_id, client_id)) {
-            --dht->num_friends;
-
-            if (dht->num_friends != i) {
-                memcpy( dht->friends_list[i].client_id,
-                        dht->friends_list[dht->num_friends].client_id,
-                        CLIENT_ID_SIZE );
-            }
+    if (i == -1)
+        return 1;
 
-            if (dht->num_friends == 0) {
-                free(dht->friends_list);
-                dht->friends_list = NULL;
-                return 0;
-            }
+    --dht->num_friends;
+    key_index_remove(&dht->friend_keys, client_id, i);
+
+    if (dht->num_friends != i) {
+        key_index_remove(&dht->friend_keys, dht->friends_list[dht->num_friends].client_id, dht->num_friends);
+        dht->friends_list[i] = dht->friends_list[dht->num_friends];
+        key_index_add(&dht->friend_keys, dht->friends_list[i].client_id, i);
+    }
 
-            temp = realloc(dht->friends_list, sizeof(DHT_Friend) * (dht->num_friends));
+    if (dht->num_friends == 0) {
+        free(dht->friends_list);
+        dht->friends_list = NULL;
+        dht->friends_list_capacity = 0;
+        return 0;
+    }
 
-            if (temp == NULL)
-                return 1;
+    /* Only give memory back once the list is mostly unused. */
+    if (dht->num_friends * 4 <= dht->friends_list_capacity) {
+        uint16_t capacity = dht->friends_list_capacity / 2;
+        DHT_Friend *temp = realloc(dht->friends_list, sizeof(DHT_Friend) * capacity);
 
+        if (temp != NULL) {
             dht->friends_list = temp;
-            return 0;
+            dht->friends_list_capacity = capacity;
         }
     }
 
-    return 1;
+    return 0;
 }
 
-/* TODO: Optimize this. */
 IP_Port DHT_getfriendip(DHT *dht, uint8_t *client_id)
 {
-    uint32_t i, j;
+    uint32_t j;
     uint64_t temp_time = unix_time();
-    IP_Port empty = {{{{0}}, 0, 0}};
+    IP_Port empty = {{{0}}, 0, 0};
+    int i = friend_number(dht, client_id);
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        /* Equal */
-        if (id_equal(dht->friends_list[i].client_id, client_id)) {
-            for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
-                if (id_equal(dht->friends_list[i].client_list[j].client_id, client_id)
-                        && !is_timeout(temp_time, dht->friends_list[i].client_list[j].timestamp, BAD_NODE_TIMEOUT))
-                    return dht->friends_list[i].client_list[j].ip_port;
-            }
+    if (i == -1) {
+        ip_init_v4(&empty.ip, htonl(1));
+        return empty;
+    }
 
-            return empty;
-        }
+    for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+        if (id_equal(dht->friends_list[i].client_list[j].client_id, client_id)
+                && !is_timeout(temp_time, dht->friends_list[i].client_list[j].timestamp, BAD_NODE_TIMEOUT))
+            return dht->friends_list[i].client_list[j].ip_port;
     }
 
-    empty.ip.uint32 = 1;
     return empty;
 }
 
+int DHT_friendip_unknown(IP_Port ip_port)
+{
+    return ip_is_v4(ip_port.ip) && ip_get_v4(ip_port.ip).uint32 == htonl(1);
+}
+
 /* Ping each client in the "friends" list every PING_INTERVAL seconds. Send a get nodes request
  * every GET_NODE_INTERVAL seconds to a random good node for each "friend" in our "friends" list.
  */
@@ -731,6 +999,7 @@ static void do_DHT_friends(DHT *dht)
             /* If node is not dead. */
             if (!is_timeout(temp_time, dht->friends_list[i].client_list[j].timestamp, Kill_NODE_TIMEOUT)) {
                 if ((dht->friends_list[i].client_list[j].last_pinged + PING_INTERVAL) <= temp_time) {
+                    client_missed_ping(&dht->friends_list[i].client_list[j]);
                     send_ping_request(dht->ping, dht->c, dht->friends_list[i].client_list[j].ip_port,
                                       dht->friends_list[i].client_list[j].client_id );
                     dht->friends_list[i].client_list[j].last_pinged = temp_time;
@@ -754,41 +1023,58 @@ static void do_DHT_friends(DHT *dht)
     }
 }
 
-/* Ping each client in the close nodes list every PING_INTERVAL seconds.
- * Send a get nodes request every GET_NODE_INTERVAL seconds to a random good node in the list.
+/* Ping each node in the routing table every PING_INTERVAL seconds.
+ * Send a get nodes request every GET_NODE_INTERVAL seconds to a random good node in the table.
  */
 static void do_Close(DHT *dht)
 {
-    uint32_t i;
+    uint32_t i, j;
     uint64_t temp_time = unix_time();
-    uint32_t num_nodes = 0;
-    uint32_t rand_node;
-    uint32_t index[LCLIENT_LIST];
+    uint64_t next = ~0;
+    uint32_t num_good = 0;
+    Client_data *rand_node = NULL;
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        /* If node is not dead. */
-        if (!is_timeout(temp_time, dht->close_clientlist[i].timestamp, Kill_NODE_TIMEOUT)) {
-            if ((dht->close_clientlist[i].last_pinged + PING_INTERVAL) <= temp_time) {
-                send_ping_request(dht->ping, dht->c, dht->close_clientlist[i].ip_port,
-                                  dht->close_clientlist[i].client_id );
-                dht->close_clientlist[i].last_pinged = temp_time;
+    if (temp_time < dht->close_next_run)
+        return;
+
+    for (i = 0; i < DHT_NUM_BUCKETS; ++i) {
+        for (j = 0; j < dht->buckets[i].num; ++j) {
+            Client_data *client = &dht->buckets[i].clients[j];
+
+            /* If node is dead. */
+            if (is_timeout(temp_time, client->timestamp, Kill_NODE_TIMEOUT))
+                continue;
+
+            if ((client->last_pinged + PING_INTERVAL) <= temp_time) {
+                if (client_missed_ping(client))
+                    ++dht->c->lossless_udp->net->stats.pings_missed;
+
+                send_ping_request(dht->ping, dht->c, client->ip_port, client->client_id);
+                client->last_pinged = temp_time;
             }
 
-            /* If node is good. */
-            if (!is_timeout(temp_time, dht->close_clientlist[i].timestamp, BAD_NODE_TIMEOUT)) {
-                index[num_nodes] = i;
-                ++num_nodes;
+            next = MIN(next, client->last_pinged + PING_INTERVAL);
+
+            /* If node is good, pick one of them at random without having to list them. */
+            if (!is_timeout(temp_time, client->timestamp, BAD_NODE_TIMEOUT)) {
+                ++num_good;
+
+                if (rand() % num_good == 0)
+                    rand_node = client;
             }
         }
     }
 
-    if (dht->close_lastgetnodes + GET_NODE_INTERVAL <= temp_time && num_nodes != 0) {
-        rand_node = rand() % num_nodes;
-        getnodes(dht, dht->close_clientlist[index[rand_node]].ip_port,
-                 dht->close_clientlist[index[rand_node]].client_id,
-                 dht->c->self_public_key );
+    if (dht->close_lastgetnodes + GET_NODE_INTERVAL <= temp_time && num_good != 0) {
+        getnodes(dht, rand_node->ip_port, rand_node->client_id, dht->c->self_public_key);
         dht->close_lastgetnodes = temp_time;
     }
+
+    if (num_good != 0)
+        next = MIN(next, dht->close_lastgetnodes + GET_NODE_INTERVAL);
+
+    /* Nodes going bad only make us do less, nothing to look at before next. */
+    dht->close_next_run = next;
 }
 
 void DHT_bootstrap(DHT *dht, IP_Port ip_port, uint8_t *public_key)
@@ -802,14 +1088,12 @@ void DHT_bootstrap(DHT *dht, IP_Port ip_port, uint8_t *public_key)
  */
 int route_packet(DHT *dht, uint8_t *client_id, uint8_t *packet, uint32_t length)
 {
-    uint32_t i;
+    Client_data *client = table_find(dht, client_id);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(client_id, dht->close_clientlist[i].client_id))
-            return sendpacket(dht->c->lossless_udp->net->sock, dht->close_clientlist[i].ip_port, packet, length);
-    }
+    if (client == NULL)
+        return -1;
 
-    return -1;
+    return sendpacket(dht->c->lossless_udp->net, client->ip_port, packet, length);
 }
 
 /* Puts all the different ips returned by the nodes for a friend_num into array ip_portlist
@@ -834,7 +1118,7 @@ static int friend_iplist(DHT *dht, IP_Port *ip_portlist, uint16_t friend_num)
         client = &friend->client_list[i];
 
         /* If ip is not zero and node is good */
-        if (client->ret_ip_port.ip.uint32 != 0 && !is_timeout(temp_time, client->ret_timestamp, BAD_NODE_TIMEOUT)) {
+        if (ip_isset(client->ret_ip_port.ip) && !is_timeout(temp_time, client->ret_timestamp, BAD_NODE_TIMEOUT)) {
 
             if (id_equal(client->client_id, friend->client_id))
                 return 0;
@@ -848,7 +1132,49 @@ static int friend_iplist(DHT *dht, IP_Port *ip_portlist, uint16_t friend_num)
 }
 
 
-/* Send the following packet to everyone who tells us they are connected to friend_id.
+/* return 1 if a is a better node to route through than b: it answers more often or, as often,
+ * faster.
+ */
+static int route_better(Client_data *a, Client_data *b)
+{
+    if (a->reliability != b->reliability)
+        return a->reliability > b->reliability;
+
+    return a->rtt != 0 && (a->rtt < b->rtt || b->rtt == 0);
+}
+
+/* Put the (at most max_paths) best nodes that tell us they are connected to friend in paths,
+ * best first.
+ * return the number of nodes put in paths.
+ */
+static uint32_t route_paths(DHT_Friend *friend, Client_data **paths, uint32_t max_paths)
+{
+    uint32_t i, j, num = 0;
+    uint64_t temp_time = unix_time();
+
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        Client_data *client = &friend->client_list[i];
+
+        /* If ip is not zero and node is good */
+        if (!ip_isset(client->ret_ip_port.ip) || is_timeout(temp_time, client->ret_timestamp, BAD_NODE_TIMEOUT))
+            continue;
+
+        for (j = num; j > 0 && route_better(client, paths[j - 1]); --j)
+            if (j < max_paths)
+                paths[j] = paths[j - 1];
+
+        if (j < max_paths) {
+            paths[j] = client;
+            num = MIN(num + 1, max_paths);
+        }
+    }
+
+    return num;
+}
+
+/* Send the following packet through the best nodes that tell us they are connected to friend_id.
+ * That is ROUTE_PATHS of them, more when the last requests got no answer (the answers to
+ * our NAT pings tell us they do).
  * returns the number of nodes it sent the packet to.
  *
  * Only works if more than (MAX_FRIEND_CLIENTS / 2) return an ip for friend.
@@ -860,32 +1186,29 @@ int route_tofriend(DHT *dht, uint8_t *friend_id, uint8_t *packet, uint32_t lengt
     if (num == -1)
         return 0;
 
-    uint32_t i, sent = 0;
-
     IP_Port ip_list[MAX_FRIEND_CLIENTS];
     int ip_num = friend_iplist(dht, ip_list, num);
 
     if (ip_num < (MAX_FRIEND_CLIENTS / 2))
         return 0;
 
-    uint64_t temp_time = unix_time();
     DHT_Friend *friend = &dht->friends_list[num];
-    Client_data *client;
-
-    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
-        client = &friend->client_list[i];
+    Client_data *paths[MAX_FRIEND_CLIENTS];
+    uint32_t i, sent = 0;
+    uint32_t num_paths = route_paths(friend, paths, MIN(ROUTE_PATHS << friend->route_unanswered, MAX_FRIEND_CLIENTS));
 
-        /* If ip is not zero and node is good */
-        if (client->ret_ip_port.ip.uint32 != 0 && !is_timeout(temp_time, client->ret_timestamp, BAD_NODE_TIMEOUT)) {
-            if (sendpacket(dht->c->lossless_udp->net->sock, client->ip_port, packet, length) == length)
-                ++sent;
-        }
+    for (i = 0; i < num_paths; ++i) {
+        if (sendpacket(dht->c->lossless_udp->net, paths[i]->ip_port, packet, length) == length)
+            ++sent;
     }
 
+    if (friend->route_unanswered < ROUTE_MAX_UNANSWERED)
+        ++friend->route_unanswered;
+
     return sent;
 }
 
-/* Send the following packet to one random person who tells us they are connected to friend_id.
+/* Send the following packet to the best node that tells us it is connected to friend_id.
 *  returns the number of nodes it sent the packet to
 */
 static int routeone_tofriend(DHT *dht, uint8_t *friend_id, uint8_t *packet, uint32_t length)
@@ -895,28 +1218,12 @@ static int routeone_tofriend(DHT *dht, uint8_t *friend_id, uint8_t *packet, uint
     if (num == -1)
         return 0;
 
-    DHT_Friend *friend = &dht->friends_list[num];
-    Client_data *client;
-
-    IP_Port ip_list[MAX_FRIEND_CLIENTS];
-    int n = 0;
-    uint32_t i;
-    uint64_t temp_time = unix_time();
-
-    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
-        client = &friend->client_list[i];
-
-        /* If ip is not zero and node is good. */
-        if (client->ret_ip_port.ip.uint32 != 0 && !is_timeout(temp_time, client->ret_timestamp, BAD_NODE_TIMEOUT)) {
-            ip_list[n] = client->ip_port;
-            ++n;
-        }
-    }
+    Client_data *path;
 
-    if (n < 1)
+    if (route_paths(&dht->friends_list[num], &path, 1) == 0)
         return 0;
 
-    if (sendpacket(dht->c->lossless_udp->net->sock, ip_list[rand() % n], packet, length) == length)
+    if (sendpacket(dht->c->lossless_udp->net, path->ip_port, packet, length) == length)
         return 1;
 
     return 0;
@@ -930,15 +1237,12 @@ static int routeone_tofriend(DHT *dht, uint8_t *friend_id, uint8_t *packet, uint
  */
 int friend_ips(DHT *dht, IP_Port *ip_portlist, uint8_t *friend_id)
 {
-    uint32_t i;
+    int i = friend_number(dht, friend_id);
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        /* Equal */
-        if (id_equal(dht->friends_list[i].client_id, friend_id))
-            return friend_iplist(dht, ip_portlist, i);
-    }
+    if (i == -1)
+        return -1;
 
-    return -1;
+    return friend_iplist(dht, ip_portlist, i);
 }
 
 /*----------------------------------------------------------------------------------*/
@@ -954,8 +1258,7 @@ static int send_NATping(DHT *dht, uint8_t *public_key, uint64_t ping_id, uint8_t
     data[0] = type;
     memcpy(data + 1, &ping_id, sizeof(uint64_t));
     /* 254 is NAT ping request packet id */
-    int len = create_request(dht->c->self_public_key, dht->c->self_secret_key, packet, public_key, data,
-                             sizeof(uint64_t) + 1, CRYPTO_PACKET_NAT_PING);
+    int len = create_request(dht->c, packet, public_key, data, sizeof(uint64_t) + 1, CRYPTO_PACKET_NAT_PING);
 
     if (len == -1)
         return -1;
@@ -993,7 +1296,15 @@ static int handle_NATping(void *object, IP_Port source, uint8_t *source_pubkey,
     } else if (packet[0] == NAT_PING_RESPONSE) {
         if (friend->NATping_id == ping_id) {
             friend->NATping_id = ((uint64_t)random_int() << 32) + random_int();
-            friend->hole_punching = 1;
+            friend->route_unanswered = 0;
+
+            if (friend->hole_punching == 0) {
+                friend->hole_punching = 1;
+                friend->punch_bursts = PUNCH_BURSTS;
+                friend->punching_index = 0;
+                ++dht->c->lossless_udp->net->stats.punch_runs;
+            }
+
             return 0;
         }
     }
@@ -1018,7 +1329,7 @@ static IP NAT_commonip(IP_Port *ip_portlist, uint16_t len, uint16_t min_num)
 
     for (i = 0; i < len; ++i) {
         for (j = 0; j < len; ++j) {
-            if (ip_portlist[i].ip.uint32 == ip_portlist[j].ip.uint32)
+            if (ip_equal(ip_portlist[i].ip, ip_portlist[j].ip))
                 ++numbers[i];
         }
 
@@ -1029,42 +1340,107 @@ static IP NAT_commonip(IP_Port *ip_portlist, uint16_t len, uint16_t min_num)
     return zero;
 }
 
-/* Return all the ports for one ip in a list.
+/* Return all the ports for one ip in a list, sorted and without duplicates.
  * portlist must be at least len long
  * where len is the length of ip_portlist
  * returns the number of ports and puts the list of ports in portlist.
  */
 static uint16_t NAT_getports(uint16_t *portlist, IP_Port *ip_portlist, uint16_t len, IP ip)
 {
-    uint32_t i;
+    uint32_t i, j;
     uint16_t num = 0;
 
     for (i = 0; i < len; ++i) {
-        if (ip_portlist[i].ip.uint32 == ip.uint32) {
-            portlist[num] = ntohs(ip_portlist[i].port);
-            ++num;
+        if (!ip_equal(ip_portlist[i].ip, ip))
+            continue;
+
+        uint16_t port = ntohs(ip_portlist[i].port);
+
+        for (j = num; j > 0 && portlist[j - 1] > port; --j)
+            portlist[j] = portlist[j - 1];
+
+        if (j > 0 && portlist[j - 1] == port) {
+            memmove(portlist + j, portlist + j + 1, (num - j) * sizeof(uint16_t));
+            continue;
         }
+
+        portlist[j] = port;
+        ++num;
     }
 
     return num;
 }
 
-static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports, uint16_t friend_num)
+/* return the step between the ports a NAT handed out, guessed from the sorted port_list:
+ * the most common difference between neighbours, 1 if there is none we believe in.
+ */
+static uint16_t NAT_portdelta(uint16_t *port_list, uint16_t numports)
+{
+    uint32_t i, j;
+    uint16_t delta = 1, best = 0;
+
+    for (i = 1; i < numports; ++i) {
+        uint16_t d = port_list[i] - port_list[i - 1], count = 0;
+
+        if (d > PUNCH_MAX_DELTA)
+            continue;
+
+        for (j = 1; j < numports; ++j)
+            if (port_list[j] - port_list[j - 1] == d)
+                ++count;
+
+        if (count > best || (count == best && d < delta)) {
+            best = count;
+            delta = d;
+        }
+    }
+
+    return delta;
+}
+
+/* return the index-th most likely port of a friend whose NAT gave the friend the ports in
+ * port_list (sorted) for the nodes that told us about it.
+ * NATs that keep the port come first: the ports seen. Then the ones that hand out ports one
+ * after the other: the ports past the last one seen, by delta. Those get two guesses for
+ * each guess around the ports seen, closest first.
+ */
+static uint16_t NAT_punchport(uint16_t *port_list, uint16_t numports, uint16_t delta, uint32_t index)
+{
+    if (index < numports)
+        return port_list[index];
+
+    index -= numports;
+    uint32_t round = index / 3;
+
+    if (index % 3 != 2)
+        return port_list[numports - 1] + delta * (round * 2 + index % 3 + 1);
+
+    uint32_t distance = round / (numports * 2) + 1, which = round % (numports * 2);
+    return port_list[which / 2] + ((which & 1) ? distance : -distance);
+}
+
+/* Send one burst of pings to the most likely ports of the friend not tried yet in this attempt.
+ * return the number of pings sent.
+ */
+static uint32_t punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports, uint16_t friend_num,
+                            uint32_t max_pings)
 {
     if (numports > MAX_FRIEND_CLIENTS || numports == 0)
-        return;
+        return 0;
 
-    uint32_t i;
-    uint32_t top = dht->friends_list[friend_num].punching_index + MAX_PUNCHING_PORTS;
+    DHT_Friend *friend = &dht->friends_list[friend_num];
+    uint16_t delta = NAT_portdelta(port_list, numports);
+    uint32_t i, num = MIN(max_pings, PUNCH_BURST_SIZE);
 
-    for (i = dht->friends_list[friend_num].punching_index; i != top; i++) {
-        /* TODO: improve port guessing algorithm */
-        uint16_t port = port_list[(i / 2) % numports] + (i / (2 * numports)) * ((i % 2) ? -1 : 1);
-        IP_Port pinging = {{ip, htons(port)}};
-        send_ping_request(dht->ping, dht->c, pinging, dht->friends_list[friend_num].client_id);
+    for (i = 0; i < num; ++i) {
+        uint16_t port = NAT_punchport(port_list, numports, delta, friend->punching_index + i);
+        IP_Port pinging = {ip, htons(port), 0};
+        send_ping_request(dht->ping, dht->c, pinging, friend->client_id);
     }
 
-    dht->friends_list[friend_num].punching_index = i;
+    dht->c->lossless_udp->net->stats.punch_pings += num;
+    friend->punching_index += num;
+    return num;
 }
 
 static void do_NAT(DHT *dht)
@@ -1085,22 +1461,41 @@ static void do_NAT(DHT *dht)
             dht->friends_list[i].NATping_timestamp = temp_time;
         }
 
-        if (dht->friends_list[i].hole_punching == 1 &&
-                dht->friends_list[i].punching_timestamp + PUNCH_INTERVAL < temp_time &&
-                dht->friends_list[i].recvNATping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
-
-            IP ip = NAT_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+        DHT_Friend *friend = &dht->friends_list[i];
 
-            if (ip.uint32 == 0)
-                continue;
+        if (friend->hole_punching == 0 || friend->punching_timestamp >= temp_time)
+            continue;
 
-            uint16_t port_list[MAX_FRIEND_CLIENTS];
-            uint16_t numports = NAT_getports(port_list, ip_list, num, ip);
-            punch_holes(dht, ip, port_list, numports, i);
+        /* Stop when the friend stopped asking us to punch or when all the bursts are sent. */
+        if (friend->recvNATping_timestamp + PUNCH_INTERVAL * 2 < temp_time || friend->punch_bursts == 0) {
+            friend->hole_punching = 0;
+            friend->punch_start = 0;
+            continue;
+        }
 
-            dht->friends_list[i].punching_timestamp = temp_time;
-            dht->friends_list[i].hole_punching = 0;
+        if (dht->punch_second != temp_time) {
+            dht->punch_second = temp_time;
+            dht->punch_pings = 0;
         }
+
+        if (dht->punch_pings >= MAX_PUNCH_PINGS_PER_SECOND)
+            continue;
+
+        IP ip = NAT_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+
+        if (!ip_isset(ip))
+            continue;
+
+        uint16_t port_list[MAX_FRIEND_CLIENTS];
+        uint16_t numports = NAT_getports(port_list, ip_list, num, ip);
+
+        if (friend->punch_bursts == PUNCH_BURSTS)
+            friend->punch_start = current_time();
+
+        dht->punch_pings += punch_holes(dht, ip, port_list, numports, i,
+                                        MAX_PUNCH_PINGS_PER_SECOND - dht->punch_pings);
+        friend->punching_timestamp = temp_time;
+        --friend->punch_bursts;
     }
 }
 
@@ -1119,16 +1514,15 @@ static void do_NAT(DHT *dht)
  */
 int add_toping(DHT *dht, uint8_t *client_id, IP_Port ip_port)
 {
-    if (ip_port.ip.uint32 == 0)
+    if (!ip_isset(ip_port.ip))
         return -1;
 
     uint32_t i;
 
     for (i = 0; i < MAX_TOPING; ++i) {
-        if (dht->toping[i].ip_port.ip.uint32 == 0) {
+        if (!ip_isset(dht->toping[i].ip_port.ip)) {
             memcpy(dht->toping[i].client_id, client_id, CLIENT_ID_SIZE);
-            dht->toping[i].ip_port.ip.uint32 = ip_port.ip.uint32;
-            dht->toping[i].ip_port.port = ip_port.port;
+            dht->toping[i].ip_port = ip_port;
             return 0;
         }
     }
@@ -1136,8 +1530,7 @@ int add_toping(DHT *dht, uint8_t *client_id, IP_Port ip_port)
     for (i = 0; i < MAX_TOPING; ++i) {
         if (id_closest(dht->c->self_public_key, dht->toping[i].client_id, client_id) == 2) {
             memcpy(dht->toping[i].client_id, client_id, CLIENT_ID_SIZE);
-            dht->toping[i].ip_port.ip.uint32 = ip_port.ip.uint32;
-            dht->toping[i].ip_port.port = ip_port.port;
+            dht->toping[i].ip_port = ip_port;
             return 0;
         }
     }
@@ -1159,11 +1552,11 @@ static void do_toping(DHT *dht)
     uint32_t i;
 
     for (i = 0; i < MAX_TOPING; ++i) {
-        if (dht->toping[i].ip_port.ip.uint32 == 0)
+        if (!ip_isset(dht->toping[i].ip_port.ip))
             return;
 
         send_ping_request(dht->ping, dht->c, dht->toping[i].ip_port, dht->toping[i].client_id);
-        dht->toping[i].ip_port.ip.uint32 = 0;
+        memset(&dht->toping[i].ip_port.ip, 0, sizeof(IP));
     }
 }
 
@@ -1180,16 +1573,22 @@ DHT *new_DHT(Net_Crypto *c)
 
     temp->ping = new_ping();
 
-    if (temp->ping == NULL) {
+    if (temp->ping == NULL
+            || request_tracker_init(&temp->getnodes_requests, LSEND_NODES_ARRAY, PING_TIMEOUT) == -1) {
         kill_DHT(temp);
         return NULL;
     }
 
     temp->c = c;
+    temp->bucket_size = DHT_BUCKET_SIZE;
+    temp->max_nodes = DHT_MAX_NODES;
+    key_index_init(&temp->friend_keys);
+    bloom_filter_init(&temp->announced, PING_INTERVAL);
     networking_registerhandler(c->lossless_udp->net, NET_PACKET_PING_REQUEST, &handle_ping_request, temp);
     networking_registerhandler(c->lossless_udp->net, NET_PACKET_PING_RESPONSE, &handle_ping_response, temp);
     networking_registerhandler(c->lossless_udp->net, NET_PACKET_GET_NODES, &handle_getnodes, temp);
     networking_registerhandler(c->lossless_udp->net, NET_PACKET_SEND_NODES, &handle_sendnodes, temp);
+    networking_registerhandler(c->lossless_udp->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes, temp);
     init_cryptopackets(temp);
     cryptopacket_registerhandler(c, CRYPTO_PACKET_NAT_PING, &handle_NATping, temp);
     return temp;
@@ -1202,48 +1601,218 @@ void do_DHT(DHT *dht)
     do_NAT(dht);
     do_toping(dht);
 }
+/* Helper for DHT_next_run(), same checks as do_Close() and do_DHT_friends(). */
+static uint64_t clients_next_run(Client_data *list, uint32_t length, uint64_t lastgetnode, uint64_t temp_time)
+{
+    uint32_t i;
+    uint64_t next = ~0;
+    uint8_t good = 0;
+
+    for (i = 0; i < length; ++i) {
+        if (is_timeout(temp_time, list[i].timestamp, Kill_NODE_TIMEOUT))
+            continue;
+
+        next = MIN(next, list[i].last_pinged + PING_INTERVAL);
+
+        if (!is_timeout(temp_time, list[i].timestamp, BAD_NODE_TIMEOUT))
+            good = 1;
+    }
+
+    if (good)
+        next = MIN(next, lastgetnode + GET_NODE_INTERVAL);
+
+    return next;
+}
+
+uint64_t DHT_next_run(DHT *dht)
+{
+    uint32_t i;
+    uint64_t temp_time = unix_time();
+    uint64_t next = dht->close_next_run;
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        DHT_Friend *friend = &dht->friends_list[i];
+        IP_Port ip_list[MAX_FRIEND_CLIENTS];
+
+        next = MIN(next, clients_next_run(friend->client_list, MAX_FRIEND_CLIENTS, friend->lastgetnode, temp_time));
+
+        if (friend_iplist(dht, ip_list, i) < MAX_FRIEND_CLIENTS / 2)
+            continue;
+
+        next = MIN(next, friend->NATping_timestamp + PUNCH_INTERVAL + 1);
+
+        if (friend->hole_punching == 1)
+            next = MIN(next, friend->punching_timestamp + 1);
+    }
+
+    if (ip_isset(dht->toping[0].ip_port.ip))
+        next = MIN(next, dht->last_toping + TIME_TOPING);
+
+    /* Anything due now was just done by do_DHT(). */
+    if (next <= temp_time)
+        return temp_time + 1;
+
+    return next;
+}
+
 void kill_DHT(DHT *dht)
 {
+    uint32_t i;
+
+    for (i = 0; i < DHT_NUM_BUCKETS; ++i)
+        free(dht->buckets[i].clients);
+
     kill_ping(dht->ping);
+    request_tracker_free(&dht->getnodes_requests);
+    key_index_free(&dht->friend_keys);
     free(dht->friends_list);
     free(dht);
 }
 
+/* The saved DHT: a uint32_t 0, DHT_STATE_COOKIE, the unix_time() it was saved at (uint64_t),
+ * the number of nodes (uint32_t) and 4 bytes of padding, then the nodes best first.
+ * Before IPv6 the cookie was DHT_STATE_COOKIE_V4 and the nodes Cached_Node_V4.
+ */
+#define DHT_STATE_COOKIE 0x159000e
+#define DHT_STATE_COOKIE_V4 0x159000d
+#define DHT_STATE_HEADER_SIZE (sizeof(uint32_t) * 2 + sizeof(uint64_t) + sizeof(uint32_t) * 2)
+
+typedef struct {
+    uint8_t     client_id[CLIENT_ID_SIZE];
+    IP_Port     ip_port;
+    uint64_t    last_seen; /* unix_time() */
+    uint32_t    rtt;
+    uint8_t     reliability;
+    uint8_t     good; /* See cached_node_rate(), set again before the loaded nodes are sorted. */
+    uint8_t     padding[2];
+} Cached_Node;
+
+typedef struct {
+    uint8_t     client_id[CLIENT_ID_SIZE];
+    IP4_Port    ip_port;
+    uint64_t    last_seen;
+    uint32_t    rtt;
+    uint8_t     reliability;
+    uint8_t     padding[3];
+} Cached_Node_V4;
+
+declare_quick_sort(Cached_Node);
+make_quick_sort(Cached_Node);
+
+/* Set whether the cached node was good (see BAD_NODE_TIMEOUT) at temp_time, before sorting. */
+static void cached_node_rate(Cached_Node *node, uint64_t temp_time)
+{
+    node->good = !is_timeout(temp_time, node->last_seen, BAD_NODE_TIMEOUT);
+}
+
+/* Compare cached nodes so that quick_sort puts the best first: good ones, then the most
+ * reliable ones, then the fastest ones.
+ */
+static int cached_node_cmp(Cached_Node a, Cached_Node b)
+{
+    if (a.good != b.good)
+        return a.good ? -1 : 1;
+
+    if (a.reliability != b.reliability)
+        return a.reliability > b.reliability ? -1 : 1;
+
+    if (a.rtt != b.rtt)
+        return (a.rtt != 0 && (a.rtt < b.rtt || b.rtt == 0)) ? -1 : 1;
+
+    return 0;
+}
+
+static void cache_node(Cached_Node *node, Client_data *client)
+{
+    memset(node, 0, sizeof(Cached_Node));
+    memcpy(node->client_id, client->client_id, CLIENT_ID_SIZE);
+    node->ip_port = client->ip_port;
+    node->last_seen = client->timestamp;
+    node->rtt = client->rtt;
+    node->reliability = client->reliability;
+}
+
 /* Get the size of the DHT (for saving). */
 uint32_t DHT_size(DHT *dht)
 {
-    return sizeof(dht->close_clientlist) + sizeof(DHT_Friend) * dht->num_friends;
+    return DHT_STATE_HEADER_SIZE + sizeof(Cached_Node) * MIN(dht->num_nodes, DHT_SAVED_NODES);
 }
 
-/* Save the DHT in data where data is an array of size DHT_size(). */
+/* Save the DHT in data where data is an array of size DHT_size().
+ * Only the DHT_SAVED_NODES best nodes of the routing table are saved.
+ */
 void DHT_save(DHT *dht, uint8_t *data)
 {
-    memcpy(data, dht->close_clientlist, sizeof(dht->close_clientlist));
-    memcpy(data + sizeof(dht->close_clientlist), dht->friends_list, sizeof(DHT_Friend) * dht->num_friends);
+    Cached_Node best[DHT_SAVED_NODES + 1];
+    uint32_t num = 0, i, j, k;
+    uint32_t header[2] = {0, DHT_STATE_COOKIE};
+    uint64_t temp_time = unix_time();
+
+    /* Keep the best nodes sorted while going through the table. */
+    for (i = 0; i < DHT_NUM_BUCKETS; ++i) {
+        for (j = 0; j < dht->buckets[i].num; ++j) {
+            Cached_Node node;
+            cache_node(&node, &dht->buckets[i].clients[j]);
+            cached_node_rate(&node, temp_time);
+
+            for (k = num; k > 0 && cached_node_cmp(node, best[k - 1]) == -1; --k)
+                best[k] = best[k - 1];
+
+            best[k] = node;
+            num = MIN(num + 1, DHT_SAVED_NODES);
+        }
+    }
+
+    uint32_t count[2] = {num, 0};
+    memcpy(data, header, sizeof(header));
+    memcpy(data + sizeof(header), &temp_time, sizeof(temp_time));
+    memcpy(data + sizeof(header) + sizeof(temp_time), count, sizeof(count));
+    memcpy(data + DHT_STATE_HEADER_SIZE, best, num * sizeof(Cached_Node));
 }
 
-/* Load the DHT from data of size size.
- * return -1 if failure.
- * return 0 if success.
- */
-int DHT_load(DHT *dht, uint8_t *data, uint32_t size)
+/* Layout of Client_data and DHT_Friend in the data saved by older versions, see load_old(). */
+typedef struct {
+    uint8_t     client_id[CLIENT_ID_SIZE];
+    IP4_Port    ip_port;
+    uint64_t    timestamp;
+    uint64_t    last_pinged;
+    IP4_Port    ret_ip_port;
+    uint64_t    ret_timestamp;
+} Old_Client_data;
+
+typedef struct {
+    uint8_t     client_id[CLIENT_ID_SIZE];
+    Old_Client_data client_list[MAX_FRIEND_CLIENTS];
+    uint64_t    lastgetnode;
+    uint8_t     hole_punching;
+    uint32_t    punching_index;
+    uint64_t    punching_timestamp;
+    uint64_t    recvNATping_timestamp;
+    uint64_t    NATping_id;
+    uint64_t    NATping_timestamp;
+} Old_DHT_Friend;
+
+/* Load the close list and the friends saved by older versions. */
+static int load_old(DHT *dht, uint8_t *data, uint32_t size)
 {
-    if (size < sizeof(dht->close_clientlist))
+    uint32_t close_size = sizeof(Old_Client_data) * LCLIENT_LIST;
+
+    if (size < close_size)
         return -1;
 
-    if ((size - sizeof(dht->close_clientlist)) % sizeof(DHT_Friend) != 0)
+    if ((size - close_size) % sizeof(Old_DHT_Friend) != 0)
         return -1;
 
     uint32_t i, j;
     uint16_t temp;
     /* uint64_t temp_time = unix_time(); */
 
-    Client_data *client;
+    Old_Client_data *client;
 
-    temp = (size - sizeof(dht->close_clientlist)) / sizeof(DHT_Friend);
+    temp = (size - close_size) / sizeof(Old_DHT_Friend);
 
     if (temp != 0) {
-        DHT_Friend *tempfriends_list = (DHT_Friend *)(data + sizeof(dht->close_clientlist));
+        Old_DHT_Friend *tempfriends_list = (Old_DHT_Friend *)(data + close_size);
 
         for (i = 0; i < temp; ++i) {
             DHT_addfriend(dht, tempfriends_list[i].client_id);
@@ -1252,34 +1821,128 @@ int DHT_load(DHT *dht, uint8_t *data, uint32_t size)
                 client = &tempfriends_list[i].client_list[j];
 
                 if (client->timestamp != 0)
-                    getnodes(dht, client->ip_port, client->client_id, tempfriends_list[i].client_id);
+                    getnodes(dht, ipport_from_v4(client->ip_port), client->client_id, tempfriends_list[i].client_id);
             }
         }
     }
 
-    Client_data *tempclose_clientlist = (Client_data *)data;
+    Old_Client_data *tempclose_clientlist = (Old_Client_data *)data;
 
     for (i = 0; i < LCLIENT_LIST; ++i) {
         if (tempclose_clientlist[i].timestamp != 0)
-            DHT_bootstrap(dht, tempclose_clientlist[i].ip_port,
+            DHT_bootstrap(dht, ipport_from_v4(tempclose_clientlist[i].ip_port),
                           tempclose_clientlist[i].client_id );
     }
 
     return 0;
 }
 
-/* returns 0 if we are not connected to the DHT.
- * returns 1 if we are.
+/* Load the DHT from data of size size.
+ * return -1 if failure.
+ * return 0 if success.
  */
+int DHT_load(DHT *dht, uint8_t *data, uint32_t size)
+{
+    uint32_t header[2], count[2], i;
+    uint64_t saved_time, temp_time = unix_time();
+
+    if (size < DHT_STATE_HEADER_SIZE)
+        return load_old(dht, data, size);
+
+    memcpy(header, data, sizeof(header));
+
+    if (header[0] != 0 || (header[1] != DHT_STATE_COOKIE && header[1] != DHT_STATE_COOKIE_V4))
+        return load_old(dht, data, size);
+
+    memcpy(&saved_time, data + sizeof(header), sizeof(saved_time));
+    memcpy(count, data + sizeof(header) + sizeof(saved_time), sizeof(count));
+
+    uint32_t node_size = header[1] == DHT_STATE_COOKIE ? sizeof(Cached_Node) : sizeof(Cached_Node_V4);
+
+    if (count[0] > DHT_SAVED_NODES || size != DHT_STATE_HEADER_SIZE + count[0] * node_size)
+        return -1;
+
+    Cached_Node nodes[DHT_SAVED_NODES];
+
+    if (header[1] == DHT_STATE_COOKIE) {
+        memcpy(nodes, data + DHT_STATE_HEADER_SIZE, count[0] * sizeof(Cached_Node));
+    } else {
+        for (i = 0; i < count[0]; ++i) {
+            Cached_Node_V4 node;
+            memcpy(&node, data + DHT_STATE_HEADER_SIZE + i * sizeof(node), sizeof(node));
+            memset(&nodes[i], 0, sizeof(Cached_Node));
+            memcpy(nodes[i].client_id, node.client_id, CLIENT_ID_SIZE);
+            nodes[i].ip_port = ipport_from_v4(node.ip_port);
+            nodes[i].last_seen = node.last_seen;
+            nodes[i].rtt = node.rtt;
+            nodes[i].reliability = node.reliability;
+        }
+    }
+
+    for (i = 0; i < count[0]; ++i)
+        cached_node_rate(&nodes[i], saved_time);
+
+    Cached_Node_quick_sort(nodes, count[0], cached_node_cmp);
+
+    for (i = 0; i < count[0]; ++i) {
+        Cached_Node *node = &nodes[i];
+
+        if (i < DHT_WARM_NODES)
+            DHT_bootstrap(dht, node->ip_port, node->client_id);
+        else
+            send_ping_request(dht->ping, dht->c, node->ip_port, node->client_id);
+
+        if (!node->good || saved_time > temp_time || saved_time + PROVISIONAL_MAX_AGE <= temp_time)
+            continue;
+
+        /* Usable until it had time to answer the ping we just sent. */
+        table_add(dht, node->client_id, node->ip_port);
+        Client_data *client = table_find(dht, node->client_id);
+
+        if (client != NULL) {
+            client->timestamp = temp_time - BAD_NODE_TIMEOUT + PING_TIMEOUT;
+            client->last_pinged = temp_time;
+            client->rtt = node->rtt;
+            client->reliability = node->reliability;
+        }
+    }
+
+    return 0;
+}
+
 int DHT_isconnected(DHT *dht)
 {
-    uint32_t i;
+    uint32_t i, j;
     uint64_t temp_time = unix_time();
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (!is_timeout(temp_time, dht->close_clientlist[i].timestamp, BAD_NODE_TIMEOUT))
-            return 1;
+    for (i = 0; i < DHT_NUM_BUCKETS; ++i) {
+        for (j = 0; j < dht->buckets[i].num; ++j)
+            if (!is_timeout(temp_time, dht->buckets[i].clients[j].timestamp, BAD_NODE_TIMEOUT))
+                return 1;
     }
 
     return 0;
 }
+
+void DHT_get_stats(DHT *dht, Stats *stats)
+{
+    Lossless_UDP *ludp = dht->c->lossless_udp;
+    uint32_t i, j;
+    uint64_t temp_time = unix_time();
+
+    *stats = ludp->net->stats;
+    stats->dht_nodes = dht->num_nodes;
+    stats->dht_good_nodes = 0;
+    stats->dht_friends = dht->num_friends;
+    stats->connections = 0;
+
+    for (i = 0; i < DHT_NUM_BUCKETS; ++i) {
+        for (j = 0; j < dht->buckets[i].num; ++j)
+            if (!is_timeout(temp_time, dht->buckets[i].clients[j].timestamp, BAD_NODE_TIMEOUT))
+                ++stats->dht_good_nodes;
+    }
+
+    for (i = 0; i < ludp->connections.len; ++i)
+        if (tox_array_get(&ludp->connections, i, Connection).status != 0)
+            ++stats->connections;
+}
@@ -25,6 +25,8 @@
 #define DHT_H
 
 #include "net_crypto.h"
+#include "request_tracker.h"
+#include "bloom_filter.h"
 
 
 /* Size of the client_id in bytes. */
@@ -33,11 +35,33 @@
 /* Maximum number of clients stored per friend. */
 #define MAX_FRIEND_CLIENTS 8
 
-/* A list of the clients mathematically closest to ours. */
+/* The max number of nodes to send with send nodes. */
+#define MAX_SENT_NODES 8
+
+/* Number of the clients closest to ours that older versions saved (see DHT_load()). */
 #define LCLIENT_LIST 32
 
-/* The list of ip ports along with the ping_id of what we sent them and a timestamp. */
-#define LPING_ARRAY 256 // NOTE: Deprecated (doesn't do anything).
+/* Maximum number of nodes of the routing table saved by DHT_save(). */
+#define DHT_SAVED_NODES 64
+
+/* Number of saved nodes DHT_load() asks for nodes right away, the others are only pinged. */
+#define DHT_WARM_NODES 8
+
+/* The routing table has one bucket per bit of the client_id: bucket i holds the
+ * nodes whose client_id has its first i bits in common with ours.
+ */
+#define DHT_NUM_BUCKETS (CLIENT_ID_SIZE * 8)
+
+/* Default maximum number of nodes per bucket of the routing table. */
+#define DHT_BUCKET_SIZE 8
+
+/* Default maximum number of nodes in the routing table. */
+#define DHT_MAX_NODES 512
+
+/* Default number of pings and of get nodes requests that can wait on a response at once,
+ * see DHT_set_request_capacity().
+ */
+#define LPING_ARRAY 256
 
 #define LSEND_NODES_ARRAY LPING_ARRAY/2
 
@@ -53,6 +77,9 @@ typedef struct {
     /* Returned by this node. Either our friend or us. */
     IP_Port     ret_ip_port;
     uint64_t    ret_timestamp;
+
+    uint32_t    rtt;         /* Smoothed round trip time of our requests in ms, 0 if unknown. */
+    uint8_t     reliability; /* How often it answers our pings, from 0 (never) to 255 (always). */
 } Client_data;
 
 /*----------------------------------------------------------------------------------*/
@@ -68,11 +95,16 @@ typedef struct {
 
     /* 1 if currently hole punching, otherwise 0 */
     uint8_t     hole_punching;
-    uint32_t    punching_index;
-    uint64_t    punching_timestamp;
+    uint8_t     punch_bursts; /* Bursts of pings left to send in this attempt. */
+    uint32_t    punching_index; /* Rank of the next port to try. */
+    uint64_t    punching_timestamp; /* When the last burst was sent. */
+    uint64_t    punch_start; /* current_time() of the first burst, 0 once the friend answered. */
     uint64_t    recvNATping_timestamp;
     uint64_t    NATping_id;
     uint64_t    NATping_timestamp;
+
+    /* Requests routed to the friend since the last answer, see route_tofriend(). */
+    uint8_t     route_unanswered;
 } DHT_Friend;
 
 typedef struct {
@@ -81,27 +113,66 @@ typedef struct {
 } Node_format;
 
 typedef struct {
-    IP_Port     ip_port;
-    uint64_t    ping_id;
-    uint64_t    timestamp;
-} Pinged;
+    Client_data *clients; /* NULL until the first node lands in the bucket. */
+    uint16_t     num;
+    uint16_t     capacity; /* Allocated length of clients. */
+} DHT_Bucket;
 
 /*----------------------------------------------------------------------------------*/
 typedef struct {
     Net_Crypto *c;
-    Client_data  close_clientlist[LCLIENT_LIST];
+
+    /* Routing table of the nodes we know, see DHT_set_routing_table(). */
+    DHT_Bucket   buckets[DHT_NUM_BUCKETS];
+    uint16_t     bucket_size;
+    uint32_t     max_nodes;
+    uint32_t     num_nodes;
+    uint64_t     close_next_run; /* When do_Close() next has work to do, 0 if it must look now. */
+
     DHT_Friend      *friends_list;
     uint16_t     num_friends;
-    Pinged       send_nodes[LSEND_NODES_ARRAY];
+    uint16_t     friends_list_capacity; /* Allocated length of friends_list. */
+    Key_Index    friend_keys; /* Index of friends_list by client_id. */
+    Request_Tracker getnodes_requests; /* The get nodes requests we sent. */
+    Bloom_Filter announced; /* Nodes sent to us that we pinged or heard from lately, see handle_sendnodes(). */
     Node_format  toping[MAX_TOPING];
     uint64_t     last_toping;
     uint64_t close_lastgetnodes;
+    uint64_t     punch_second; /* The second punch_pings were sent in. */
+    uint32_t     punch_pings;
     void *ping;
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
 
-Client_data *DHT_get_close_list(DHT *dht);
+/* Put the (at most length) nodes in the routing table closest to us in list.
+ * return the number of nodes put in list.
+ */
+uint32_t DHT_get_close_list(DHT *dht, Client_data *list, uint32_t length);
+
+/* Find MAX_SENT_NODES nodes closest to the client_id for the send nodes request:
+ * put them in the nodes_list and return how many were found.
+ */
+int get_close_nodes(DHT *dht, uint8_t *client_id, Node_format *nodes_list);
+
+/* Set how many nodes the routing table holds per bucket and in total, the
+ * defaults are DHT_BUCKET_SIZE and DHT_MAX_NODES.
+ * Nodes that are always online (bootstrap nodes) can hold thousands of nodes
+ * with bigger buckets.
+ * Only works while the routing table is empty (right after new_DHT()).
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int DHT_set_routing_table(DHT *dht, uint16_t bucket_size, uint32_t max_nodes);
+
+/* Set how many pings and how many get nodes requests can wait on a response at once,
+ * the defaults are LPING_ARRAY and LSEND_NODES_ARRAY.
+ * Busy nodes (bootstrap nodes) send more requests than the defaults allow for: a response
+ * to a request that was pushed out is dropped.
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int DHT_set_request_capacity(DHT *dht, uint32_t max_requests);
 
 /* Add a new friend to the friends list.
  *  client_id must be CLIENT_ID_SIZE bytes long.
@@ -119,17 +190,26 @@ int DHT_delfriend(DHT *dht, uint8_t *client_id);
 
 /* Get ip of friend.
  *  client_id must be CLIENT_ID_SIZE bytes long.
- *  ip must be 4 bytes long.
- *  port must be 2 bytes long.
  *  returns ip if success.
  *  returns ip of 0 if failure (This means the friend is either offline or we have not found him yet).
- *  returns ip of 1 if friend is not in list.
+ *  returns ip 0.0.0.1 if friend is not in list, see DHT_friendip_unknown().
  */
 IP_Port DHT_getfriendip(DHT *dht, uint8_t *client_id);
 
+/* return 1 if ip_port is what DHT_getfriendip() returns for friends that are not in the list.
+ * return 0 if not.
+ */
+int DHT_friendip_unknown(IP_Port ip_port);
+
 /* Run this function at least a couple times per second (It's the main loop). */
 void do_DHT(DHT *dht);
 
+/* return the time (in unix_time() units) at which do_DHT() next has work to do.
+ * Call it right after do_DHT().
+ * return ~0 if there is nothing scheduled (no nodes).
+ */
+uint64_t DHT_next_run(DHT *dht);
+
 /* Use this function to bootstrap the client.
  *  Sends a get nodes request to the given node with ip port and public_key.
  */
@@ -152,7 +232,9 @@ int add_toping(DHT *dht, uint8_t *client_id, IP_Port ip_port);
     returns -1 if failure. */
 int route_packet(DHT *dht, uint8_t *client_id, uint8_t *packet, uint32_t length);
 
-/* Send the following packet to everyone who tells us they are connected to friend_id.
+/* Send the following packet through the nodes that tell us they are connected to friend_id.
+ * The ones that answer our pings most often and fastest are used, a couple of them at first,
+ * more and up to all of them while the friend does not answer.
  *  returns the number of nodes it sent the packet to.
  */
 int route_tofriend(DHT *dht, uint8_t *friend_id, uint8_t *packet, uint32_t length);
@@ -171,7 +253,10 @@ int friend_ips(DHT *dht, IP_Port *ip_portlist, uint8_t *friend_id);
 /* Get the size of the DHT (for saving). */
 uint32_t DHT_size(DHT *dht);
 
-/* Save the DHT in data where data is an array of size DHT_size(). */
+/* Save the DHT in data where data is an array of size DHT_size().
+ * It is a cache of the best nodes of the routing table with their last seen time, round trip
+ * time and reliability.
+ */
 void DHT_save(DHT *dht, uint8_t *data);
 
 /* Initialize DHT. */
@@ -180,6 +265,9 @@ DHT *new_DHT(Net_Crypto *c);
 void kill_DHT(DHT *dht);
 
 /* Load the DHT from data of size size.
+ * All the nodes are pinged at once, the best DHT_WARM_NODES are also asked for nodes. The ones
+ * that were good when saved not long ago are put in the routing table right away, as good for
+ * PING_TIMEOUT seconds, so that we are connected without waiting for their answers.
  *  return -1 if failure.
  *  return 0 if success.
  */
@@ -190,7 +278,17 @@ int DHT_load(DHT *dht, uint8_t *data, uint32_t size);
  */
 int DHT_isconnected(DHT *dht);
 
+/* Copy the counters of the networking instance under dht to stats (see stats.h)
+ * and fill in the current sizes of the DHT and of the Lossless_UDP connections.
+ */
+void DHT_get_stats(DHT *dht, Stats *stats);
+
 void addto_lists(DHT *dht, IP_Port ip_port, uint8_t *client_id);
 
+/* The node with client_id answered our request sent at sent_time (current_time()),
+ * update its round trip time and reliability.
+ */
+void DHT_node_responded(DHT *dht, uint8_t *client_id, uint64_t sent_time);
+
 
 #endif
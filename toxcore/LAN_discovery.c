@@ -89,13 +89,14 @@ static IP broadcast_ip(void)
 {
     IP ip;
 #ifdef __linux
-    ip.uint32 = get_broadcast();
+    uint32_t broadcast = get_broadcast();
 
-    if (ip.uint32 == 0)
-        ip.uint32 = ~0; /* Error occured, but try anyway? */
+    if (broadcast == 0)
+        broadcast = ~0; /* Error occured, but try anyway? */
 
+    ip_init_v4(&ip, broadcast);
 #else
-    ip.uint32 = ~0;
+    ip_init_v4(&ip, ~0);
 #endif
     return ip;
 }
@@ -103,8 +104,26 @@ static IP broadcast_ip(void)
 /* return 0 if ip is a LAN ip.
  * return -1 if it is not.
  */
-static int LAN_ip(IP ip)
+static int LAN_ip(IP ip6)
 {
+    if (!ip_is_v4(ip6)) {
+        IP loopback = {{0}};
+        loopback.uint8[15] = 1;
+
+        if (ip_equal(ip6, loopback)) /* ::1 loopback. */
+            return 0;
+
+        if (ip6.uint8[0] == 0xFE && (ip6.uint8[1] & 0xC0) == 0x80) /* fe80::/10 link-local. */
+            return 0;
+
+        if ((ip6.uint8[0] & 0xFE) == 0xFC) /* fc00::/7 unique local. */
+            return 0;
+
+        return -1;
+    }
+
+    IP4 ip = ip_get_v4(ip6);
+
     if (ip.uint8[0] == 127) /* Loopback. */
         return 0;
 
@@ -144,8 +163,8 @@ int send_LANdiscovery(uint16_t port, Net_Crypto *c)
     uint8_t data[crypto_box_PUBLICKEYBYTES + 1];
     data[0] = NET_PACKET_LAN_DISCOVERY;
     memcpy(data + 1, c->self_public_key, crypto_box_PUBLICKEYBYTES);
-    IP_Port ip_port = {{broadcast_ip(), port}};
-    return sendpacket(c->lossless_udp->net->sock, ip_port, data, 1 + crypto_box_PUBLICKEYBYTES);
+    IP_Port ip_port = {broadcast_ip(), port, 0};
+    return sendpacket(c->lossless_udp->net, ip_port, data, 1 + crypto_box_PUBLICKEYBYTES);
 }
 
 
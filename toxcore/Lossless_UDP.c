@@ -28,9 +28,138 @@
 
 #include "Lossless_UDP.h"
 
+#define MAX_SYNC_RATE 10
+
+/* Version we put in the capabilities of our SYNC packets, see missing_bitmap(). */
+#define LOSSLESS_UDP_VERSION 1
+
+/* Words of a SYNC bitmap big enough for the biggest window. */
+#define SACK_WORDS (LOSSLESS_UDP_MAX_QUEUE / 32)
+
+/* Seconds a handshake cookie is valid for, see handshake_id(). */
+#define HANDSHAKE_COOKIE_TIME 8
+
+/* Handshake replies we send to an IP per second at most. */
+#define HANDSHAKE_LIMIT 16
+
+/* Seconds nothing must go through the queues of a connection for them to be freed. */
+#define QUEUE_IDLE_TIME 10
+
+/* Congestion control, see update_congestion(). */
+#define MIN_CWND     2
+#define INITIAL_CWND BUFFER_PACKET_NUM
+#define MIN_RTO      300000
+#define MAX_RTO      3000000
+
+static void schedule_connection(Lossless_UDP *ludp, int connection_id);
 
 /* Functions */
 
+/*
+ * Index of the live connections by IP_Port.
+ * Open addressing with linear probing, slots hold connection ids.
+ */
+#define IP_INDEX_EMPTY   -1
+#define IP_INDEX_DELETED -2
+
+static uint32_t ip_index_hash(Lossless_UDP *ludp, IP_Port ip_port)
+{
+    /* Seeded so that nobody can pick addresses that all land in the same slot. */
+    return ipport_hash(ip_port, ludp->ip_index_seed);
+}
+
+/* return the slot of ip_port in the index, or the slot of the first free one if it is not there. */
+static uint32_t ip_index_find(Lossless_UDP *ludp, IP_Port ip_port, int *found)
+{
+    uint32_t mask = ludp->ip_index_size - 1;
+    uint32_t i = ip_index_hash(ludp, ip_port) & mask;
+    uint32_t free_slot = ~0;
+
+    *found = 0;
+
+    while (1) {
+        int id = ludp->ip_index[i];
+
+        if (id == IP_INDEX_EMPTY)
+            return free_slot != (uint32_t)~0 ? free_slot : i;
+
+        if (id == IP_INDEX_DELETED) {
+            if (free_slot == (uint32_t)~0)
+                free_slot = i;
+        } else if (ipport_equal(tox_array_get(&ludp->connections, id, Connection).ip_port, ip_port)) {
+            *found = 1;
+            return i;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+/* Rebuild the index from the connections array with room for at least num live connections.
+ * return 0 on success, -1 on failure.
+ */
+static int ip_index_rebuild(Lossless_UDP *ludp, uint32_t num)
+{
+    uint32_t size = 16;
+
+    while (size < num * 2)
+        size *= 2;
+
+    int *index = malloc(size * sizeof(int));
+
+    if (index == NULL)
+        return -1;
+
+    memset(index, 0xFF, size * sizeof(int)); /* IP_INDEX_EMPTY */
+    free(ludp->ip_index);
+    ludp->ip_index = index;
+    ludp->ip_index_size = size;
+    ludp->ip_index_used = 0;
+
+    tox_array_for_each(&ludp->connections, Connection, tmp) {
+        if (tmp->status > 0) {
+            int found;
+            ludp->ip_index[ip_index_find(ludp, tmp->ip_port, &found)] = tmp_i;
+            ++ludp->ip_index_used;
+        }
+    }
+
+    return 0;
+}
+
+/* Add a (new) connection to the index.
+ * return 0 on success, -1 on failure.
+ */
+static int ip_index_add(Lossless_UDP *ludp, int connection_id)
+{
+    /* Keep at least half of the slots empty (deleted slots count as used). */
+    if ((ludp->ip_index_used + 1) * 2 > ludp->ip_index_size) {
+        if (ip_index_rebuild(ludp, ludp->connections.len + 1) == -1)
+            return -1;
+    }
+
+    int found;
+    uint32_t i = ip_index_find(ludp, tox_array_get(&ludp->connections, connection_id, Connection).ip_port, &found);
+
+    if (!found && ludp->ip_index[i] == IP_INDEX_EMPTY)
+        ++ludp->ip_index_used;
+
+    ludp->ip_index[i] = connection_id;
+    return 0;
+}
+
+static void ip_index_remove(Lossless_UDP *ludp, int connection_id)
+{
+    if (ludp->ip_index_size == 0)
+        return;
+
+    int found;
+    uint32_t i = ip_index_find(ludp, tox_array_get(&ludp->connections, connection_id, Connection).ip_port, &found);
+
+    if (found && ludp->ip_index[i] == connection_id)
+        ludp->ip_index[i] = IP_INDEX_DELETED;
+}
+
 /*
  * Get connection id from IP_Port.
  * return -1 if there are no connections like we are looking for.
@@ -38,34 +167,42 @@
  */
 int getconnection_id(Lossless_UDP *ludp, IP_Port ip_port)
 {
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->ip_port.ip.uint32 == ip_port.ip.uint32 &&
-                tmp->ip_port.port == ip_port.port &&
-                tmp->status > 0) {
-            return tmp_i;
-        }
-    }
+    if (ludp->ip_index_size == 0)
+        return -1;
 
-    return -1;
+    int found;
+    uint32_t i = ip_index_find(ludp, ip_port, &found);
+
+    if (!found)
+        return -1;
+
+    return ludp->ip_index[i];
 }
 
 
 /*
  * Generate a handshake_id which depends on the ip_port.
- * This function will always give one unique handshake_id per ip_port.
- *
- * TODO: make this better
+ * It is a cookie: a MAC of ip_port and the current HANDSHAKE_COOKIE_TIME period with a secret
+ * key, so nobody who doesn't get our packets at ip_port can guess it. That lets us reply to
+ * handshakes without keeping anything and only create the connection once the other answers
+ * with the id (see handle_SYNC1()).
+ * ago is the number of periods to go back, for checking ids we sent before.
  */
-static uint32_t handshake_id(Lossless_UDP *ludp, IP_Port source)
+static uint32_t handshake_id(Lossless_UDP *ludp, IP_Port source, uint32_t ago)
 {
-    uint32_t id = 0, i;
+    uint8_t slot = ip_index_hash(ludp, source);
+    uint64_t period = current_time() / (HANDSHAKE_COOKIE_TIME * 1000000UL) - ago;
+    uint8_t data[sizeof(source.ip) + 2 + 1 + 8];
+    uint8_t mac[crypto_auth_BYTES];
+    uint32_t id;
 
-    for (i = 0; i < 6; ++i) {
-        if (ludp->randtable[i][source.uint8[i]] == 0)
-            ludp->randtable[i][source.uint8[i]] = random_int();
+    memcpy(data, source.ip.uint8, sizeof(source.ip));
+    memcpy(data + sizeof(source.ip), &source.port, 2);
+    data[sizeof(source.ip) + 2] = ludp->cookie_generation[slot];
+    memcpy(data + sizeof(source.ip) + 3, &period, 8);
 
-        id ^= ludp->randtable[i][source.uint8[i]];
-    }
+    crypto_auth(mac, data, sizeof(data), ludp->cookie_key);
+    memcpy(&id, mac, sizeof(id));
 
     /* id can't be zero. */
     if (id == 0)
@@ -76,13 +213,145 @@ static uint32_t handshake_id(Lossless_UDP *ludp, IP_Port source)
 
 /*
  * Change the handshake id associated with that ip_port.
- *
- * TODO: Make this better
  */
 static void change_handshake(Lossless_UDP *ludp, IP_Port source)
 {
-    uint8_t rand = random_int() % 4;
-    ludp->randtable[rand][((uint8_t *)&source)[rand]] = random_int();
+    ++ludp->cookie_generation[(uint8_t)ip_index_hash(ludp, source)];
+}
+
+/* Count a handshake reply to ip.
+ * return 1 if fewer than HANDSHAKE_LIMIT were sent to it in the last second.
+ * return 0 if not, it then gets no reply: we don't want to be used to flood it.
+ */
+static int handshake_allowed(Lossless_UDP *ludp, IP ip)
+{
+    IP_Port ip_port = {ip, 0, 0};
+    Handshake_Limit *limit = &ludp->handshake_limits[ip_index_hash(ludp, ip_port) % HANDSHAKE_LIMIT_SLOTS];
+    uint64_t temp_time = current_time();
+
+    /* Slots are shared, the last IP to use one gets it. */
+    if (!ip_equal(limit->ip, ip) || limit->start + 1000000UL <= temp_time) {
+        limit->ip = ip;
+        limit->count = 0;
+        limit->start = temp_time;
+    }
+
+    if (limit->count >= HANDSHAKE_LIMIT)
+        return 0;
+
+    ++limit->count;
+    return 1;
+}
+
+/* return the window of connection (packets that can be buffered in each direction). */
+static uint32_t window_size(Connection *connection)
+{
+    return connection->window;
+}
+
+/* Set the queue size of a new connection and reset its congestion control.
+ * The queues themselves are only allocated once packets go through them, see alloc_queues().
+ */
+static void init_queues(Connection *connection, uint32_t queue_size)
+{
+    connection->queue_size = queue_size;
+    connection->window = queue_size - 1;
+    connection->cwnd = MIN(INITIAL_CWND, queue_size - 1);
+    connection->ssthresh = queue_size - 1;
+    connection->srtt = 1000000UL / MAX_SYNC_RATE;
+    connection->rttvar = connection->srtt / 2;
+}
+
+/* Size of the block holding sendbuffer, recvbuffer and req_packets of a connection. */
+static size_t queue_block_size(uint32_t queue_size)
+{
+    return queue_size * 2 * sizeof(Data) + queue_size * sizeof(uint32_t);
+}
+
+/* Make sure connection has its queues, all of them in one block taken from the pool if there is one.
+ * return 0 on success.
+ * return -1 if out of memory.
+ */
+static int alloc_queues(Lossless_UDP *ludp, Connection *connection)
+{
+    uint8_t *block;
+
+    if (connection->sendbuffer != NULL)
+        return 0;
+
+    if (ludp->queue_pool != NULL && connection->queue_size == ludp->queue_size) {
+        block = ludp->queue_pool;
+        memcpy(&ludp->queue_pool, block, sizeof(void *));
+        --ludp->queue_pool_num;
+        memset(block, 0, queue_block_size(connection->queue_size));
+    } else {
+        block = calloc(1, queue_block_size(connection->queue_size));
+
+        if (block == NULL)
+            return -1;
+    }
+
+    connection->sendbuffer = (Data *)block;
+    connection->recvbuffer = connection->sendbuffer + connection->queue_size;
+    connection->req_packets = (uint32_t *)(connection->recvbuffer + connection->queue_size);
+    connection->req_start = 0;
+    connection->num_req_paquets = 0;
+    return 0;
+}
+
+/* Drop the packets still queued in connection and give the queues back to the pool. */
+static void free_queues(Lossless_UDP *ludp, Connection *connection)
+{
+    uint32_t i;
+    uint8_t *block = (uint8_t *)connection->sendbuffer;
+
+    if (block == NULL)
+        return;
+
+    for (i = 0; i < connection->queue_size; ++i) {
+        packet_buffer_unref(connection->sendbuffer[i].buffer);
+        packet_buffer_unref(connection->recvbuffer[i].buffer);
+    }
+
+    if (connection->queue_size == ludp->queue_size && ludp->queue_pool_num < QUEUE_POOL_MAX) {
+        memcpy(block, &ludp->queue_pool, sizeof(void *));
+        ludp->queue_pool = block;
+        ++ludp->queue_pool_num;
+    } else {
+        free(block);
+    }
+
+    connection->sendbuffer = NULL;
+    connection->recvbuffer = NULL;
+    connection->req_packets = NULL;
+    connection->num_req_paquets = 0;
+}
+
+/* Free the queue blocks in the pool. */
+static void free_queue_pool(Lossless_UDP *ludp)
+{
+    while (ludp->queue_pool != NULL) {
+        void *block = ludp->queue_pool;
+        memcpy(&ludp->queue_pool, block, sizeof(void *));
+        free(block);
+    }
+
+    ludp->queue_pool_num = 0;
+}
+
+/* return 1 if connection has nothing queued and nothing coming, 0 if not. */
+static int queues_empty(Connection *connection)
+{
+    return connection->sendbuff_packetnum == connection->successful_sent
+           && connection->recv_packetnum == connection->successful_read
+           && connection->recv_packetnum == connection->osent_packetnum
+           && connection->num_req_paquets == 0;
+}
+
+/* return 1 if packet_num is in the receive queue of connection, 0 if not. */
+static int received(Connection *connection, uint32_t packet_num)
+{
+    return connection->recvbuffer != NULL && connection->recvbuffer[packet_num % connection->queue_size].buffer != NULL;
 }
 
 /*
@@ -98,25 +367,16 @@ int new_connection(Lossless_UDP *ludp, IP_Port ip_port)
     if (connection_id != -1)
         return connection_id;
 
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 0) {
-            connection_id = tmp_i;
-            break;
-        }
-    }
+    connection_id = tox_array_acquire(&ludp->connections);
 
-    if (connection_id == -1) {
-        if (tox_array_push_ptr(&ludp->connections, 0) == 0)
-            return -1;
-
-        connection_id = ludp->connections.len - 1;
-    }
+    if (connection_id == -1)
+        return -1;
 
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
     memset(connection, 0, sizeof(Connection));
 
-    uint32_t handshake_id1 = handshake_id(ludp, ip_port);
+    uint32_t handshake_id1 = handshake_id(ludp, ip_port, 0);
 
     *connection = (Connection) {
         .ip_port            = ip_port,
@@ -136,9 +396,35 @@ int new_connection(Lossless_UDP *ludp, IP_Port ip_port)
                      .timeout            = CONNEXION_TIMEOUT + rand() % CONNEXION_TIMEOUT
     };
 
+    init_queues(connection, ludp->queue_size);
+
+    if (ip_index_add(ludp, connection_id) == -1) {
+        connection->status = 0;
+        tox_array_release(&ludp->connections, connection_id);
+        return -1;
+    }
+
+    schedule_connection(ludp, connection_id);
     return connection_id;
 }
 
+int lossless_udp_set_window(Lossless_UDP *ludp, uint32_t window)
+{
+    if (window == 0 || window >= LOSSLESS_UDP_MAX_QUEUE)
+        return -1;
+
+    uint32_t queue_size = 2;
+
+    while (queue_size - 1 < window)
+        queue_size *= 2;
+
+    if (queue_size != ludp->queue_size)
+        free_queue_pool(ludp);
+
+    ludp->queue_size = queue_size;
+    return 0;
+}
+
 /*
  * Initialize a new inbound connection from ip_port.
  * return an integer corresponding to the connection id.
@@ -149,20 +435,10 @@ static int new_inconnection(Lossless_UDP *ludp, IP_Port ip_port)
     if (getconnection_id(ludp, ip_port) != -1)
         return -1; /* TODO: return existing connection instead? */
 
-    int connection_id = -1;
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 0) {
-            connection_id = tmp_i;
-            break;
-        }
-    }
-
-    if (connection_id == -1) {
-        if (tox_array_push_ptr(&ludp->connections, 0) == 0)
-            return -1;
+    int connection_id = tox_array_acquire(&ludp->connections);
 
-        connection_id = ludp->connections.len - 1;
-    }
+    if (connection_id == -1)
+        return -1;
 
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
     memset(connection, 0, sizeof(Connection));
@@ -186,6 +462,20 @@ static int new_inconnection(Lossless_UDP *ludp, IP_Port ip_port)
                  .killat = current_time() + 1000000UL * timeout
     };
 
+    init_queues(connection, ludp->queue_size);
+
+    if (ip_index_add(ludp, connection_id) == -1) {
+        connection->status = 0;
+        tox_array_release(&ludp->connections, connection_id);
+        return -1;
+    }
+
+    if (timer_set(&ludp->incoming, connection_id, 0) == -1) {
+        kill_connection(ludp, connection_id);
+        return -1;
+    }
+
+    schedule_connection(ludp, connection_id);
     return connection_id;
 }
 
@@ -195,13 +485,17 @@ static int new_inconnection(Lossless_UDP *ludp, IP_Port ip_port)
  */
 int incoming_connection(Lossless_UDP *ludp)
 {
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->inbound == 2) {
-            tmp->inbound = 1;
-            return tmp_i;
-        }
-    }
-    return -1;
+    int connection_id = timer_pop(&ludp->incoming, 0);
+
+    if (connection_id == -1)
+        return -1;
+
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+    connection->inbound = 1;
+    /* It is handled now, don't kill it when the handling timeout expires. */
+    connection->killat = ~0;
+    schedule_connection(ludp, connection_id);
+    return connection_id;
 }
 /* Try to free some memory from the connections array. */
 static void free_connections(Lossless_UDP *ludp)
@@ -209,7 +503,7 @@ static void free_connections(Lossless_UDP *ludp)
     uint32_t i;
 
     for (i = ludp->connections.len; i != 0; --i) {
-        Connection *connection = &tox_array_get(&ludp->connections, i, Connection);
+        Connection *connection = &tox_array_get(&ludp->connections, i - 1, Connection);
 
         if (connection->status != 0)
             break;
@@ -218,8 +512,9 @@ static void free_connections(Lossless_UDP *ludp)
     if (ludp->connections.len == i)
         return;
 
-    return tox_array_pop(&ludp->connections, ludp->connections.len - i);
+    tox_array_pop(&ludp->connections, ludp->connections.len - i);
 }
+
 /*
  * return -1 if it could not kill the connection.
  * return 0 if killed successfully.
@@ -230,9 +525,15 @@ int kill_connection(Lossless_UDP *ludp, int connection_id)
         Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
         if (connection->status > 0) {
+            ip_index_remove(ludp, connection_id);
             connection->status = 0;
+            timer_unset(&ludp->timers, connection_id);
+            timer_unset(&ludp->ready, connection_id);
+            timer_unset(&ludp->incoming, connection_id);
             change_handshake(ludp, connection->ip_port);
+            free_queues(ludp, connection);
             memset(connection, 0, sizeof(Connection));
+            tox_array_release(&ludp->connections, connection_id);
             free_connections(ludp);
             return 0;
         }
@@ -253,6 +554,7 @@ int kill_connection_in(Lossless_UDP *ludp, int connection_id, uint32_t seconds)
 
         if (connection->status > 0) {
             connection->killat = current_time() + 1000000UL * seconds;
+            schedule_connection(ludp, connection_id);
             return 0;
         }
     }
@@ -282,10 +584,29 @@ IP_Port connection_ip(Lossless_UDP *ludp, int connection_id)
     if (connection_id >= 0 && connection_id < ludp->connections.len)
         return tox_array_get(&ludp->connections, connection_id, Connection).ip_port;
 
-    IP_Port zero = {{{{0}}, 0, 0}};
+    IP_Port zero = {{{0}}, 0, 0};
     return zero;
 }
 
+void set_connection_tag(Lossless_UDP *ludp, int connection_id, uint32_t tag)
+{
+    if (connection_id >= 0 && connection_id < ludp->connections.len)
+        tox_array_get(&ludp->connections, connection_id, Connection).tag = tag;
+}
+
+uint32_t connection_tag(Lossless_UDP *ludp, int connection_id)
+{
+    if (connection_id >= 0 && connection_id < ludp->connections.len)
+        return tox_array_get(&ludp->connections, connection_id, Connection).tag;
+
+    return 0;
+}
+
+int lossless_udp_pop_ready(Lossless_UDP *ludp)
+{
+    return timer_pop(&ludp->ready, 0);
+}
+
 /* returns the number of packets in the queue waiting to be successfully sent. */
 uint32_t sendqueue(Lossless_UDP *ludp, int connection_id)
 {
@@ -296,6 +617,19 @@ uint32_t sendqueue(Lossless_UDP *ludp, int connection_id)
     return connection->sendbuff_packetnum - connection->successful_sent;
 }
 
+uint32_t sendqueue_room(Lossless_UDP *ludp, int connection_id)
+{
+    if (connection_id < 0 || connection_id >= ludp->connections.len)
+        return 0;
+
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+
+    if (connection->status == 0 || sendqueue(ludp, connection_id) >= window_size(connection))
+        return 0;
+
+    return window_size(connection) - sendqueue(ludp, connection_id);
+}
+
 /* returns the number of packets in the queue waiting to be successfully read with read_packet(...). */
 uint32_t recvqueue(Lossless_UDP *ludp, int connection_id)
 {
@@ -317,7 +651,7 @@ char id_packet(Lossless_UDP *ludp, int connection_id)
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
     if (connection->status != 0)
-        return connection->recvbuffer[connection->successful_read % MAX_QUEUE_NUM].data[0];
+        return packet_buffer_data(connection->recvbuffer[connection->successful_read % connection->queue_size].buffer)[0];
 
     return -1;
 }
@@ -327,17 +661,28 @@ char id_packet(Lossless_UDP *ludp, int connection_id)
  */
 int read_packet(Lossless_UDP *ludp, int connection_id, uint8_t *data)
 {
-    if (recvqueue(ludp, connection_id) == 0)
+    Packet_Buffer *buffer = read_packet_buffer(ludp, connection_id);
+
+    if (buffer == NULL)
         return 0;
 
-    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
-    uint16_t index = connection->successful_read % MAX_QUEUE_NUM;
-    uint16_t size  = connection->recvbuffer[index].size;
-    memcpy(data, connection->recvbuffer[index].data, size);
-    ++connection->successful_read;
-    connection->recvbuffer[index].size = 0;
+    uint16_t size = buffer->length;
+    memcpy(data, packet_buffer_data(buffer), size);
+    packet_buffer_unref(buffer);
     return size;
+}
+
+Packet_Buffer *read_packet_buffer(Lossless_UDP *ludp, int connection_id)
+{
+    if (recvqueue(ludp, connection_id) == 0)
+        return NULL;
 
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+    uint16_t index = connection->successful_read % connection->queue_size;
+    Packet_Buffer *buffer = connection->recvbuffer[index].buffer;
+    ++connection->successful_read;
+    connection->recvbuffer[index].buffer = NULL;
+    return buffer;
 }
 
 /*
@@ -346,46 +691,132 @@ int read_packet(Lossless_UDP *ludp, int connection_id, uint8_t *data)
  */
 int write_packet(Lossless_UDP *ludp, int connection_id, uint8_t *data, uint32_t length)
 {
-    if (length > MAX_DATA_SIZE || length == 0 || sendqueue(ludp, connection_id) >= BUFFER_PACKET_NUM)
+    if (length > MAX_DATA_SIZE || length == 0)
+        return 0;
+
+    Packet_Buffer *buffer = new_packet_buffer(LOSSLESS_UDP_HEADER_SIZE + length, LOSSLESS_UDP_HEADER_SIZE);
+
+    if (buffer == NULL)
+        return 0;
+
+    memcpy(packet_buffer_data(buffer), data, length);
+    buffer->length = length;
+    int ret = write_packet_buffer(ludp, connection_id, buffer);
+    packet_buffer_unref(buffer);
+    return ret;
+}
+
+int write_packet_buffer(Lossless_UDP *ludp, int connection_id, Packet_Buffer *buffer)
+{
+    if (connection_id < 0 || connection_id >= ludp->connections.len)
         return 0;
 
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
-    uint32_t index = connection->sendbuff_packetnum % MAX_QUEUE_NUM;
-    memcpy(connection->sendbuffer[index].data, data, length);
-    connection->sendbuffer[index].size = length;
+
+    if (connection->status == 0 || buffer->length > MAX_DATA_SIZE || buffer->length == 0
+            || sendqueue(ludp, connection_id) >= window_size(connection))
+        return 0;
+
+    if (alloc_queues(ludp, connection) == -1)
+        return 0;
+
+    uint32_t packet_num = connection->sendbuff_packetnum;
+    uint8_t *header = packet_buffer_push(buffer, LOSSLESS_UDP_HEADER_SIZE);
+
+    if (header == NULL)
+        return 0;
+
+    /* The packet number never changes so the header is written once for all (re)sends. */
+    uint32_t temp = htonl(packet_num);
+    header[0] = NET_PACKET_DATA;
+    memcpy(header + 1, &temp, 4);
+
+    uint32_t index = packet_num % connection->queue_size;
+    packet_buffer_unref(connection->sendbuffer[index].buffer);
+    connection->sendbuffer[index].buffer = packet_buffer_ref(buffer);
     connection->sendbuff_packetnum++;
+    schedule_connection(ludp, connection_id);
     return 1;
 }
 
 /* Put the packet numbers the we are missing in requested and return the number. */
 uint32_t missing_packets(Lossless_UDP *ludp, int connection_id, uint32_t *requested)
 {
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+
     /* don't request packets if the buffer is full. */
-    if (recvqueue(ludp, connection_id) >= (BUFFER_PACKET_NUM - 1))
+    if (recvqueue(ludp, connection_id) >= (window_size(connection) - 1))
         return 0;
 
     uint32_t number = 0;
     uint32_t i;
     uint32_t temp;
 
-    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
-
     for (i = connection->recv_packetnum;
             i != connection->osent_packetnum;
             i++) {
-        if (connection->recvbuffer[i % MAX_QUEUE_NUM].size == 0) {
+        if (!received(connection, i)) {
             temp = htonl(i);
             memcpy(requested + number, &temp, 4);
             ++number;
         }
     }
 
-    if (number == 0)
+    /* Everything up to osent_packetnum is there, it can be read now. */
+    if (number == 0 && connection->recv_packetnum != connection->osent_packetnum) {
         connection->recv_packetnum = connection->osent_packetnum;
+        timer_set(&ludp->ready, connection_id, 0);
+    }
 
     return number;
 }
 
+/* return our capabilities, the first word of our SYNC packets when the other understands them
+ * (and of our handshake SYNCs before we know), see handle_capabilities().
+ */
+static uint32_t capabilities_word(Connection *connection)
+{
+    return htonl((LOSSLESS_UDP_VERSION << 24) | (window_size(connection) << 16));
+}
+
+/* Put our capabilities followed by the bitmap of the packets we are missing in words.
+ * Bit n (least significant first) of the bitmap is packet recv_packetnum + n.
+ * return the number of words.
+ */
+static uint32_t missing_bitmap(Lossless_UDP *ludp, int connection_id, uint32_t *words)
+{
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+    uint32_t bitmap[SACK_WORDS] = {0};
+    uint32_t number = 0;
+    uint32_t i, bit;
+
+    words[0] = capabilities_word(connection);
+
+    /* don't request packets if the buffer is full. */
+    if (recvqueue(ludp, connection_id) >= (window_size(connection) - 1))
+        return 1;
+
+    for (i = connection->recv_packetnum, bit = 0;
+            i != connection->osent_packetnum && bit < window_size(connection);
+            ++i, ++bit) {
+        if (!received(connection, i)) {
+            bitmap[bit / 32] |= 1UL << (bit % 32);
+            number = bit / 32 + 1;
+        }
+    }
+
+    /* Everything up to osent_packetnum is there, it can be read now. */
+    if (number == 0 && connection->recv_packetnum != connection->osent_packetnum) {
+        connection->recv_packetnum = connection->osent_packetnum;
+        timer_set(&ludp->ready, connection_id, 0);
+    }
+
+    for (i = 0; i < number; ++i)
+        words[i + 1] = htonl(bitmap[i]);
+
+    return number + 1;
+}
+
 /*
  * BEGIN Packet sending functions.
  * One per packet type.
@@ -403,13 +834,13 @@ static int send_handshake(Lossless_UDP *ludp, IP_Port ip_port, uint32_t handshak
     temp = htonl(handshake_id2);
     memcpy(packet + 5, &temp, 4);
 
-    return sendpacket(ludp->net->sock, ip_port, packet, sizeof(packet));
+    return sendpacket(ludp->net, ip_port, packet, sizeof(packet));
 }
 
 static int send_SYNC(Lossless_UDP *ludp, int connection_id)
 {
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
-    uint8_t packet[(BUFFER_PACKET_NUM * 4 + 4 + 4 + 2)];
+    uint8_t packet[((LOSSLESS_UDP_MAX_QUEUE - 1) * 4 + 4 + 4 + 2)];
     uint16_t index = 0;
 
     IP_Port ip_port         = connection->ip_port;
@@ -417,8 +848,20 @@ static int send_SYNC(Lossless_UDP *ludp, int connection_id)
     uint32_t recv_packetnum = htonl(connection->recv_packetnum);
     uint32_t sent_packetnum = htonl(connection->sent_packetnum);
 
-    uint32_t requested[BUFFER_PACKET_NUM];
-    uint32_t number         = missing_packets(ludp, connection_id, requested);
+    uint32_t requested[LOSSLESS_UDP_MAX_QUEUE - 1];
+    uint32_t number;
+
+    if (connection->sack) {
+        number = missing_bitmap(ludp, connection_id, requested);
+    } else if (connection->status == 2 && !connection->inbound) {
+        /* Tell the other what we support while it can't take the word for a packet request:
+         * old peers only look at the packet numbers of SYNCs once they are connected.
+         */
+        requested[0] = capabilities_word(connection);
+        number = 1;
+    } else {
+        number = missing_packets(ludp, connection_id, requested);
+    }
 
     packet[0] = NET_PACKET_SYNC;
     index += 1;
@@ -430,7 +873,7 @@ static int send_SYNC(Lossless_UDP *ludp, int connection_id)
     index += 4;
     memcpy(packet + index, requested, 4 * number);
 
-    return sendpacket(ludp->net->sock, ip_port, packet, (number * 4 + 4 + 4 + 2));
+    return sendpacket(ludp->net, ip_port, packet, (number * 4 + 4 + 4 + 2));
 
 }
 
@@ -438,34 +881,52 @@ static int send_data_packet(Lossless_UDP *ludp, int connection_id, uint32_t pack
 {
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
-    uint32_t index = packet_num % MAX_QUEUE_NUM;
-    uint32_t temp;
-    uint8_t packet[1 + 4 + MAX_DATA_SIZE];
-    packet[0] = NET_PACKET_DATA;
-    temp = htonl(packet_num);
-    memcpy(packet + 1, &temp, 4);
-    memcpy(packet + 5, connection->sendbuffer[index].data, connection->sendbuffer[index].size);
-    return sendpacket(ludp->net->sock, connection->ip_port, packet, 1 + 4 + connection->sendbuffer[index].size);
+    uint32_t index = packet_num % connection->queue_size;
+    return sendpacket_buffer(ludp->net, connection->ip_port, connection->sendbuffer[index].buffer);
 }
 
-/* sends 1 data packet */
+/* return 1 if packet_num is in our send queue, 0 if not. */
+static int in_sendqueue(Connection *connection, uint32_t packet_num)
+{
+    return (uint32_t)(packet_num - connection->successful_sent) <
+           (uint32_t)(connection->sendbuff_packetnum - connection->successful_sent);
+}
+
+/* sends 1 data packet
+ * Packets requested by the other are sent first, new ones only while less than cwnd are in flight.
+ * return 0 if there was nothing we could send.
+ */
 static int send_DATA(Lossless_UDP *ludp, int connection_id)
 {
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
     int ret;
-    uint32_t buffer[BUFFER_PACKET_NUM];
 
-    if (connection->num_req_paquets > 0) {
-        ret = send_data_packet(ludp, connection_id, connection->req_packets[0]);
+    while (connection->num_req_paquets > 0) {
+        uint32_t packet_num = connection->req_packets[connection->req_start];
+        connection->req_start = (connection->req_start + 1) & (connection->queue_size - 1);
         connection->num_req_paquets--;
-        memcpy(buffer, connection->req_packets + 1, connection->num_req_paquets * 4);
-        memcpy(connection->req_packets, buffer, connection->num_req_paquets * 4);
-        return ret;
+
+        /* Don't trust the other to only ask for what we have. */
+        if (!in_sendqueue(connection, packet_num))
+            continue;
+
+        /* Karn: no RTT sample from a resent packet. */
+        connection->sendbuffer[packet_num % connection->queue_size].sent_time = 0;
+        ++ludp->net->stats.data_resent;
+        return send_data_packet(ludp, connection_id, packet_num);
     }
 
-    if (connection->sendbuff_packetnum != connection->sent_packetnum) {
+    if (connection->sendbuff_packetnum != connection->sent_packetnum
+            && (uint32_t)(connection->sent_packetnum - connection->successful_sent) < connection->cwnd) {
+        uint64_t temp_time = current_time();
+
+        if (connection->sent_packetnum == connection->successful_sent)
+            connection->last_ack = temp_time;
+
+        connection->sendbuffer[connection->sent_packetnum % connection->queue_size].sent_time = temp_time;
         ret = send_data_packet(ludp, connection_id, connection->sent_packetnum);
         connection->sent_packetnum++;
+        ++ludp->net->stats.data_sent;
         return ret;
     }
 
@@ -502,7 +963,20 @@ static int handle_handshake(void *object, IP_Port source, uint8_t *packet, uint3
 
 
     if (handshake_id2 == 0 && is_connected(ludp, connection_id) < 3) {
-        send_handshake(ludp, source, handshake_id(ludp, source), handshake_id1);
+        if (!handshake_allowed(ludp, source.ip)) {
+            ++ludp->net->stats.handshakes_refused;
+            return 1;
+        }
+
+        uint32_t id = handshake_id(ludp, source, 0);
+
+        /* Keep giving the id the connection already uses, the cookie may have changed since. */
+        if (connection_id != -1) {
+            Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+            id = connection->status == 1 ? connection->handshake_id1 : connection->orecv_packetnum;
+        }
+
+        send_handshake(ludp, source, id, handshake_id1);
         return 0;
     }
 
@@ -520,6 +994,7 @@ static int handle_handshake(void *object, IP_Port source, uint8_t *packet, uint3
         connection->osent_packetnum = handshake_id1;
         connection->recv_packetnum  = handshake_id1;
         connection->successful_read = handshake_id1;
+        schedule_connection(ludp, connection_id);
     }
 
     return 0;
@@ -531,17 +1006,108 @@ static int SYNC_valid(uint32_t length)
     if (length < 4 + 4 + 2)
         return 0;
 
-    if (length > (BUFFER_PACKET_NUM * 4 + 4 + 4 + 2) ||
+    if (length > ((LOSSLESS_UDP_MAX_QUEUE - 1) * 4 + 4 + 4 + 2) ||
             ((length - 4 - 4 - 2) % 4) != 0)
         return 0;
 
     return 1;
 }
 
+/* Feed congestion control with a valid SYNC that moved successful_sent from old_successful_sent
+ * and asked for num_requested packets again.
+ * cwnd grows by one per acknowledged packet below ssthresh (slow start) and by one per
+ * window above it, it is cut to 7/10 at most once per window of data when the other reports losses.
+ */
+static void update_congestion(Lossless_UDP *ludp, Connection *connection, uint32_t old_successful_sent,
+                              uint16_t num_requested, uint64_t temp_time)
+{
+    uint32_t acked = connection->successful_sent - old_successful_sent;
+
+    /* The other is alive and telling us what it got, no need for the timeout. */
+    connection->last_ack = temp_time;
+
+    if (acked != 0 && acked <= window_size(connection) && connection->sendbuffer != NULL) {
+        uint64_t sent_time = connection->sendbuffer[(connection->successful_sent - 1) % connection->queue_size].sent_time;
+
+        if (sent_time != 0 && sent_time <= temp_time) {
+            uint32_t rtt = MIN(temp_time - sent_time, MAX_RTO);
+            uint32_t diff = rtt > connection->srtt ? rtt - connection->srtt : connection->srtt - rtt;
+            connection->rttvar = (connection->rttvar * 3 + diff) / 4;
+            connection->srtt = (connection->srtt * 7 + rtt) / 8;
+            stats_histogram_add(&ludp->net->stats.connection_rtt, rtt / 1000);
+        }
+
+        if (connection->cwnd < connection->ssthresh) {
+            connection->cwnd += acked;
+        } else {
+            connection->cwnd_acked += acked;
+
+            while (connection->cwnd_acked >= connection->cwnd) {
+                connection->cwnd_acked -= connection->cwnd;
+                ++connection->cwnd;
+            }
+        }
+
+        connection->cwnd = MIN(connection->cwnd, window_size(connection));
+    }
+
+    /* Still recovering from the last loss. */
+    if ((int32_t)(connection->successful_sent - connection->recovery_num) < 0)
+        return;
+
+    if (num_requested != 0) {
+        connection->ssthresh = MAX(connection->cwnd * 7 / 10, MIN_CWND);
+        connection->cwnd = connection->ssthresh;
+        connection->cwnd_acked = 0;
+        connection->recovery_num = connection->sent_packetnum;
+    }
+}
+
+/* Retransmission timeout of connection in us. */
+static uint64_t connection_rto(Connection *connection)
+{
+    return MIN(MAX(connection->srtt + 4 * connection->rttvar, MIN_RTO), MAX_RTO);
+}
+
+/* Agree on the SYNC format and the window with the other from the words of a SYNC it sent
+ * before the connection was established.
+ * Old peers send no words, new ones their capabilities (see missing_bitmap()).
+ */
+static void handle_capabilities(Connection *connection, uint32_t *words, uint16_t number)
+{
+    uint32_t capabilities = number != 0 ? ntohl(words[0]) : 0;
+    uint32_t window = (capabilities >> 16) & 0xFF;
+
+    if ((capabilities >> 24) >= LOSSLESS_UDP_VERSION && window != 0) {
+        connection->sack = 1;
+    } else {
+        connection->sack = 0;
+        window = BUFFER_PACKET_NUM;
+    }
+
+    connection->window   = MIN(connection->window, window);
+    connection->cwnd     = MIN(connection->cwnd, connection->window);
+    connection->ssthresh = MIN(connection->ssthresh, connection->window);
+}
+
+/* Add packet_num to the packets requested by the other. */
+static void add_request(Connection *connection, uint32_t packet_num)
+{
+    /* Without queues we have nothing the other could ask for. */
+    if (connection->req_packets == NULL)
+        return;
+
+    uint32_t index = (connection->req_start + connection->num_req_paquets) & (connection->queue_size - 1);
+    connection->req_packets[index] = packet_num;
+    ++connection->num_req_paquets;
+}
+
 /* case 1 in handle_SYNC: */
-static int handle_SYNC1(Lossless_UDP *ludp, IP_Port source, uint32_t recv_packetnum, uint32_t sent_packetnum)
+static int handle_SYNC1(Lossless_UDP *ludp, IP_Port source, uint32_t recv_packetnum, uint32_t sent_packetnum,
+                        uint32_t *req_packets, uint16_t number)
 {
-    if (handshake_id(ludp, source) == recv_packetnum) {
+    /* The cookie may be from the previous period. */
+    if (handshake_id(ludp, source, 0) == recv_packetnum || handshake_id(ludp, source, 1) == recv_packetnum) {
         int connection_id = new_inconnection(ludp, source);
 
         if (connection_id != -1) {
@@ -553,6 +1119,7 @@ static int handle_SYNC1(Lossless_UDP *ludp, IP_Port source, uint32_t recv_packet
             connection->osent_packetnum    = sent_packetnum;
             connection->recv_packetnum     = sent_packetnum;
             connection->successful_read    = sent_packetnum;
+            handle_capabilities(connection, req_packets, number);
 
             return connection_id;
         }
@@ -563,16 +1130,21 @@ static int handle_SYNC1(Lossless_UDP *ludp, IP_Port source, uint32_t recv_packet
 
 /* case 2 in handle_SYNC: */
 static int handle_SYNC2(Lossless_UDP *ludp, int connection_id, uint8_t counter, uint32_t recv_packetnum,
-                        uint32_t sent_packetnum)
+                        uint32_t sent_packetnum, uint32_t *req_packets, uint16_t number)
 {
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
     if (recv_packetnum == connection->orecv_packetnum) {
         /* && sent_packetnum == connection->osent_packetnum) */
+        /* Inbound connections already agreed in handle_SYNC1(). */
+        if (connection->inbound == 0)
+            handle_capabilities(connection, req_packets, number);
+
         connection->status = 3;
         connection->recv_counter = counter;
         ++connection->send_counter;
         send_SYNC(ludp, connection_id);
+        schedule_connection(ludp, connection_id);
         return 0;
     }
 
@@ -587,16 +1159,20 @@ static int handle_SYNC3(Lossless_UDP *ludp, int connection_id, uint8_t counter,
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
     uint8_t comp_counter = (counter - connection->recv_counter);
-    uint32_t i, temp;
+    uint32_t i, bit;
+    /* With SACK, the capabilities and then at most one bitmap word per 32 packets of the window. */
+    uint32_t max_number = connection->sack ? 1 + (window_size(connection) + 31) / 32 : window_size(connection);
     /* uint32_t comp_1 = (recv_packetnum - connection->successful_sent);
        uint32_t comp_2 = (sent_packetnum - connection->successful_read); */
     uint32_t comp_1 = (recv_packetnum - connection->orecv_packetnum);
     uint32_t comp_2 = (sent_packetnum - connection->osent_packetnum);
 
     /* Packet valid. */
-    if (comp_1 <= BUFFER_PACKET_NUM &&
-            comp_2 <= BUFFER_PACKET_NUM &&
+    if (comp_1 <= window_size(connection) &&
+            comp_2 <= window_size(connection) &&
+            number <= max_number && (number != 0 || !connection->sack) &&
             comp_counter < 10 && comp_counter != 0) {
+        uint32_t old_successful_sent = connection->successful_sent;
         connection->orecv_packetnum = recv_packetnum;
         connection->osent_packetnum = sent_packetnum;
         connection->successful_sent = recv_packetnum;
@@ -605,12 +1181,29 @@ static int handle_SYNC3(Lossless_UDP *ludp, int connection_id, uint8_t counter,
 
         ++connection->send_counter;
 
-        for (i = 0; i < number; ++i) {
-            temp = ntohl(req_packets[i]);
-            memcpy(connection->req_packets + i, &temp, 4 * number);
+        connection->req_start = 0;
+        connection->num_req_paquets = 0;
+
+        if (connection->sack) {
+            for (i = 1; i < number; ++i) {
+                uint32_t bitmap = ntohl(req_packets[i]);
+
+                for (bit = 0; bit < 32 && bitmap != 0; ++bit, bitmap >>= 1)
+                    if ((bitmap & 1) && (i - 1) * 32 + bit < window_size(connection))
+                        add_request(connection, recv_packetnum + (i - 1) * 32 + bit);
+            }
+        } else {
+            for (i = 0; i < number; ++i)
+                add_request(connection, ntohl(req_packets[i]));
         }
 
-        connection->num_req_paquets = number;
+        update_congestion(ludp, connection, old_successful_sent, connection->num_req_paquets, connection->last_recvSYNC);
+        schedule_connection(ludp, connection_id);
+
+        /* Room was made in the send queue. */
+        if (connection->successful_sent != old_successful_sent)
+            timer_set(&ludp->ready, connection_id, 0);
+
         return 0;
     }
 
@@ -627,7 +1220,7 @@ static int handle_SYNC(void *object, IP_Port source, uint8_t *packet, uint32_t l
     uint8_t counter;
     uint32_t temp;
     uint32_t recv_packetnum, sent_packetnum;
-    uint32_t req_packets[BUFFER_PACKET_NUM];
+    uint32_t req_packets[LOSSLESS_UDP_MAX_QUEUE - 1];
     uint16_t number = (length - 4 - 4 - 2) / 4;
 
     memcpy(&counter, packet + 1, 1);
@@ -642,13 +1235,13 @@ static int handle_SYNC(void *object, IP_Port source, uint8_t *packet, uint32_t l
     int connection_id = getconnection_id(ludp, source);
 
     if (connection_id == -1)
-        return handle_SYNC1(ludp, source, recv_packetnum, sent_packetnum);
+        return handle_SYNC1(ludp, source, recv_packetnum, sent_packetnum, req_packets, number);
 
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
     if (connection->status == 2)
         return handle_SYNC2(ludp, connection_id, counter,
-                            recv_packetnum, sent_packetnum);
+                            recv_packetnum, sent_packetnum, req_packets, number);
 
     if (connection->status == 3)
         return handle_SYNC3(ludp, connection_id, counter, recv_packetnum,
@@ -663,24 +1256,27 @@ static int handle_SYNC(void *object, IP_Port source, uint8_t *packet, uint32_t l
  * return 1 if data was too big.
  * return 0 if not.
  */
-static int add_recv(Lossless_UDP *ludp, int connection_id, uint32_t data_num, uint8_t *data, uint16_t size)
+static int add_recv(Lossless_UDP *ludp, int connection_id, uint32_t data_num, Packet_Buffer *buffer)
 {
-    if (size > MAX_DATA_SIZE)
+    if (buffer->length > MAX_DATA_SIZE)
         return 1;
 
     Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+
+    if (alloc_queues(ludp, connection) == -1)
+        return 1;
+
     uint32_t i;
-    uint32_t maxnum = connection->successful_read + BUFFER_PACKET_NUM;
+    uint32_t maxnum = connection->successful_read + window_size(connection);
     uint32_t sent_packet = data_num - connection->osent_packetnum;
 
     for (i = connection->recv_packetnum; i != maxnum; ++i) {
         if (i == data_num) {
-            memcpy(connection->recvbuffer[i % MAX_QUEUE_NUM].data, data, size);
-
-            connection->recvbuffer[i % MAX_QUEUE_NUM].size = size;
+            packet_buffer_unref(connection->recvbuffer[i % connection->queue_size].buffer);
+            connection->recvbuffer[i % connection->queue_size].buffer = packet_buffer_ref(buffer);
             connection->last_recvdata = current_time();
 
-            if (sent_packet < BUFFER_PACKET_NUM)
+            if (sent_packet < window_size(connection))
                 connection->osent_packetnum = data_num;
 
             break;
@@ -688,7 +1284,7 @@ static int add_recv(Lossless_UDP *ludp, int connection_id, uint32_t data_num, ui
     }
 
     for (i = connection->recv_packetnum; i != maxnum; ++i) {
-        if (connection->recvbuffer[i % MAX_QUEUE_NUM].size != 0)
+        if (connection->recvbuffer[i % connection->queue_size].buffer != NULL)
             connection->recv_packetnum = i;
         else
             break;
@@ -697,6 +1293,26 @@ static int add_recv(Lossless_UDP *ludp, int connection_id, uint32_t data_num, ui
     return 0;
 }
 
+/* return a buffer holding packet, the one it was received in if we can have it.
+ * return NULL if out of memory.
+ */
+static Packet_Buffer *received_buffer(Lossless_UDP *ludp, uint8_t *packet, uint32_t length)
+{
+    Packet_Buffer *buffer = ludp->net->recv_packet;
+
+    if (buffer != NULL && packet_buffer_data(buffer) == packet && buffer->length == length)
+        return packet_buffer_ref(buffer);
+
+    buffer = new_packet_buffer(PACKET_BUFFER_HEADROOM + length, PACKET_BUFFER_HEADROOM);
+
+    if (buffer == NULL)
+        return NULL;
+
+    memcpy(packet_buffer_data(buffer), packet, length);
+    buffer->length = length;
+    return buffer;
+}
+
 static int handle_data(void *object, IP_Port source, uint8_t *packet, uint32_t length)
 {
     Lossless_UDP *ludp = object;
@@ -709,17 +1325,38 @@ static int handle_data(void *object, IP_Port source, uint8_t *packet, uint32_t l
     if (tox_array_get(&ludp->connections, connection_id, Connection).status != 3)
         return 1;
 
-    if (length > 1 + 4 + MAX_DATA_SIZE || length < 1 + 4 + 1)
+    if (length > LOSSLESS_UDP_HEADER_SIZE + MAX_DATA_SIZE || length < LOSSLESS_UDP_HEADER_SIZE + 1)
         return 1;
 
     uint32_t temp;
     uint32_t number;
-    uint16_t size = length - 1 - 4;
 
     memcpy(&temp, packet + 1, 4);
     number = ntohl(temp);
 
-    return add_recv(ludp, connection_id, number, packet + 5, size);
+    Packet_Buffer *buffer = received_buffer(ludp, packet, length);
+
+    if (buffer == NULL)
+        return 1;
+
+    packet_buffer_pull(buffer, LOSSLESS_UDP_HEADER_SIZE);
+    int ret = add_recv(ludp, connection_id, number, buffer);
+    packet_buffer_unref(buffer);
+
+    if (ret)
+        return 1;
+
+    timer_set(&ludp->ready, connection_id, 0);
+
+    /* We have data coming in, SYNC faster. */
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+
+    if (connection->SYNC_rate != MAX_SYNC_RATE) {
+        connection->SYNC_rate = MAX_SYNC_RATE;
+        schedule_connection(ludp, connection_id);
+    }
+
+    return 0;
 }
 
 /*
@@ -728,6 +1365,8 @@ static int handle_data(void *object, IP_Port source, uint8_t *packet, uint32_t l
 
 Lossless_UDP *new_lossless_udp(Networking_Core *net)
 {
+    uint32_t i;
+
     if (net == NULL)
         return NULL;
 
@@ -737,6 +1376,17 @@ Lossless_UDP *new_lossless_udp(Networking_Core *net)
         return NULL;
 
     tox_array_init(&temp->connections, sizeof(Connection));
+    timer_heap_init(&temp->timers);
+    timer_heap_init(&temp->ready);
+    timer_heap_init(&temp->incoming);
+    temp->ip_index_seed = random_int();
+
+    for (i = 0; i < sizeof(temp->cookie_key); i += 4) {
+        uint32_t r = random_int();
+        memcpy(temp->cookie_key + i, &r, MIN(4, sizeof(temp->cookie_key) - i));
+    }
+
+    temp->queue_size = MAX_QUEUE_NUM;
 
     temp->net = net;
     networking_registerhandler(net, NET_PACKET_HANDSHAKE, &handle_handshake, temp);
@@ -749,95 +1399,193 @@ Lossless_UDP *new_lossless_udp(Networking_Core *net)
  * Send handshake requests.
  * Handshake packets are sent at the same rate as SYNC packets.
  */
-static void do_new(Lossless_UDP *ludp)
+static void do_new(Lossless_UDP *ludp, int connection_id, uint64_t temp_time)
 {
-    uint64_t temp_time = current_time();
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 1 && (tmp->last_sent + (1000000UL / tmp->SYNC_rate)) <= temp_time) {
-            send_handshake(ludp, tmp->ip_port, tmp->handshake_id1, 0);
-            tmp->last_sent = temp_time;
-        }
+    if (connection->status == 1 && (connection->last_sent + (1000000UL / connection->SYNC_rate)) <= temp_time) {
+        send_handshake(ludp, connection->ip_port, connection->handshake_id1, 0);
+        connection->last_sent = temp_time;
+    }
 
-        /* kill all timed out connections */
-        if (tmp->status > 0 && (tmp->last_recvSYNC + tmp->timeout * 1000000UL) < temp_time && tmp->status != 4) {
-            tmp->status = 4;
-            /* kill_connection(i); */
+    /* kill all timed out connections */
+    if (connection->status > 0 && (connection->last_recvSYNC + connection->timeout * 1000000UL) < temp_time
+            && connection->status != 4) {
+        connection->status = 4;
+        ++ludp->net->stats.connections_timed_out;
+        timer_set(&ludp->ready, connection_id, 0);
+        /* kill_connection(i); */
+    }
+
+    if (connection->status > 0 && connection->killat < temp_time)
+        kill_connection(ludp, connection_id);
+}
+
+static void do_SYNC(Lossless_UDP *ludp, int connection_id, uint64_t temp_time)
+{
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+
+    if (connection->status == 2 || connection->status == 3)
+        if ((connection->last_SYNC + (1000000UL / connection->SYNC_rate)) <= temp_time) {
+            send_SYNC(ludp, connection_id);
+            connection->last_SYNC = temp_time;
         }
+}
+
+/* return 1 if send_DATA() has something it is allowed to send, 0 if not. */
+static int can_send_data(Connection *connection)
+{
+    if (connection->num_req_paquets > 0)
+        return 1;
+
+    return connection->sendbuff_packetnum != connection->sent_packetnum
+           && (uint32_t)(connection->sent_packetnum - connection->successful_sent) < connection->cwnd;
+}
 
-        if (tmp->status > 0 && tmp->killat < temp_time)
-            kill_connection(ludp, tmp_i);
+static void do_data(Lossless_UDP *ludp, int connection_id, uint64_t temp_time)
+{
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+    uint64_t j;
+
+    if (connection->status == 3 && can_send_data(connection) &&
+            (connection->last_sent + (1000000UL / connection->data_rate)) <= temp_time) {
+        for (j = connection->last_sent; j < temp_time; j +=  (1000000UL / connection->data_rate))
+            if (send_DATA(ludp, connection_id) <= 0)
+                break;
+
+        connection->last_sent = temp_time;
     }
 }
 
-static void do_SYNC(Lossless_UDP *ludp)
+/*
+ * Automatically adjusts send rates of packets for optimal transmission.
+ * Data is paced at cwnd packets per srtt, see update_congestion() for cwnd.
+ */
+static void adjust_rates(Lossless_UDP *ludp, int connection_id, uint64_t temp_time)
 {
-    uint64_t temp_time = current_time();
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 2 || tmp->status == 3)
-            if ((tmp->last_SYNC + (1000000UL / tmp->SYNC_rate)) <= temp_time) {
-                send_SYNC(ludp, tmp_i);
-                tmp->last_SYNC = temp_time;
+    if (connection->status == 1 || connection->status == 2)
+        connection->SYNC_rate = MAX_SYNC_RATE;
+
+    if (connection->status == 3) {
+        if (sendqueue(ludp, connection_id) != 0) {
+            /* Nothing acknowledged for too long, start over from a small window. */
+            if (connection->sent_packetnum != connection->successful_sent
+                    && connection->last_ack + connection_rto(connection) <= temp_time) {
+                connection->ssthresh = MAX(connection->cwnd / 2, MIN_CWND);
+                connection->cwnd = MIN_CWND;
+                connection->cwnd_acked = 0;
+                connection->recovery_num = connection->sent_packetnum;
+                connection->last_ack = temp_time;
             }
+
+            uint64_t rate = (uint64_t)connection->cwnd * 1000000UL / MAX(connection->srtt, 1);
+            connection->data_rate = MIN(MAX(rate, DATA_SYNC_RATE), 1000000UL);
+            connection->SYNC_rate = MAX_SYNC_RATE;
+        } else if (connection->last_recvdata + 1000000UL > temp_time)
+            connection->SYNC_rate = MAX_SYNC_RATE;
+        else
+            connection->SYNC_rate = SYNC_RATE;
     }
 }
 
-static void do_data(Lossless_UDP *ludp)
+/* Give the queues of connection back once nothing went through them for QUEUE_IDLE_TIME. */
+static void free_idle_queues(Lossless_UDP *ludp, int connection_id, uint64_t temp_time)
 {
-    uint64_t j;
-    uint64_t temp_time = current_time();
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
 
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 3 && sendqueue(ludp, tmp_i) != 0 &&
-                (tmp->last_sent + (1000000UL / tmp->data_rate)) <= temp_time) {
-            for (j = tmp->last_sent; j < temp_time; j +=  (1000000UL / tmp->data_rate))
-                send_DATA(ludp, tmp_i);
+    if (connection->sendbuffer != NULL && queues_empty(connection)
+            && MAX(connection->last_sent, connection->last_recvdata) + QUEUE_IDLE_TIME * 1000000UL <= temp_time)
+        free_queues(ludp, connection);
+}
+
+/* return the time at which the connection next needs to be looked at by do_lossless_udp(). */
+static uint64_t connection_next_run(Lossless_UDP *ludp, int connection_id)
+{
+    Connection *connection = &tox_array_get(&ludp->connections, connection_id, Connection);
+    uint64_t next = connection->killat;
 
-            tmp->last_sent = temp_time;
+    if (connection->status == 1)
+        next = MIN(next, connection->last_sent + (1000000UL / connection->SYNC_rate));
 
-        }
-    }
+    if (connection->status == 2 || connection->status == 3)
+        next = MIN(next, connection->last_SYNC + (1000000UL / connection->SYNC_rate));
+
+    if (connection->status == 3 && can_send_data(connection))
+        next = MIN(next, connection->last_sent + (1000000UL / connection->data_rate));
+
+    if (connection->status == 3 && connection->sent_packetnum != connection->successful_sent)
+        next = MIN(next, connection->last_ack + connection_rto(connection));
+
+    /* Drop back to the slow SYNC rate once data stops coming in. */
+    if (connection->status == 3 && connection->SYNC_rate != SYNC_RATE)
+        next = MIN(next, connection->last_recvdata + 1000000UL);
+
+    if (connection->status != 4)
+        next = MIN(next, connection->last_recvSYNC + connection->timeout * 1000000UL);
+
+    if (connection->sendbuffer != NULL && queues_empty(connection))
+        next = MIN(next, MAX(connection->last_sent, connection->last_recvdata) + QUEUE_IDLE_TIME * 1000000UL);
+
+    return next;
 }
 
-#define MAX_SYNC_RATE 10
+/* (Re)compute the deadline of the connection, call this whenever its state changes. */
+static void schedule_connection(Lossless_UDP *ludp, int connection_id)
+{
+    if (tox_array_get(&ludp->connections, connection_id, Connection).status == 0) {
+        timer_unset(&ludp->timers, connection_id);
+        return;
+    }
 
-/*
- * Automatically adjusts send rates of packets for optimal transmission.
- *
- * TODO: Flow control.
+    timer_set(&ludp->timers, connection_id, connection_next_run(ludp, connection_id));
+}
+
+/* Call this function a couple times per second It's the main loop.
+ * Only the connections whose deadline has passed are looked at.
  */
-static void adjust_rates(Lossless_UDP *ludp)
+void do_lossless_udp(Lossless_UDP *ludp)
 {
     uint64_t temp_time = current_time();
+    int connection_id;
 
-    tox_array_for_each(&ludp->connections, Connection, tmp) {
-        if (tmp->status == 1 || tmp->status == 2)
-            tmp->SYNC_rate = MAX_SYNC_RATE;
-
-        if (tmp->status == 3) {
-            if (sendqueue(ludp, tmp_i) != 0) {
-                tmp->data_rate = (BUFFER_PACKET_NUM - tmp->num_req_paquets) * MAX_SYNC_RATE;
-                tmp->SYNC_rate = MAX_SYNC_RATE;
-            } else if (tmp->last_recvdata + 1000000UL > temp_time)
-                tmp->SYNC_rate = MAX_SYNC_RATE;
-            else
-                tmp->SYNC_rate = SYNC_RATE;
-        }
+    while ((connection_id = timer_pop(&ludp->timers, temp_time)) != -1) {
+        do_new(ludp, connection_id, temp_time);
+
+        if (is_connected(ludp, connection_id) == 0)
+            continue;
+
+        do_SYNC(ludp, connection_id, temp_time);
+        do_data(ludp, connection_id, temp_time);
+        adjust_rates(ludp, connection_id, temp_time);
+        free_idle_queues(ludp, connection_id, temp_time);
+
+        /* Anything still due gets looked at on the next call, not in this loop. */
+        timer_set(&ludp->timers, connection_id, MAX(connection_next_run(ludp, connection_id), temp_time + 1));
     }
 }
 
-/* Call this function a couple times per second It's the main loop. */
-void do_lossless_udp(Lossless_UDP *ludp)
+/* return the time (in current_time() units) at which do_lossless_udp() next has work to do.
+ * return ~0 if there are no connections.
+ */
+uint64_t lossless_udp_next_run(Lossless_UDP *ludp)
 {
-    do_new(ludp);
-    do_SYNC(ludp);
-    do_data(ludp);
-    adjust_rates(ludp);
+    return timer_next(&ludp->timers);
 }
 
 void kill_lossless_udp(Lossless_UDP *ludp)
 {
+    tox_array_for_each(&ludp->connections, Connection, tmp) {
+        free_queues(ludp, tmp);
+    }
+
+    free_queue_pool(ludp);
+
+    timer_heap_free(&ludp->timers);
+    timer_heap_free(&ludp->ready);
+    timer_heap_free(&ludp->incoming);
+    free(ludp->ip_index);
     tox_array_delete(&ludp->connections);
     free(ludp);
 }
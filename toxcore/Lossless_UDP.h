@@ -26,16 +26,22 @@
 
 #include "network.h"
 #include "misc_tools.h"
+#include "timer.h"
 
 
 /* Maximum length of the data in the data packets. */
 #define MAX_DATA_SIZE 1024
 
-/* Maximum data packets in sent and receive queues. */
+/* Default size of the send and receive queues (see lossless_udp_set_window()). */
 #define MAX_QUEUE_NUM     16
 
-/* Maximum number of data packets in the buffer. */
-#define BUFFER_PACKET_NUM (16-1)
+/* Default maximum number of data packets in the buffer (the window). */
+#define BUFFER_PACKET_NUM (MAX_QUEUE_NUM - 1)
+
+/* Biggest send and receive queues a connection can have.
+ * SYNC packets to old peers list every missing packet so this also bounds their size.
+ */
+#define LOSSLESS_UDP_MAX_QUEUE 256
 
 /* Timeout per connection is randomly set between CONNEXION_TIMEOUT and 2*CONNEXION_TIMEOUT. */
 #define CONNEXION_TIMEOUT 5
@@ -46,9 +52,16 @@
 /* Initial send rate of data. */
 #define DATA_SYNC_RATE    30
 
+/* Size of the header Lossless_UDP puts in front of data packets. */
+#define LOSSLESS_UDP_HEADER_SIZE (1 + 4)
+
 typedef struct {
-    uint8_t  data[MAX_DATA_SIZE];
-    uint16_t size;
+    /* The packet data (without the Lossless_UDP header for received packets),
+     * NULL if the slot is empty. */
+    Packet_Buffer *buffer;
+
+    /* Time a sent packet was first sent at, 0 if unsent or resent (no RTT sample from it). */
+    uint64_t sent_time;
 } Data;
 
 typedef struct {
@@ -70,8 +83,11 @@ typedef struct {
      */
     uint8_t inbound;
 
+    /* Whatever the layer above wants to remember for the connection, see set_connection_tag(). */
+    uint32_t  tag;
+
     uint16_t  SYNC_rate;     /* Current SYNC packet send rate packets per second. */
-    uint16_t  data_rate;     /* Current data packet send rate packets per second. */
+    uint32_t  data_rate;     /* Current data packet send rate packets per second. */
 
     uint64_t  last_SYNC;     /* Time our last SYNC packet was sent. */
     uint64_t  last_sent;     /* Time our last data or handshake packet was sent. */
@@ -79,8 +95,21 @@ typedef struct {
     uint64_t  last_recvdata; /* Time we last received a DATA packet from the other. */
     uint64_t  killat;        /* Time to kill the connection. */
 
-    Data      sendbuffer[MAX_QUEUE_NUM]; /* packet send buffer. */
-    Data      recvbuffer[MAX_QUEUE_NUM]; /* packet receive buffer. */
+    /* Length of sendbuffer and recvbuffer, a power of two.
+     * At most queue_size - 1 packets are buffered in each direction (the window). */
+    uint32_t  queue_size;
+    uint32_t  window;     /* Window agreed on with the other, at most queue_size - 1. */
+    Data     *sendbuffer; /* packet send buffer, NULL while the queues are not needed. */
+    Data     *recvbuffer; /* packet receive buffer, NULL along with sendbuffer. */
+
+    /* Congestion control: at most cwnd packets are in flight, sent at cwnd per srtt. */
+    uint32_t  cwnd;
+    uint32_t  ssthresh;
+    uint32_t  cwnd_acked;    /* Packets acknowledged since cwnd last grew (congestion avoidance). */
+    uint32_t  recovery_num;  /* Losses are ignored until packets before this number are acknowledged. */
+    uint32_t  srtt;          /* Smoothed round trip time in us (SYNC delay of the other included). */
+    uint32_t  rttvar;        /* Round trip time variation in us. */
+    uint64_t  last_ack;      /* Time of the last valid SYNC (or of the first packet in flight). */
 
     uint32_t  handshake_id1;
     uint32_t  handshake_id2;
@@ -106,24 +135,72 @@ typedef struct {
     /* Packet number of last packet read with the read_packet function. */
     uint32_t  successful_read;
 
-    /* List of currently requested packet numbers(by the other person). */
-    uint32_t  req_packets[BUFFER_PACKET_NUM];
+    /* Ring of currently requested packet numbers(by the other person), queue_size long,
+     * the first one is at req_start. */
+    uint32_t *req_packets;
+    uint16_t  req_start;
 
     /* Total number of currently requested packets(by the other person). */
     uint16_t  num_req_paquets;
 
+    /* 1 if our SYNC packets carry our capabilities and request packets with a bitmap,
+     * 0 if the other is an old peer that only understands lists of packet numbers.
+     * Outbound connections assume 0 until the first SYNC of the other tells, their
+     * handshake SYNCs only carry the capabilities. */
+    uint8_t   sack;
+
     uint8_t   recv_counter;
     uint8_t   send_counter;
     uint8_t   timeout; /* connection timeout in seconds. */
 } Connection;
 
+/* Unused connection queues kept for new connections at most. */
+#define QUEUE_POOL_MAX 64
+
+/* Slots of the per IP rate limit of handshake replies. */
+#define HANDSHAKE_LIMIT_SLOTS 1024
+
+typedef struct {
+    IP        ip;
+    uint32_t  count; /* Replies sent to ip since start. */
+    uint64_t  start;
+} Handshake_Limit;
+
 typedef struct {
     Networking_Core *net;
 
     tox_array connections;
 
-    /* Table of random numbers used in handshake_id. */
-    uint32_t randtable[6][256];
+    /* Next deadline of every connection, keyed by connection id. */
+    Timer_Heap timers;
+
+    /* Connections with news for the layer above (see lossless_udp_pop_ready()) and inbound
+     * connections incoming_connection() has not returned yet. All the deadlines are 0, the heaps
+     * are only used as sets of connection ids. */
+    Timer_Heap ready;
+    Timer_Heap incoming;
+
+    /* queue_size of new connections (see lossless_udp_set_window()). */
+    uint32_t  queue_size;
+
+    /* Unused blocks of connection queues of queue_size, linked through their first bytes. */
+    void     *queue_pool;
+    uint32_t  queue_pool_num;
+
+    /* Hash index of the live connections by IP_Port (see getconnection_id()). */
+    int      *ip_index;
+    uint32_t  ip_index_size;
+    uint32_t  ip_index_used;
+    uint32_t  ip_index_seed;
+
+    /* Key of the handshake cookies, see handshake_id(). */
+    uint8_t   cookie_key[crypto_auth_KEYBYTES];
+
+    /* Bumped by change_handshake() to give new handshake ids to the addresses hashed to a slot. */
+    uint8_t   cookie_generation[256];
+
+    /* Handshake replies sent to each IP, see handshake_allowed(). */
+    Handshake_Limit handshake_limits[HANDSHAKE_LIMIT_SLOTS];
 
 } Lossless_UDP;
 
@@ -135,6 +212,17 @@ typedef struct {
  */
 int new_connection(Lossless_UDP *ludp, IP_Port ip_port);
 
+/*
+ * Set the window (how many packets can be unacknowledged or unread in each direction)
+ * of the connections created after this call, the default is BUFFER_PACKET_NUM.
+ * The window is rounded up to a power of two minus one.
+ * Each connection uses the smaller of the windows of both peers, or at most
+ * BUFFER_PACKET_NUM with old peers that don't tell theirs.
+ * return 0 on success.
+ * return -1 if window is 0 or bigger than LOSSLESS_UDP_MAX_QUEUE - 1.
+ */
+int lossless_udp_set_window(Lossless_UDP *ludp, uint32_t window);
+
 /*
  * Get connection id from IP_Port.
  * return -1 if there are no connections like we are looking for.
@@ -167,6 +255,22 @@ int kill_connection_in(Lossless_UDP *ludp, int connection_id, uint32_t seconds);
  */
 IP_Port connection_ip(Lossless_UDP *ludp, int connection_id);
 
+/* Set the tag of the connection, it is 0 for new connections. */
+void set_connection_tag(Lossless_UDP *ludp, int connection_id, uint32_t tag);
+
+/* return the tag of the connection.
+ * return 0 if there is no such connection.
+ */
+uint32_t connection_tag(Lossless_UDP *ludp, int connection_id);
+
+/* return the id of a connection that received data, got room in its send queue or timed out
+ * since it was last returned.
+ * return -1 if there is none.
+ * The connections with received data still waiting to be read are not returned again until
+ * more arrives, read everything there is.
+ */
+int lossless_udp_pop_ready(Lossless_UDP *ludp);
+
 /*
  * returns the id of the next packet in the queue.
  * return -1 if no packet in queue.
@@ -179,15 +283,34 @@ char id_packet(Lossless_UDP *ludp, int connection_id);
  */
 int read_packet(Lossless_UDP *ludp, int connection_id, uint8_t *data);
 
+/*
+ * Same as read_packet() but hands over the buffer the packet was received in.
+ * The caller owns the returned reference and must packet_buffer_unref() it.
+ * return NULL if there is no received data in the buffer.
+ */
+Packet_Buffer *read_packet_buffer(Lossless_UDP *ludp, int connection_id);
+
 /*
  * return 0 if data could not be put in packet queue.
  * return 1 if data was put into the queue.
  */
 int write_packet(Lossless_UDP *ludp, int connection_id, uint8_t *data, uint32_t length);
 
+/*
+ * Same as write_packet() but queues buffer itself instead of a copy of the data.
+ * buffer needs LOSSLESS_UDP_HEADER_SIZE bytes of headroom, the header is written there.
+ * Lossless_UDP takes its own reference, the packet must not be changed afterwards.
+ * return 0 if data could not be put in packet queue.
+ * return 1 if data was put into the queue.
+ */
+int write_packet_buffer(Lossless_UDP *ludp, int connection_id, Packet_Buffer *buffer);
+
 /* returns the number of packets in the queue waiting to be successfully sent. */
 uint32_t sendqueue(Lossless_UDP *ludp, int connection_id);
 
+/* return the number of packets write_packet() can still put in the send queue. */
+uint32_t sendqueue_room(Lossless_UDP *ludp, int connection_id);
+
 /*
  * return the number of packets in the queue waiting to be successfully
  * read with read_packet(...).
@@ -206,6 +329,11 @@ int is_connected(Lossless_UDP *ludp, int connection_id);
 /* Call this function a couple times per second It's the main loop. */
 void do_lossless_udp(Lossless_UDP *ludp);
 
+/* return the time (in current_time() units) at which do_lossless_udp() next has work to do.
+ * return ~0 if there are no connections.
+ */
+uint64_t lossless_udp_next_run(Lossless_UDP *ludp);
+
 /* This function sets up LosslessUDP packet handling. */
 Lossless_UDP *new_lossless_udp(Networking_Core *net);
 
@@ -21,12 +21,25 @@
  *
  */
 
+/* pread() is POSIX, not C99. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "Messenger.h"
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
+#ifdef WIN32
+#include <io.h>
+#endif
+
 
 static void set_friend_status(Messenger *m, int friendnumber, uint8_t status);
 static int write_cryptpacket_id(Messenger *m, int friendnumber, uint8_t packet_id, uint8_t *data, uint32_t length);
+static int write_friend_packet(Messenger *m, int friendnumber, uint8_t *packet, uint32_t length);
+static void wake_friend(Messenger *m, int friendnumber);
+static int flush_batch(Messenger *m, int friendnumber);
+static void drop_batch(Messenger *m, int friendnumber);
+static void kill_file_transfers(Messenger *m, int friendnumber);
 
 /* return 1 if we are online.
  * return 0 if we are offline.
@@ -34,6 +47,7 @@ static int write_cryptpacket_id(Messenger *m, int friendnumber, uint8_t packet_i
  */
 
 /* Set the size of the friend list to numfriends.
+ * Memory is only reallocated when it is exhausted or mostly unused.
  * return -1 if realloc fails.
  */
 int realloc_friendlist(Messenger *m, uint32_t num)
@@ -41,32 +55,87 @@ int realloc_friendlist(Messenger *m, uint32_t num)
     if (num == 0) {
         free(m->friendlist);
         m->friendlist = NULL;
+        m->friendlist_capacity = 0;
         return 0;
     }
 
-    Friend *newfriendlist = realloc(m->friendlist, num * sizeof(Friend));
+    uint32_t capacity = m->friendlist_capacity;
+
+    if (num > capacity)
+        capacity = MAX(num, capacity * 2);
+    else if (num * 4 <= capacity)
+        capacity /= 2;
+    else
+        return 0;
+
+    Friend *newfriendlist = realloc(m->friendlist, capacity * sizeof(Friend));
 
     if (newfriendlist == NULL)
         return -1;
 
     m->friendlist = newfriendlist;
+    m->friendlist_capacity = capacity;
     return 0;
 }
 
-/* return the friend id associated to that public key.
- * return -1 if no such friend.
+/* Give friend a Friend_Request record, taken from the pool if there is one.
+ * return 0 on success.
+ * return -1 if malloc fails.
  */
-int getfriend_id(Messenger *m, uint8_t *client_id)
+static int alloc_request(Messenger *m, Friend *friend)
 {
-    uint32_t i;
+    Friend_Request *request = m->request_pool;
 
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0)
-            if (memcmp(client_id, m->friendlist[i].client_id, crypto_box_PUBLICKEYBYTES) == 0)
-                return i;
+    if (request != NULL) {
+        memcpy(&m->request_pool, request, sizeof(void *));
+        --m->request_pool_num;
+    } else {
+        request = malloc(sizeof(Friend_Request));
+
+        if (request == NULL)
+            return -1;
     }
 
-    return -1;
+    friend->request = request;
+    return 0;
+}
+
+/* Give the Friend_Request record of friend (if it has one) back to the pool. */
+static void free_request(Messenger *m, Friend *friend)
+{
+    Friend_Request *request = friend->request;
+
+    if (request == NULL)
+        return;
+
+    friend->request = NULL;
+
+    if (m->request_pool_num < FRIEND_REQUEST_POOL_MAX) {
+        memcpy(request, &m->request_pool, sizeof(void *));
+        m->request_pool = request;
+        ++m->request_pool_num;
+    } else {
+        free(request);
+    }
+}
+
+static void free_request_pool(Messenger *m)
+{
+    while (m->request_pool != NULL) {
+        Friend_Request *request = m->request_pool;
+        memcpy(&m->request_pool, request, sizeof(void *));
+        free(request);
+    }
+
+    m->request_pool_num = 0;
+}
+
+/* return the friend id associated to that public key.
+ * return -1 if no such friend.
+ */
+int getfriend_id(Messenger *m, uint8_t *client_id)
+{
+    return key_index_find(&m->friend_keys, client_id);
 }
 
 /* Copies the public key associated to that friend id into client_id buffer.
@@ -166,6 +235,7 @@ int m_addfriend(Messenger *m, uint8_t *address, uint8_t *data, uint16_t length)
             return FAERR_ALREADYSENT;
 
         m->friendlist[friend_id].friendrequest_nospam = nospam;
+        m->friendlist[friend_id].changed = 1;
         return FAERR_SETNEWNOSPAM;
     }
 
@@ -177,26 +247,37 @@ int m_addfriend(Messenger *m, uint8_t *address, uint8_t *data, uint16_t length)
 
     uint32_t i;
 
-    for (i = 0; i <= m->numfriends; ++i)  {
+    for (i = m->friendlist_free; i <= m->numfriends; ++i)  {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (alloc_request(m, &m->friendlist[i]) == -1)
+                return FAERR_NOMEM;
+
+            if (key_index_add(&m->friend_keys, client_id, i) == -1) {
+                free_request(m, &m->friendlist[i]);
+                return FAERR_NOMEM;
+            }
+
             DHT_addfriend(m->dht, client_id);
             m->friendlist[i].status = FRIEND_ADDED;
             m->friendlist[i].crypt_connection_id = -1;
-            m->friendlist[i].friendrequest_lastsent = 0;
-            m->friendlist[i].friendrequest_timeout = FRIENDREQUEST_TIMEOUT;
+            m->friendlist[i].request->friendrequest_lastsent = 0;
+            m->friendlist[i].request->friendrequest_timeout = FRIENDREQUEST_TIMEOUT;
             memcpy(m->friendlist[i].client_id, client_id, CLIENT_ID_SIZE);
             m->friendlist[i].statusmessage = calloc(1, 1);
             m->friendlist[i].statusmessage_length = 1;
             m->friendlist[i].userstatus = USERSTATUS_NONE;
-            memcpy(m->friendlist[i].info, data, length);
-            m->friendlist[i].info_size = length;
+            memcpy(m->friendlist[i].request->info, data, length);
+            m->friendlist[i].request->info_size = length;
             m->friendlist[i].message_id = 0;
             m->friendlist[i].receives_read_receipts = 1; /* Default: YES. */
             memcpy(&(m->friendlist[i].friendrequest_nospam), address + crypto_box_PUBLICKEYBYTES, sizeof(uint32_t));
+            m->friendlist[i].changed = 1;
 
             if (m->numfriends == i)
                 ++ m->numfriends;
 
+            m->friendlist_free = i + 1;
+            wake_friend(m, i);
             return i;
         }
     }
@@ -217,22 +298,27 @@ int m_addfriend_norequest(Messenger *m, uint8_t *client_id)
 
     uint32_t i;
 
-    for (i = 0; i <= m->numfriends; ++i) {
+    for (i = m->friendlist_free; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (key_index_add(&m->friend_keys, client_id, i) == -1)
+                return -1;
+
             DHT_addfriend(m->dht, client_id);
             m->friendlist[i].status = FRIEND_CONFIRMED;
             m->friendlist[i].crypt_connection_id = -1;
-            m->friendlist[i].friendrequest_lastsent = 0;
             memcpy(m->friendlist[i].client_id, client_id, CLIENT_ID_SIZE);
             m->friendlist[i].statusmessage = calloc(1, 1);
             m->friendlist[i].statusmessage_length = 1;
             m->friendlist[i].userstatus = USERSTATUS_NONE;
             m->friendlist[i].message_id = 0;
             m->friendlist[i].receives_read_receipts = 1; /* Default: YES. */
+            m->friendlist[i].changed = 1;
 
             if (m->numfriends == i)
                 ++ m->numfriends;
 
+            m->friendlist_free = i + 1;
+            wake_friend(m, i);
             return i;
         }
     }
@@ -249,8 +335,23 @@ int m_delfriend(Messenger *m, int friendnumber)
     if (friendnumber >= m->numfriends || friendnumber < 0)
         return -1;
 
+    /* Remember the removal for Messenger_save_changes(). */
+    uint8_t (*removed)[CLIENT_ID_SIZE] = realloc(m->removed_friends, (m->num_removed_friends + 1) * CLIENT_ID_SIZE);
+
+    if (removed == NULL)
+        return -1;
+
+    m->removed_friends = removed;
+    memcpy(m->removed_friends[m->num_removed_friends], m->friendlist[friendnumber].client_id, CLIENT_ID_SIZE);
+    ++m->num_removed_friends;
+
     DHT_delfriend(m->dht, m->friendlist[friendnumber].client_id);
+    key_index_remove(&m->friend_keys, m->friendlist[friendnumber].client_id, friendnumber);
     crypto_kill(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id);
+    timer_unset(&m->friend_timers, friendnumber);
+    drop_batch(m, friendnumber);
+    free_request(m, &m->friendlist[friendnumber]);
+    free(m->friendlist[friendnumber].files);
     free(m->friendlist[friendnumber].statusmessage);
     memset(&(m->friendlist[friendnumber]), 0, sizeof(Friend));
     uint32_t i;
@@ -261,6 +362,7 @@ int m_delfriend(Messenger *m, int friendnumber)
     }
 
     m->numfriends = i;
+    m->friendlist_free = MIN(m->friendlist_free, MIN((uint32_t)friendnumber, m->numfriends));
 
     if (realloc_friendlist(m, m->numfriends) != 0)
         return FAERR_NOMEM;
@@ -282,20 +384,121 @@ int m_friendstatus(Messenger *m, int friendnumber)
     return m->friendlist[friendnumber].status;
 }
 
-/* Send a text chat message to an online friend.
- * return the message id if packet was successfully put into the send queue.
- * return 0 if it was not.
+/* return the watermarks of friendnumber's send queue, with the defaults applied. */
+static void send_watermarks(Messenger *m, int friendnumber, uint32_t *low, uint32_t *high)
+{
+    Friend *friend = &m->friendlist[friendnumber];
+    uint32_t queued = crypto_sendqueue(m->net_crypto, friend->crypt_connection_id);
+    uint32_t window = queued + crypto_sendqueue_room(m->net_crypto, friend->crypt_connection_id);
+
+    *high = friend->send_high == 0 ? window : MIN(friend->send_high, window);
+    *low = friend->send_low == 0 ? window / 2 : friend->send_low;
+
+    if (*high != 0 && *low >= *high)
+        *low = *high - 1;
+}
+
+/* write_friend_packet() for the packets of the application, which respect the high watermark.
+ * A refused packet makes friendnumber blocked until its send queue is down to the low one.
  */
-uint32_t m_sendmessage(Messenger *m, int friendnumber, uint8_t *message, uint32_t length)
+static int send_watermarked_packet(Messenger *m, int friendnumber, uint8_t *packet, uint32_t length)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return 0;
+
+    uint32_t low, high;
+    send_watermarks(m, friendnumber, &low, &high);
+
+    if (crypto_sendqueue(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id) < high
+            && write_friend_packet(m, friendnumber, packet, length))
+        return 1;
+
+    m->friendlist[friendnumber].send_blocked = 1;
+    /* In case nothing is waiting for an ack. */
+    wake_friend(m, friendnumber);
+    return 0;
+}
+
+static int send_watermarked(Messenger *m, int friendnumber, uint8_t packet_id, uint8_t *data, uint32_t length)
+{
+    if (length >= MAX_DATA_SIZE)
+        return 0;
+
+    uint8_t packet[length + 1];
+    packet[0] = packet_id;
+    memcpy(packet + 1, data, length);
+    return send_watermarked_packet(m, friendnumber, packet, length + 1);
+}
+
+/* Call the writable callback if friendnumber was blocked and its send queue went down enough. */
+static void check_writable(Messenger *m, int friendnumber)
+{
+    uint32_t low, high;
+
+    if (!m->friendlist[friendnumber].send_blocked)
+        return;
+
+    send_watermarks(m, friendnumber, &low, &high);
+
+    if (crypto_sendqueue(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id) > low)
+        return;
+
+    m->friendlist[friendnumber].send_blocked = 0;
+
+    if (m->friend_writable)
+        m->friend_writable(m, friendnumber, m->friend_writable_userdata);
+}
+
+int m_set_send_watermarks(Messenger *m, int friendnumber, uint32_t low, uint32_t high)
 {
     if (friendnumber < 0 || friendnumber >= m->numfriends)
+        return -1;
+
+    if (high != 0 && low >= high)
+        return -1;
+
+    m->friendlist[friendnumber].send_low = low;
+    m->friendlist[friendnumber].send_high = high;
+    wake_friend(m, friendnumber);
+    return 0;
+}
+
+uint32_t m_sendqueue(Messenger *m, int friendnumber)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends || m->friendlist[friendnumber].status != FRIEND_ONLINE)
         return 0;
 
+    return crypto_sendqueue(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id);
+}
+
+void m_callback_writable(Messenger *m, void (*function)(Messenger *m, int, void *), void *userdata)
+{
+    m->friend_writable = function;
+    m->friend_writable_userdata = userdata;
+}
+
+/* return the next message id of friendnumber, never 0. */
+static uint32_t new_message_id(Messenger *m, int friendnumber)
+{
     uint32_t msgid = ++m->friendlist[friendnumber].message_id;
 
     if (msgid == 0)
         msgid = 1; // Otherwise, false error
 
+    return msgid;
+}
+
+/* Send a text chat message to an online friend.
+ * return the message id if packet was successfully put into the send queue.
+ * return 0 if it was not.
+ */
+uint32_t m_sendmessage(Messenger *m, int friendnumber, uint8_t *message, uint32_t length)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends)
+        return 0;
+
+    uint32_t msgid = new_message_id(m, friendnumber);
+
     if (m_sendmessage_withid(m, friendnumber, msgid, message, length)) {
         return msgid;
     }
@@ -308,11 +511,12 @@ uint32_t m_sendmessage_withid(Messenger *m, int friendnumber, uint32_t theid, ui
     if (length >= (MAX_DATA_SIZE - sizeof(theid)))
         return 0;
 
-    uint8_t temp[MAX_DATA_SIZE];
-    theid = htonl(theid);
-    memcpy(temp, &theid, sizeof(theid));
-    memcpy(temp + sizeof(theid), message, length);
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_MESSAGE, temp, length + sizeof(theid));
+    uint8_t packet[1 + sizeof(theid) + length];
+    uint32_t temp = htonl(theid);
+    packet[0] = PACKET_ID_MESSAGE;
+    memcpy(packet + 1, &temp, sizeof(temp));
+    memcpy(packet + 1 + sizeof(temp), message, length);
+    return send_watermarked_packet(m, friendnumber, packet, sizeof(packet));
 }
 
 /* Send an action to an online friend.
@@ -321,18 +525,64 @@ uint32_t m_sendmessage_withid(Messenger *m, int friendnumber, uint32_t theid, ui
  */
 int m_sendaction(Messenger *m, int friendnumber, uint8_t *action, uint32_t length)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_ACTION, action, length);
+    return send_watermarked(m, friendnumber, PACKET_ID_ACTION, action, length);
 }
 
-/* Send a name packet to friendnumber.
- * length is the length with the NULL terminator.
- */
-static int m_sendname(Messenger *m, int friendnumber, uint8_t *name, uint16_t length)
+uint32_t m_sendmessage_multi(Messenger *m, int *friendnumbers, uint32_t num, uint8_t *message, uint32_t length,
+                             uint32_t *ids)
 {
-    if (length > MAX_NAME_LENGTH || length == 0)
+    uint32_t i, sent = 0;
+
+    if (length >= MAX_DATA_SIZE - sizeof(uint32_t)) {
+        memset(ids, 0, num * sizeof(uint32_t));
+        return 0;
+    }
+
+    /* Only the message id changes from one friend to the next. */
+    uint8_t packet[1 + sizeof(uint32_t) + length];
+    packet[0] = PACKET_ID_MESSAGE;
+    memcpy(packet + 1 + sizeof(uint32_t), message, length);
+
+    for (i = 0; i < num; ++i) {
+        int friendnumber = friendnumbers[i];
+        ids[i] = 0;
+
+        if (friendnumber < 0 || friendnumber >= m->numfriends)
+            continue;
+
+        uint32_t msgid = new_message_id(m, friendnumber);
+        uint32_t temp = htonl(msgid);
+        memcpy(packet + 1, &temp, sizeof(temp));
+
+        if (send_watermarked_packet(m, friendnumber, packet, sizeof(packet))) {
+            ids[i] = msgid;
+            ++sent;
+        }
+    }
+
+    return sent;
+}
+
+uint32_t m_sendaction_multi(Messenger *m, int *friendnumbers, uint32_t num, uint8_t *action, uint32_t length,
+                            uint8_t *accepted)
+{
+    uint32_t i, sent = 0;
+
+    if (length >= MAX_DATA_SIZE) {
+        memset(accepted, 0, num);
         return 0;
+    }
+
+    uint8_t packet[1 + length];
+    packet[0] = PACKET_ID_ACTION;
+    memcpy(packet + 1, action, length);
+
+    for (i = 0; i < num; ++i) {
+        accepted[i] = send_watermarked_packet(m, friendnumbers[i], packet, sizeof(packet));
+        sent += accepted[i];
+    }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_NICKNAME, name, length);
+    return sent;
 }
 
 /* Set the name of a friend.
@@ -344,7 +594,11 @@ static int setfriendname(Messenger *m, int friendnumber, uint8_t *name)
     if (friendnumber >= m->numfriends || friendnumber < 0)
         return -1;
 
-    memcpy(m->friendlist[friendnumber].name, name, MAX_NAME_LENGTH);
+    if (memcmp(m->friendlist[friendnumber].name, name, MAX_NAME_LENGTH) != 0) {
+        memcpy(m->friendlist[friendnumber].name, name, MAX_NAME_LENGTH);
+        m->friendlist[friendnumber].changed = 1;
+    }
+
     return 0;
 }
 
@@ -364,9 +618,13 @@ int setname(Messenger *m, uint8_t *name, uint16_t length)
     m->name_length = length;
     uint32_t i;
 
-    for (i = 0; i < m->numfriends; ++i)
+    for (i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].name_sent = 0;
 
+        if (m->friendlist[i].status == FRIEND_ONLINE)
+            wake_friend(m, i);
+    }
+
     return 0;
 }
 
@@ -412,9 +670,13 @@ int m_set_statusmessage(Messenger *m, uint8_t *status, uint16_t length)
 
     uint32_t i;
 
-    for (i = 0; i < m->numfriends; ++i)
+    for (i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].statusmessage_sent = 0;
 
+        if (m->friendlist[i].status == FRIEND_ONLINE)
+            wake_friend(m, i);
+    }
+
     return 0;
 }
 
@@ -427,9 +689,13 @@ int m_set_userstatus(Messenger *m, USERSTATUS status)
     m->userstatus = status;
     uint32_t i;
 
-    for (i = 0; i < m->numfriends; ++i)
+    for (i = 0; i < m->numfriends; ++i) {
         m->friendlist[i].userstatus_sent = 0;
 
+        if (m->friendlist[i].status == FRIEND_ONLINE)
+            wake_friend(m, i);
+    }
+
     return 0;
 }
 
@@ -483,15 +749,52 @@ USERSTATUS m_get_self_userstatus(Messenger *m)
     return m->userstatus;
 }
 
-static int send_statusmessage(Messenger *m, int friendnumber, uint8_t *status, uint16_t length)
+/* Send what friendnumber doesn't have yet of our name (length with the NULL terminator),
+ * status message and user status, encrypted in one write_cryptpackets() call.
+ */
+static void send_profile(Messenger *m, int friendnumber)
 {
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_STATUSMESSAGE, status, length);
-}
+    Friend *friend = &m->friendlist[friendnumber];
+    uint8_t name[1 + MAX_NAME_LENGTH];
+    uint8_t statusmessage[1 + MAX_STATUSMESSAGE_LENGTH];
+    uint8_t userstatus[2];
+    uint8_t *data[3];
+    uint32_t length[3];
+    uint8_t *sent[3];
+    uint32_t num = 0, i;
+
+    if (friend->name_sent == 0 && m->name_length != 0 && m->name_length <= MAX_NAME_LENGTH) {
+        name[0] = PACKET_ID_NICKNAME;
+        memcpy(name + 1, m->name, m->name_length);
+        data[num] = name;
+        length[num] = 1 + m->name_length;
+        sent[num++] = &friend->name_sent;
+    }
 
-static int send_userstatus(Messenger *m, int friendnumber, USERSTATUS status)
-{
-    uint8_t stat = status;
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_USERSTATUS, &stat, sizeof(stat));
+    if (friend->statusmessage_sent == 0) {
+        statusmessage[0] = PACKET_ID_STATUSMESSAGE;
+        memcpy(statusmessage + 1, m->statusmessage, m->statusmessage_length);
+        data[num] = statusmessage;
+        length[num] = 1 + m->statusmessage_length;
+        sent[num++] = &friend->statusmessage_sent;
+    }
+
+    if (friend->userstatus_sent == 0) {
+        userstatus[0] = PACKET_ID_USERSTATUS;
+        userstatus[1] = m->userstatus;
+        data[num] = userstatus;
+        length[num] = sizeof(userstatus);
+        sent[num++] = &friend->userstatus_sent;
+    }
+
+    /* What was batched before goes first. */
+    if (num == 0 || flush_batch(m, friendnumber) == -1)
+        return;
+
+    num = write_cryptpackets(m->net_crypto, friend->crypt_connection_id, data, length, num);
+
+    for (i = 0; i < num; ++i)
+        *sent[i] = 1;
 }
 
 static int send_ping(Messenger *m, int friendnumber)
@@ -601,289 +904,1012 @@ static void check_friend_connectionstatus(Messenger *m, int friendnumber, uint8_
 void set_friend_status(Messenger *m, int friendnumber, uint8_t status)
 {
     check_friend_connectionstatus(m, friendnumber, status);
+
+    /* Callbacks can remove friends. */
+    if (friendnumber >= m->numfriends || m->friendlist[friendnumber].status == NOFRIEND)
+        return;
+
+    if (status != FRIEND_ONLINE) {
+        m->friendlist[friendnumber].send_blocked = 0;
+        drop_batch(m, friendnumber);
+        kill_file_transfers(m, friendnumber);
+
+        if (friendnumber >= m->numfriends || m->friendlist[friendnumber].status == NOFRIEND)
+            return;
+    }
+
+    /* Only friends that did not accept our request yet need it. */
+    if (status >= FRIEND_CONFIRMED || status == NOFRIEND)
+        free_request(m, &m->friendlist[friendnumber]);
+
+    /* We only save whether the friend is confirmed. */
+    if ((m->friendlist[friendnumber].status >= FRIEND_CONFIRMED) != (status >= FRIEND_CONFIRMED))
+        m->friendlist[friendnumber].changed = 1;
+
     m->friendlist[friendnumber].status = status;
 }
 
-int write_cryptpacket_id(Messenger *m, int friendnumber, uint8_t packet_id, uint8_t *data, uint32_t length)
+/* Microseconds before trying again to send to a friend whose send queue was full. */
+#define SEND_RETRY_TIME 50000
+
+/* Most bytes write_cryptpacket() takes in one packet. */
+#define MAX_CRYPTPACKET_SIZE (MAX_DATA_SIZE - 1 - crypto_box_MACBYTES)
+
+/* Each packet in a PACKET_ID_BATCH one is preceded by its length (2 bytes, network order). */
+#define BATCH_ENTRY_HEADER 2
+
+/* Send what is waiting in the batch of friendnumber, as the packet itself if there is only one.
+ *  return 0 if nothing is waiting anymore.
+ *  return -1 if the send queue is full (what is waiting stays there).
+ */
+static int flush_batch(Messenger *m, int friendnumber)
 {
-    if (friendnumber < 0 || friendnumber >= m->numfriends)
-        return 0;
+    Friend *friend = &m->friendlist[friendnumber];
 
-    if (length >= MAX_DATA_SIZE || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+    if (friend->batch_length == 0)
         return 0;
 
-    uint8_t packet[length + 1];
-    packet[0] = packet_id;
+    uint8_t *packet = friend->batch;
+    uint32_t length = friend->batch_length;
+    uint16_t first;
 
-    if (length != 0)
-        memcpy(packet + 1, data, length);
+    memcpy(&first, packet + 1, sizeof(first));
 
-    return write_cryptpacket(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id, packet, length + 1);
-}
+    if (1 + BATCH_ENTRY_HEADER + ntohs(first) == length) {
+        packet += 1 + BATCH_ENTRY_HEADER;
+        length -= 1 + BATCH_ENTRY_HEADER;
+    }
 
-/* Interval in seconds between LAN discovery packet sending. */
-#define LAN_DISCOVERY_INTERVAL 60
-#define PORT 33445
+    if (!write_cryptpacket(m->net_crypto, friend->crypt_connection_id, packet, length))
+        return -1;
 
-/* Send a LAN discovery packet every LAN_DISCOVERY_INTERVAL seconds. */
-static void LANdiscovery(Messenger *m)
-{
-    if (m->last_LANdiscovery + LAN_DISCOVERY_INTERVAL < unix_time()) {
-        send_LANdiscovery(htons(PORT), m->net_crypto);
-        m->last_LANdiscovery = unix_time();
-    }
+    friend->batch_length = 0;
+    timer_unset(&m->batch_timers, friendnumber);
+    return 0;
 }
 
-/* Run this at startup. */
-Messenger *initMessenger(void)
+/* Drop what is waiting in the batch of friendnumber, for when its connection is gone. */
+static void drop_batch(Messenger *m, int friendnumber)
 {
-    Messenger *m = calloc(1, sizeof(Messenger));
-
-    if ( ! m )
-        return NULL;
+    free(m->friendlist[friendnumber].batch);
+    m->friendlist[friendnumber].batch = NULL;
+    m->friendlist[friendnumber].batch_length = 0;
+    timer_unset(&m->batch_timers, friendnumber);
+}
 
-    IP ip;
-    ip.uint32 = 0;
-    m->net = new_networking(ip, PORT);
+/* Add packet to the batch of friendnumber, sending the batch first if packet doesn't fit.
+ * return 0 if it could not be added.
+ * return 1 if it was.
+ */
+static int batch_packet(Messenger *m, int friendnumber, uint8_t *packet, uint32_t length)
+{
+    Friend *friend = &m->friendlist[friendnumber];
 
-    if (m->net == NULL) {
-        free(m);
-        return NULL;
-    }
+    if (friend->batch_length + BATCH_ENTRY_HEADER + length > MAX_CRYPTPACKET_SIZE && flush_batch(m, friendnumber) == -1)
+        return 0;
 
-    m->net_crypto = new_net_crypto(m->net);
+    if (friend->batch == NULL) {
+        friend->batch = malloc(MAX_CRYPTPACKET_SIZE);
 
-    if (m->net_crypto == NULL) {
-        kill_networking(m->net);
-        free(m);
-        return NULL;
+        if (friend->batch == NULL)
+            return write_cryptpacket(m->net_crypto, friend->crypt_connection_id, packet, length);
     }
 
-    m->dht = new_DHT(m->net_crypto);
+    if (friend->batch_length == 0) {
+        if (timer_set(&m->batch_timers, friendnumber, current_time() + m->coalesce_time) == -1)
+            return write_cryptpacket(m->net_crypto, friend->crypt_connection_id, packet, length);
 
-    if (m->dht == NULL) {
-        kill_net_crypto(m->net_crypto);
-        kill_networking(m->net);
-        free(m);
-        return NULL;
+        friend->batch[0] = PACKET_ID_BATCH;
+        friend->batch_length = 1;
     }
 
-    new_keys(m->net_crypto);
-    m_set_statusmessage(m, (uint8_t *)"Online", sizeof("Online"));
-
-    friendreq_init(&(m->fr), m->net_crypto);
-    LANdiscovery_init(m->dht);
-    set_nospam(&(m->fr), random_int());
-
-    return m;
+    uint16_t temp = htons(length);
+    memcpy(friend->batch + friend->batch_length, &temp, sizeof(temp));
+    memcpy(friend->batch + friend->batch_length + BATCH_ENTRY_HEADER, packet, length);
+    friend->batch_length += BATCH_ENTRY_HEADER + length;
+    return 1;
 }
 
-/* Run this before closing shop. */
-void cleanupMessenger(Messenger *m)
+/* Send the batches whose time has come. */
+static void flush_batches(Messenger *m)
 {
-    /* FIXME TODO: ideally cleanupMessenger will mirror initMessenger.
-     * This requires the other modules to expose cleanup functions.
-     */
-    kill_DHT(m->dht);
-    kill_net_crypto(m->net_crypto);
-    kill_networking(m->net);
-    free(m->friendlist);
-    free(m);
+    uint64_t temp_time = current_time();
+    int friendnumber;
+
+    while ((friendnumber = timer_pop(&m->batch_timers, temp_time)) != -1) {
+        /* Try again later if the send queue is full. */
+        if (flush_batch(m, friendnumber) == -1)
+            timer_set(&m->batch_timers, friendnumber, temp_time + MAX(m->coalesce_time, SEND_RETRY_TIME));
+    }
 }
 
-/* TODO: Make this function not suck. */
-void doFriends(Messenger *m)
+void m_set_coalescing(Messenger *m, uint32_t latency)
 {
-    /* TODO: Add incoming connections and some other stuff. */
     uint32_t i;
-    int len;
-    uint8_t temp[MAX_DATA_SIZE];
-    uint64_t temp_time = unix_time();
 
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status == FRIEND_ADDED) {
-            int fr = send_friendrequest(m->dht, m->friendlist[i].client_id, m->friendlist[i].friendrequest_nospam,
-                                        m->friendlist[i].info,
-                                        m->friendlist[i].info_size);
-
-            if (fr >= 0) {
-                set_friend_status(m, i, FRIEND_REQUESTED);
-                m->friendlist[i].friendrequest_lastsent = temp_time;
-            }
-        }
+    m->coalesce_time = latency;
 
-        if (m->friendlist[i].status == FRIEND_REQUESTED
-                || m->friendlist[i].status == FRIEND_CONFIRMED) { /* friend is not online. */
-            if (m->friendlist[i].status == FRIEND_REQUESTED) {
-                /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
-                 * unsuccessful so we set the status back to FRIEND_ADDED and try again.
-                 */
-                if (m->friendlist[i].friendrequest_lastsent + m->friendlist[i].friendrequest_timeout < temp_time) {
-                    set_friend_status(m, i, FRIEND_ADDED);
-                    /* Double the default timeout everytime if friendrequest is assumed to have been
-                     * sent unsuccessfully.
-                     */
-                    m->friendlist[i].friendrequest_timeout *= 2;
-                }
-            }
+    if (latency != 0)
+        return;
 
-            IP_Port friendip = DHT_getfriendip(m->dht, m->friendlist[i].client_id);
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].batch_length != 0 && flush_batch(m, i) == -1)
+            timer_set(&m->batch_timers, i, current_time() + SEND_RETRY_TIME);
+    }
+}
 
-            switch (is_cryptoconnected(m->net_crypto, m->friendlist[i].crypt_connection_id)) {
-                case 0:
-                    if (friendip.ip.uint32 > 1)
-                        m->friendlist[i].crypt_connection_id = crypto_connect(m->net_crypto, m->friendlist[i].client_id, friendip);
+int write_cryptpacket_id(Messenger *m, int friendnumber, uint8_t packet_id, uint8_t *data, uint32_t length)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends)
+        return 0;
 
-                    break;
+    if (length >= MAX_DATA_SIZE || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return 0;
 
-                case 3: /* Connection is established. */
-                    set_friend_status(m, i, FRIEND_ONLINE);
-                    m->friendlist[i].name_sent = 0;
-                    m->friendlist[i].userstatus_sent = 0;
-                    m->friendlist[i].statusmessage_sent = 0;
-                    m->friendlist[i].ping_lastrecv = temp_time;
-                    break;
+    uint8_t packet[length + 1];
+    packet[0] = packet_id;
 
-                case 4:
-                    crypto_kill(m->net_crypto, m->friendlist[i].crypt_connection_id);
-                    m->friendlist[i].crypt_connection_id = -1;
-                    break;
+    if (length != 0)
+        memcpy(packet + 1, data, length);
 
-                default:
-                    break;
+    return write_friend_packet(m, friendnumber, packet, length + 1);
+}
+
+/* write_cryptpacket_id() for a packet that already starts with its id, friendnumber must be online.
+ * packet is only read, so the same one can be sent to several friends.
+ */
+static int write_friend_packet(Messenger *m, int friendnumber, uint8_t *packet, uint32_t length)
+{
+    if (m->coalesce_time != 0 && 1 + BATCH_ENTRY_HEADER + length <= MAX_CRYPTPACKET_SIZE)
+        return batch_packet(m, friendnumber, packet, length);
+
+    /* Keep the packets in order. */
+    if (flush_batch(m, friendnumber) == -1)
+        return 0;
+
+    return write_cryptpacket(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id, packet, length);
+}
+
+/* FILE SENDING AND RECEIVING */
+
+/* Most file data in one PACKET_ID_FILE_DATA packet, after the packet id and the file number. */
+#define MAX_FILE_DATA_SIZE (MAX_CRYPTPACKET_SIZE - 2)
+
+/* Send queue slots file data leaves free for the other packets. */
+#define FILE_QUEUE_RESERVE 4
+
+static void u64_to_bytes(uint8_t *bytes, uint64_t value)
+{
+    uint32_t temp = htonl(value >> 32);
+    memcpy(bytes, &temp, sizeof(temp));
+    temp = htonl(value);
+    memcpy(bytes + sizeof(temp), &temp, sizeof(temp));
+}
+
+static uint64_t bytes_to_u64(uint8_t *bytes)
+{
+    uint32_t high, low;
+    memcpy(&high, bytes, sizeof(high));
+    memcpy(&low, bytes + sizeof(high), sizeof(low));
+    return ((uint64_t)ntohl(high) << 32) | ntohl(low);
+}
+
+/* return the transfer of filenumber of friendnumber (send_receive as in file_control()).
+ * return NULL if there is no such transfer.
+ */
+static File_Transfer *get_transfer(Messenger *m, int friendnumber, uint8_t send_receive, uint8_t filenumber)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends || m->friendlist[friendnumber].files == NULL
+            || filenumber >= MAX_CONCURRENT_FILE_PIPES || send_receive > 1)
+        return NULL;
+
+    File_Transfers *files = m->friendlist[friendnumber].files;
+    File_Transfer *transfer = send_receive == 0 ? &files->sending[filenumber] : &files->receiving[filenumber];
+
+    if (transfer->status == FILESTATUS_NONE)
+        return NULL;
+
+    return transfer;
+}
+
+/* return the file transfers of friendnumber, allocated if needed.
+ * return NULL if out of memory.
+ */
+static File_Transfers *friend_files(Messenger *m, int friendnumber)
+{
+    if (m->friendlist[friendnumber].files == NULL)
+        m->friendlist[friendnumber].files = calloc(1, sizeof(File_Transfers));
+
+    return m->friendlist[friendnumber].files;
+}
+
+/* Tell the application about the end of the transfers of friendnumber, for when it goes offline. */
+static void kill_file_transfers(Messenger *m, int friendnumber)
+{
+    File_Transfers *files = m->friendlist[friendnumber].files;
+    uint32_t i, send_receive;
+
+    if (files == NULL)
+        return;
+
+    /* The callbacks can remove the friend, which must not free the transfers under us. */
+    m->friendlist[friendnumber].files = NULL;
+
+    for (send_receive = 0; send_receive < 2; ++send_receive) {
+        for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+            File_Transfer *transfer = send_receive == 0 ? &files->sending[i] : &files->receiving[i];
+
+            if (transfer->status == FILESTATUS_NONE)
+                continue;
+
+            transfer->status = FILESTATUS_NONE;
+
+            if (m->file_filecontrol)
+                (*m->file_filecontrol)(m, friendnumber, send_receive, i, FILECONTROL_KILL, NULL, 0,
+                                       m->file_filecontrol_userdata);
+        }
+    }
+
+    free(files);
+}
+
+int new_filesender(Messenger *m, int friendnumber, uint64_t filesize, uint8_t *filename, uint16_t filename_length)
+{
+    if (friendnumber < 0 || friendnumber >= m->numfriends || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return -1;
+
+    if (1 + sizeof(uint64_t) + filename_length > MAX_CRYPTPACKET_SIZE - 1)
+        return -1;
+
+    File_Transfers *files = friend_files(m, friendnumber);
+    uint32_t i;
+
+    if (files == NULL)
+        return -1;
+
+    for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        if (files->sending[i].status == FILESTATUS_NONE)
+            break;
+    }
+
+    if (i == MAX_CONCURRENT_FILE_PIPES)
+        return -1;
+
+    uint8_t packet[1 + sizeof(uint64_t) + filename_length];
+    packet[0] = i;
+    u64_to_bytes(packet + 1, filesize);
+    memcpy(packet + 1 + sizeof(uint64_t), filename, filename_length);
+
+    if (!write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_SENDREQUEST, packet, sizeof(packet)))
+        return -1;
+
+    File_Transfer *transfer = &files->sending[i];
+    memset(transfer, 0, sizeof(File_Transfer));
+    transfer->status = FILESTATUS_NOT_ACCEPTED;
+    transfer->size = filesize;
+    transfer->fd = -1;
+    return i;
+}
+
+int file_set_source(Messenger *m, int friendnumber, uint8_t filenumber, int fd, file_read_callback function,
+                    void *userdata)
+{
+    File_Transfer *transfer = get_transfer(m, friendnumber, 0, filenumber);
+
+    if (transfer == NULL || (fd == -1 && function == NULL))
+        return -1;
+
+    transfer->fd = fd;
+    transfer->read = function;
+    transfer->userdata = userdata;
+    wake_friend(m, friendnumber);
+    return 0;
+}
+
+/* Apply a FILECONTROL_* to transfer, send_receive as in file_control().
+ * by_sender is 1 if the file sender sent the control, 0 if the receiver did.
+ *  return 0 if the control is valid.
+ *  return -1 if not (nothing is changed).
+ */
+static int apply_file_control(File_Transfer *transfer, uint8_t by_sender, uint8_t message_id, uint8_t *data,
+                              uint16_t length)
+{
+    switch (message_id) {
+        case FILECONTROL_ACCEPT:
+
+            /* Only the receiver accepts a new file, from where it wants. */
+            if (transfer->status == FILESTATUS_NOT_ACCEPTED && by_sender)
+                return -1;
+
+            if (transfer->status != FILESTATUS_NOT_ACCEPTED && transfer->status != FILESTATUS_PAUSED)
+                return -1;
+
+            if (length == sizeof(uint64_t) && !by_sender) {
+                uint64_t position = bytes_to_u64(data);
+
+                if (position > transfer->size)
+                    return -1;
+
+                transfer->position = position;
+            } else if (length != 0) {
+                return -1;
             }
+
+            transfer->status = FILESTATUS_TRANSFERRING;
+            return 0;
+
+        case FILECONTROL_PAUSE:
+            if (transfer->status != FILESTATUS_TRANSFERRING)
+                return -1;
+
+            transfer->status = FILESTATUS_PAUSED;
+            return 0;
+
+        case FILECONTROL_KILL:
+            transfer->status = FILESTATUS_NONE;
+            return 0;
+
+        case FILECONTROL_FINISHED:
+            if (!by_sender)
+                return -1;
+
+            transfer->status = FILESTATUS_NONE;
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Send a control packet, send_receive is the one of the sender of the packet. */
+static int send_file_control(Messenger *m, int friendnumber, uint8_t send_receive, uint8_t filenumber,
+                             uint8_t message_id, uint8_t *data, uint16_t length)
+{
+    uint8_t packet[3 + length];
+    packet[0] = send_receive;
+    packet[1] = filenumber;
+    packet[2] = message_id;
+
+    if (length != 0)
+        memcpy(packet + 3, data, length);
+
+    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_CONTROL, packet, sizeof(packet));
+}
+
+int file_control(Messenger *m, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+                 uint8_t *data, uint16_t length)
+{
+    File_Transfer *transfer = get_transfer(m, friendnumber, send_receive, filenumber);
+
+    if (transfer == NULL || message_id == FILECONTROL_FINISHED || length > MAX_CRYPTPACKET_SIZE - 4)
+        return -1;
+
+    File_Transfer old = *transfer;
+
+    if (apply_file_control(transfer, send_receive == 0, message_id, data, length) == -1)
+        return -1;
+
+    if (!send_file_control(m, friendnumber, send_receive, filenumber, message_id, data, length)) {
+        *transfer = old;
+        return -1;
+    }
+
+    wake_friend(m, friendnumber);
+    return 0;
+}
+
+uint64_t file_dataremaining(Messenger *m, int friendnumber, uint8_t filenumber, uint8_t send_receive)
+{
+    File_Transfer *transfer = get_transfer(m, friendnumber, send_receive, filenumber);
+
+    if (transfer == NULL)
+        return 0;
+
+    return transfer->size - transfer->position;
+}
+
+void m_callback_file_sendrequest(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint64_t, uint8_t *,
+                                 uint16_t, void *), void *userdata)
+{
+    m->file_sendrequest = function;
+    m->file_sendrequest_userdata = userdata;
+}
+
+void m_callback_file_control(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint8_t, uint8_t, uint8_t *,
+                             uint16_t, void *), void *userdata)
+{
+    m->file_filecontrol = function;
+    m->file_filecontrol_userdata = userdata;
+}
+
+void m_callback_file_data(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint64_t, uint8_t *, uint16_t,
+                          void *), void *userdata)
+{
+    m->file_filedata = function;
+    m->file_filedata_userdata = userdata;
+}
+
+static void handle_file_sendrequest(Messenger *m, int friendnumber, uint8_t *data, int length)
+{
+    if (length < 1 + (int)sizeof(uint64_t) || data[0] >= MAX_CONCURRENT_FILE_PIPES)
+        return;
+
+    File_Transfers *files = friend_files(m, friendnumber);
+
+    if (files == NULL)
+        return;
+
+    /* A file number is only reused once the transfer it had is over. */
+    File_Transfer *transfer = &files->receiving[data[0]];
+    memset(transfer, 0, sizeof(File_Transfer));
+    transfer->status = FILESTATUS_NOT_ACCEPTED;
+    transfer->size = bytes_to_u64(data + 1);
+    transfer->fd = -1;
+
+    if (m->file_sendrequest)
+        (*m->file_sendrequest)(m, friendnumber, data[0], transfer->size, data + 1 + sizeof(uint64_t),
+                               length - 1 - sizeof(uint64_t), m->file_sendrequest_userdata);
+}
+
+static void handle_file_control(Messenger *m, int friendnumber, uint8_t *data, int length)
+{
+    if (length < 3)
+        return;
+
+    /* The friend sends the files we receive. */
+    uint8_t send_receive = data[0] == 0 ? 1 : 0;
+    File_Transfer *transfer = get_transfer(m, friendnumber, send_receive, data[1]);
+
+    if (transfer == NULL || apply_file_control(transfer, send_receive == 1, data[2], data + 3, length - 3) == -1)
+        return;
+
+    if (m->file_filecontrol)
+        (*m->file_filecontrol)(m, friendnumber, send_receive, data[1], data[2], data + 3, length - 3,
+                               m->file_filecontrol_userdata);
+}
+
+static void handle_file_data(Messenger *m, int friendnumber, uint8_t *data, int length)
+{
+    if (length < 2)
+        return;
+
+    File_Transfer *transfer = get_transfer(m, friendnumber, 1, data[0]);
+
+    /* What was sent before a pause still arrives while paused. */
+    if (transfer == NULL || transfer->status == FILESTATUS_NOT_ACCEPTED
+            || (uint64_t)(length - 1) > transfer->size - transfer->position)
+        return;
+
+    uint64_t position = transfer->position;
+    transfer->position += length - 1;
+
+    if (m->file_filedata)
+        (*m->file_filedata)(m, friendnumber, data[0], position, data + 1, length - 1, m->file_filedata_userdata);
+}
+
+/* Read length bytes of fd from position.
+ * return the number of bytes read.
+ * return -1 on error.
+ */
+static int read_fd(int fd, uint64_t position, uint8_t *data, uint16_t length)
+{
+#ifdef WIN32
+
+    if (_lseeki64(fd, position, SEEK_SET) == -1)
+        return -1;
+
+    return _read(fd, data, length);
+#else
+    return pread(fd, data, length, position);
+#endif
+}
+
+/* Send the next packet of transfer filenumber.
+ *  return 1 if it was sent or the transfer is over.
+ *  return 0 if there was nothing to send right now.
+ */
+static int send_file_packet(Messenger *m, int friendnumber, uint8_t filenumber)
+{
+    Friend *friend = &m->friendlist[friendnumber];
+    File_Transfer *transfer = &friend->files->sending[filenumber];
+    uint16_t length = MIN(MAX_FILE_DATA_SIZE, transfer->size - transfer->position);
+    int read = 0;
+
+    Packet_Buffer *buffer = NULL;
+
+    if (length != 0) {
+        buffer = new_cryptpacket_buffer(2 + length);
+
+        if (buffer == NULL)
+            return 0;
+
+        uint8_t *packet = packet_buffer_data(buffer);
+
+        if (transfer->fd != -1)
+            read = read_fd(transfer->fd, transfer->position, packet + 2, length);
+        else
+            read = transfer->read(m, friendnumber, filenumber, transfer->position, packet + 2, length, transfer->userdata);
+
+        if (read < 0 && transfer->fd == -1) {
+            packet_buffer_unref(buffer);
+            return 0;
+        }
+
+        if (read < 0) {
+            packet_buffer_unref(buffer);
+
+            if (!send_file_control(m, friendnumber, 0, filenumber, FILECONTROL_KILL, NULL, 0))
+                return 0;
+
+            transfer->status = FILESTATUS_NONE;
+
+            if (m->file_filecontrol)
+                (*m->file_filecontrol)(m, friendnumber, 0, filenumber, FILECONTROL_KILL, NULL, 0,
+                                       m->file_filecontrol_userdata);
+
+            return 1;
+        }
+
+        read = MIN(read, length);
+    }
+
+    if (read == 0) {
+        packet_buffer_unref(buffer);
+
+        if (!send_file_control(m, friendnumber, 0, filenumber, FILECONTROL_FINISHED, NULL, 0))
+            return 0;
+
+        transfer->status = FILESTATUS_NONE;
+
+        if (m->file_filecontrol)
+            (*m->file_filecontrol)(m, friendnumber, 0, filenumber, FILECONTROL_FINISHED, NULL, 0,
+                                   m->file_filecontrol_userdata);
+
+        return 1;
+    }
+
+    uint8_t *packet = packet_buffer_data(buffer);
+    packet[0] = PACKET_ID_FILE_DATA;
+    packet[1] = filenumber;
+    buffer->length = 2 + read;
+
+    /* Batched packets go first. */
+    int sent = flush_batch(m, friendnumber) == 0
+               && write_cryptpacket_buffer(m->net_crypto, friend->crypt_connection_id, buffer);
+    packet_buffer_unref(buffer);
+
+    if (!sent)
+        return 0;
+
+    transfer->position += read;
+    return 1;
+}
+
+/* Send file data to friendnumber while there is room in its send queue, a packet from each
+ * transferring file in turn.
+ */
+static void send_file_data(Messenger *m, int friendnumber)
+{
+    uint32_t skip = 0; /* Bit i is set once file i had nothing to send. */
+    uint32_t i;
+
+    if (m->friendlist[friendnumber].files == NULL)
+        return;
+
+    m->friendlist[friendnumber].files->retry = 0;
+
+    /* The file control callback can remove the friend or end its transfers. */
+    while (friendnumber < m->numfriends && m->friendlist[friendnumber].files != NULL
+            && crypto_sendqueue_room(m->net_crypto, m->friendlist[friendnumber].crypt_connection_id) > FILE_QUEUE_RESERVE) {
+        File_Transfers *files = m->friendlist[friendnumber].files;
+
+        for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+            uint8_t filenumber = (files->next + i) % MAX_CONCURRENT_FILE_PIPES;
+            File_Transfer *transfer = &files->sending[filenumber];
+
+            if (transfer->status == FILESTATUS_TRANSFERRING && (transfer->fd != -1 || transfer->read != NULL)
+                    && !(skip & (1U << filenumber)))
+                break;
+        }
+
+        if (i == MAX_CONCURRENT_FILE_PIPES)
+            return;
+
+        uint8_t filenumber = (files->next + i) % MAX_CONCURRENT_FILE_PIPES;
+        files->next = filenumber + 1;
+
+        if (send_file_packet(m, friendnumber, filenumber) == 0) {
+            skip |= 1U << filenumber;
+            files->retry = 1;
+        }
+    }
+}
+
+/* Interval in seconds between LAN discovery packet sending. */
+#define LAN_DISCOVERY_INTERVAL 60
+#define PORT 33445
+
+/* Send a LAN discovery packet every LAN_DISCOVERY_INTERVAL seconds. */
+static void LANdiscovery(Messenger *m)
+{
+    if (m->last_LANdiscovery + LAN_DISCOVERY_INTERVAL < unix_time()) {
+        send_LANdiscovery(htons(PORT), m->net_crypto);
+        m->last_LANdiscovery = unix_time();
+    }
+}
+
+/* Run this at startup. */
+Messenger *initMessenger(void)
+{
+    Messenger *m = calloc(1, sizeof(Messenger));
+
+    if ( ! m )
+        return NULL;
+
+    IP ip = {{0}}; /* ::, for a dual-stack socket. */
+    m->net = new_networking(ip, PORT);
+
+    if (m->net == NULL) {
+        free(m);
+        return NULL;
+    }
+
+    /* Packets sent during one doMessenger() go out together at the end of it. */
+    networking_set_batching(m->net, 1);
+
+    m->net_crypto = new_net_crypto(m->net);
+
+    if (m->net_crypto == NULL) {
+        kill_networking(m->net);
+        free(m);
+        return NULL;
+    }
+
+    m->dht = new_DHT(m->net_crypto);
+
+    if (m->dht == NULL) {
+        kill_net_crypto(m->net_crypto);
+        kill_networking(m->net);
+        free(m);
+        return NULL;
+    }
+
+    new_keys(m->net_crypto);
+    m_set_statusmessage(m, (uint8_t *)"Online", sizeof("Online"));
+
+    friendreq_init(&(m->fr), m->net_crypto);
+    LANdiscovery_init(m->dht);
+    set_nospam(&(m->fr), random_int());
+    key_index_init(&m->friend_keys);
+    timer_heap_init(&m->friend_timers);
+    timer_heap_init(&m->batch_timers);
+
+    return m;
+}
+
+/* Run this before closing shop. */
+void cleanupMessenger(Messenger *m)
+{
+    /* FIXME TODO: ideally cleanupMessenger will mirror initMessenger.
+     * This requires the other modules to expose cleanup functions.
+     */
+    kill_DHT(m->dht);
+    kill_net_crypto(m->net_crypto);
+    kill_networking(m->net);
+    friendreq_kill(&m->fr);
+    key_index_free(&m->friend_keys);
+    timer_heap_free(&m->friend_timers);
+    timer_heap_free(&m->batch_timers);
+
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        free(m->friendlist[i].batch);
+        free(m->friendlist[i].files);
+        free(m->friendlist[i].request);
+    }
+
+    realloc_friendlist(m, 0);
+    free_request_pool(m);
+    free(m->removed_friends);
+    free(m);
+}
+
+/* Seconds between doFriends() looks at a friend we are still looking for.
+ * Finding them depends on DHT and crypto state that has no deadline of its own.
+ */
+#define FRIEND_SEARCH_INTERVAL 1
+
+/* Make doFriends() look at the friend on its next run. */
+static void wake_friend(Messenger *m, int friendnumber)
+{
+    timer_set(&m->friend_timers, friendnumber, 0);
+}
+
+/* return 1 if some of our profile still has to be sent to the friend, 0 if not. */
+static int profile_pending(Messenger *m, Friend *friend)
+{
+    return (friend->name_sent == 0 && m->name_length != 0 && m->name_length <= MAX_NAME_LENGTH)
+           || friend->statusmessage_sent == 0 || friend->userstatus_sent == 0;
+}
+
+/* return the time (current_time()) at which doFriends() next has to look at the friend
+ * if nothing happens to its connection before.
+ */
+static uint64_t friend_next_run(Messenger *m, int friendnumber, uint64_t temp_time)
+{
+    Friend *friend = &m->friendlist[friendnumber];
+
+    if (friend->status != FRIEND_ONLINE)
+        return temp_time + FRIEND_SEARCH_INTERVAL * 1000000UL;
+
+    if (profile_pending(m, friend) || (friend->files != NULL && friend->files->retry))
+        return temp_time + SEND_RETRY_TIME;
+
+    uint64_t next = MIN(friend->ping_lastsent + FRIEND_PING_INTERVAL, friend->ping_lastrecv + FRIEND_CONNECTION_TIMEOUT);
+    return (next + 1) * 1000000UL;
+}
+
+/* Callbacks can remove friends and shrink the list, check i before looking at the friend. */
+static int friend_online(Messenger *m, int i)
+{
+    return i < m->numfriends && m->friendlist[i].status == FRIEND_ONLINE;
+}
+
+/* Handle a packet of length len received from friend i. */
+static void handle_packet(Messenger *m, int i, uint8_t *temp, int len, uint64_t temp_time)
+{
+    uint8_t packet_id = temp[0];
+    uint8_t *data = temp + 1;
+    int data_length = len - 1;
+
+    switch (packet_id) {
+        case PACKET_ID_PING: {
+            m->friendlist[i].ping_lastrecv = temp_time;
+            break;
+        }
+
+        case PACKET_ID_NICKNAME: {
+            if (data_length >= MAX_NAME_LENGTH || data_length == 0)
+                break;
+
+            if (m->friend_namechange)
+                m->friend_namechange(m, i, data, data_length, m->friend_namechange_userdata);
+
+            memcpy(m->friendlist[i].name, data, data_length);
+            m->friendlist[i].name[data_length - 1] = 0; /* Make sure the NULL terminator is present. */
+            break;
+        }
+
+        case PACKET_ID_STATUSMESSAGE: {
+            if (data_length == 0)
+                break;
+
+            uint8_t *status = calloc(MIN(data_length, MAX_STATUSMESSAGE_LENGTH), 1);
+            memcpy(status, data, MIN(data_length, MAX_STATUSMESSAGE_LENGTH));
+
+            if (m->friend_statusmessagechange)
+                m->friend_statusmessagechange(m, i, status, MIN(data_length, MAX_STATUSMESSAGE_LENGTH),
+                                              m->friend_statuschange_userdata);
+
+            set_friend_statusmessage(m, i, status, MIN(data_length, MAX_STATUSMESSAGE_LENGTH));
+            free(status);
+            break;
+        }
+
+        case PACKET_ID_USERSTATUS: {
+            if (data_length != 1)
+                break;
+
+            USERSTATUS status = data[0];
+
+            if (m->friend_userstatuschange)
+                m->friend_userstatuschange(m, i, status, m->friend_userstatuschange_userdata);
+
+            set_friend_userstatus(m, i, status);
+            break;
         }
 
-        while (m->friendlist[i].status == FRIEND_ONLINE) { /* friend is online. */
-            if (m->friendlist[i].name_sent == 0) {
-                if (m_sendname(m, i, m->name, m->name_length))
-                    m->friendlist[i].name_sent = 1;
-            }
+        case PACKET_ID_MESSAGE: {
+            uint8_t *message_id = data;
+            uint8_t message_id_length = 4;
+            uint8_t *message = data + message_id_length;
+            uint16_t message_length = data_length - message_id_length;
 
-            if (m->friendlist[i].statusmessage_sent == 0) {
-                if (send_statusmessage(m, i, m->statusmessage, m->statusmessage_length))
-                    m->friendlist[i].statusmessage_sent = 1;
+            if (m->friendlist[i].receives_read_receipts) {
+                write_cryptpacket_id(m, i, PACKET_ID_RECEIPT, message_id, message_id_length);
             }
 
-            if (m->friendlist[i].userstatus_sent == 0) {
-                if (send_userstatus(m, i, m->userstatus))
-                    m->friendlist[i].userstatus_sent = 1;
-            }
+            if (m->friend_message)
+                (*m->friend_message)(m, i, message, message_length, m->friend_message_userdata);
 
-            if (m->friendlist[i].ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
-                send_ping(m, i);
-            }
+            break;
+        }
+
+        case PACKET_ID_ACTION: {
+            if (m->friend_action)
+                (*m->friend_action)(m, i, data, data_length, m->friend_action_userdata);
 
-            len = read_cryptpacket(m->net_crypto, m->friendlist[i].crypt_connection_id, temp);
-            uint8_t packet_id = temp[0];
-            uint8_t *data = temp + 1;
-            int data_length = len - 1;
+            break;
+        }
 
-            if (len > 0) {
-                switch (packet_id) {
-                    case PACKET_ID_PING: {
-                        m->friendlist[i].ping_lastrecv = temp_time;
-                        break;
-                    }
+        case PACKET_ID_RECEIPT: {
+            uint32_t msgid;
 
-                    case PACKET_ID_NICKNAME: {
-                        if (data_length >= MAX_NAME_LENGTH || data_length == 0)
-                            break;
+            if (data_length < sizeof(msgid))
+                break;
 
-                        if (m->friend_namechange)
-                            m->friend_namechange(m, i, data, data_length, m->friend_namechange_userdata);
+            memcpy(&msgid, data, sizeof(msgid));
+            msgid = ntohl(msgid);
 
-                        memcpy(m->friendlist[i].name, data, data_length);
-                        m->friendlist[i].name[data_length - 1] = 0; /* Make sure the NULL terminator is present. */
-                        break;
-                    }
+            if (m->read_receipt)
+                (*m->read_receipt)(m, i, msgid, m->read_receipt_userdata);
 
-                    case PACKET_ID_STATUSMESSAGE: {
-                        if (data_length == 0)
-                            break;
+            break;
+        }
 
-                        uint8_t *status = calloc(MIN(data_length, MAX_STATUSMESSAGE_LENGTH), 1);
-                        memcpy(status, data, MIN(data_length, MAX_STATUSMESSAGE_LENGTH));
+        case PACKET_ID_FILE_SENDREQUEST: {
+            handle_file_sendrequest(m, i, data, data_length);
+            break;
+        }
 
-                        if (m->friend_statusmessagechange)
-                            m->friend_statusmessagechange(m, i, status, MIN(data_length, MAX_STATUSMESSAGE_LENGTH),
-                                                          m->friend_statuschange_userdata);
+        case PACKET_ID_FILE_CONTROL: {
+            handle_file_control(m, i, data, data_length);
+            break;
+        }
 
-                        set_friend_statusmessage(m, i, status, MIN(data_length, MAX_STATUSMESSAGE_LENGTH));
-                        free(status);
-                        break;
-                    }
+        case PACKET_ID_FILE_DATA: {
+            handle_file_data(m, i, data, data_length);
+            break;
+        }
 
-                    case PACKET_ID_USERSTATUS: {
-                        if (data_length != 1)
-                            break;
+        case PACKET_ID_BATCH: {
+            while (data_length >= BATCH_ENTRY_HEADER && friend_online(m, i)) {
+                uint16_t length;
+                memcpy(&length, data, sizeof(length));
+                length = ntohs(length);
 
-                        USERSTATUS status = data[0];
+                if (length == 0 || length > data_length - BATCH_ENTRY_HEADER)
+                    break;
 
-                        if (m->friend_userstatuschange)
-                            m->friend_userstatuschange(m, i, status, m->friend_userstatuschange_userdata);
+                /* Batches are not nested. */
+                if (data[BATCH_ENTRY_HEADER] != PACKET_ID_BATCH)
+                    handle_packet(m, i, data + BATCH_ENTRY_HEADER, length, temp_time);
 
-                        set_friend_userstatus(m, i, status);
-                        break;
-                    }
+                data += BATCH_ENTRY_HEADER + length;
+                data_length -= BATCH_ENTRY_HEADER + length;
+            }
 
-                    case PACKET_ID_MESSAGE: {
-                        uint8_t *message_id = data;
-                        uint8_t message_id_length = 4;
-                        uint8_t *message = data + message_id_length;
-                        uint16_t message_length = data_length - message_id_length;
+            break;
+        }
+    }
+}
 
-                        if (m->friendlist[i].receives_read_receipts) {
-                            write_cryptpacket_id(m, i, PACKET_ID_RECEIPT, message_id, message_id_length);
-                        }
+static void do_friend(Messenger *m, int i)
+{
+    int len;
+    uint8_t temp[MAX_DATA_SIZE];
+    uint64_t temp_time = unix_time();
 
-                        if (m->friend_message)
-                            (*m->friend_message)(m, i, message, message_length, m->friend_message_userdata);
+    Friend_Request *request = m->friendlist[i].request;
 
-                        break;
-                    }
+    if (m->friendlist[i].status == FRIEND_ADDED) {
+        int fr = send_friendrequest(m->dht, m->friendlist[i].client_id, m->friendlist[i].friendrequest_nospam,
+                                    request->info, request->info_size);
 
-                    case PACKET_ID_ACTION: {
-                        if (m->friend_action)
-                            (*m->friend_action)(m, i, data, data_length, m->friend_action_userdata);
+        if (fr >= 0) {
+            set_friend_status(m, i, FRIEND_REQUESTED);
+            request->friendrequest_lastsent = temp_time;
+        }
+    }
 
-                        break;
-                    }
+    if (m->friendlist[i].status == FRIEND_REQUESTED
+            || m->friendlist[i].status == FRIEND_CONFIRMED) { /* friend is not online. */
+        if (m->friendlist[i].status == FRIEND_REQUESTED) {
+            /* If we didn't connect to friend after successfully sending him a friend request the request is deemed
+             * unsuccessful so we set the status back to FRIEND_ADDED and try again.
+             */
+            if (request->friendrequest_lastsent + request->friendrequest_timeout < temp_time) {
+                set_friend_status(m, i, FRIEND_ADDED);
+                /* Double the default timeout everytime if friendrequest is assumed to have been
+                 * sent unsuccessfully.
+                 */
+                request->friendrequest_timeout *= 2;
+            }
+        }
 
-                    case PACKET_ID_RECEIPT: {
-                        uint32_t msgid;
+        IP_Port friendip = DHT_getfriendip(m->dht, m->friendlist[i].client_id);
 
-                        if (data_length < sizeof(msgid))
-                            break;
+        switch (is_cryptoconnected(m->net_crypto, m->friendlist[i].crypt_connection_id)) {
+            case 0:
+                if (ip_isset(friendip.ip) && !DHT_friendip_unknown(friendip))
+                    m->friendlist[i].crypt_connection_id = crypto_connect(m->net_crypto, m->friendlist[i].client_id, friendip);
 
-                        memcpy(&msgid, data, sizeof(msgid));
-                        msgid = ntohl(msgid);
+                break;
 
-                        if (m->read_receipt)
-                            (*m->read_receipt)(m, i, msgid, m->read_receipt_userdata);
+            case 3: /* Connection is established. */
+                set_friend_status(m, i, FRIEND_ONLINE);
+                m->friendlist[i].name_sent = 0;
+                m->friendlist[i].userstatus_sent = 0;
+                m->friendlist[i].statusmessage_sent = 0;
+                m->friendlist[i].ping_lastrecv = temp_time;
+                break;
 
-                        break;
-                    }
-                }
-            } else {
-                if (is_cryptoconnected(m->net_crypto,
-                                       m->friendlist[i].crypt_connection_id) == 4) { /* If the connection timed out, kill it. */
-                    crypto_kill(m->net_crypto, m->friendlist[i].crypt_connection_id);
-                    m->friendlist[i].crypt_connection_id = -1;
-                    set_friend_status(m, i, FRIEND_CONFIRMED);
-                }
+            case 4:
+                crypto_kill(m->net_crypto, m->friendlist[i].crypt_connection_id);
+                m->friendlist[i].crypt_connection_id = -1;
+                break;
 
+            default:
                 break;
-            }
+        }
+    }
+
+    while (friend_online(m, i)) { /* friend is online. */
+        send_profile(m, i);
+
+        if (m->friendlist[i].ping_lastsent + FRIEND_PING_INTERVAL < temp_time) {
+            send_ping(m, i);
+        }
+
+        len = read_cryptpacket(m->net_crypto, m->friendlist[i].crypt_connection_id, temp);
 
-            if (m->friendlist[i].ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
-                /* If we stopped recieving ping packets, kill it. */
+        if (len > 0) {
+            handle_packet(m, i, temp, len, temp_time);
+
+            if (!friend_online(m, i))
+                return;
+        } else if (len == -1) {
+            /* Discarded, there may be more behind it. */
+            continue;
+        } else {
+            if (is_cryptoconnected(m->net_crypto,
+                                   m->friendlist[i].crypt_connection_id) == 4) { /* If the connection timed out, kill it. */
                 crypto_kill(m->net_crypto, m->friendlist[i].crypt_connection_id);
                 m->friendlist[i].crypt_connection_id = -1;
                 set_friend_status(m, i, FRIEND_CONFIRMED);
             }
+
+            break;
+        }
+
+        if (m->friendlist[i].ping_lastrecv + FRIEND_CONNECTION_TIMEOUT < temp_time) {
+            /* If we stopped recieving ping packets, kill it. */
+            crypto_kill(m->net_crypto, m->friendlist[i].crypt_connection_id);
+            m->friendlist[i].crypt_connection_id = -1;
+            set_friend_status(m, i, FRIEND_CONFIRMED);
         }
     }
+
+    /* The application gets the room before the files. */
+    if (friend_online(m, i))
+        check_writable(m, i);
+
+    if (friend_online(m, i))
+        send_file_data(m, i);
+}
+
+/* Only the friends whose connection has news or whose timers are due are looked at. */
+void doFriends(Messenger *m)
+{
+    uint64_t temp_time = current_time();
+    int id;
+
+    while ((id = crypto_pop_ready(m->net_crypto)) != -1) {
+        int friendnumber = getfriend_id(m, m->net_crypto->crypto_connections[id].public_key);
+
+        if (friendnumber != -1 && m->friendlist[friendnumber].crypt_connection_id == id)
+            wake_friend(m, friendnumber);
+    }
+
+    while ((id = timer_pop(&m->friend_timers, temp_time)) != -1) {
+        do_friend(m, id);
+
+        /* Callbacks can remove friends. */
+        if (id < m->numfriends && m->friendlist[id].status != NOFRIEND)
+            timer_set(&m->friend_timers, id, MAX(friend_next_run(m, id, temp_time), temp_time + 1));
+    }
+
+    flush_batches(m);
 }
 
 void doInbound(Messenger *m)
@@ -902,66 +1928,427 @@ void doInbound(Messenger *m)
                 accept_crypto_inbound(m->net_crypto, inconnection, public_key, secret_nonce, session_key);
 
             set_friend_status(m, friend_id, FRIEND_CONFIRMED);
+
+            /* Callbacks can remove friends. */
+            if (friend_id < m->numfriends && m->friendlist[friend_id].status != NOFRIEND)
+                wake_friend(m, friend_id);
         }
     }
 }
 
+/* Record in tick how long phase took if timing is set, the next phase starts now. */
+static void end_phase(uint8_t timing, uint64_t *tick, uint32_t phase, uint64_t *start)
+{
+    if (!timing)
+        return;
+
+    uint64_t now = current_time();
+    tick[phase] = now - *start;
+    *start = now;
+}
+
+static void phases_done(Messenger *m, uint64_t *tick)
+{
+    uint64_t total = 0;
+    uint32_t i;
+
+    for (i = 0; i < MESSENGER_PHASES; ++i) {
+        m->phase_time[i] += tick[i];
+        total += tick[i];
+    }
+
+    ++m->phase_runs;
+
+    if (m->slow_tick_callback != NULL && total >= m->slow_tick)
+        m->slow_tick_callback(m, tick, m->slow_tick_userdata);
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void doMessenger(Messenger *m)
 {
+    uint8_t timing = m->phase_timing;
+    uint64_t tick[MESSENGER_PHASES];
+    uint64_t start = timing ? current_time() : 0;
+
     networking_poll(m->net);
+    end_phase(timing, tick, MESSENGER_PHASE_NETWORK, &start);
 
     do_DHT(m->dht);
-    do_net_crypto(m->net_crypto);
+    end_phase(timing, tick, MESSENGER_PHASE_DHT, &start);
+    do_lossless_udp(m->net_crypto->lossless_udp);
+    end_phase(timing, tick, MESSENGER_PHASE_LOSSLESS_UDP, &start);
+    do_net_crypto_connections(m->net_crypto);
+    end_phase(timing, tick, MESSENGER_PHASE_NET_CRYPTO, &start);
     doInbound(m);
+    end_phase(timing, tick, MESSENGER_PHASE_INBOUND, &start);
     doFriends(m);
+    end_phase(timing, tick, MESSENGER_PHASE_FRIENDS, &start);
     LANdiscovery(m);
+    end_phase(timing, tick, MESSENGER_PHASE_LAN_DISCOVERY, &start);
+
+    networking_flush(m->net);
+    end_phase(timing, tick, MESSENGER_PHASE_FLUSH, &start);
+
+    if (timing)
+        phases_done(m, tick);
+}
+
+void m_set_phase_timing(Messenger *m, uint8_t enable, uint32_t slow_tick,
+                        void (*function)(Messenger *m, uint64_t *, void *), void *userdata)
+{
+    m->phase_timing = enable;
+    m->slow_tick = slow_tick;
+    m->slow_tick_callback = function;
+    m->slow_tick_userdata = userdata;
+}
+
+uint64_t m_get_phase_times(Messenger *m, uint64_t *times)
+{
+    memcpy(times, m->phase_time, sizeof(m->phase_time));
+    return m->phase_runs;
+}
+
+/* return the number of milliseconds before doMessenger() has to be run again.
+ * Call it right after doMessenger().
+ */
+uint32_t doMessenger_interval(Messenger *m)
+{
+    uint64_t temp_time = unix_time();
+    uint64_t next = m->last_LANdiscovery + LAN_DISCOVERY_INTERVAL + 1;
+
+    next = MIN(next, DHT_next_run(m->dht));
+
+    if (next <= temp_time)
+        return 0;
+
+    uint64_t now = current_time();
+    uint64_t next_us = next * 1000000UL;
+
+    /* unix_time() can lag behind current_time() by a few ms, don't spin while it catches up. */
+    if (next_us <= now)
+        next_us = now + 1000;
+
+    next_us = MIN(next_us, lossless_udp_next_run(m->net_crypto->lossless_udp));
+    next_us = MIN(next_us, timer_next(&m->friend_timers));
+    next_us = MIN(next_us, timer_next(&m->batch_timers));
+
+    if (next_us <= now)
+        return 0;
+
+    return (next_us - now + 999) / 1000;
+}
+
+/* SAVING AND LOADING
+ *
+ * The saved data starts with a uint32_t 0 and MESSENGER_STATE_COOKIE_GLOBAL, followed by sections.
+ * A section is a uint32_t length, a uint16_t type and MESSENGER_STATE_COOKIE_TYPE then length
+ * bytes of data. Sections of types we don't know are skipped.
+ * The FRIENDS section holds friend records:
+ * [client_id][status][friendrequest_nospam][name length (uint16_t)][name][info length (uint16_t)][info]
+ * status is FRIEND_CONFIRMED, FRIEND_ADDED (friend request not accepted yet, only those have info)
+ * or NOFRIEND (removed friend). Later records of a friend replace earlier ones, which is how
+ * Messenger_save_changes() appends to the data.
+ * Numbers are in host byte order.
+ */
+#define MESSENGER_STATE_COOKIE_GLOBAL 0x15ed1b1e
+#define MESSENGER_STATE_COOKIE_TYPE   0x01ce
+
+#define MESSENGER_STATE_TYPE_KEYS     1 /* nospam, public key and secret key. */
+#define MESSENGER_STATE_TYPE_DHT      2 /* DHT_save() data. */
+#define MESSENGER_STATE_TYPE_FRIENDS  3
+#define MESSENGER_STATE_TYPE_NAME     4
+
+#define MESSENGER_STATE_HEADER_SIZE  (sizeof(uint32_t) * 2)
+#define MESSENGER_SECTION_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint16_t) * 2)
+#define FRIEND_RECORD_HEADER_SIZE (CLIENT_ID_SIZE + 1 + sizeof(uint32_t) + sizeof(uint16_t) * 2)
+
+/* Write the header of a section of type with length bytes of data.
+ * return a pointer to where the data goes.
+ */
+static uint8_t *save_section_header(uint8_t *data, uint16_t type, uint32_t length)
+{
+    uint16_t cookie = MESSENGER_STATE_COOKIE_TYPE;
+
+    memcpy(data, &length, sizeof(length));
+    memcpy(data + sizeof(length), &type, sizeof(type));
+    memcpy(data + sizeof(length) + sizeof(type), &cookie, sizeof(cookie));
+    return data + MESSENGER_SECTION_HEADER_SIZE;
+}
+
+/* return the length of the name of friend we save (up to its terminating zero). */
+static uint16_t friend_name_length(Friend *friend)
+{
+    uint8_t *end = memchr(friend->name, 0, MAX_NAME_LENGTH);
+    return end == NULL ? MAX_NAME_LENGTH : end - friend->name + 1;
+}
+
+/* return the size of the record of friend. */
+static uint32_t friend_record_size(Friend *friend)
+{
+    uint32_t size = FRIEND_RECORD_HEADER_SIZE + friend_name_length(friend);
+
+    if (friend->request != NULL)
+        size += friend->request->info_size;
+
+    return size;
+}
+
+/* Write the record of friend, or of a friend with client_id that was removed if friend is NULL.
+ * return a pointer to the byte after it.
+ */
+static uint8_t *save_friend_record(uint8_t *data, uint8_t *client_id, Friend *friend)
+{
+    uint8_t status = NOFRIEND;
+    uint32_t nospam = 0;
+    uint16_t name_length = 0, info_size = 0;
+
+    if (friend != NULL) {
+        status = friend->status >= FRIEND_CONFIRMED ? FRIEND_CONFIRMED : FRIEND_ADDED;
+        nospam = friend->friendrequest_nospam;
+        name_length = friend_name_length(friend);
+        info_size = friend->request != NULL ? friend->request->info_size : 0;
+    }
+
+    memcpy(data, client_id, CLIENT_ID_SIZE);
+    data += CLIENT_ID_SIZE;
+    *data++ = status;
+    memcpy(data, &nospam, sizeof(nospam));
+    data += sizeof(nospam);
+    memcpy(data, &name_length, sizeof(name_length));
+    data += sizeof(name_length);
+
+    if (name_length != 0)
+        memcpy(data, friend->name, name_length);
+
+    data += name_length;
+    memcpy(data, &info_size, sizeof(info_size));
+    data += sizeof(info_size);
+
+    if (info_size != 0)
+        memcpy(data, friend->request->info, info_size);
+
+    return data + info_size;
+}
+
+/* Forget the friend changes, they are saved. */
+static void clear_friend_changes(Messenger *m)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i)
+        m->friendlist[i].changed = 0;
+
+    free(m->removed_friends);
+    m->removed_friends = NULL;
+    m->num_removed_friends = 0;
+}
+
+/* return the size of the FRIENDS section with all our friends. */
+static uint32_t friends_section_size(Messenger *m)
+{
+    uint32_t i, size = 0;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].status != NOFRIEND)
+            size += friend_record_size(&m->friendlist[i]);
+    }
+
+    return size;
 }
 
 /* return the size of the messenger data (for saving) */
 uint32_t Messenger_size(Messenger *m)
 {
-    return crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES
-           + sizeof(uint32_t)                  // nospam.
-           + sizeof(uint32_t)                  // DHT size.
-           + DHT_size(m->dht)                  // DHT itself.
-           + sizeof(uint32_t)                  // Friendlist size.
-           + sizeof(Friend) * m->numfriends    // Friendlist itself.
-           + sizeof(uint16_t)                  // Own nickname length.
-           + m->name_length                    // Own nickname.
+    return MESSENGER_STATE_HEADER_SIZE
+           + MESSENGER_SECTION_HEADER_SIZE + sizeof(uint32_t) + crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES
+           + MESSENGER_SECTION_HEADER_SIZE + DHT_size(m->dht)
+           + MESSENGER_SECTION_HEADER_SIZE + friends_section_size(m)
+           + MESSENGER_SECTION_HEADER_SIZE + m->name_length
            ;
 }
 
 /* Save the messenger in data of size Messenger_size(). */
 void Messenger_save(Messenger *m, uint8_t *data)
 {
-    save_keys(m->net_crypto, data);
-    data += crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES;
+    uint32_t i, size, cookie = MESSENGER_STATE_COOKIE_GLOBAL;
+
+    memset(data, 0, sizeof(uint32_t));
+    memcpy(data + sizeof(uint32_t), &cookie, sizeof(cookie));
+    data += MESSENGER_STATE_HEADER_SIZE;
+
     uint32_t nospam = get_nospam(&(m->fr));
+    data = save_section_header(data, MESSENGER_STATE_TYPE_KEYS,
+                               sizeof(nospam) + crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES);
     memcpy(data, &nospam, sizeof(nospam));
-    data += sizeof(nospam);
-    uint32_t size = DHT_size(m->dht);
-    memcpy(data, &size, sizeof(size));
-    data += sizeof(size);
+    save_keys(m->net_crypto, data + sizeof(nospam));
+    data += sizeof(nospam) + crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES;
+
+    size = DHT_size(m->dht);
+    data = save_section_header(data, MESSENGER_STATE_TYPE_DHT, size);
     DHT_save(m->dht, data);
     data += size;
-    size = sizeof(Friend) * m->numfriends;
-    memcpy(data, &size, sizeof(size));
-    data += sizeof(size);
-    memcpy(data, m->friendlist, sizeof(Friend) * m->numfriends);
-    data += size;
-    uint16_t small_size = m->name_length;
-    memcpy(data, &small_size, sizeof(small_size));
-    data += sizeof(small_size);
-    memcpy(data, m->name, small_size);
+
+    data = save_section_header(data, MESSENGER_STATE_TYPE_FRIENDS, friends_section_size(m));
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].status != NOFRIEND)
+            data = save_friend_record(data, m->friendlist[i].client_id, &m->friendlist[i]);
+    }
+
+    data = save_section_header(data, MESSENGER_STATE_TYPE_NAME, m->name_length);
+    memcpy(data, m->name, m->name_length);
+
+    clear_friend_changes(m);
 }
 
-/* Load the messenger from data of size length. */
-int Messenger_load(Messenger *m, uint8_t *data, uint32_t length)
+/* return the size of the FRIENDS section with the friend changes. */
+static uint32_t changes_section_size(Messenger *m)
 {
-    if (length == ~0)
-        return -1;
+    uint32_t i, size = m->num_removed_friends * FRIEND_RECORD_HEADER_SIZE;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].changed && m->friendlist[i].status != NOFRIEND)
+            size += friend_record_size(&m->friendlist[i]);
+    }
+
+    return size;
+}
+
+uint32_t Messenger_changes_size(Messenger *m)
+{
+    uint32_t size = changes_section_size(m);
+
+    if (size == 0)
+        return 0;
+
+    return MESSENGER_SECTION_HEADER_SIZE + size;
+}
+
+void Messenger_save_changes(Messenger *m, uint8_t *data)
+{
+    uint32_t i, size = changes_section_size(m);
+
+    if (size == 0)
+        return;
+
+    data = save_section_header(data, MESSENGER_STATE_TYPE_FRIENDS, size);
+
+    /* Removals first: a friend removed and added again has both. */
+    for (i = 0; i < m->num_removed_friends; ++i)
+        data = save_friend_record(data, m->removed_friends[i], NULL);
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].changed && m->friendlist[i].status != NOFRIEND)
+            data = save_friend_record(data, m->friendlist[i].client_id, &m->friendlist[i]);
+    }
+
+    clear_friend_changes(m);
+}
+
+/* Add the friend with client_id that we sent a friend request to with info. */
+static int load_requested_friend(Messenger *m, uint8_t *client_id, uint32_t nospam, uint8_t *info, uint16_t info_size)
+{
+    /* TODO: This is not a good way to do this. */
+    uint8_t address[FRIEND_ADDRESS_SIZE];
+    memcpy(address, client_id, crypto_box_PUBLICKEYBYTES);
+    memcpy(address + crypto_box_PUBLICKEYBYTES, &nospam, sizeof(uint32_t));
+    uint16_t checksum = address_checksum(address, FRIEND_ADDRESS_SIZE - sizeof(checksum));
+    memcpy(address + crypto_box_PUBLICKEYBYTES + sizeof(uint32_t), &checksum, sizeof(checksum));
+    return m_addfriend(m, address, info, info_size);
+}
+
+/* Apply the friend records of a FRIENDS section.
+ * return 0 on success.
+ * return -1 if the section is malformed.
+ */
+static int load_friends(Messenger *m, uint8_t *data, uint32_t length)
+{
+    while (length != 0) {
+        uint8_t *client_id = data, status;
+        uint32_t nospam;
+        uint16_t name_length, info_size;
+        uint8_t name[MAX_NAME_LENGTH] = {0};
+
+        if (length < FRIEND_RECORD_HEADER_SIZE)
+            return -1;
+
+        status = data[CLIENT_ID_SIZE];
+        memcpy(&nospam, data + CLIENT_ID_SIZE + 1, sizeof(nospam));
+        memcpy(&name_length, data + CLIENT_ID_SIZE + 1 + sizeof(nospam), sizeof(name_length));
+
+        if (name_length > MAX_NAME_LENGTH || length < FRIEND_RECORD_HEADER_SIZE + name_length)
+            return -1;
+
+        uint8_t *record_name = data + CLIENT_ID_SIZE + 1 + sizeof(nospam) + sizeof(name_length);
+        memcpy(&info_size, record_name + name_length, sizeof(info_size));
+        uint8_t *info = record_name + name_length + sizeof(info_size);
+
+        if (info_size > MAX_DATA_SIZE || length < FRIEND_RECORD_HEADER_SIZE + name_length + info_size)
+            return -1;
+
+        if (name_length != 0)
+            memcpy(name, record_name, name_length);
+
+        int friendnumber = getfriend_id(m, client_id);
+
+        if (status == NOFRIEND) {
+            if (friendnumber != -1)
+                m_delfriend(m, friendnumber);
+        } else if (friendnumber == -1) {
+            if (status == FRIEND_CONFIRMED)
+                friendnumber = m_addfriend_norequest(m, client_id);
+            else
+                friendnumber = load_requested_friend(m, client_id, nospam, info, info_size);
+
+            setfriendname(m, friendnumber, name);
+        } else {
+            Friend *friend = &m->friendlist[friendnumber];
+
+            if (status == FRIEND_CONFIRMED && friend->status < FRIEND_CONFIRMED)
+                set_friend_status(m, friendnumber, FRIEND_CONFIRMED);
+
+            if (status != FRIEND_CONFIRMED && friend->request != NULL) {
+                friend->friendrequest_nospam = nospam;
+                memcpy(friend->request->info, info, info_size);
+                friend->request->info_size = info_size;
+            }
+
+            setfriendname(m, friendnumber, name);
+        }
+
+        data += FRIEND_RECORD_HEADER_SIZE + name_length + info_size;
+        length -= FRIEND_RECORD_HEADER_SIZE + name_length + info_size;
+    }
+
+    return 0;
+}
 
+/* Friend as versions before the sections saved it, all of the struct. */
+typedef struct {
+    uint8_t client_id[CLIENT_ID_SIZE];
+    int crypt_connection_id;
+    uint64_t friendrequest_lastsent;
+    uint32_t friendrequest_timeout;
+    uint8_t status;
+    uint8_t info[MAX_DATA_SIZE];
+    uint8_t name[MAX_NAME_LENGTH];
+    uint8_t name_sent;
+    uint8_t *statusmessage;
+    uint16_t statusmessage_length;
+    uint8_t statusmessage_sent;
+    USERSTATUS userstatus;
+    uint8_t userstatus_sent;
+    uint16_t info_size;
+    uint32_t message_id;
+    uint8_t receives_read_receipts;
+    uint32_t friendrequest_nospam;
+    uint64_t ping_lastrecv;
+    uint64_t ping_lastsent;
+} Old_Friend;
+
+/* Load data saved by versions before the sections. */
+static int load_old(Messenger *m, uint8_t *data, uint32_t length)
+{
     if (length < crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES + sizeof(uint32_t) * 3)
         return -1;
 
@@ -988,13 +2375,13 @@ int Messenger_load(Messenger *m, uint8_t *data, uint32_t length)
     memcpy(&size, data, sizeof(size));
     data += sizeof(size);
 
-    if (length < size || size % sizeof(Friend) != 0)
+    if (length < size || size % sizeof(Old_Friend) != 0)
         return -1;
 
-    Friend *temp = malloc(size);
+    Old_Friend *temp = malloc(size);
     memcpy(temp, data, size);
 
-    uint16_t num = size / sizeof(Friend);
+    uint16_t num = size / sizeof(Old_Friend);
 
     uint32_t i;
 
@@ -1004,13 +2391,7 @@ int Messenger_load(Messenger *m, uint8_t *data, uint32_t length)
             setfriendname(m, fnum, temp[i].name);
             /* set_friend_statusmessage(fnum, temp[i].statusmessage, temp[i].statusmessage_length); */
         } else if (temp[i].status != 0) {
-            /* TODO: This is not a good way to do this. */
-            uint8_t address[FRIEND_ADDRESS_SIZE];
-            memcpy(address, temp[i].client_id, crypto_box_PUBLICKEYBYTES);
-            memcpy(address + crypto_box_PUBLICKEYBYTES, &(temp[i].friendrequest_nospam), sizeof(uint32_t));
-            uint16_t checksum = address_checksum(address, FRIEND_ADDRESS_SIZE - sizeof(checksum));
-            memcpy(address + crypto_box_PUBLICKEYBYTES + sizeof(uint32_t), &checksum, sizeof(checksum));
-            m_addfriend(m, address, temp[i].info, temp[i].info_size);
+            load_requested_friend(m, temp[i].client_id, temp[i].friendrequest_nospam, temp[i].info, temp[i].info_size);
         }
     }
 
@@ -1034,3 +2415,85 @@ int Messenger_load(Messenger *m, uint8_t *data, uint32_t length)
 
     return 0;
 }
+
+/* Load the messenger from data of size length. */
+int Messenger_load(Messenger *m, uint8_t *data, uint32_t length)
+{
+    uint32_t cookie[2];
+
+    if (length == ~0)
+        return -1;
+
+    if (length < MESSENGER_STATE_HEADER_SIZE)
+        return -1;
+
+    memcpy(cookie, data, sizeof(cookie));
+
+    if (cookie[0] != 0 || cookie[1] != MESSENGER_STATE_COOKIE_GLOBAL) {
+        int ret = load_old(m, data, length);
+        clear_friend_changes(m);
+        return ret;
+    }
+
+    data += MESSENGER_STATE_HEADER_SIZE;
+    length -= MESSENGER_STATE_HEADER_SIZE;
+
+    while (length != 0) {
+        uint32_t size;
+        uint16_t type, type_cookie;
+
+        if (length < MESSENGER_SECTION_HEADER_SIZE)
+            return -1;
+
+        memcpy(&size, data, sizeof(size));
+        memcpy(&type, data + sizeof(size), sizeof(type));
+        memcpy(&type_cookie, data + sizeof(size) + sizeof(type), sizeof(type_cookie));
+        data += MESSENGER_SECTION_HEADER_SIZE;
+        length -= MESSENGER_SECTION_HEADER_SIZE;
+
+        if (type_cookie != MESSENGER_STATE_COOKIE_TYPE || size > length)
+            return -1;
+
+        switch (type) {
+            case MESSENGER_STATE_TYPE_KEYS: {
+                uint32_t nospam;
+
+                if (size != sizeof(nospam) + crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES)
+                    return -1;
+
+                memcpy(&nospam, data, sizeof(nospam));
+                set_nospam(&(m->fr), nospam);
+                load_keys(m->net_crypto, data + sizeof(nospam));
+                break;
+            }
+
+            case MESSENGER_STATE_TYPE_DHT:
+                if (DHT_load(m->dht, data, size) == -1)
+                    return -1;
+
+                break;
+
+            case MESSENGER_STATE_TYPE_FRIENDS:
+                if (load_friends(m, data, size) == -1)
+                    return -1;
+
+                break;
+
+            case MESSENGER_STATE_TYPE_NAME:
+                if (size != 0)
+                    setname(m, data, size);
+
+                break;
+
+            default:
+                break;
+        }
+
+        data += size;
+        length -= size;
+    }
+
+    /* What we loaded is saved already. */
+    clear_friend_changes(m);
+    return 0;
+}
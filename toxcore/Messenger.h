@@ -43,6 +43,10 @@
 #define PACKET_ID_RECEIPT 65
 #define PACKET_ID_MESSAGE 64
 #define PACKET_ID_ACTION 63
+#define PACKET_ID_BATCH 66 /* Packets of the kinds above put together, see m_set_coalescing(). */
+#define PACKET_ID_FILE_SENDREQUEST 80
+#define PACKET_ID_FILE_CONTROL 81
+#define PACKET_ID_FILE_DATA 82
 
 
 /* Status definitions. */
@@ -93,28 +97,100 @@ typedef enum {
 }
 USERSTATUS;
 
+/* Files sent and received at the same time with each friend. */
+#define MAX_CONCURRENT_FILE_PIPES 16
+
+/* message_id of file_control(). */
+enum {
+    FILECONTROL_ACCEPT, /* Start, or resume after a pause. */
+    FILECONTROL_PAUSE,
+    FILECONTROL_KILL,
+    FILECONTROL_FINISHED /* Sent by Messenger once all of a file was sent. */
+};
+
+/* Status of a file transfer. */
+enum {
+    FILESTATUS_NONE,
+    FILESTATUS_NOT_ACCEPTED,
+    FILESTATUS_TRANSFERRING,
+    FILESTATUS_PAUSED
+};
+
+struct Messenger;
+
+/* Where the data of a file we send comes from, see file_set_source(). */
+typedef int (*file_read_callback)(struct Messenger *m, int friendnumber, uint8_t filenumber, uint64_t position,
+                                  uint8_t *data, uint16_t length, void *userdata);
+
+typedef struct {
+    uint8_t status;
+    uint64_t size;
+    uint64_t position; /* Bytes sent or received so far, with the ones skipped by an accept offset. */
+    int fd; /* -1 if the data doesn't come from a file descriptor. */
+    file_read_callback read;
+    void *userdata;
+} File_Transfer;
+
+typedef struct {
+    File_Transfer sending[MAX_CONCURRENT_FILE_PIPES];
+    File_Transfer receiving[MAX_CONCURRENT_FILE_PIPES];
+    uint8_t next; /* The sending file that gets the next packet. */
+    uint8_t retry; /* 1 if some data could not be read or sent although there was room. */
+} File_Transfers;
+
+/* What we only need of a friend until it accepts our friend request, see Friend.request. */
 typedef struct {
-    uint8_t client_id[CLIENT_ID_SIZE];
-    int crypt_connection_id;
     uint64_t friendrequest_lastsent; // Time at which the last friend request was sent.
     uint32_t friendrequest_timeout; // The timeout between successful friendrequest sending attempts.
-    uint8_t status; // 0 if no friend, 1 if added, 2 if friend request sent, 3 if confirmed friend, 4 if online.
+    uint16_t info_size; // Length of the info.
     uint8_t info[MAX_DATA_SIZE]; // the data that is sent during the friend requests we do.
-    uint8_t name[MAX_NAME_LENGTH];
+} Friend_Request;
+
+/* Most Friend_Request records a Messenger keeps for reuse. */
+#define FRIEND_REQUEST_POOL_MAX 16
+
+/* The fields doFriends() looks at come first, what is only needed when the friend sends us something
+ * or when saving comes last.
+ */
+typedef struct {
+    uint8_t client_id[CLIENT_ID_SIZE];
+    int crypt_connection_id;
+    uint8_t status; // 0 if no friend, 1 if added, 2 if friend request sent, 3 if confirmed friend, 4 if online.
     uint8_t name_sent; // 0 if we didn't send our name to this friend 1 if we have.
-    uint8_t *statusmessage;
-    uint16_t statusmessage_length;
     uint8_t statusmessage_sent;
-    USERSTATUS userstatus;
     uint8_t userstatus_sent;
-    uint16_t info_size; // Length of the info.
+    uint8_t send_blocked; // 1 if a message or action was refused since the friend was last writable.
+    uint16_t batch_length; // 0 if nothing is waiting in batch.
+    uint64_t ping_lastrecv;
+    uint64_t ping_lastsent;
+    uint32_t send_low; // Watermarks of the send queue, see m_set_send_watermarks().
+    uint32_t send_high;
+    uint8_t *batch; // PACKET_ID_BATCH packet being filled, allocated when coalescing first needs it.
+    File_Transfers *files; // Allocated by the first file transfer with this friend.
+    Friend_Request *request; // Set while status is FRIEND_ADDED or FRIEND_REQUESTED.
     uint32_t message_id; // a semi-unique id used in read receipts.
     uint8_t receives_read_receipts; // shall we send read receipts to this person?
+    uint8_t changed; // 1 if what we save of this friend changed since the last save.
+    USERSTATUS userstatus;
     uint32_t friendrequest_nospam; // The nospam number used in the friend request.
-    uint64_t ping_lastrecv;
-    uint64_t ping_lastsent;
+    uint8_t *statusmessage;
+    uint16_t statusmessage_length;
+    uint8_t name[MAX_NAME_LENGTH];
 } Friend;
 
+/* Phases of doMessenger(), see m_set_phase_timing(). */
+enum {
+    MESSENGER_PHASE_NETWORK, /* networking_poll() */
+    MESSENGER_PHASE_DHT,
+    MESSENGER_PHASE_LOSSLESS_UDP,
+    MESSENGER_PHASE_NET_CRYPTO, /* do_net_crypto_connections() */
+    MESSENGER_PHASE_INBOUND,
+    MESSENGER_PHASE_FRIENDS,
+    MESSENGER_PHASE_LAN_DISCOVERY,
+    MESSENGER_PHASE_FLUSH,
+    MESSENGER_PHASES
+};
+
 typedef struct Messenger {
 
     Networking_Core *net;
@@ -131,9 +207,30 @@ typedef struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    uint32_t friendlist_capacity; /* Allocated length of friendlist. */
+    uint32_t friendlist_free; /* Every friend below this index is in use. */
+
+    /* Friend_Request records of confirmed or removed friends, linked through their first bytes. */
+    Friend_Request *request_pool;
+    uint32_t request_pool_num;
+
+    /* Index of friendlist by client_id. */
+    Key_Index friend_keys;
+
+    /* When doFriends() next has to look at each friend (current_time()), keyed by friend number. */
+    Timer_Heap friend_timers;
+
+    /* client_id of the friends removed since the last save, see Messenger_save_changes(). */
+    uint8_t (*removed_friends)[CLIENT_ID_SIZE];
+    uint32_t num_removed_friends;
 
     uint64_t last_LANdiscovery;
 
+    /* Microseconds a packet may wait for others to be sent with, 0 to send them right away. */
+    uint32_t coalesce_time;
+    /* When the batch of each friend has to be sent (current_time()), keyed by friend number. */
+    Timer_Heap batch_timers;
+
     void (*friend_message)(struct Messenger *m, int, uint8_t *, uint16_t, void *);
     void *friend_message_userdata;
     void (*friend_action)(struct Messenger *m, int, uint8_t *, uint16_t, void *);
@@ -150,8 +247,25 @@ typedef struct Messenger {
     void *friend_statuschange_userdata;
     void (*friend_connectionstatuschange)(struct Messenger *m, int, uint8_t, void *);
     void *friend_connectionstatuschange_userdata;
-
-
+    void (*friend_writable)(struct Messenger *m, int, void *);
+    void *friend_writable_userdata;
+    void (*file_sendrequest)(struct Messenger *m, int, uint8_t, uint64_t, uint8_t *, uint16_t, void *);
+    void *file_sendrequest_userdata;
+    void (*file_filecontrol)(struct Messenger *m, int, uint8_t, uint8_t, uint8_t, uint8_t *, uint16_t, void *);
+    void *file_filecontrol_userdata;
+    void (*file_filedata)(struct Messenger *m, int, uint8_t, uint64_t, uint8_t *, uint16_t, void *);
+    void *file_filedata_userdata;
+
+    /* Network thread, NULL until tox_start_thread() (see tox_thread.h). */
+    void *thread;
+
+    /* doMessenger() takes no timestamps unless phase_timing is set. */
+    uint8_t phase_timing;
+    uint64_t phase_time[MESSENGER_PHASES]; /* Microseconds spent in each phase. */
+    uint64_t phase_runs;
+    uint32_t slow_tick; /* Microseconds. */
+    void (*slow_tick_callback)(struct Messenger *m, uint64_t *, void *);
+    void *slow_tick_userdata;
 } Messenger;
 
 /*
@@ -227,6 +341,22 @@ uint32_t m_sendmessage_withid(Messenger *m, int friendnumber, uint32_t theid, ui
  */
 int m_sendaction(Messenger *m, int friendnumber, uint8_t *action, uint32_t length);
 
+/* Send the same text chat message to the num friends in friendnumbers.
+ * The packet is built once, only its message id changes from one friend to the next, and each
+ * friend gets it as if m_sendmessage() had been called for it (watermarks, coalescing).
+ *  ids[i] is set to the message id sent to friendnumbers[i], 0 if it was not put into its send queue.
+ *  return the number of friends it was put into the send queue of.
+ */
+uint32_t m_sendmessage_multi(Messenger *m, int *friendnumbers, uint32_t num, uint8_t *message, uint32_t length,
+                             uint32_t *ids);
+
+/* Same as m_sendmessage_multi() for an action.
+ *  accepted[i] is set to 1 if it was put into the send queue of friendnumbers[i], 0 if not.
+ *  return the number of friends it was put into the send queue of.
+ */
+uint32_t m_sendaction_multi(Messenger *m, int *friendnumbers, uint32_t num, uint8_t *action, uint32_t length,
+                            uint8_t *accepted);
+
 /* Set our nickname.
  * name must be a string of maximum MAX_NAME_LENGTH length.
  * length must be at least 1 byte.
@@ -347,6 +477,24 @@ void m_callback_read_receipt(Messenger *m, void (*function)(Messenger *m, int, u
  */
 void m_callback_connectionstatus(Messenger *m, void (*function)(Messenger *m, int, uint8_t, void *), void *userdata);
 
+/* Set when m_sendmessage() and m_sendaction() to friendnumber start failing, and when they work again.
+ * They fail once high packets wait in the friend's send queue (0, the default, for when it is
+ * full). After one failed, the writable callback is called as soon as no more than low
+ * packets wait (0, the default, for half the queue).
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int m_set_send_watermarks(Messenger *m, int friendnumber, uint32_t low, uint32_t high);
+
+/* return the number of packets waiting in the send queue of friendnumber to be received. */
+uint32_t m_sendqueue(Messenger *m, int friendnumber);
+
+/* Set the callback for when a friend whose send queue refused a message or an action can be
+ * sent to again, so that a producer can wait for it instead of retrying.
+ *  function(Messenger *m, int friendnumber, void *userdata)
+ */
+void m_callback_writable(Messenger *m, void (*function)(Messenger *m, int, void *), void *userdata);
+
 /* Run this at startup.
  *  returns allocated instance of Messenger on success.
  *  returns 0 if there are problems.
@@ -361,6 +509,101 @@ void cleanupMessenger(Messenger *M);
 /* The main loop that needs to be run at least 20 times per second. */
 void doMessenger(Messenger *m);
 
+/* return the number of milliseconds before doMessenger() has to be run again.
+ * Call it right after doMessenger(), then wait at most that long on m->net->sock.
+ */
+uint32_t doMessenger_interval(Messenger *m);
+
+/* Time the phases of doMessenger() (enable 1) or stop (enable 0).
+ * When a doMessenger() run takes slow_tick microseconds or more, function is called at its end
+ * with the microseconds each phase took in that run (MESSENGER_PHASES of them).
+ * It is called from the thread running doMessenger() and must not call back into m.
+ * function can be NULL.
+ */
+void m_set_phase_timing(Messenger *m, uint8_t enable, uint32_t slow_tick,
+                        void (*function)(Messenger *m, uint64_t *, void *), void *userdata);
+
+/* Copy the microseconds spent in each phase of doMessenger() while timing was on to times
+ * (MESSENGER_PHASES of them).
+ *  return the number of timed runs.
+ */
+uint64_t m_get_phase_times(Messenger *m, uint64_t *times);
+
+/* Let the packets sent to a friend (messages, actions, receipts, pings and status updates)
+ * wait up to latency microseconds so that the ones sent in that time go out as one
+ * PACKET_ID_BATCH packet: one encryption, header and sequence number for all of them.
+ * 0 (the default) sends every packet on its own and sends what is waiting now.
+ * Friends running a version that doesn't know PACKET_ID_BATCH drop the batched packets, only
+ * turn it on when they all understand it.
+ */
+void m_set_coalescing(Messenger *m, uint32_t latency);
+
+/* FILE SENDING AND RECEIVING
+ *
+ * Files go through their own packets, on the friend's connection: the data is read from its
+ * source only when the send queue has room for it, straight into the packet it is sent in.
+ * Transfers stop (with a FILECONTROL_KILL callback) when the friend goes offline, they are
+ * resumed by sending the file again and accepting it with the position to start from.
+ */
+
+/* Offer friendnumber a file of filesize bytes named filename.
+ * Nothing is sent before the friend accepts it and file_set_source() was called.
+ *  return the file number on success.
+ *  return -1 on failure.
+ */
+int new_filesender(Messenger *m, int friendnumber, uint64_t filesize, uint8_t *filename, uint16_t filename_length);
+
+/* Set where the data of file filenumber we send to friendnumber comes from.
+ * If fd is not -1, the data is read from it with pread(), at the position in the file.
+ * Otherwise function(m, friendnumber, filenumber, position, data, length, userdata) is called
+ * whenever there is room to send: it puts at most length bytes from position in data and
+ * returns how many, 0 if there are no more or -1 if it has nothing yet (it is called again a bit
+ * later). This is where a fast sender waits for a slow link. It must not call back into m.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int file_set_source(Messenger *m, int friendnumber, uint8_t filenumber, int fd, file_read_callback function,
+                    void *userdata);
+
+/* Send a FILECONTROL_* for file filenumber of friendnumber.
+ * send_receive is 0 for a file we send, 1 for one we receive.
+ * When accepting a file we receive, data can be the position to start from (8 bytes, network
+ * order) to resume an earlier transfer.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int file_control(Messenger *m, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+                 uint8_t *data, uint16_t length);
+
+/* return the number of bytes of the file left to send or receive.
+ * return 0 if there is no such transfer.
+ */
+uint64_t file_dataremaining(Messenger *m, int friendnumber, uint8_t filenumber, uint8_t send_receive);
+
+/* Set the callback for file send requests.
+ *  function(Messenger *m, int friendnumber, uint8_t filenumber, uint64_t filesize, uint8_t *filename,
+ *           uint16_t filename_length, void *userdata)
+ */
+void m_callback_file_sendrequest(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint64_t, uint8_t *,
+                                 uint16_t, void *), void *userdata);
+
+/* Set the callback for the file controls of friends.
+ *  function(Messenger *m, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+ *           uint8_t *data, uint16_t length, void *userdata)
+ * send_receive is the same as in file_control(). Once all of a file we send was sent, it is called
+ * with send_receive 0 and FILECONTROL_FINISHED.
+ */
+void m_callback_file_control(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint8_t, uint8_t, uint8_t *,
+                             uint16_t, void *), void *userdata);
+
+/* Set the callback for file data.
+ *  function(Messenger *m, int friendnumber, uint8_t filenumber, uint64_t position, uint8_t *data,
+ *           uint16_t length, void *userdata)
+ * position is where data goes in the file. Pause the transfer to slow the friend down.
+ */
+void m_callback_file_data(Messenger *m, void (*function)(Messenger *m, int, uint8_t, uint64_t, uint8_t *, uint16_t,
+                          void *), void *userdata);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* return size of the messenger data (for saving). */
@@ -369,7 +612,21 @@ uint32_t Messenger_size(Messenger *m);
 /* Save the messenger in data (must be allocated memory of size Messenger_size()) */
 void Messenger_save(Messenger *m, uint8_t *data);
 
-/* Load the messenger from data of size length. */
+/* return size of the changes to the friend list since the last save (for saving). */
+uint32_t Messenger_changes_size(Messenger *m);
+
+/* Save the changes to the friend list since the last Messenger_save() or Messenger_save_changes()
+ * in data (must be allocated memory of size Messenger_changes_size()).
+ * Append them to the saved data, Messenger_load() applies them on top of it.
+ * Nothing needs to be saved if Messenger_changes_size() is 0.
+ */
+void Messenger_save_changes(Messenger *m, uint8_t *data);
+
+/* Load the messenger from data of size length.
+ * data is only read and only the sections we know are looked at, it can be the saved file mapped in memory.
+ * return 0 on success.
+ * return -1 on failure.
+ */
 int Messenger_load(Messenger *m, uint8_t *data, uint32_t length);
 
 
@@ -0,0 +1,109 @@
+/* bloom_filter.c
+ *
+ * Remembering what was seen in the last minutes in constant time and space, see
+ * bloom_filter_add().
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bloom_filter.h"
+#include "misc_tools.h"
+
+void bloom_filter_init(Bloom_Filter *filter, uint32_t window)
+{
+    memset(filter, 0, sizeof(Bloom_Filter));
+    filter->seed = random_int();
+    filter->window = window;
+    filter->rotated = unix_time();
+}
+
+/* Start a new generation if the current one is window seconds old. */
+static void rotate(Bloom_Filter *filter)
+{
+    uint64_t temp_time = unix_time();
+
+    if (filter->rotated + filter->window > temp_time)
+        return;
+
+    /* Nothing in either generation is recent enough any more. */
+    if (filter->rotated + filter->window * 2 <= temp_time)
+        memset(filter->bits[filter->current], 0, BLOOM_FILTER_BITS / 8);
+
+    filter->current ^= 1;
+    memset(filter->bits[filter->current], 0, BLOOM_FILTER_BITS / 8);
+    filter->rotated = temp_time;
+}
+
+/* The BLOOM_FILTER_HASHES bits of data are h1 + i * h2 for i from 0. */
+static void hash(Bloom_Filter *filter, uint8_t *data, uint32_t length, uint32_t *h1, uint32_t *h2)
+{
+    /* Public keys and addresses are attacker controlled so mix them with our random seed. */
+    uint32_t a = filter->seed, b = ~filter->seed;
+    uint32_t i, word;
+
+    for (i = 0; i < length; i += sizeof(word)) {
+        word = 0;
+        memcpy(&word, data + i, MIN(sizeof(word), length - i));
+        a ^= word;
+        a *= 0x9E3779B1;
+        a ^= a >> 15;
+        b += word;
+        b *= 0x85EBCA77;
+        b ^= b >> 13;
+    }
+
+    *h1 = a;
+    /* Odd so that the bits differ. */
+    *h2 = b | 1;
+}
+
+void bloom_filter_add(Bloom_Filter *filter, uint8_t *data, uint32_t length)
+{
+    uint32_t h1, h2, i;
+
+    rotate(filter);
+    hash(filter, data, length, &h1, &h2);
+
+    for (i = 0; i < BLOOM_FILTER_HASHES; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_FILTER_BITS;
+        filter->bits[filter->current][bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+int bloom_filter_check(Bloom_Filter *filter, uint8_t *data, uint32_t length)
+{
+    uint32_t h1, h2, i, j;
+
+    rotate(filter);
+    hash(filter, data, length, &h1, &h2);
+
+    for (j = 0; j < 2; ++j) {
+        for (i = 0; i < BLOOM_FILTER_HASHES; ++i) {
+            uint32_t bit = (h1 + i * h2) % BLOOM_FILTER_BITS;
+
+            if (!(filter->bits[j][bit / 8] & (1 << (bit % 8))))
+                break;
+        }
+
+        if (i == BLOOM_FILTER_HASHES)
+            return 1;
+    }
+
+    return 0;
+}
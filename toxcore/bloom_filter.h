@@ -0,0 +1,58 @@
+/* bloom_filter.h
+ *
+ * Remembering what was seen in the last minutes in constant time and space, see
+ * bloom_filter_add().
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include "network.h"
+
+/* Bits of each of the two generations. With BLOOM_FILTER_HASHES bits set per item, less than
+ * 1% of the checks are false positives while the generations hold up to about 1400 items each.
+ */
+#define BLOOM_FILTER_BITS 16384
+#define BLOOM_FILTER_HASHES 5
+
+/* Items are added to the current generation and looked for in both. Every window seconds the
+ * previous generation is cleared and becomes the current one, so items are remembered for
+ * window to 2 * window seconds after they were last added.
+ */
+typedef struct {
+    uint8_t  bits[2][BLOOM_FILTER_BITS / 8];
+    uint8_t  current; /* Index of the current generation in bits. */
+    uint32_t seed;
+    uint32_t window; /* In seconds. */
+    uint64_t rotated; /* unix_time() at which the current generation started. */
+} Bloom_Filter;
+
+void bloom_filter_init(Bloom_Filter *filter, uint32_t window);
+
+/* Remember the length bytes of data. */
+void bloom_filter_add(Bloom_Filter *filter, uint8_t *data, uint32_t length);
+
+/* return 1 if data was added in the last window seconds (or, rarely, if it was not).
+ * return 0 if it was not added in the last 2 * window seconds.
+ */
+int bloom_filter_check(Bloom_Filter *filter, uint8_t *data, uint32_t length);
+
+#endif
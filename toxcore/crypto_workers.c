@@ -0,0 +1,333 @@
+/* crypto_workers.c
+ *
+ * Threads that do the public key crypto of incoming DHT packets, for busy nodes.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "crypto_workers.h"
+
+#if defined(HAVE_PTHREAD) && !defined(WIN32)
+
+#include <pthread.h>
+
+typedef struct {
+    Packet_Buffer *buffer;
+    IP_Port        ip_port;
+    uint16_t       key; /* Where the public key of the sender is in the packet. */
+    uint16_t       nonce; /* Where the nonce is, the encrypted part follows it. */
+    uint8_t        valid; /* Set by the worker if the packet decrypts. */
+    uint8_t        shared_key[crypto_box_BEFORENMBYTES];
+} Crypto_Job;
+
+typedef struct {
+    Crypto_Job jobs[CRYPTO_WORKERS_QUEUE];
+    uint32_t   start;
+    uint32_t   num;
+} Job_Queue;
+
+typedef struct {
+    Net_Crypto      *c;
+
+    /* Handlers of the packets we took over, function is NULL for the others. */
+    Packet_Handles   handlers[256];
+
+    pthread_t        threads[CRYPTO_WORKERS_MAX];
+    uint32_t         num_threads;
+
+    /* Everything below is shared with the workers. */
+    pthread_mutex_t  lock;
+    pthread_cond_t   work; /* Signaled when there is a job in todo or the workers must stop. */
+    Job_Queue        todo; /* Waiting for a worker. */
+    Job_Queue        done; /* Waiting for networking_poll(). */
+    uint32_t         pending; /* Jobs in todo, done or in the hands of a worker. */
+    uint8_t          stop;
+} Crypto_Workers;
+
+static void push_job(Job_Queue *queue, Crypto_Job *job)
+{
+    queue->jobs[(queue->start + queue->num) % CRYPTO_WORKERS_QUEUE] = *job;
+    ++queue->num;
+}
+
+static void pop_job(Job_Queue *queue, Crypto_Job *job)
+{
+    *job = queue->jobs[queue->start];
+    queue->start = (queue->start + 1) % CRYPTO_WORKERS_QUEUE;
+    --queue->num;
+}
+
+/* Find where the public key of the sender and the nonce are in packet.
+ * return 0 if packet is one the workers can check.
+ * return -1 if not (it is then handled right away).
+ */
+static int packet_layout(Net_Crypto *c, uint8_t *packet, uint32_t length, uint16_t *key, uint16_t *nonce)
+{
+    switch (packet[0]) {
+        case NET_PACKET_PING_REQUEST:
+        case NET_PACKET_PING_RESPONSE:
+        case NET_PACKET_GET_NODES:
+        case NET_PACKET_SEND_NODES:
+        case NET_PACKET_SEND_NODES_IPV6:
+            *key = 1;
+            break;
+
+        case NET_PACKET_CRYPTO:
+
+            /* Requests for someone else are routed, not decrypted. */
+            if (length < 1 + crypto_box_PUBLICKEYBYTES
+                    || memcmp(packet + 1, c->self_public_key, crypto_box_PUBLICKEYBYTES) != 0)
+                return -1;
+
+            *key = 1 + crypto_box_PUBLICKEYBYTES;
+            break;
+
+        default:
+            return -1;
+    }
+
+    *nonce = *key + crypto_box_PUBLICKEYBYTES;
+
+    /* Leave the ones decrypt_data_fast() would refuse to the handlers. */
+    if (length <= *nonce + crypto_box_NONCEBYTES + crypto_box_BOXZEROBYTES
+            || length > *nonce + crypto_box_NONCEBYTES + MAX_DATA_SIZE)
+        return -1;
+
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    Crypto_Workers *workers = arg;
+    Networking_Core *net = workers->c->lossless_udp->net;
+    uint8_t plain[MAX_DATA_SIZE];
+    Crypto_Job job;
+
+    pthread_mutex_lock(&workers->lock);
+
+    while (1) {
+        while (!workers->stop && workers->todo.num == 0)
+            pthread_cond_wait(&workers->work, &workers->lock);
+
+        if (workers->stop)
+            break;
+
+        pop_job(&workers->todo, &job);
+        pthread_mutex_unlock(&workers->lock);
+
+        /* The buffer can't change, networking_poll() doesn't reuse buffers someone holds a reference to. */
+        uint8_t *packet = packet_buffer_data(job.buffer);
+        uint32_t length = job.buffer->length;
+
+        encrypt_precompute(packet + job.key, workers->c->self_secret_key, job.shared_key);
+        job.valid = decrypt_data_fast(job.shared_key, packet + job.nonce, packet + job.nonce + crypto_box_NONCEBYTES,
+                                      length - job.nonce - crypto_box_NONCEBYTES, plain) != -1;
+
+        pthread_mutex_lock(&workers->lock);
+        push_job(&workers->done, &job);
+
+        /* networking_poll() empties done every time it is woken up. */
+        if (workers->done.num == 1)
+            networking_wakeup(net);
+    }
+
+    pthread_mutex_unlock(&workers->lock);
+    return NULL;
+}
+
+/* Handler of the packets we took over. */
+static int handle_packet(void *object, IP_Port source, uint8_t *packet, uint32_t length)
+{
+    Crypto_Workers *workers = object;
+    Net_Crypto *c = workers->c;
+    Networking_Core *net = c->lossless_udp->net;
+    Packet_Handles *handler = &workers->handlers[packet[0]];
+    Crypto_Job job;
+
+    if (packet_layout(c, packet, length, &job.key, &job.nonce) == -1 || net->recv_packet == NULL
+            || shared_key_cache_has(&c->shared_keys, packet + job.key))
+        return handler->function(handler->object, source, packet, length);
+
+    job.buffer = net->recv_packet;
+    job.ip_port = source;
+
+    pthread_mutex_lock(&workers->lock);
+
+    if (workers->pending == CRYPTO_WORKERS_QUEUE) {
+        pthread_mutex_unlock(&workers->lock);
+        return 1;
+    }
+
+    /* Only this thread touches the reference count of the buffers. */
+    packet_buffer_ref(job.buffer);
+    push_job(&workers->todo, &job);
+    ++workers->pending;
+    pthread_cond_signal(&workers->work);
+    pthread_mutex_unlock(&workers->lock);
+    return 0;
+}
+
+/* Wakeup handler: handle the packets the workers are done with. */
+static void handle_done(void *object)
+{
+    Crypto_Workers *workers = object;
+    Net_Crypto *c = workers->c;
+    Networking_Core *net = c->lossless_udp->net;
+    Crypto_Job job;
+
+    while (1) {
+        pthread_mutex_lock(&workers->lock);
+
+        if (workers->done.num == 0) {
+            pthread_mutex_unlock(&workers->lock);
+            return;
+        }
+
+        pop_job(&workers->done, &job);
+        --workers->pending;
+        pthread_mutex_unlock(&workers->lock);
+
+        if (job.valid) {
+            uint8_t *packet = packet_buffer_data(job.buffer);
+            Packet_Handles *handler = &workers->handlers[packet[0]];
+
+            shared_key_cache_add(&c->shared_keys, packet + job.key, job.shared_key);
+            net->recv_packet = job.buffer;
+            handler->function(handler->object, job.ip_port, packet, job.buffer->length);
+            net->recv_packet = NULL;
+        }
+
+        packet_buffer_unref(job.buffer);
+    }
+}
+
+int crypto_workers_start(Net_Crypto *c, uint32_t threads)
+{
+    static const uint8_t packet_ids[] = {NET_PACKET_PING_REQUEST, NET_PACKET_PING_RESPONSE, NET_PACKET_GET_NODES,
+                                         NET_PACKET_SEND_NODES, NET_PACKET_SEND_NODES_IPV6, NET_PACKET_CRYPTO
+                                        };
+    Networking_Core *net = c->lossless_udp->net;
+    uint32_t i;
+
+    if (c->workers != NULL || threads == 0 || threads > CRYPTO_WORKERS_MAX)
+        return -1;
+
+    Crypto_Workers *workers = calloc(1, sizeof(Crypto_Workers));
+
+    if (workers == NULL)
+        return -1;
+
+    workers->c = c;
+
+    if (pthread_mutex_init(&workers->lock, NULL) != 0) {
+        free(workers);
+        return -1;
+    }
+
+    if (pthread_cond_init(&workers->work, NULL) != 0) {
+        pthread_mutex_destroy(&workers->lock);
+        free(workers);
+        return -1;
+    }
+
+    c->workers = workers;
+
+    if (networking_set_wakeup_handler(net, &handle_done, workers) == -1) {
+        crypto_workers_stop(c);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(packet_ids); ++i) {
+        Packet_Handles *handler = &net->packethandlers[packet_ids[i]];
+
+        if (handler->function != NULL) {
+            workers->handlers[packet_ids[i]] = *handler;
+            networking_registerhandler(net, packet_ids[i], &handle_packet, workers);
+        }
+    }
+
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&workers->threads[i], NULL, &worker_thread, workers) != 0) {
+            crypto_workers_stop(c);
+            return -1;
+        }
+
+        ++workers->num_threads;
+    }
+
+    return 0;
+}
+
+void crypto_workers_stop(Net_Crypto *c)
+{
+    Crypto_Workers *workers = c->workers;
+    Networking_Core *net = c->lossless_udp->net;
+    Crypto_Job job;
+    uint32_t i;
+
+    if (workers == NULL)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->stop = 1;
+    pthread_cond_broadcast(&workers->work);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->num_threads; ++i)
+        pthread_join(workers->threads[i], NULL);
+
+    for (i = 0; i < 256; ++i) {
+        if (workers->handlers[i].function != NULL)
+            networking_registerhandler(net, i, workers->handlers[i].function, workers->handlers[i].object);
+    }
+
+    networking_set_wakeup_handler(net, NULL, workers);
+
+    while (workers->todo.num != 0) {
+        pop_job(&workers->todo, &job);
+        packet_buffer_unref(job.buffer);
+    }
+
+    while (workers->done.num != 0) {
+        pop_job(&workers->done, &job);
+        packet_buffer_unref(job.buffer);
+    }
+
+    pthread_cond_destroy(&workers->work);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers);
+    c->workers = NULL;
+}
+
+#else
+
+int crypto_workers_start(Net_Crypto *c, uint32_t threads)
+{
+    return -1;
+}
+
+void crypto_workers_stop(Net_Crypto *c)
+{
+}
+
+#endif
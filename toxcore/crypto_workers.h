@@ -0,0 +1,56 @@
+/* crypto_workers.h
+ *
+ * Threads that do the public key crypto of incoming DHT packets, for busy nodes.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CRYPTO_WORKERS_H
+#define CRYPTO_WORKERS_H
+
+#include "net_crypto.h"
+
+/* Maximum number of threads crypto_workers_start() starts. */
+#define CRYPTO_WORKERS_MAX 64
+
+/* Maximum number of packets given to the workers at once, more are dropped. */
+#define CRYPTO_WORKERS_QUEUE 4096
+
+/* Start threads worker threads for the pings, get nodes, send nodes and crypto requests
+ * received by c from peers whose shared key is not in c->shared_keys.
+ * A worker computes the shared key (the expensive part) and checks that the packet decrypts
+ * with it. The packet is then handled by the thread calling networking_poll() like any other,
+ * with the key in the cache. Packets that do not decrypt are dropped.
+ * Only that thread touches the DHT, workers never do.
+ *
+ * Call it after new_DHT() (it takes over the packet handlers the DHT registers) and after our
+ * keys are loaded: they must not change while the workers run.
+ * Fails if something else uses the wakeup handler of the networking (tox_thread_start()).
+ * Not available on Windows or without pthreads.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int crypto_workers_start(Net_Crypto *c, uint32_t threads);
+
+/* Stop the workers and give the packet handlers back, packets the workers have not finished
+ * with are dropped. kill_net_crypto() calls it.
+ */
+void crypto_workers_stop(Net_Crypto *c);
+
+#endif
@@ -38,20 +38,18 @@ int send_friendrequest(DHT *dht, uint8_t *public_key, uint32_t nospam_num, uint8
     memcpy(temp, &nospam_num, sizeof(nospam_num));
     memcpy(temp + sizeof(nospam_num), data, length);
     uint8_t packet[MAX_DATA_SIZE];
-    int len = create_request(dht->c->self_public_key, dht->c->self_secret_key, packet, public_key, temp,
-                             length + sizeof(nospam_num),
-                             CRYPTO_PACKET_FRIEND_REQ);
+    int len = create_request(dht->c, packet, public_key, temp, length + sizeof(nospam_num), CRYPTO_PACKET_FRIEND_REQ);
 
     if (len == -1)
         return -1;
 
     IP_Port ip_port = DHT_getfriendip(dht, public_key);
 
-    if (ip_port.ip.uint32 == 1)
+    if (DHT_friendip_unknown(ip_port))
         return -1;
 
-    if (ip_port.ip.uint32 != 0) {
-        if (sendpacket(dht->c->lossless_udp->net->sock, ip_port, packet, len) != -1)
+    if (ip_isset(ip_port.ip)) {
+        if (sendpacket(dht->c->lossless_udp->net, ip_port, packet, len) != -1)
             return 0;
 
         return -1;
@@ -87,14 +85,21 @@ void callback_friendrequest(Friend_Requests *fr, void (*function)(uint8_t *, uin
     fr->handle_friendrequest_userdata = userdata;
 }
 
-/* Add to list of received friend requests. */
+/* Add to list of received friend requests, forgetting the oldest one if it is full. */
 static void addto_receivedlist(Friend_Requests *fr, uint8_t *client_id)
 {
-    if (fr->received_requests_index >= MAX_RECEIVED_STORED)
-        fr->received_requests_index = 0;
+    uint16_t i = fr->received_requests_index;
 
-    memcpy(fr->received_requests[fr->received_requests_index], client_id, crypto_box_PUBLICKEYBYTES);
-    ++fr->received_requests_index;
+    if (fr->received_requests_num == MAX_RECEIVED_STORED)
+        key_index_remove(&fr->received_index, fr->received_requests[i], i);
+    else
+        ++fr->received_requests_num;
+
+    memcpy(fr->received_requests[i], client_id, crypto_box_PUBLICKEYBYTES);
+    fr->received_requests_index = (i + 1) % MAX_RECEIVED_STORED;
+
+    /* If out of memory the sender is just not remembered. */
+    key_index_add(&fr->received_index, client_id, i);
 }
 
 /* Check if a friend request was already received.
@@ -103,14 +108,7 @@ static void addto_receivedlist(Friend_Requests *fr, uint8_t *client_id)
  */
 static int request_received(Friend_Requests *fr, uint8_t *client_id)
 {
-    uint32_t i;
-
-    for (i = 0; i < MAX_RECEIVED_STORED; ++i) {
-        if (memcmp(fr->received_requests[i], client_id, crypto_box_PUBLICKEYBYTES) == 0)
-            return 1;
-    }
-
-    return 0;
+    return key_index_find(&fr->received_index, client_id) != -1;
 }
 
 
@@ -138,5 +136,11 @@ static int friendreq_handlepacket(void *object, IP_Port source, uint8_t *source_
 
 void friendreq_init(Friend_Requests *fr, Net_Crypto *c)
 {
+    key_index_init(&fr->received_index);
     cryptopacket_registerhandler(c, CRYPTO_PACKET_FRIEND_REQ, &friendreq_handlepacket, fr);
 }
+
+void friendreq_kill(Friend_Requests *fr)
+{
+    key_index_free(&fr->received_index);
+}
@@ -26,6 +26,10 @@
 
 #include "DHT.h"
 #include "net_crypto.h"
+#include "key_index.h"
+
+/* Senders remembered so that their requests are not handled again, the oldest is forgotten first. */
+#define MAX_RECEIVED_STORED 1024
 
 
 typedef struct {
@@ -34,14 +38,11 @@ typedef struct {
     uint8_t handle_friendrequest_isset;
     void *handle_friendrequest_userdata;
 
-    /* NOTE: The following is just a temporary fix for the multiple friend requests received at the same time problem.
-     *  TODO: Make this better (This will most likely tie in with the way we will handle spam.)
-     */
-
-#define MAX_RECEIVED_STORED 32
-
+    /* Public keys of the senders of the requests we handled, a ring indexed by received_index. */
     uint8_t received_requests[MAX_RECEIVED_STORED][crypto_box_PUBLICKEYBYTES];
-    uint16_t received_requests_index;
+    uint16_t received_requests_index; /* Next slot of the ring. */
+    uint16_t received_requests_num;
+    Key_Index received_index;
 } Friend_Requests;
 
 /* Try to send a friendrequest to peer with public_key.
@@ -61,5 +62,8 @@ void callback_friendrequest(Friend_Requests *fr, void (*function)(uint8_t *, uin
 /* Sets up friendreq packet handlers. */
 void friendreq_init(Friend_Requests *fr, Net_Crypto *c);
 
+/* Free what friendreq_init() allocated. */
+void friendreq_kill(Friend_Requests *fr);
+
 
 #endif
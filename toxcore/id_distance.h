@@ -0,0 +1,181 @@
+/* id_distance.h
+ *
+ * XOR distance between client_ids, the metric of the DHT.
+ * Everything is inline: these are in the innermost loops of the DHT.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ID_DISTANCE_H
+#define ID_DISTANCE_H
+
+#include "network.h"
+
+#define ID_DISTANCE_ID_SIZE crypto_box_PUBLICKEYBYTES
+#define ID_DISTANCE_WORDS (ID_DISTANCE_ID_SIZE / 8)
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ID_DISTANCE_LITTLE_ENDIAN
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define ID_DISTANCE_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(ID_DISTANCE_LITTLE_ENDIAN)
+#include <arm_neon.h>
+#define ID_DISTANCE_NEON
+#endif
+
+/* XOR distance between two client_ids as big endian words: distances compare
+ * (with id_distance_cmp()) like the client_ids they were made of.
+ */
+typedef struct {
+    uint64_t word[ID_DISTANCE_WORDS];
+} ID_Distance;
+
+/* 8 bytes of data as a big endian number. */
+static inline uint64_t id_load_be64(uint8_t *data)
+{
+#ifdef ID_DISTANCE_LITTLE_ENDIAN
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return __builtin_bswap64(value);
+#else
+    uint64_t value = 0;
+    uint32_t i;
+
+    for (i = 0; i < 8; ++i)
+        value = (value << 8) | data[i];
+
+    return value;
+#endif
+}
+
+/* return the index of the first byte that differs between id1 and id2.
+ * return ID_DISTANCE_ID_SIZE if they are the same.
+ */
+static inline uint32_t id_first_difference(uint8_t *id1, uint8_t *id2)
+{
+#if defined(ID_DISTANCE_SSE2)
+    /* One bit per byte that is the same in both. */
+    uint32_t same = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)id1),
+                    _mm_loadu_si128((__m128i *)id2)))
+                    | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(id1 + 16)),
+                            _mm_loadu_si128((__m128i *)(id2 + 16)))) << 16;
+
+    if (same == 0xFFFFFFFF)
+        return ID_DISTANCE_ID_SIZE;
+
+    return __builtin_ctz(~same);
+#elif defined(ID_DISTANCE_NEON)
+    uint32_t i;
+
+    for (i = 0; i < ID_DISTANCE_ID_SIZE; i += 16) {
+        /* Four bits per byte that is the same in both (narrowing shift of the compare mask). */
+        uint8x16_t same = vceqq_u8(vld1q_u8(id1 + i), vld1q_u8(id2 + i));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(same), 4)), 0);
+
+        if (mask != ~0ULL)
+            return i + __builtin_ctzll(~mask) / 4;
+    }
+
+    return ID_DISTANCE_ID_SIZE;
+#elif defined(ID_DISTANCE_LITTLE_ENDIAN)
+    uint32_t i;
+
+    for (i = 0; i < ID_DISTANCE_ID_SIZE; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, id1 + i, sizeof(a));
+        memcpy(&b, id2 + i, sizeof(b));
+
+        if (a != b)
+            return i + __builtin_ctzll(a ^ b) / 8;
+    }
+
+    return ID_DISTANCE_ID_SIZE;
+#else
+    uint32_t i;
+
+    for (i = 0; i < ID_DISTANCE_ID_SIZE; ++i)
+        if (id1[i] != id2[i])
+            return i;
+
+    return ID_DISTANCE_ID_SIZE;
+#endif
+}
+
+/* Put the distance between id1 and id2 in distance. */
+static inline void id_distance(ID_Distance *distance, uint8_t *id1, uint8_t *id2)
+{
+    uint32_t i;
+
+    for (i = 0; i < ID_DISTANCE_WORDS; ++i)
+        distance->word[i] = id_load_be64(id1 + i * 8) ^ id_load_be64(id2 + i * 8);
+}
+
+/* return a negative number if a is smaller (closer) than b.
+ * return 0 if they are the same.
+ * return a positive number if a is bigger (further) than b.
+ */
+static inline int id_distance_cmp(ID_Distance *a, ID_Distance *b)
+{
+    uint32_t i;
+
+    for (i = 0; i < ID_DISTANCE_WORDS; ++i)
+        if (a->word[i] != b->word[i])
+            return a->word[i] < b->word[i] ? -1 : 1;
+
+    return 0;
+}
+
+/* Compares client_id1 and client_id2 with client_id (by XOR distance)
+ * return 0 if both are same distance
+ * return 1 if client_id1 is closer
+ * return 2 if client_id2 is closer
+ */
+static inline int id_closest(uint8_t *id, uint8_t *id1, uint8_t *id2)
+{
+    /* The distances only differ from the first byte where id1 and id2 do. */
+    uint32_t i = id_first_difference(id1, id2);
+
+    if (i == ID_DISTANCE_ID_SIZE)
+        return 0;
+
+    return (id[i] ^ id1[i]) < (id[i] ^ id2[i]) ? 1 : 2;
+}
+
+/* return the number of leading bits id1 and id2 have in common.
+ * return ID_DISTANCE_ID_SIZE * 8 if they are the same.
+ */
+static inline uint32_t id_common_bits(uint8_t *id1, uint8_t *id2)
+{
+    uint32_t i = id_first_difference(id1, id2);
+    uint8_t distance;
+    uint32_t bits = 0;
+
+    if (i == ID_DISTANCE_ID_SIZE)
+        return ID_DISTANCE_ID_SIZE * 8;
+
+    for (distance = id1[i] ^ id2[i]; !(distance & 0x80); distance <<= 1)
+        ++bits;
+
+    return i * 8 + bits;
+}
+
+#endif
@@ -0,0 +1,165 @@
+/* key_index.c
+ *
+ * Hash index from public keys to positions in an array (friends, crypto connections...).
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "key_index.h"
+
+#define KEY_INDEX_EMPTY   -1
+#define KEY_INDEX_DELETED -2
+
+#define KEY_INDEX_MIN_SIZE 16
+
+void key_index_init(Key_Index *key_index)
+{
+    memset(key_index, 0, sizeof(Key_Index));
+    key_index->seed = random_int();
+}
+
+void key_index_free(Key_Index *key_index)
+{
+    free(key_index->entries);
+    key_index->entries = NULL;
+    key_index->size = 0;
+    key_index->used = 0;
+}
+
+static uint32_t key_hash(Key_Index *key_index, uint8_t *key)
+{
+    /* Public keys are attacker controlled so mix them with our random seed. */
+    uint32_t hash = key_index->seed;
+    uint32_t i, word;
+
+    for (i = 0; i < KEY_INDEX_KEY_SIZE; i += sizeof(word)) {
+        memcpy(&word, key + i, sizeof(word));
+        hash ^= word;
+        hash *= 0x9E3779B1;
+        hash ^= hash >> 15;
+    }
+
+    return hash;
+}
+
+static void insert_entry(Key_Index *key_index, uint8_t *key, int index)
+{
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = key_hash(key_index, key) & mask;
+
+    while (key_index->entries[i].index >= 0)
+        i = (i + 1) & mask;
+
+    if (key_index->entries[i].index == KEY_INDEX_EMPTY)
+        ++key_index->used;
+
+    memcpy(key_index->entries[i].key, key, KEY_INDEX_KEY_SIZE);
+    key_index->entries[i].index = index;
+}
+
+/* Resize to size slots, dropping the deleted ones.
+ * return 0 on success, -1 on failure.
+ */
+static int key_index_resize(Key_Index *key_index, uint32_t size)
+{
+    Key_Index_Entry *entries = malloc(size * sizeof(Key_Index_Entry));
+
+    if (entries == NULL)
+        return -1;
+
+    Key_Index_Entry *old = key_index->entries;
+    uint32_t old_size = key_index->size, i;
+
+    for (i = 0; i < size; ++i)
+        entries[i].index = KEY_INDEX_EMPTY;
+
+    key_index->entries = entries;
+    key_index->size = size;
+    key_index->used = 0;
+
+    for (i = 0; i < old_size; ++i) {
+        if (old[i].index >= 0)
+            insert_entry(key_index, old[i].key, old[i].index);
+    }
+
+    free(old);
+    return 0;
+}
+
+int key_index_add(Key_Index *key_index, uint8_t *key, int index)
+{
+    /* Keep at least half of the slots empty. */
+    if ((key_index->used + 1) * 2 > key_index->size) {
+        uint32_t size = key_index->size ? key_index->size : KEY_INDEX_MIN_SIZE;
+        uint32_t live = 0, i;
+
+        for (i = 0; i < key_index->size; ++i) {
+            if (key_index->entries[i].index >= 0)
+                ++live;
+        }
+
+        /* Only grow if the table is full of live entries, otherwise just clear out deleted ones. */
+        while ((live + 1) * 4 > size)
+            size *= 2;
+
+        if (key_index_resize(key_index, size) == -1)
+            return -1;
+    }
+
+    insert_entry(key_index, key, index);
+    return 0;
+}
+
+void key_index_remove(Key_Index *key_index, uint8_t *key, int index)
+{
+    if (key_index->size == 0)
+        return;
+
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = key_hash(key_index, key) & mask;
+
+    while (key_index->entries[i].index != KEY_INDEX_EMPTY) {
+        if (key_index->entries[i].index == index && memcmp(key_index->entries[i].key, key, KEY_INDEX_KEY_SIZE) == 0) {
+            key_index->entries[i].index = KEY_INDEX_DELETED;
+            return;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+int key_index_find(Key_Index *key_index, uint8_t *key)
+{
+    if (key_index->size == 0)
+        return -1;
+
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = key_hash(key_index, key) & mask;
+    int found = -1;
+
+    while (key_index->entries[i].index != KEY_INDEX_EMPTY) {
+        if (key_index->entries[i].index >= 0 && (found == -1 || key_index->entries[i].index < found)
+                && memcmp(key_index->entries[i].key, key, KEY_INDEX_KEY_SIZE) == 0)
+            found = key_index->entries[i].index;
+
+        i = (i + 1) & mask;
+    }
+
+    return found;
+}
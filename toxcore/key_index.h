@@ -0,0 +1,62 @@
+/* key_index.h
+ *
+ * Hash index from public keys to positions in an array (friends, crypto connections...).
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include "network.h"
+
+#define KEY_INDEX_KEY_SIZE crypto_box_PUBLICKEYBYTES
+
+typedef struct {
+    uint8_t key[KEY_INDEX_KEY_SIZE];
+    int32_t index; /* Position in the indexed array, or one of the KEY_INDEX_* slot markers. */
+} Key_Index_Entry;
+
+typedef struct {
+    Key_Index_Entry *entries;
+    uint32_t size; /* Number of slots, always a power of two. */
+    uint32_t used; /* Slots that are not empty (deleted ones included). */
+    uint32_t seed;
+} Key_Index;
+
+void key_index_init(Key_Index *key_index);
+
+void key_index_free(Key_Index *key_index);
+
+/* Add key at index.
+ * The same key can be added more than once with different indexes.
+ *  return 0 on success.
+ *  return -1 on failure (out of memory).
+ */
+int key_index_add(Key_Index *key_index, uint8_t *key, int index);
+
+/* Remove key at index if it is there. */
+void key_index_remove(Key_Index *key_index, uint8_t *key, int index);
+
+/* return the lowest index added with key.
+ * return -1 if key is not in the index.
+ */
+int key_index_find(Key_Index *key_index, uint8_t *key);
+
+#endif
@@ -28,6 +28,14 @@
 #include <stdint.h>
 #include <string.h> /* for memcpy() */
 
+#ifndef MIN
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#endif
+
 /*********************Debugging Macros********************
  * wiki.tox.im/index.php/Internal_functions_and_data_structures#Debugging
  *********************************************************/
@@ -132,41 +140,78 @@ static inline void tox_list_remove(tox_list *lst)
 /****************************Array***************************
  * Array which manages its own memory allocation.
  * It stores copy of data (not pointers).
+ * Memory grows by doubling so pushing n items costs O(n).
+ * Slots given back with tox_array_release() are handed out again by
+ * tox_array_acquire() so indexes of the other items never change.
  * TODO: Add wiki info usage.
  ************************************************************/
 
 typedef struct tox_array {
     uint8_t *data;
     uint32_t len;
+    uint32_t capacity; /* in elements */
     size_t elem_size; /* in bytes */
+
+    /* Released slots, reused by tox_array_acquire(). */
+    uint32_t *free_slots;
+    uint32_t num_free;
+    uint32_t free_capacity;
 } tox_array;
 
 static inline void tox_array_init(tox_array *arr, size_t elem_size)
 {
-    arr->len = 0;
+    memset(arr, 0, sizeof(tox_array));
     arr->elem_size = elem_size;
-    arr->data = NULL;
 }
 
 static inline void tox_array_delete(tox_array *arr)
 {
     free(arr->data);
-    arr->len = arr->elem_size = 0;
+    free(arr->free_slots);
+    arr->data = NULL;
+    arr->free_slots = NULL;
+    arr->len = arr->capacity = arr->elem_size = 0;
+    arr->num_free = arr->free_capacity = 0;
 }
 
-static inline void tox_array_push_ptr(tox_array *arr, uint8_t *item)
+/* Make sure there is room for capacity items.
+ * return 1 on success, 0 on failure.
+ */
+static inline int tox_array_reserve(tox_array *arr, uint32_t capacity)
 {
-    uint8_t *temp = realloc(arr->data, arr->elem_size * (arr->len + 1));
+    if (capacity <= arr->capacity)
+        return 1;
+
+    uint32_t new_capacity = arr->capacity ? arr->capacity : 4;
+
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+
+    uint8_t *temp = realloc(arr->data, arr->elem_size * new_capacity);
 
     if (temp == NULL)
         return 0;
 
     arr->data = temp;
+    arr->capacity = new_capacity;
+    return 1;
+}
+
+/* Add a copy of item at the end of the array (zeroed item if item is NULL).
+ * return 1 on success, 0 on failure.
+ */
+static inline int tox_array_push_ptr(tox_array *arr, uint8_t *item)
+{
+    if (!tox_array_reserve(arr, arr->len + 1))
+        return 0;
 
     if (item != NULL)
         memcpy(arr->data + arr->elem_size * arr->len, item, arr->elem_size);
+    else
+        memset(arr->data + arr->elem_size * arr->len, 0, arr->elem_size);
 
     arr->len++;
+    return 1;
 }
 #define tox_array_push(arr, item) tox_array_push_ptr(arr, (uint8_t*)(&(item)))
 
@@ -181,20 +226,74 @@ static inline void tox_array_pop(tox_array *arr, uint32_t num)
     if (num > arr->len)
         return;
 
-    if (arr->len == num) {
+    arr->len -= num;
+
+    /* Forget released slots that don't exist anymore. */
+    uint32_t i, j = 0;
+
+    for (i = 0; i < arr->num_free; ++i) {
+        if (arr->free_slots[i] < arr->len)
+            arr->free_slots[j++] = arr->free_slots[i];
+    }
+
+    arr->num_free = j;
+
+    if (arr->len == 0) {
         free(arr->data);
         arr->data = NULL;
-        arr->len = 0;
+        arr->capacity = 0;
         return;
     }
 
-    uint8_t *temp = realloc(arr->data, arr->elem_size * (arr->len - num));
+    /* Give memory back once we use less than a quarter of it. */
+    if (arr->len * 4 <= arr->capacity) {
+        uint8_t *temp = realloc(arr->data, arr->elem_size * (arr->capacity / 2));
 
-    if (temp == NULL)
-        return;
+        if (temp == NULL)
+            return;
 
-    arr->len -= num;
-    arr->data = temp;
+        arr->data = temp;
+        arr->capacity /= 2;
+    }
+}
+
+/* Mark slot i as unused so that tox_array_acquire() can hand it out again.
+ * The item itself stays where it is until then.
+ * return 1 on success, 0 on failure.
+ */
+static inline int tox_array_release(tox_array *arr, uint32_t i)
+{
+    if (i >= arr->len)
+        return 0;
+
+    if (arr->num_free == arr->free_capacity) {
+        uint32_t new_capacity = arr->free_capacity ? arr->free_capacity * 2 : 4;
+        uint32_t *temp = realloc(arr->free_slots, new_capacity * sizeof(uint32_t));
+
+        if (temp == NULL)
+            return 0;
+
+        arr->free_slots = temp;
+        arr->free_capacity = new_capacity;
+    }
+
+    arr->free_slots[arr->num_free++] = i;
+    return 1;
+}
+
+/* Get an unused slot, a released one if there is one, otherwise a new zeroed one at the end.
+ * return the index of the slot.
+ * return -1 on failure.
+ */
+static inline int tox_array_acquire(tox_array *arr)
+{
+    if (arr->num_free != 0)
+        return arr->free_slots[--arr->num_free];
+
+    if (!tox_array_push_ptr(arr, NULL))
+        return -1;
+
+    return arr->len - 1;
 }
 
 /* TODO: return ptr and do not take type */
@@ -0,0 +1,99 @@
+/* mpsc_queue.h
+ *
+ * Lock-free queue that any number of threads push to and one thread at a time pops from.
+ * Everything is inline, it is a handful of instructions.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stddef.h>
+
+/* Put one of these in the structs that go in the queue. */
+typedef struct MPSC_Node {
+    struct MPSC_Node *volatile next;
+} MPSC_Node;
+
+/* Pushing is one atomic exchange on head, popping happens at tail.
+ * stub is in the queue when it would otherwise be empty, so that head is never NULL.
+ */
+typedef struct {
+    MPSC_Node *volatile head;
+    MPSC_Node *tail;
+    MPSC_Node stub;
+} MPSC_Queue;
+
+static inline void mpsc_queue_init(MPSC_Queue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/* Add node at the end of queue, from any thread. */
+static inline void mpsc_queue_push(MPSC_Queue *queue, MPSC_Node *node)
+{
+    node->next = NULL;
+    /* Whatever was written to the struct must be visible before the node is. */
+    __sync_synchronize();
+    MPSC_Node *prev = __sync_lock_test_and_set(&queue->head, node);
+    prev->next = node;
+}
+
+/* Take the first node out of queue.
+ * Only one thread at a time may pop (and init) the queue.
+ *  return the node.
+ *  return NULL if the queue is empty or the first node is still being pushed (pop again
+ *  after the pusher is done with it, for example when it signals it pushed something).
+ */
+static inline MPSC_Node *mpsc_queue_pop(MPSC_Queue *queue)
+{
+    MPSC_Node *tail = queue->tail;
+    MPSC_Node *next = tail->next;
+
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = next->next;
+    }
+
+    if (next == NULL) {
+        if (tail != queue->head)
+            return NULL;
+
+        /* tail is the last node, put stub behind it so that it can be taken out. */
+        mpsc_queue_push(queue, &queue->stub);
+        next = tail->next;
+
+        if (next == NULL)
+            return NULL;
+    }
+
+    queue->tail = next;
+    /* Pairs with the barrier in mpsc_queue_push(): read the node only after seeing it. */
+    __sync_synchronize();
+    return tail;
+}
+
+#endif
@@ -25,6 +25,7 @@
  */
 
 #include "net_crypto.h"
+#include "crypto_workers.h"
 
 #define CONN_NO_CONNECTION 0
 #define CONN_HANDSHAKE_SENT 1
@@ -32,6 +33,8 @@
 #define CONN_ESTABLISHED 3
 #define CONN_TIMED_OUT 4
 
+static void check_connection(Net_Crypto *c, int i);
+
 /* Use this instead of memcmp; not vulnerable to timing attacks. */
 uint8_t crypto_iszero(uint8_t *mem, uint32_t length)
 {
@@ -62,9 +65,11 @@ int encrypt_data_fast(uint8_t *enc_key, uint8_t *nonce,
     if (length + crypto_box_MACBYTES > MAX_DATA_SIZE || length == 0)
         return -1;
 
-    uint8_t temp_plain[MAX_DATA_SIZE + crypto_box_ZEROBYTES] = {0};
+    uint8_t temp_plain[MAX_DATA_SIZE + crypto_box_ZEROBYTES];
     uint8_t temp_encrypted[MAX_DATA_SIZE + crypto_box_BOXZEROBYTES];
 
+    /* Only the padding has to be zero, not the whole buffer. */
+    memset(temp_plain, 0, crypto_box_ZEROBYTES);
     memcpy(temp_plain + crypto_box_ZEROBYTES, plain, length); // Pad the message with 32 0 bytes.
 
     crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce, enc_key);
@@ -85,8 +90,9 @@ int decrypt_data_fast(uint8_t *enc_key, uint8_t *nonce,
         return -1;
 
     uint8_t temp_plain[MAX_DATA_SIZE + crypto_box_ZEROBYTES];
-    uint8_t temp_encrypted[MAX_DATA_SIZE + crypto_box_BOXZEROBYTES] = {0};
+    uint8_t temp_encrypted[MAX_DATA_SIZE + crypto_box_BOXZEROBYTES];
 
+    memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
     memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, encrypted, length); // Pad the message with 16 0 bytes.
 
     if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_BOXZEROBYTES,
@@ -104,6 +110,25 @@ int decrypt_data_fast(uint8_t *enc_key, uint8_t *nonce,
     return length - crypto_box_ZEROBYTES + crypto_box_BOXZEROBYTES;
 }
 
+void get_shared_key(Net_Crypto *c, uint8_t *shared_key, uint8_t *public_key)
+{
+    shared_key_cache_get(&c->shared_keys, shared_key, c->self_secret_key, public_key);
+}
+
+int set_shared_key_cache_size(Net_Crypto *c, uint32_t size)
+{
+    Shared_Key_Cache cache;
+
+    if (shared_key_cache_init(&cache, size) == -1)
+        return -1;
+
+    cache.hits = c->shared_keys.hits;
+    cache.misses = c->shared_keys.misses;
+    shared_key_cache_free(&c->shared_keys);
+    c->shared_keys = cache;
+    return 0;
+}
+
 int encrypt_data(uint8_t *public_key, uint8_t *secret_key, uint8_t *nonce,
                  uint8_t *plain, uint32_t length, uint8_t *encrypted)
 {
@@ -125,12 +150,29 @@ static void increment_nonce(uint8_t *nonce)
 {
     uint32_t i;
 
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* The nonce is a little endian number, add 8 bytes at a time: the carry almost never goes further. */
+    uint64_t word;
+
+    for (i = 0; i < crypto_box_NONCEBYTES; i += sizeof(word)) {
+        memcpy(&word, nonce + i, sizeof(word));
+        ++word;
+        memcpy(nonce + i, &word, sizeof(word));
+
+        if (word != 0)
+            break;
+    }
+
+#else
+
     for (i = 0; i < crypto_box_NONCEBYTES; ++i) {
         ++nonce[i];
 
         if (nonce[i] != 0)
             break;
     }
+
+#endif
 }
 
 /* Fill the given nonce with random bytes. */
@@ -144,6 +186,52 @@ void random_nonce(uint8_t *nonce)
     }
 }
 
+/* Decrypt the packet in buffer in place, the plain data ends up crypto_box_MACBYTES bytes further.
+ * Needs crypto_box_BOXZEROBYTES bytes of headroom.
+ * return length of the plain data if successful.
+ * return -1 if failure.
+ */
+static int decrypt_buffer_fast(uint8_t *enc_key, uint8_t *nonce, Packet_Buffer *buffer)
+{
+    if (buffer->length > MAX_DATA_SIZE || buffer->length <= crypto_box_BOXZEROBYTES
+            || buffer->offset < crypto_box_BOXZEROBYTES)
+        return -1;
+
+    uint8_t *padded = packet_buffer_data(buffer) - crypto_box_BOXZEROBYTES;
+    memset(padded, 0, crypto_box_BOXZEROBYTES);
+
+    if (crypto_box_open_afternm(padded, padded, buffer->length + crypto_box_BOXZEROBYTES, nonce, enc_key) == -1)
+        return -1;
+
+    if (crypto_iszero(padded, crypto_box_ZEROBYTES) != 0)
+        return -1;
+
+    return buffer->length - crypto_box_MACBYTES;
+}
+
+/* Encrypt the packet in buffer in place, the encrypted data starts crypto_box_MACBYTES bytes earlier.
+ * Needs crypto_box_ZEROBYTES bytes of headroom.
+ * return length of the encrypted data if successful.
+ * return -1 if failure.
+ */
+static int encrypt_buffer_fast(uint8_t *enc_key, uint8_t *nonce, Packet_Buffer *buffer)
+{
+    if (buffer->length + crypto_box_MACBYTES > MAX_DATA_SIZE || buffer->length == 0
+            || buffer->offset < crypto_box_ZEROBYTES)
+        return -1;
+
+    uint8_t *padded = packet_buffer_data(buffer) - crypto_box_ZEROBYTES;
+    memset(padded, 0, crypto_box_ZEROBYTES);
+
+    crypto_box_afternm(padded, padded, buffer->length + crypto_box_ZEROBYTES, nonce, enc_key);
+
+    if (crypto_iszero(padded, crypto_box_BOXZEROBYTES) != 0)
+        return -1;
+
+    packet_buffer_push(buffer, crypto_box_MACBYTES);
+    return buffer->length;
+}
+
 /* return 0 if there is no received data in the buffer.
  * return -1  if the packet was discarded.
  * return length of received data if successful.
@@ -156,60 +244,154 @@ int read_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data)
     if (c->crypto_connections[crypt_connection_id].status != CONN_ESTABLISHED)
         return 0;
 
-    uint8_t temp_data[MAX_DATA_SIZE];
-    int length = read_packet(c->lossless_udp, c->crypto_connections[crypt_connection_id].number, temp_data);
+    Packet_Buffer *buffer = read_packet_buffer(c->lossless_udp, c->crypto_connections[crypt_connection_id].number);
 
-    if (length == 0)
+    if (buffer == NULL)
         return 0;
 
-    if (temp_data[0] != 3)
-        return -1;
+    /* The data is decrypted right where it was received. */
+    uint8_t *temp_data = packet_buffer_data(buffer);
+    int len = -1;
 
-    int len = decrypt_data_fast(c->crypto_connections[crypt_connection_id].shared_key,
-                                c->crypto_connections[crypt_connection_id].recv_nonce,
-                                temp_data + 1, length - 1, data);
+    if (temp_data[0] == 3) {
+        packet_buffer_pull(buffer, 1);
+        len = decrypt_buffer_fast(c->crypto_connections[crypt_connection_id].shared_key,
+                                  c->crypto_connections[crypt_connection_id].recv_nonce, buffer);
+    }
 
     if (len != -1) {
+        memcpy(data, packet_buffer_data(buffer) + crypto_box_MACBYTES, len);
         increment_nonce(c->crypto_connections[crypt_connection_id].recv_nonce);
-        return len;
+    } else {
+        ++c->lossless_udp->net->stats.decrypt_failures;
     }
 
-    return -1;
+    packet_buffer_unref(buffer);
+    return len;
 }
 
-/* return 0 if data could not be put in packet queue.
+/* Headroom of the buffers write_cryptpacket() encrypts into. */
+#define CRYPTPACKET_HEADROOM (LOSSLESS_UDP_HEADER_SIZE + 1 + crypto_box_ZEROBYTES)
+
+/* Encrypt the data in buffer in place for conn and put it in its Lossless_UDP send queue.
+ * buffer must have at least CRYPTPACKET_HEADROOM bytes of headroom in front of the data.
+ * return 0 if data could not be put in packet queue.
  * return 1 if data was put into the queue.
  */
-int write_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint32_t length)
+static int write_connection_buffer(Net_Crypto *c, Crypto_Connection *conn, Packet_Buffer *buffer)
 {
-    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
+    if (buffer->length - crypto_box_BOXZEROBYTES + crypto_box_ZEROBYTES > MAX_DATA_SIZE - 1
+            || buffer->offset < CRYPTPACKET_HEADROOM)
         return 0;
 
+    int ret = 0;
+
+    if (encrypt_buffer_fast(conn->shared_key, conn->sent_nonce, buffer) != -1) {
+        packet_buffer_push(buffer, 1)[0] = 3;
+        ret = write_packet_buffer(c->lossless_udp, conn->number, buffer);
+    }
+
+    if (ret)
+        increment_nonce(conn->sent_nonce);
+
+    return ret;
+}
+
+/* Encrypt length bytes of data for conn and queue them, as write_connection_buffer() does. */
+static int write_connection_packet(Net_Crypto *c, Crypto_Connection *conn, uint8_t *data, uint32_t length)
+{
     if (length - crypto_box_BOXZEROBYTES + crypto_box_ZEROBYTES > MAX_DATA_SIZE - 1)
         return 0;
 
+    /* Copy the data once, it is then encrypted in place and the headers of both
+     * net_crypto and Lossless_UDP are written in front of it. */
+    Packet_Buffer *buffer = new_cryptpacket_buffer(length);
+
+    if (buffer == NULL)
+        return 0;
+
+    memcpy(packet_buffer_data(buffer), data, length);
+    buffer->length = length;
+
+    int ret = write_connection_buffer(c, conn, buffer);
+    packet_buffer_unref(buffer);
+    return ret;
+}
+
+Packet_Buffer *new_cryptpacket_buffer(uint32_t length)
+{
+    return new_packet_buffer(CRYPTPACKET_HEADROOM + length, CRYPTPACKET_HEADROOM);
+}
+
+int write_cryptpacket_buffer(Net_Crypto *c, int crypt_connection_id, Packet_Buffer *buffer)
+{
+    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
+        return 0;
+
     if (c->crypto_connections[crypt_connection_id].status != CONN_ESTABLISHED)
         return 0;
 
-    uint8_t temp_data[MAX_DATA_SIZE];
-    int len = encrypt_data_fast(c->crypto_connections[crypt_connection_id].shared_key,
-                                c->crypto_connections[crypt_connection_id].sent_nonce,
-                                data, length, temp_data + 1);
+    return write_connection_buffer(c, &c->crypto_connections[crypt_connection_id], buffer);
+}
 
-    if (len == -1)
+uint32_t crypto_sendqueue_room(Net_Crypto *c, int crypt_connection_id)
+{
+    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
+        return 0;
+
+    if (c->crypto_connections[crypt_connection_id].status != CONN_ESTABLISHED)
         return 0;
 
-    temp_data[0] = 3;
+    return sendqueue_room(c->lossless_udp, c->crypto_connections[crypt_connection_id].number);
+}
 
-    if (write_packet(c->lossless_udp, c->crypto_connections[crypt_connection_id].number, temp_data, len + 1) == 0)
+uint32_t crypto_sendqueue(Net_Crypto *c, int crypt_connection_id)
+{
+    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
         return 0;
 
-    increment_nonce(c->crypto_connections[crypt_connection_id].sent_nonce);
-    return 1;
+    if (c->crypto_connections[crypt_connection_id].status != CONN_ESTABLISHED)
+        return 0;
+
+    return sendqueue(c->lossless_udp, c->crypto_connections[crypt_connection_id].number);
+}
+
+/* return 0 if data could not be put in packet queue.
+ * return 1 if data was put into the queue.
+ */
+int write_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint32_t length)
+{
+    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
+        return 0;
+
+    if (c->crypto_connections[crypt_connection_id].status != CONN_ESTABLISHED)
+        return 0;
+
+    return write_connection_packet(c, &c->crypto_connections[crypt_connection_id], data, length);
+}
+
+uint32_t write_cryptpackets(Net_Crypto *c, int crypt_connection_id, uint8_t **data, uint32_t *length, uint32_t num)
+{
+    uint32_t i;
+
+    if (crypt_connection_id < 0 || crypt_connection_id >= c->crypto_connections_length)
+        return 0;
+
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    if (conn->status != CONN_ESTABLISHED)
+        return 0;
+
+    /* The packets after one that doesn't fit must not go out before it. */
+    for (i = 0; i < num; ++i) {
+        if (write_connection_packet(c, conn, data[i], length[i]) == 0)
+            break;
+    }
+
+    return i;
 }
 
 /* Ceate a request to peer.
- * send_public_key and send_secret_key are the pub/secret keys of the sender.
  * recv_public_key is public key of reciever.
  * packet must be an array of MAX_DATA_SIZE big.
  * Data represents the data we send with the request with length being the length of the data.
@@ -218,8 +400,8 @@ int write_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uin
  * returns -1 on failure.
  * returns the length of the created packet on success.
  */
-int create_request(uint8_t *send_public_key, uint8_t *send_secret_key, uint8_t *packet, uint8_t *recv_public_key,
-                   uint8_t *data, uint32_t length, uint8_t request_id)
+int create_request(Net_Crypto *c, uint8_t *packet, uint8_t *recv_public_key, uint8_t *data, uint32_t length,
+                   uint8_t request_id)
 {
     if (MAX_DATA_SIZE < length + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + ENCRYPTION_PADDING)
         return -1;
@@ -229,15 +411,17 @@ int create_request(uint8_t *send_public_key, uint8_t *send_secret_key, uint8_t *
     memcpy(temp + 1, data, length);
     temp[0] = request_id;
     random_nonce(nonce);
-    int len = encrypt_data(recv_public_key, send_secret_key, nonce, temp, length + 1,
-                           1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + packet);
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(c, shared_key, recv_public_key);
+    int len = encrypt_data_fast(shared_key, nonce, temp, length + 1,
+                                1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + packet);
 
     if (len == -1)
         return -1;
 
     packet[0] = NET_PACKET_CRYPTO;
     memcpy(packet + 1, recv_public_key, crypto_box_PUBLICKEYBYTES);
-    memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, send_public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, c->self_public_key, crypto_box_PUBLICKEYBYTES);
     memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES * 2, nonce, crypto_box_NONCEBYTES);
 
     return len + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES;
@@ -259,9 +443,11 @@ static int handle_request(Net_Crypto *c, uint8_t *public_key, uint8_t *data, uin
         uint8_t nonce[crypto_box_NONCEBYTES];
         uint8_t temp[MAX_DATA_SIZE];
         memcpy(nonce, packet + 1 + crypto_box_PUBLICKEYBYTES * 2, crypto_box_NONCEBYTES);
-        int len1 = decrypt_data(public_key, c->self_secret_key, nonce,
-                                packet + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES,
-                                length - (crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1), temp);
+        uint8_t shared_key[crypto_box_BEFORENMBYTES];
+        get_shared_key(c, shared_key, public_key);
+        int len1 = decrypt_data_fast(shared_key, nonce,
+                                     packet + 1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES,
+                                     length - (crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1), temp);
 
         if (len1 == -1 || len1 == 0)
             return -1;
@@ -327,8 +513,10 @@ static int send_cryptohandshake(Net_Crypto *c, int connection_id, uint8_t *publi
     memcpy(temp, secret_nonce, crypto_box_NONCEBYTES);
     memcpy(temp + crypto_box_NONCEBYTES, session_key, crypto_box_PUBLICKEYBYTES);
 
-    int len = encrypt_data(public_key, c->self_secret_key, nonce, temp, crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
-                           1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + temp_data);
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(c, shared_key, public_key);
+    int len = encrypt_data_fast(shared_key, nonce, temp, crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
+                                1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + temp_data);
 
     if (len == -1)
         return 0;
@@ -361,9 +549,11 @@ static int handle_cryptohandshake(Net_Crypto *c, uint8_t *public_key, uint8_t *s
 
     memcpy(public_key, data + 1, crypto_box_PUBLICKEYBYTES);
 
-    int len = decrypt_data(public_key, c->self_secret_key, data + 1 + crypto_box_PUBLICKEYBYTES,
-                           data + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
-                           crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + pad, temp);
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    get_shared_key(c, shared_key, public_key);
+    int len = decrypt_data_fast(shared_key, data + 1 + crypto_box_PUBLICKEYBYTES,
+                                data + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
+                                crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + pad, temp);
 
     if (len != crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES)
         return 0;
@@ -379,18 +569,11 @@ static int handle_cryptohandshake(Net_Crypto *c, uint8_t *public_key, uint8_t *s
  */
 static int getcryptconnection_id(Net_Crypto *c, uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CONN_NO_CONNECTION)
-            if (memcmp(public_key, c->crypto_connections[i].public_key, crypto_box_PUBLICKEYBYTES) == 0)
-                return i;
-    }
-
-    return -1;
+    return key_index_find(&c->connection_keys, public_key);
 }
 
-/* Set the size of the friend list to numfriends.
+/* Set the size of the crypto connection list to num.
+ * Memory is only reallocated when it is exhausted or mostly unused.
  * return -1 if realloc fails.
  */
 int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
@@ -398,15 +581,26 @@ int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
     if (num == 0) {
         free(c->crypto_connections);
         c->crypto_connections = NULL;
+        c->crypto_connections_capacity = 0;
         return 0;
     }
 
-    Crypto_Connection *newcrypto_connections = realloc(c->crypto_connections, num * sizeof(Crypto_Connection));
+    uint32_t capacity = c->crypto_connections_capacity;
+
+    if (num > capacity)
+        capacity = MAX(num, capacity * 2);
+    else if (num * 4 <= capacity)
+        capacity /= 2;
+    else
+        return 0;
+
+    Crypto_Connection *newcrypto_connections = realloc(c->crypto_connections, capacity * sizeof(Crypto_Connection));
 
     if (newcrypto_connections == NULL)
         return -1;
 
     c->crypto_connections = newcrypto_connections;
+    c->crypto_connections_capacity = capacity;
     return 0;
 }
 
@@ -422,7 +616,7 @@ int crypto_connect(Net_Crypto *c, uint8_t *public_key, IP_Port ip_port)
     if (id != -1) {
         IP_Port c_ip = connection_ip(c->lossless_udp, c->crypto_connections[id].number);
 
-        if (c_ip.ip.uint32 == ip_port.ip.uint32 && c_ip.port == ip_port.port)
+        if (ipport_equal(c_ip, ip_port))
             return -1;
     }
 
@@ -432,15 +626,21 @@ int crypto_connect(Net_Crypto *c, uint8_t *public_key, IP_Port ip_port)
     memset(&(c->crypto_connections[c->crypto_connections_length]), 0, sizeof(Crypto_Connection));
     c->crypto_connections[c->crypto_connections_length].number = ~0;
 
-    for (i = 0; i <= c->crypto_connections_length; ++i) {
+    for (i = c->crypto_connections_free; i <= c->crypto_connections_length; ++i) {
         if (c->crypto_connections[i].status == CONN_NO_CONNECTION) {
             int id = new_connection(c->lossless_udp, ip_port);
 
             if (id == -1)
                 return -1;
 
+            if (key_index_add(&c->connection_keys, public_key, i) == -1) {
+                kill_connection(c->lossless_udp, id);
+                return -1;
+            }
+
             c->crypto_connections[i].number = id;
             c->crypto_connections[i].status = CONN_HANDSHAKE_SENT;
+            set_connection_tag(c->lossless_udp, id, i + 1);
             random_nonce(c->crypto_connections[i].recv_nonce);
             memcpy(c->crypto_connections[i].public_key, public_key, crypto_box_PUBLICKEYBYTES);
             crypto_box_keypair(c->crypto_connections[i].sessionpublic_key, c->crypto_connections[i].sessionsecret_key);
@@ -448,6 +648,8 @@ int crypto_connect(Net_Crypto *c, uint8_t *public_key, IP_Port ip_port)
             if (c->crypto_connections_length == i)
                 ++c->crypto_connections_length;
 
+            c->crypto_connections_free = i + 1;
+
             if (send_cryptohandshake(c, id, public_key,  c->crypto_connections[i].recv_nonce,
                                      c->crypto_connections[i].sessionpublic_key) == 1) {
                 increment_nonce(c->crypto_connections[i].recv_nonce);
@@ -510,6 +712,8 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 
     if (c->crypto_connections[crypt_connection_id].status != CONN_NO_CONNECTION) {
         c->crypto_connections[crypt_connection_id].status = CONN_NO_CONNECTION;
+        timer_unset(&c->ready, crypt_connection_id);
+        key_index_remove(&c->connection_keys, c->crypto_connections[crypt_connection_id].public_key, crypt_connection_id);
         kill_connection(c->lossless_udp, c->crypto_connections[crypt_connection_id].number);
         memset(&(c->crypto_connections[crypt_connection_id]), 0 , sizeof(Crypto_Connection));
         c->crypto_connections[crypt_connection_id].number = ~0;
@@ -521,6 +725,8 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         }
 
         c->crypto_connections_length = i;
+        c->crypto_connections_free = MIN(c->crypto_connections_free,
+                                         MIN((uint32_t)crypt_connection_id, c->crypto_connections_length));
         realloc_cryptoconnection(c, c->crypto_connections_length);
         return 0;
     }
@@ -552,10 +758,14 @@ int accept_crypto_inbound(Net_Crypto *c, int connection_id, uint8_t *public_key,
     memset(&(c->crypto_connections[c->crypto_connections_length]), 0, sizeof(Crypto_Connection));
     c->crypto_connections[c->crypto_connections_length].number = ~0;
 
-    for (i = 0; i <= c->crypto_connections_length; ++i) {
+    for (i = c->crypto_connections_free; i <= c->crypto_connections_length; ++i) {
         if (c->crypto_connections[i].status == CONN_NO_CONNECTION) {
+            if (key_index_add(&c->connection_keys, public_key, i) == -1)
+                return -1;
+
             c->crypto_connections[i].number = connection_id;
             c->crypto_connections[i].status = CONN_NOT_CONFIRMED;
+            set_connection_tag(c->lossless_udp, connection_id, i + 1);
             random_nonce(c->crypto_connections[i].recv_nonce);
             memcpy(c->crypto_connections[i].sent_nonce, secret_nonce, crypto_box_NONCEBYTES);
             memcpy(c->crypto_connections[i].peersessionpublic_key, session_key, crypto_box_PUBLICKEYBYTES);
@@ -567,6 +777,8 @@ int accept_crypto_inbound(Net_Crypto *c, int connection_id, uint8_t *public_key,
             if (c->crypto_connections_length == i)
                 ++c->crypto_connections_length;
 
+            c->crypto_connections_free = i + 1;
+
             if (send_cryptohandshake(c, connection_id, public_key, c->crypto_connections[i].recv_nonce,
                                      c->crypto_connections[i].sessionpublic_key) == 1) {
                 increment_nonce(c->crypto_connections[i].recv_nonce);
@@ -578,6 +790,8 @@ int accept_crypto_inbound(Net_Crypto *c, int connection_id, uint8_t *public_key,
                     CONN_ESTABLISHED; /* Connection status needs to be 3 for write_cryptpacket() to work. */
                 write_cryptpacket(c, i, ((uint8_t *)&zero), sizeof(zero));
                 c->crypto_connections[i].status = CONN_NOT_CONFIRMED; /* Set it to its proper value right after. */
+                /* What arrived before the tag was set was not looked at. */
+                check_connection(c, i);
                 return i;
             }
 
@@ -605,6 +819,7 @@ int is_cryptoconnected(Net_Crypto *c, int crypt_connection_id)
 void new_keys(Net_Crypto *c)
 {
     crypto_box_keypair(c->self_public_key, c->self_secret_key);
+    shared_key_cache_clear(&c->shared_keys);
 }
 
 /* Save the public and private keys to the keys array.
@@ -623,6 +838,7 @@ void load_keys(Net_Crypto *c, uint8_t *keys)
 {
     memcpy(c->self_public_key, keys, crypto_box_PUBLICKEYBYTES);
     memcpy(c->self_secret_key, keys + crypto_box_PUBLICKEYBYTES, crypto_box_SECRETKEYBYTES);
+    shared_key_cache_clear(&c->shared_keys);
 }
 
 /* Adds an incoming connection to the incoming_connection list.
@@ -659,75 +875,101 @@ static void handle_incomings(Net_Crypto *c)
     }
 }
 
-/* Handle received packets for not yet established crypto connections. */
-static void receive_crypto(Net_Crypto *c)
+/* Handle received packets for a not yet established crypto connection. */
+static void receive_crypto(Net_Crypto *c, int i)
 {
-    uint32_t i;
+    if (c->crypto_connections[i].status == CONN_HANDSHAKE_SENT) {
+        uint8_t temp_data[MAX_DATA_SIZE];
+        uint8_t secret_nonce[crypto_box_NONCEBYTES];
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t session_key[crypto_box_PUBLICKEYBYTES];
+        uint16_t len;
+
+        if (id_packet(c->lossless_udp, c->crypto_connections[i].number) == 2) { /* Handle handshake packet. */
+            len = read_packet(c->lossless_udp, c->crypto_connections[i].number, temp_data);
+
+            if (handle_cryptohandshake(c, public_key, secret_nonce, session_key, temp_data, len)) {
+                if (memcmp(public_key, c->crypto_connections[i].public_key, crypto_box_PUBLICKEYBYTES) == 0) {
+                    memcpy(c->crypto_connections[i].sent_nonce, secret_nonce, crypto_box_NONCEBYTES);
+                    memcpy(c->crypto_connections[i].peersessionpublic_key, session_key, crypto_box_PUBLICKEYBYTES);
+                    increment_nonce(c->crypto_connections[i].sent_nonce);
+                    uint32_t zero = 0;
+                    encrypt_precompute(c->crypto_connections[i].peersessionpublic_key,
+                                       c->crypto_connections[i].sessionsecret_key,
+                                       c->crypto_connections[i].shared_key);
+                    c->crypto_connections[i].status =
+                        CONN_ESTABLISHED; /* Connection status needs to be 3 for write_cryptpacket() to work. */
+                    write_cryptpacket(c, i, ((uint8_t *)&zero), sizeof(zero));
+                    c->crypto_connections[i].status = CONN_NOT_CONFIRMED; /* Set it to its proper value right after. */
+                }
+            }
+        } else if (id_packet(c->lossless_udp,
+                             c->crypto_connections[i].number) != -1) { // This should not happen, kill the connection if it does.
+            crypto_kill(c, i);
+        }
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CONN_HANDSHAKE_SENT) {
+        return;
+    }
+
+    if (c->crypto_connections[i].status == CONN_NOT_CONFIRMED) {
+        if (id_packet(c->lossless_udp, c->crypto_connections[i].number) == 3) {
             uint8_t temp_data[MAX_DATA_SIZE];
-            uint8_t secret_nonce[crypto_box_NONCEBYTES];
-            uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-            uint8_t session_key[crypto_box_PUBLICKEYBYTES];
-            uint16_t len;
+            uint8_t data[MAX_DATA_SIZE];
+            int length = read_packet(c->lossless_udp, c->crypto_connections[i].number, temp_data);
+            int len = decrypt_data(c->crypto_connections[i].peersessionpublic_key,
+                                   c->crypto_connections[i].sessionsecret_key,
+                                   c->crypto_connections[i].recv_nonce, temp_data + 1, length - 1, data);
+            uint32_t zero = 0;
 
-            if (id_packet(c->lossless_udp, c->crypto_connections[i].number) == 2) { /* Handle handshake packet. */
-                len = read_packet(c->lossless_udp, c->crypto_connections[i].number, temp_data);
+            if (len == sizeof(uint32_t) && memcmp(((uint8_t *)&zero), data, sizeof(uint32_t)) == 0) {
+                increment_nonce(c->crypto_connections[i].recv_nonce);
+                encrypt_precompute(c->crypto_connections[i].peersessionpublic_key,
+                                   c->crypto_connections[i].sessionsecret_key,
+                                   c->crypto_connections[i].shared_key);
+                c->crypto_connections[i].status = CONN_ESTABLISHED;
 
-                if (handle_cryptohandshake(c, public_key, secret_nonce, session_key, temp_data, len)) {
-                    if (memcmp(public_key, c->crypto_connections[i].public_key, crypto_box_PUBLICKEYBYTES) == 0) {
-                        memcpy(c->crypto_connections[i].sent_nonce, secret_nonce, crypto_box_NONCEBYTES);
-                        memcpy(c->crypto_connections[i].peersessionpublic_key, session_key, crypto_box_PUBLICKEYBYTES);
-                        increment_nonce(c->crypto_connections[i].sent_nonce);
-                        uint32_t zero = 0;
-                        encrypt_precompute(c->crypto_connections[i].peersessionpublic_key,
-                                           c->crypto_connections[i].sessionsecret_key,
-                                           c->crypto_connections[i].shared_key);
-                        c->crypto_connections[i].status =
-                            CONN_ESTABLISHED; /* Connection status needs to be 3 for write_cryptpacket() to work. */
-                        write_cryptpacket(c, i, ((uint8_t *)&zero), sizeof(zero));
-                        c->crypto_connections[i].status = CONN_NOT_CONFIRMED; /* Set it to its proper value right after. */
-                    }
-                }
-            } else if (id_packet(c->lossless_udp,
-                                 c->crypto_connections[i].number) != -1) { // This should not happen, kill the connection if it does.
+                /* Connection is accepted so we disable the auto kill by setting it to about 1 month from now. */
+                kill_connection_in(c->lossless_udp, c->crypto_connections[i].number, 3000000);
+            } else {
+                /* This should not happen, kill the connection if it does. */
                 crypto_kill(c, i);
-                return;
             }
-        }
+        } else if (id_packet(c->lossless_udp, c->crypto_connections[i].number) != -1)
+            /* This should not happen, kill the connection if it does. */
+            crypto_kill(c, i);
+    }
+}
 
-        if (c->crypto_connections[i].status == CONN_NOT_CONFIRMED) {
-            if (id_packet(c->lossless_udp, c->crypto_connections[i].number) == 3) {
-                uint8_t temp_data[MAX_DATA_SIZE];
-                uint8_t data[MAX_DATA_SIZE];
-                int length = read_packet(c->lossless_udp, c->crypto_connections[i].number, temp_data);
-                int len = decrypt_data(c->crypto_connections[i].peersessionpublic_key,
-                                       c->crypto_connections[i].sessionsecret_key,
-                                       c->crypto_connections[i].recv_nonce, temp_data + 1, length - 1, data);
-                uint32_t zero = 0;
+/* Look at a crypto connection whose Lossless_UDP connection received something or timed out:
+ * go through the handshake packets, mark it timed out, then give it to crypto_pop_ready().
+ */
+static void check_connection(Net_Crypto *c, int i)
+{
+    uint8_t status;
 
-                if (len == sizeof(uint32_t) && memcmp(((uint8_t *)&zero), data, sizeof(uint32_t)) == 0) {
-                    increment_nonce(c->crypto_connections[i].recv_nonce);
-                    encrypt_precompute(c->crypto_connections[i].peersessionpublic_key,
-                                       c->crypto_connections[i].sessionsecret_key,
-                                       c->crypto_connections[i].shared_key);
-                    c->crypto_connections[i].status = CONN_ESTABLISHED;
-
-                    /* Connection is accepted so we disable the auto kill by setting it to about 1 month from now. */
-                    kill_connection_in(c->lossless_udp, c->crypto_connections[i].number, 3000000);
-                } else {
-                    /* This should not happen, kill the connection if it does. */
-                    crypto_kill(c, i);
-                    return;
-                }
-            } else if (id_packet(c->lossless_udp, c->crypto_connections[i].number) != -1)
-                /* This should not happen, kill the connection if it does. */
-                crypto_kill(c, i);
+    do {
+        status = c->crypto_connections[i].status;
+        receive_crypto(c, i);
 
+        /* Killed, the array may have shrunk. */
+        if (i >= c->crypto_connections_length)
             return;
-        }
-    }
+    } while (c->crypto_connections[i].status != status
+             && (c->crypto_connections[i].status == CONN_HANDSHAKE_SENT
+                 || c->crypto_connections[i].status == CONN_NOT_CONFIRMED));
+
+    if (c->crypto_connections[i].status == CONN_NO_CONNECTION)
+        return;
+
+    if (is_connected(c->lossless_udp, c->crypto_connections[i].number) == 4)
+        c->crypto_connections[i].status = CONN_TIMED_OUT;
+
+    timer_set(&c->ready, i, 0);
+}
+
+int crypto_pop_ready(Net_Crypto *c)
+{
+    return timer_pop(&c->ready, 0);
 }
 
 /* Run this to (re)initialize net_crypto.
@@ -748,7 +990,15 @@ Net_Crypto *new_net_crypto(Networking_Core *net)
     if (temp->lossless_udp == NULL)
         return NULL;
 
+    if (shared_key_cache_init(&temp->shared_keys, SHARED_KEY_CACHE_SIZE) == -1) {
+        kill_lossless_udp(temp->lossless_udp);
+        free(temp);
+        return NULL;
+    }
+
     memset(temp->incoming_connections, -1 , sizeof(int) * MAX_INCOMING);
+    key_index_init(&temp->connection_keys);
+    timer_heap_init(&temp->ready);
     return temp;
 }
 
@@ -758,39 +1008,44 @@ void init_cryptopackets(void *dht)
     networking_registerhandler(s_dht->c->lossless_udp->net, NET_PACKET_CRYPTO, &cryptopacket_handle, s_dht);
 }
 
-static void kill_timedout(Net_Crypto *c)
+/* Main loop. */
+void do_net_crypto_connections(Net_Crypto *c)
 {
-    uint32_t i;
+    int connection_id;
 
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CONN_NO_CONNECTION
-                && is_connected(c->lossless_udp, c->crypto_connections[i].number) == 4)
-            c->crypto_connections[i].status = CONN_TIMED_OUT;
-        else if (is_connected(c->lossless_udp, c->crypto_connections[i].number) == 4) {
-            kill_connection(c->lossless_udp, c->crypto_connections[i].number);
-            c->crypto_connections[i].number = ~0;
-        }
+    handle_incomings(c);
+
+    while ((connection_id = lossless_udp_pop_ready(c->lossless_udp)) != -1) {
+        /* The crypto connection id plus one, 0 if it has none (yet). */
+        uint32_t tag = connection_tag(c->lossless_udp, connection_id);
+
+        if (tag != 0 && tag <= c->crypto_connections_length
+                && c->crypto_connections[tag - 1].number == connection_id)
+            check_connection(c, tag - 1);
     }
 }
 
-/* Main loop. */
 void do_net_crypto(Net_Crypto *c)
 {
     do_lossless_udp(c->lossless_udp);
-    handle_incomings(c);
-    receive_crypto(c);
-    kill_timedout(c);
+    do_net_crypto_connections(c);
 }
 
 void kill_net_crypto(Net_Crypto *c)
 {
     uint32_t i;
 
+    crypto_workers_stop(c);
+
     for (i = 0; i < c->crypto_connections_length; ++i) {
         crypto_kill(c, i);
     }
 
+    realloc_cryptoconnection(c, 0);
     kill_lossless_udp(c->lossless_udp);
+    key_index_free(&c->connection_keys);
+    timer_heap_free(&c->ready);
+    shared_key_cache_free(&c->shared_keys);
     memset(c, 0, sizeof(Net_Crypto));
     free(c);
 }
@@ -25,6 +25,8 @@
 #define NET_CRYPTO_H
 
 #include "Lossless_UDP.h"
+#include "key_index.h"
+#include "shared_key_cache.h"
 
 #define MAX_INCOMING 64
 
@@ -61,15 +63,31 @@ typedef struct {
     Crypto_Connection *crypto_connections;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
+    uint32_t crypto_connections_capacity; /* Allocated length of connections array. */
+    uint32_t crypto_connections_free; /* Every connection below this index is in use. */
+
+    /* Index of the crypto_connections in use by the public key of the peer. */
+    Key_Index connection_keys;
+
+    /* Connections for crypto_pop_ready(), the deadlines are all 0. */
+    Timer_Heap ready;
 
     /* Our public and secret keys. */
     uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
     uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
 
+    /* Shared keys between self_secret_key and the peers we send packets to outside of
+     * crypto connections (DHT, pings, requests, handshakes), see get_shared_key().
+     */
+    Shared_Key_Cache shared_keys;
+
     /* keeps track of the connection numbers for friends request so we can check later if they were sent. */
     int incoming_connections[MAX_INCOMING];
 
     Cryptopacket_Handles cryptopackethandlers[256];
+
+    /* Crypto worker threads, NULL if not started (see crypto_workers.h). */
+    void *workers;
 } Net_Crypto;
 
 #include "DHT.h"
@@ -110,6 +128,20 @@ int decrypt_data_fast(uint8_t *enc_key, uint8_t *nonce,
                       uint8_t *encrypted, uint32_t length, uint8_t *plain);
 
 
+/* Put the shared key between our secret key and public_key in shared_key, for use with
+ * encrypt_data_fast()/decrypt_data_fast().
+ * Recently used ones come from a cache (c->shared_keys, with hit and miss counters)
+ * instead of being computed every time.
+ */
+void get_shared_key(Net_Crypto *c, uint8_t *shared_key, uint8_t *public_key);
+
+/* Set the number of shared keys get_shared_key() keeps, the default is SHARED_KEY_CACHE_SIZE.
+ * Nodes that exchange packets with many peers (bootstrap nodes) want more.
+ *  return 0 on success.
+ *  return -1 on failure (the cache is left as it was).
+ */
+int set_shared_key_cache_size(Net_Crypto *c, uint32_t size);
+
 /* Fill the given nonce with random bytes. */
 void random_nonce(uint8_t *nonce);
 
@@ -124,8 +156,38 @@ int read_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data);
  */
 int write_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uint32_t length);
 
-/* Create a request to peer.
- * send_public_key and send_secret_key are the pub/secret keys of the sender.
+/* Same as write_cryptpacket() for num packets: data[i] is length[i] bytes long.
+ * The connection is checked once and the packets are encrypted one after the other,
+ * in order, until one doesn't fit in the queue.
+ * return the number of packets put in the queue (the first ones).
+ */
+uint32_t write_cryptpackets(Net_Crypto *c, int crypt_connection_id, uint8_t **data, uint32_t *length, uint32_t num);
+
+/* return a buffer with room in front for the headers, to put up to length bytes of data in
+ * for write_cryptpacket_buffer() (set its length to what was written).
+ * return NULL if out of memory.
+ */
+Packet_Buffer *new_cryptpacket_buffer(uint32_t length);
+
+/* Same as write_cryptpacket() for data in a buffer from new_cryptpacket_buffer(): the data is
+ * encrypted where it is instead of being copied, it can't be sent again afterwards.
+ * The caller keeps its reference.
+ * return 0 if data could not be put in packet queue.
+ * return 1 if data was put into the queue.
+ */
+int write_cryptpacket_buffer(Net_Crypto *c, int crypt_connection_id, Packet_Buffer *buffer);
+
+/* return the number of packets write_cryptpacket() can still put in the send queue.
+ * return 0 if the connection is not established.
+ */
+uint32_t crypto_sendqueue_room(Net_Crypto *c, int crypt_connection_id);
+
+/* return the number of packets in the send queue waiting to be acknowledged.
+ * return 0 if the connection is not established.
+ */
+uint32_t crypto_sendqueue(Net_Crypto *c, int crypt_connection_id);
+
+/* Create a request from us to peer.
  * recv_public_key is public key of reciever.
  * packet must be an array of MAX_DATA_SIZE big.
  * Data represents the data we send with the request with length being the length of the data.
@@ -134,8 +196,8 @@ int write_cryptpacket(Net_Crypto *c, int crypt_connection_id, uint8_t *data, uin
  * returns -1 on failure.
  * returns the length of the created packet on success.
  */
-int create_request(uint8_t *send_public_key, uint8_t *send_secret_key, uint8_t *packet, uint8_t *recv_public_key,
-                   uint8_t *data, uint32_t length, uint8_t request_id);
+int create_request(Net_Crypto *c, uint8_t *packet, uint8_t *recv_public_key, uint8_t *data, uint32_t length,
+                   uint8_t request_id);
 
 
 /* Function to call when request beginning with byte is received. */
@@ -179,6 +241,13 @@ int accept_crypto_inbound(Net_Crypto *c, int connection_id, uint8_t *public_key,
  */
 int is_cryptoconnected(Net_Crypto *c, int crypt_connection_id);
 
+/* return the id of a crypto connection that may have changed status, received data for
+ * read_cryptpacket() or got room in its send queue since it was last returned.
+ * return -1 if there is none.
+ * Connections are only returned again once something new happens to them, so read all there is.
+ */
+int crypto_pop_ready(Net_Crypto *c);
+
 
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
@@ -203,6 +272,11 @@ Net_Crypto *new_net_crypto(Networking_Core *net);
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c);
 
+/* do_net_crypto() without the do_lossless_udp() part: incoming connections, received
+ * handshakes and data, timed out connections.
+ */
+void do_net_crypto_connections(Net_Crypto *c);
+
 void kill_net_crypto(Net_Crypto *c);
 
 /* Initialize the cryptopacket handling. */
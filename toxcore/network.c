@@ -21,12 +21,42 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* recvmmsg/sendmmsg are GNU extensions. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "network.h"
 
+#if defined(WIN32) || !defined(HAVE_RECVMMSG)
+#undef HAVE_RECVMMSG
+#endif
+
+#if defined(WIN32) || !defined(HAVE_SENDMMSG)
+#undef HAVE_SENDMMSG
+#endif
+
+static clock_callback clock_function;
+static void *clock_object;
+
+void networking_set_clock(clock_callback cb, void *object)
+{
+    clock_function = cb;
+    clock_object = object;
+}
+
 /* return current UNIX time in microseconds (us). */
 uint64_t current_time(void)
 {
     uint64_t time;
+
+    if (clock_function != NULL)
+        return clock_function(clock_object);
+
 #ifdef WIN32
     /* This probably works fine */
     FILETIME ft;
@@ -60,35 +90,241 @@ uint32_t random_int(void)
 /* Basic network functions:
  * Function to send packet(data) of length length to ip_port.
  */
-int sendpacket(int sock, IP_Port ip_port, uint8_t *data, uint32_t length)
+static void count_sent(Networking_Core *net, int length)
+{
+    if (length < 0) {
+        ++net->stats.send_errors;
+        return;
+    }
+
+    ++net->stats.packets_sent;
+    net->stats.bytes_sent += length;
+}
+
+/* Put ip_port in addr, the way the socket of net takes it.
+ * return the length of the address.
+ * return 0 if the socket can't send to it (IPv6 address but no IPv6).
+ */
+static uint32_t ipport_to_addr(Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+
+    if (net->family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = ip_port.port;
+        memcpy(&addr6->sin6_addr, ip_port.ip.uint8, sizeof(ip_port.ip));
+        return sizeof(struct sockaddr_in6);
+    }
+
+    if (!ip_is_v4(ip_port.ip))
+        return 0;
+
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = ip_port.port;
+    addr4->sin_addr.s_addr = ip_port.ip.uint32[3];
+    return sizeof(struct sockaddr_in);
+}
+
+/* Put the address in addr in ip_port.
+ * return 0 on success.
+ * return -1 if it isn't an IP one.
+ */
+static int addr_to_ipport(struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    ip_port->padding = 0;
+
+    if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+        memcpy(ip_port->ip.uint8, &addr6->sin6_addr, sizeof(ip_port->ip));
+        ip_port->port = addr6->sin6_port;
+        return 0;
+    }
+
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+        ip_init_v4(&ip_port->ip, addr4->sin_addr.s_addr);
+        ip_port->port = addr4->sin_port;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int sendpacket_direct(Networking_Core *net, IP_Port ip_port, uint8_t *data, uint32_t length)
 {
-    ADDR addr = {AF_INET, ip_port.port, ip_port.ip};
-    return sendto(sock, (char *) data, length, 0, (struct sockaddr *)&addr, sizeof(addr));
+    int ret = -1;
+
+    if (net->transport != NULL) {
+        ret = net->transport(net->transport_object, ip_port, data, length);
+    } else {
+        struct sockaddr_storage addr;
+        uint32_t addrlen = ipport_to_addr(net, ip_port, &addr);
+
+        if (addrlen != 0)
+            ret = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrlen);
+    }
+
+    count_sent(net, ret);
+    return ret;
+}
+
+int sendpacket(Networking_Core *net, IP_Port ip_port, uint8_t *data, uint32_t length)
+{
+    if (!net->send_batching || length > NET_BATCH_PACKET_SIZE) {
+        /* Keep ordering with anything still queued. */
+        networking_flush(net);
+        return sendpacket_direct(net, ip_port, data, length);
+    }
+
+    if (net->send_queue_length == NET_BATCH_SIZE)
+        networking_flush(net);
+
+    Queued_Packet *queued = &net->send_queue[net->send_queue_length++];
+    queued->ip_port = ip_port;
+    queued->length = length;
+    queued->buffer = NULL;
+    memcpy(queued->data, data, length);
+    return length;
+}
+
+int sendpacket_buffer(Networking_Core *net, IP_Port ip_port, Packet_Buffer *buffer)
+{
+    if (!net->send_batching) {
+        networking_flush(net);
+        return sendpacket_direct(net, ip_port, packet_buffer_data(buffer), buffer->length);
+    }
+
+    if (net->send_queue_length == NET_BATCH_SIZE)
+        networking_flush(net);
+
+    Queued_Packet *queued = &net->send_queue[net->send_queue_length++];
+    queued->ip_port = ip_port;
+    queued->length = buffer->length;
+    queued->buffer = packet_buffer_ref(buffer);
+    return buffer->length;
 }
 
+static uint8_t *queued_data(Queued_Packet *queued)
+{
+    if (queued->buffer != NULL)
+        return packet_buffer_data(queued->buffer);
+
+    return queued->data;
+}
+
+#ifdef HAVE_SENDMMSG
+
+static void flush_sendmmsg(Networking_Core *net)
+{
+    struct sockaddr_storage addrs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    uint32_t i;
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < net->send_queue_length; ++i) {
+        Queued_Packet *queued = &net->send_queue[i];
+        iovecs[i].iov_base = queued_data(queued);
+        iovecs[i].iov_len = queued->length;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        /* A 0 length address makes sendmmsg() fail the packet, which is then dropped below. */
+        msgs[i].msg_hdr.msg_namelen = ipport_to_addr(net, queued->ip_port, &addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = 0;
+
+    while (i < net->send_queue_length) {
+        int sent = sendmmsg(net->sock, msgs + i, net->send_queue_length - i, 0);
+
+        if (sent <= 0) {
+            /* The packet at i failed (full socket buffer or bad address), drop it like sendto would. */
+            count_sent(net, -1);
+            ++i;
+        } else {
+            for (; sent > 0; --sent, ++i)
+                count_sent(net, net->send_queue[i].length);
+        }
+    }
+}
+
+#endif
+
+void networking_flush(Networking_Core *net)
+{
+    uint32_t i;
+
+    if (net->send_queue_length == 0)
+        return;
+
+#ifdef HAVE_SENDMMSG
+
+    if (net->transport == NULL)
+        flush_sendmmsg(net);
+    else
+#endif
+        for (i = 0; i < net->send_queue_length; ++i)
+            sendpacket_direct(net, net->send_queue[i].ip_port, queued_data(&net->send_queue[i]),
+                              net->send_queue[i].length);
+
+    for (i = 0; i < net->send_queue_length; ++i)
+        packet_buffer_unref(net->send_queue[i].buffer);
+
+    net->send_queue_length = 0;
+}
+
+int networking_set_batching(Networking_Core *net, uint8_t enable)
+{
+    if (!enable) {
+        networking_flush(net);
+        net->send_batching = 0;
+        return 0;
+    }
+
+    if (net->send_queue == NULL) {
+        net->send_queue = malloc(NET_BATCH_SIZE * sizeof(Queued_Packet));
+
+        if (net->send_queue == NULL)
+            return -1;
+    }
+
+    net->send_batching = 1;
+    return 0;
+}
+
+#ifndef HAVE_RECVMMSG
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
  *  Packet data is put into data.
  *  Packet length is put into length.
  *  Dump all empty packets.
  */
-static int receivepacket(int sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+static int receivepacket(int sock, IP_Port *ip_port, uint8_t *data, uint32_t max_length,
+                         uint32_t *length)
 {
-    ADDR addr;
+    struct sockaddr_storage addr;
 #ifdef WIN32
     int addrlen = sizeof(addr);
 #else
     uint32_t addrlen = sizeof(addr);
 #endif
-    (*(int32_t *)length) = recvfrom(sock, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
 
-    if (*(int32_t *)length <= 0)
-        return -1; /* Nothing received or empty packet. */
+    while (1) {
+        (*(int32_t *)length) = recvfrom(sock, (char *) data, max_length, 0, (struct sockaddr *)&addr, &addrlen);
 
-    ip_port->ip = addr.ip;
-    ip_port->port = addr.port;
-    return 0;
+        if (*(int32_t *)length <= 0)
+            return -1; /* Nothing received or empty packet. */
+
+        if (addr_to_ipport(&addr, ip_port) == 0)
+            return 0;
+
+        addrlen = sizeof(addr);
+    }
 }
+#endif
 
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
 {
@@ -96,19 +332,253 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
     net->packethandlers[byte].object = object;
 }
 
+/* return a receive buffer for slot i that no one else holds a reference to.
+ * return NULL if out of memory.
+ */
+static Packet_Buffer *recv_buffer(Networking_Core *net, uint32_t i, uint32_t size)
+{
+    Packet_Buffer *buffer = net->recv_buffers[i];
+
+    if (buffer != NULL && buffer->refcount != 1) {
+        packet_buffer_unref(buffer);
+        buffer = NULL;
+    }
+
+    if (buffer == NULL) {
+        buffer = new_packet_buffer(PACKET_BUFFER_HEADROOM + size, PACKET_BUFFER_HEADROOM);
+        net->recv_buffers[i] = buffer;
+
+        if (buffer == NULL)
+            return NULL;
+    }
+
+    buffer->offset = PACKET_BUFFER_HEADROOM;
+    buffer->length = 0;
+    return buffer;
+}
+
+static void networking_dispatch(Networking_Core *net, IP_Port ip_port, Packet_Buffer *buffer, uint32_t length)
+{
+    if (length < 1)
+        return;
+
+    uint8_t *data = packet_buffer_data(buffer);
+    ++net->stats.packets_received[data[0]];
+    net->stats.bytes_received += length;
+
+    if (!(net->packethandlers[data[0]].function)) {
+        ++net->stats.packets_dropped;
+        return;
+    }
+
+    buffer->length = length;
+    net->recv_packet = buffer;
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
+    net->recv_packet = NULL;
+}
+
+int networking_set_wakeup_handler(Networking_Core *net, wakeup_handler_callback cb, void *object)
+{
+#ifdef WIN32
+    return -1;
+#else
+
+    if (cb == NULL) {
+        if (net->wakeup_object == object) {
+            net->wakeup_handler = NULL;
+            net->wakeup_object = NULL;
+        }
+
+        return 0;
+    }
+
+    if (net->wakeup_handler != NULL && (net->wakeup_handler != cb || net->wakeup_object != object))
+        return -1;
+
+    if (net->wakeup_fds[0] == -1) {
+        if (pipe(net->wakeup_fds) == -1) {
+            net->wakeup_fds[0] = net->wakeup_fds[1] = -1;
+            return -1;
+        }
+
+        fcntl(net->wakeup_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(net->wakeup_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    net->wakeup_handler = cb;
+    net->wakeup_object = object;
+    return 0;
+#endif
+}
+
+void networking_wakeup(Networking_Core *net)
+{
+#ifndef WIN32
+    uint8_t byte = 0;
+
+    if (net->wakeup_fds[1] == -1)
+        return;
+
+    /* Nothing to do if it fails: the pipe is full so a wakeup is pending already. */
+    if (write(net->wakeup_fds[1], &byte, 1) == -1)
+        return;
+
+#endif
+}
+
+static void handle_wakeup(Networking_Core *net)
+{
+#ifndef WIN32
+    uint8_t bytes[64];
+    int woken = 0;
+
+    if (net->wakeup_fds[0] == -1)
+        return;
+
+    while (read(net->wakeup_fds[0], bytes, sizeof(bytes)) > 0)
+        woken = 1;
+
+    if (woken && net->wakeup_handler != NULL)
+        net->wakeup_handler(net->wakeup_object);
+
+#endif
+}
+
+#ifdef HAVE_RECVMMSG
+
+void networking_poll(Networking_Core *net)
+{
+    struct sockaddr_storage addrs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    Packet_Buffer *buffers[NET_BATCH_SIZE];
+    int received, num, i;
+
+    handle_wakeup(net);
+
+    if (net->transport != NULL) {
+        networking_flush(net);
+        return;
+    }
+
+    do {
+        memset(msgs, 0, sizeof(msgs));
+
+        for (num = 0; num < NET_BATCH_SIZE; ++num) {
+            buffers[num] = recv_buffer(net, num, NET_BATCH_PACKET_SIZE);
+
+            if (buffers[num] == NULL)
+                break;
+
+            iovecs[num].iov_base = packet_buffer_data(buffers[num]);
+            iovecs[num].iov_len = NET_BATCH_PACKET_SIZE;
+            msgs[num].msg_hdr.msg_name = &addrs[num];
+            msgs[num].msg_hdr.msg_namelen = sizeof(addrs[num]);
+            msgs[num].msg_hdr.msg_iov = &iovecs[num];
+            msgs[num].msg_hdr.msg_iovlen = 1;
+        }
+
+        if (num == 0)
+            break;
+
+        received = recvmmsg(net->sock, msgs, num, MSG_DONTWAIT, NULL);
+
+        for (i = 0; i < received; ++i) {
+            /* Dump truncated packets, none of ours are that big. */
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                ++net->stats.packets_dropped;
+                continue;
+            }
+
+            IP_Port ip_port;
+
+            if (addr_to_ipport(&addrs[i], &ip_port) == -1) {
+                ++net->stats.packets_dropped;
+                continue;
+            }
+
+            networking_dispatch(net, ip_port, buffers[i], msgs[i].msg_len);
+        }
+    } while (received == num);
+
+    networking_flush(net);
+}
+
+#else
+
 void networking_poll(Networking_Core *net)
 {
     IP_Port ip_port;
-    uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
+    Packet_Buffer *buffer;
 
-    while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) continue;
+    handle_wakeup(net);
+
+    /* One byte more than the batched path takes, to tell the packets that are too big:
+     * dumped like the truncated ones recvmmsg gets, so the same packets get through everywhere.
+     */
+    while (net->transport == NULL && (buffer = recv_buffer(net, 0, NET_BATCH_PACKET_SIZE + 1)) != NULL
+            && receivepacket(net->sock, &ip_port, packet_buffer_data(buffer), NET_BATCH_PACKET_SIZE + 1, &length) != -1) {
+        if (length > NET_BATCH_PACKET_SIZE) {
+            ++net->stats.packets_dropped;
+            continue;
+        }
+
+        networking_dispatch(net, ip_port, buffer, length);
+    }
+
+    networking_flush(net);
+}
 
-        if (!(net->packethandlers[data[0]].function)) continue;
+#endif
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length);
+void networking_receive(Networking_Core *net, IP_Port ip_port, uint8_t *data, uint32_t length)
+{
+    /* Dropped like the truncated ones the socket gets, none of ours are that big. */
+    if (length > NET_BATCH_PACKET_SIZE) {
+        ++net->stats.packets_dropped;
+        return;
     }
+
+    Packet_Buffer *buffer = recv_buffer(net, 0, NET_BATCH_PACKET_SIZE);
+
+    if (buffer == NULL)
+        return;
+
+    memcpy(packet_buffer_data(buffer), data, length);
+    networking_dispatch(net, ip_port, buffer, length);
+}
+
+int networking_wait(Networking_Core *net, uint32_t timeout_ms)
+{
+    fd_set readfds;
+    struct timeval timeout;
+    int nfds = net->sock + 1;
+
+    FD_ZERO(&readfds);
+
+    if (net->sock != -1)
+        FD_SET(net->sock, &readfds);
+
+#ifndef WIN32
+
+    if (net->wakeup_fds[0] != -1) {
+        FD_SET(net->wakeup_fds[0], &readfds);
+
+        if (net->wakeup_fds[0] >= nfds)
+            nfds = net->wakeup_fds[0] + 1;
+    }
+
+#endif
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int ret = select(nfds, &readfds, NULL, NULL, &timeout);
+
+    if (ret < 0)
+        return -1;
+
+    return ret != 0;
 }
 
 uint8_t at_startup_ran;
@@ -141,8 +611,7 @@ static void at_shutdown(void)
 */
 
 /* Initialize networking.
- * Bind to ip and port.
- * ip must be in network order EX: 127.0.0.1 = (7F000001).
+ * Bind to ip and port, with a dual-stack socket if ip is :: (see network.h).
  * port is in host byte order (this means don't worry about it).
  *
  * returns Networking_Core object if no problems
@@ -159,7 +628,15 @@ Networking_Core *new_networking(IP ip, uint16_t port)
     if (temp == NULL)
         return NULL;
 
-    temp->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    temp->wakeup_fds[0] = temp->wakeup_fds[1] = -1;
+    temp->family = ip_is_v4(ip) ? AF_INET : AF_INET6;
+    temp->sock = socket(temp->family, SOCK_DGRAM, IPPROTO_UDP);
+
+    /* No IPv6 here, do IPv4 only. */
+    if (temp->sock < 0 && temp->family == AF_INET6 && !ip_isset(ip)) {
+        temp->family = AF_INET;
+        temp->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    }
 
     /* Check for socket error. */
 #ifdef WIN32
@@ -206,20 +683,68 @@ Networking_Core *new_networking(IP ip, uint16_t port)
     fcntl(temp->sock, F_SETFL, O_NONBLOCK, 1);
 #endif
 
-    /* Bind our socket to port PORT and address 0.0.0.0 */
-    ADDR addr = {AF_INET, htons(port), ip};
-    bind(temp->sock, (struct sockaddr *)&addr, sizeof(addr));
+    if (temp->family == AF_INET6) {
+        /* Take IPv4 packets too, as mapped addresses. */
+        int v6only = 0;
+        setsockopt(temp->sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&v6only, sizeof(v6only));
+    }
+
+    /* Bind our socket to port PORT and address ip. */
+    IP_Port ip_port = {ip, htons(port), 0};
+
+    if (temp->family == AF_INET && !ip_isset(ip))
+        ip_init_v4(&ip_port.ip, 0);
+
+    struct sockaddr_storage addr;
+    bind(temp->sock, (struct sockaddr *)&addr, ipport_to_addr(temp, ip_port, &addr));
+    return temp;
+}
+
+Networking_Core *new_networking_transport(IP ip, transport_send_callback cb, void *object)
+{
+    if (at_startup() != 0 || cb == NULL)
+        return NULL;
+
+    Networking_Core *temp = calloc(1, sizeof(Networking_Core));
+
+    if (temp == NULL)
+        return NULL;
+
+    temp->wakeup_fds[0] = temp->wakeup_fds[1] = -1;
+    temp->family = ip_is_v4(ip) ? AF_INET : AF_INET6;
+    temp->sock = -1;
+    temp->transport = cb;
+    temp->transport_object = object;
     return temp;
 }
 
 /* Function to cleanup networking stuff. */
 void kill_networking(Networking_Core *net)
 {
+    networking_flush(net);
 #ifdef WIN32
-    closesocket(net->sock);
+
+    if (net->sock != -1)
+        closesocket(net->sock);
+
 #else
-    close(net->sock);
+
+    if (net->sock != -1)
+        close(net->sock);
+
+    if (net->wakeup_fds[0] != -1) {
+        close(net->wakeup_fds[0]);
+        close(net->wakeup_fds[1]);
+    }
+
 #endif
+    free(net->send_queue);
+
+    uint32_t i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i)
+        packet_buffer_unref(net->recv_buffers[i]);
+
     free(net);
     return;
 }
@@ -49,6 +49,7 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/select.h>
 #include <netdb.h>
 #include <unistd.h>
 
@@ -59,16 +60,29 @@
 #include <sodium.h>
 #else
 #include <crypto_box.h>
+#include <crypto_auth.h>
 #define crypto_box_MACBYTES (crypto_box_ZEROBYTES - crypto_box_BOXZEROBYTES)
 #endif
 
+#include "packet_buffer.h"
+#include "stats.h"
 
 #define MAX_UDP_PACKET_SIZE 65507
 
+/* Maximum number of datagrams received or sent per syscall in batched mode. */
+#define NET_BATCH_SIZE 32
+
+/* Largest packet that can be queued for a batched send, and largest packet received.
+ * Bigger packets are sent immediately (after flushing the queue) and dropped when received.
+ * Every packet type we currently use fits easily.
+ */
+#define NET_BATCH_PACKET_SIZE 2048
+
 #define NET_PACKET_PING_REQUEST    0   /* Ping request packet ID. */
 #define NET_PACKET_PING_RESPONSE   1   /* Ping response packet ID. */
 #define NET_PACKET_GET_NODES       2   /* Get nodes request packet ID. */
 #define NET_PACKET_SEND_NODES      3   /* Send nodes response packet ID. */
+#define NET_PACKET_SEND_NODES_IPV6 4   /* Send nodes response packet ID for the IPv6 nodes. */
 #define NET_PACKET_HANDSHAKE       16  /* Handshake packet ID. */
 #define NET_PACKET_SYNC            17  /* SYNC packet ID. */
 #define NET_PACKET_DATA            18  /* Data packet ID. */
@@ -76,35 +90,128 @@
 #define NET_PACKET_LAN_DISCOVERY   33  /* LAN discovery packet ID. */
 
 
-/* Current time, unix format */
-#define unix_time() ((uint64_t)time(NULL))
+/* Current time, unix format (seconds), from the same clock as current_time(). */
+#define unix_time() (current_time() / 1000000)
 
 
+/* IPv4 address, in network order. */
 typedef union {
     uint8_t uint8[4];
     uint16_t uint16[2];
     uint32_t uint32;
-} IP;
+} IP4;
 
+/* Address and port as they were before IPv6, for the data of older versions and of the
+ * packets they understand.
+ */
 typedef union {
     struct {
-        IP ip;
+        IP4 ip;
         uint16_t port;
-        /* Not used for anything right now. */
         uint16_t padding;
     };
     uint8_t uint8[8];
-} IP_Port;
+} IP4_Port;
+
+/* IPv6 address, in network order.
+ * IPv4 addresses are kept mapped into it (::ffff:a.b.c.d, see ip_init_v4()), so that each
+ * address has one representation: comparing and hashing them is a matter of their bytes.
+ * All zeroes (::) is no address.
+ */
+typedef union {
+    uint8_t uint8[16];
+    uint16_t uint16[8];
+    uint32_t uint32[4];
+    uint64_t uint64[2];
+} IP;
 
 typedef struct {
-    int16_t family;
-    uint16_t port;
     IP ip;
-    uint8_t zeroes[8];
-#ifdef ENABLE_IPV6
-    uint8_t zeroes2[12];
-#endif
-} ADDR;
+    uint16_t port; /* In network order. */
+    /* Not used for anything right now. */
+    uint16_t padding;
+} IP_Port;
+
+/* Set ip to the IPv4 address addr (network order). */
+static inline void ip_init_v4(IP *ip, uint32_t addr)
+{
+    ip->uint32[0] = 0;
+    ip->uint32[1] = 0;
+    ip->uint32[2] = htonl(0xFFFF);
+    ip->uint32[3] = addr;
+}
+
+/* return 1 if ip is an IPv4 address, 0 if not. */
+static inline int ip_is_v4(IP ip)
+{
+    return ip.uint32[0] == 0 && ip.uint32[1] == 0 && ip.uint32[2] == htonl(0xFFFF);
+}
+
+/* return the IPv4 address of ip, 0.0.0.0 if it isn't one. */
+static inline IP4 ip_get_v4(IP ip)
+{
+    IP4 ip4;
+    ip4.uint32 = ip_is_v4(ip) ? ip.uint32[3] : 0;
+    return ip4;
+}
+
+/* return 1 if ip is an address (neither :: nor 0.0.0.0), 0 if not. */
+static inline int ip_isset(IP ip)
+{
+    return ip_is_v4(ip) ? ip.uint32[3] != 0 : (ip.uint64[0] | ip.uint64[1]) != 0;
+}
+
+static inline int ip_equal(IP a, IP b)
+{
+    return a.uint64[0] == b.uint64[0] && a.uint64[1] == b.uint64[1];
+}
+
+static inline int ipport_equal(IP_Port a, IP_Port b)
+{
+    return ip_equal(a.ip, b.ip) && a.port == b.port;
+}
+
+/* return a hash of ip_port.
+ * Mix in a random seed wherever others can choose the addresses, so that they can't make them collide.
+ */
+static inline uint32_t ipport_hash(IP_Port ip_port, uint32_t seed)
+{
+    uint32_t hash = seed, i;
+
+    for (i = 0; i < 4; ++i) {
+        hash ^= ip_port.ip.uint32[i];
+        hash *= 0x9E3779B1;
+    }
+
+    hash ^= ip_port.port;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline IP_Port ipport_from_v4(IP4_Port ip4_port)
+{
+    IP_Port ip_port;
+    ip_init_v4(&ip_port.ip, ip4_port.ip.uint32);
+    ip_port.port = ip4_port.port;
+    ip_port.padding = 0;
+    return ip_port;
+}
+
+/* Put ip_port in *ip4_port.
+ * return 0 on success.
+ * return -1 if it isn't an IPv4 one.
+ */
+static inline int ipport_to_v4(IP_Port ip_port, IP4_Port *ip4_port)
+{
+    if (!ip_is_v4(ip_port.ip))
+        return -1;
+
+    ip4_port->ip = ip_get_v4(ip_port.ip);
+    ip4_port->port = ip_port.port;
+    ip4_port->padding = 0;
+    return 0;
+}
 
 /* Function to receive data, ip and port of sender is put into ip_port.
  * Packet data is put into data.
@@ -117,15 +224,70 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+/* Function to call from networking_poll() after networking_wakeup(). */
+typedef void (*wakeup_handler_callback)(void *object);
+
+/* Function that sends the packets of an instance without a socket, see new_networking_transport().
+ * return length if the packet was sent (or dropped on the way, like UDP does).
+ * return -1 on failure.
+ */
+typedef int (*transport_send_callback)(void *object, IP_Port ip_port, uint8_t *data, uint32_t length);
+
+/* Function that returns the current time in microseconds, see networking_set_clock(). */
+typedef uint64_t (*clock_callback)(void *object);
+
+typedef struct {
+    IP_Port ip_port;
+    uint16_t length;
+
+    /* If not NULL the packet is in there (see sendpacket_buffer()) and not in data. */
+    Packet_Buffer *buffer;
+    uint8_t data[NET_BATCH_PACKET_SIZE];
+} Queued_Packet;
+
 typedef struct {
     Packet_Handles packethandlers[256];
-    /* Our UDP socket. */
+    /* Our UDP socket, -1 if there is a transport instead. */
     int sock;
+    /* AF_INET6 if it is a dual-stack one, AF_INET if it only does IPv4. */
+    int family;
+
+    /* Receive buffers, NET_BATCH_SIZE buffers of NET_BATCH_PACKET_SIZE bytes
+     * when recvmmsg is available, a single one otherwise. Bigger packets are dropped.
+     * A buffer some handler kept a reference to is replaced before it is reused. */
+    Packet_Buffer *recv_buffers[NET_BATCH_SIZE];
+
+    /* Buffer of the packet currently passed to a packet handler, NULL outside of handlers.
+     * A handler can keep the packet with packet_buffer_ref() instead of copying it. */
+    Packet_Buffer *recv_packet;
+
+    /* Outgoing packets waiting for networking_flush() (only used if send_batching is set). */
+    uint8_t send_batching;
+    uint16_t send_queue_length;
+    Queued_Packet *send_queue;
+
+    /* Pipe other threads write to in networking_wakeup(), -1 until there is a wakeup handler. */
+    int wakeup_fds[2];
+    wakeup_handler_callback wakeup_handler;
+    void *wakeup_object;
+
+    /* Sends the packets when sock is -1, see new_networking_transport(). */
+    transport_send_callback transport;
+    void *transport_object;
+
+    /* Counters of this instance, network.c counts packets, the layers above the rest. */
+    Stats stats;
 } Networking_Core;
 
-/* return current time in milleseconds since the epoch. */
+/* return current time in microseconds since the epoch. */
 uint64_t current_time(void);
 
+/* Make current_time() and unix_time() return what cb returns, for all the instances.
+ * For running instances on a simulated clock, cb NULL goes back to the system clock.
+ * Set it before creating any instance and don't change it while they run.
+ */
+void networking_set_clock(clock_callback cb, void *object);
+
 /* return a random number.
  * NOTE: this function should probably not be used where cryptographic randomness is absolutely necessary.
  */
@@ -133,8 +295,29 @@ uint32_t random_int(void);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
-int sendpacket(int sock, IP_Port ip_port, uint8_t *data, uint32_t length);
+/* Function to send packet(data) of length length to ip_port.
+ * If batching is enabled the packet is queued and length is returned,
+ * the actual send happens at the next networking_flush().
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, uint8_t *data, uint32_t length);
+
+/* Same as sendpacket() but for a packet in a Packet_Buffer.
+ * If batching is enabled the queue keeps a reference to buffer instead of copying it,
+ * so the packet in it must not change until the next networking_flush().
+ */
+int sendpacket_buffer(Networking_Core *net, IP_Port ip_port, Packet_Buffer *buffer);
+
+/* Send all queued packets (with sendmmsg if available).
+ * networking_poll() calls this, call it again at the end of your main loop iteration.
+ */
+void networking_flush(Networking_Core *net);
+
+/* Enable (1) or disable (0) queueing of outgoing packets.
+ * Disabling flushes the queue.
+ *  return 0 on success.
+ *  return -1 on failure (out of memory).
+ */
+int networking_set_batching(Networking_Core *net, uint8_t enable);
 
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
@@ -142,9 +325,37 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net);
 
+/* Handle the packet of length length from ip_port as if it came from the socket.
+ * This is how the packets of an instance created with new_networking_transport() come in.
+ */
+void networking_receive(Networking_Core *net, IP_Port ip_port, uint8_t *data, uint32_t length);
+
+/* Set the function networking_poll() calls (before reading the socket) when another thread
+ * has called networking_wakeup() since the last time.
+ * There is one handler at a time: it fails if another one is set. cb NULL removes the
+ * handler if it was set with object, so that only the one who set it can remove it.
+ * Not available on Windows.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int networking_set_wakeup_handler(Networking_Core *net, wakeup_handler_callback cb, void *object);
+
+/* Make networking_wait() return and the next networking_poll() call the wakeup handler.
+ * This is the only networking function that can be called from other threads.
+ */
+void networking_wakeup(Networking_Core *net);
+
+/* Wait until a packet arrives or timeout_ms milliseconds have passed.
+ *  return 1 if there is something to read.
+ *  return 0 on timeout.
+ *  return -1 on error (EINTR included).
+ */
+int networking_wait(Networking_Core *net, uint32_t timeout_ms);
+
 /* Initialize networking.
  *  bind to ip and port.
- *  ip must be in network order EX: 127.0.0.1 = (7F000001).
+ *  If ip is :: (all zeroes) the socket is a dual-stack one: it talks to IPv4 and IPv6 addresses.
+ *  It falls back to IPv4 only where there is no IPv6.
  *  port is in host byte order (this means don't worry about it).
  *
  *  returns 0 if no problems.
@@ -152,6 +363,16 @@ void networking_poll(Networking_Core *net);
  */
 Networking_Core *new_networking(IP ip, uint16_t port);
 
+/* Initialize networking without a socket: the packets are sent with cb and received with
+ * networking_receive(), for running many instances in one process (see testing/DHT_sim.c).
+ *  ip tells whether the instance talks to IPv6 addresses (:: or an IPv6 address) or
+ *  only to IPv4 ones, as for new_networking().
+ *
+ *  returns Networking_Core object if no problems.
+ *  returns NULL if there are problems.
+ */
+Networking_Core *new_networking_transport(IP ip, transport_send_callback cb, void *object);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
@@ -0,0 +1,78 @@
+/* packet_buffer.c
+ *
+ * Reference counted packet buffers with headroom.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "packet_buffer.h"
+
+Packet_Buffer *new_packet_buffer(uint32_t capacity, uint32_t headroom)
+{
+    if (headroom > capacity)
+        return NULL;
+
+    Packet_Buffer *buffer = malloc(sizeof(Packet_Buffer) + capacity);
+
+    if (buffer == NULL)
+        return NULL;
+
+    buffer->refcount = 1;
+    buffer->offset = headroom;
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+Packet_Buffer *packet_buffer_ref(Packet_Buffer *buffer)
+{
+    ++buffer->refcount;
+    return buffer;
+}
+
+void packet_buffer_unref(Packet_Buffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    if (--buffer->refcount == 0)
+        free(buffer);
+}
+
+uint8_t *packet_buffer_push(Packet_Buffer *buffer, uint32_t length)
+{
+    if (length > buffer->offset)
+        return NULL;
+
+    buffer->offset -= length;
+    buffer->length += length;
+    return packet_buffer_data(buffer);
+}
+
+uint8_t *packet_buffer_pull(Packet_Buffer *buffer, uint32_t length)
+{
+    if (length > buffer->length)
+        return NULL;
+
+    buffer->offset += length;
+    buffer->length -= length;
+    return packet_buffer_data(buffer);
+}
@@ -0,0 +1,76 @@
+/* packet_buffer.h
+ *
+ * Reference counted packet buffers with room in front of the data for headers,
+ * so a packet can go from the socket to net_crypto (and back) without being copied.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include <stdint.h>
+
+/* Headroom to give a buffer so that every layer can prepend its header
+ * and net_crypto can encrypt or decrypt in place (crypto_box_ZEROBYTES). */
+#define PACKET_BUFFER_HEADROOM 32
+
+typedef struct {
+    uint32_t refcount;
+    uint32_t offset;   /* Start of the packet in bytes. */
+    uint32_t length;   /* Length of the packet. */
+    uint32_t capacity; /* Size of bytes. */
+    uint8_t  bytes[];
+} Packet_Buffer;
+
+/* Create an empty buffer of capacity bytes with a packet starting at headroom.
+ * The buffer starts with a single reference.
+ *  return NULL if headroom > capacity or if out of memory.
+ */
+Packet_Buffer *new_packet_buffer(uint32_t capacity, uint32_t headroom);
+
+/* Take one more reference to buffer.
+ * return buffer.
+ */
+Packet_Buffer *packet_buffer_ref(Packet_Buffer *buffer);
+
+/* Drop a reference to buffer, the buffer is freed with the last one.
+ * buffer may be NULL.
+ */
+void packet_buffer_unref(Packet_Buffer *buffer);
+
+/* return a pointer to the first byte of the packet. */
+static inline uint8_t *packet_buffer_data(Packet_Buffer *buffer)
+{
+    return buffer->bytes + buffer->offset;
+}
+
+/* Grow the packet by length bytes at the front (to write a header there).
+ * return a pointer to the new first byte of the packet.
+ * return NULL if there is not enough headroom.
+ */
+uint8_t *packet_buffer_push(Packet_Buffer *buffer, uint32_t length);
+
+/* Remove length bytes from the front of the packet (to strip a header).
+ * return a pointer to the new first byte of the packet.
+ * return NULL if the packet is shorter than length.
+ */
+uint8_t *packet_buffer_pull(Packet_Buffer *buffer, uint32_t length);
+
+#endif
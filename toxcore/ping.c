@@ -11,108 +11,75 @@
 #include "DHT.h"
 #include "net_crypto.h"
 #include "network.h"
+#include "request_tracker.h"
 #include "util.h"
 
 #define PING_NUM_MAX 256
 #define PING_TIMEOUT 5 // 5s
 
 typedef struct {
-    IP_Port  ipp;
-    uint64_t id;
-    uint64_t timestamp;
-} pinged_t;
-
-typedef struct {
-    pinged_t    pings[PING_NUM_MAX];
-    size_t      num_pings;
-    size_t      pos_pings;
+    Request_Tracker requests;
 } PING;
 
 void *new_ping(void)
 {
-    return calloc(1, sizeof(PING));
+    PING *png = calloc(1, sizeof(PING));
+
+    if (png == NULL)
+        return NULL;
+
+    if (request_tracker_init(&png->requests, PING_NUM_MAX, PING_TIMEOUT) == -1) {
+        free(png);
+        return NULL;
+    }
+
+    return png;
 }
 
 void kill_ping(void *ping)
 {
+    PING *png = ping;
+
+    if (png != NULL)
+        request_tracker_free(&png->requests);
+
     free(ping);
 }
 
-static bool is_timeout(uint64_t time)
+int ping_set_capacity(void *ping, uint32_t capacity)
 {
-    return (time + PING_TIMEOUT) < now();
+    PING *png = ping;
+    return request_tracker_set_capacity(&png->requests, capacity);
 }
 
-static void remove_timeouts(void *ping)    // O(n)
+uint64_t add_ping(void *ping, IP_Port ipp)  // O(1)
 {
     PING *png = ping;
-    size_t i, id;
-    size_t new_pos = png->pos_pings;
-    size_t new_num = png->num_pings;
-
-    // Loop through buffer, oldest first.
-    for (i = 0; i < png->num_pings; i++) {
-        id = (png->pos_pings + i) % PING_NUM_MAX;
-
-        if (is_timeout(png->pings[id].timestamp)) {
-            new_pos++;
-            new_num--;
-        }
-        // Break here because list is sorted.
-        else {
-            break;
-        }
-    }
-
-    png->num_pings = new_num;
-    png->pos_pings = new_pos % PING_NUM_MAX;
+    return request_tracker_add(&png->requests, ipp);
 }
 
-uint64_t add_ping(void *ping, IP_Port ipp)  // O(n)
+bool is_pinging(void *ping, IP_Port ipp, uint64_t ping_id)    // O(1)
 {
     PING *png = ping;
-    size_t p;
-
-    remove_timeouts(ping);
 
-    /* Remove oldest ping if full buffer. */
-    if (png->num_pings == PING_NUM_MAX) {
-        png->num_pings--;
-        png->pos_pings = (png->pos_pings + 1) % PING_NUM_MAX;
-    }
-
-    /* Insert new ping at end of list. */
-    p = (png->pos_pings + png->num_pings) % PING_NUM_MAX;
-
-    png->pings[p].ipp       = ipp;
-    png->pings[p].timestamp = now();
-    png->pings[p].id        = random_64b();
+    if (!ip_isset(ipp.ip))
+        return false;
 
-    png->num_pings++;
-    return png->pings[p].id;
+    return request_tracker_find(&png->requests, ipp, ping_id);
 }
 
-bool is_pinging(void *ping, IP_Port ipp, uint64_t ping_id)    // O(n) TODO: Replace this with something else.
+/* Stop waiting for the ping, it is answered.
+ * return the current_time() at which the ping was sent, 0 if we were not waiting for it.
+ */
+uint64_t ping_sent_time(void *ping, IP_Port ipp, uint64_t ping_id)
 {
     PING *png = ping;
+    uint64_t sent_time;
 
-    if (ipp.ip.uint32 == 0 && ping_id == 0)
-        return false;
-
-    size_t i, id;
+    if (request_tracker_take(&png->requests, ipp, ping_id, 0, &sent_time) == 0)
+        return 0;
 
-    remove_timeouts(ping);
-
-    for (i = 0; i < png->num_pings; i++) {
-        id = (png->pos_pings + i) % PING_NUM_MAX;
-
-        /* ping_id = 0 means match any id. */
-        if ((ipp_eq(png->pings[id].ipp, ipp) || ipp.ip.uint32 == 0) && (png->pings[id].id == ping_id || ping_id == 0)) {
-            return true;
-        }
-    }
-
-    return false;
+    return sent_time;
 }
 
 #define DHT_PING_SIZE (1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES + sizeof(uint64_t) + ENCRYPTION_PADDING)
@@ -120,6 +87,7 @@ bool is_pinging(void *ping, IP_Port ipp, uint64_t ping_id)    // O(n) TODO: Repl
 int send_ping_request(void *ping, Net_Crypto *c, IP_Port ipp, uint8_t *client_id)
 {
     uint8_t   pk[DHT_PING_SIZE];
+    uint8_t   shared_key[crypto_box_BEFORENMBYTES];
     int       rc;
     uint64_t  ping_id;
 
@@ -134,21 +102,23 @@ int send_ping_request(void *ping, Net_Crypto *c, IP_Port ipp, uint8_t *client_id
     random_nonce(pk + 1 + CLIENT_ID_SIZE); // Generate random nonce
 
     // Encrypt ping_id using recipient privkey
-    rc = encrypt_data(client_id,
-                      c->self_secret_key,
-                      pk + 1 + CLIENT_ID_SIZE,
-                      (uint8_t *) &ping_id, sizeof(ping_id),
-                      pk + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES);
+    get_shared_key(c, shared_key, client_id);
+    rc = encrypt_data_fast(shared_key,
+                           pk + 1 + CLIENT_ID_SIZE,
+                           (uint8_t *) &ping_id, sizeof(ping_id),
+                           pk + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES);
 
     if (rc != sizeof(ping_id) + ENCRYPTION_PADDING)
         return 1;
 
-    return sendpacket(c->lossless_udp->net->sock, ipp, pk, sizeof(pk));
+    ++c->lossless_udp->net->stats.pings_sent;
+    return sendpacket(c->lossless_udp->net, ipp, pk, sizeof(pk));
 }
 
 int send_ping_response(Net_Crypto *c, IP_Port ipp, uint8_t *client_id, uint64_t ping_id)
 {
     uint8_t   pk[DHT_PING_SIZE];
+    uint8_t   shared_key[crypto_box_BEFORENMBYTES];
     int       rc;
 
     if (id_eq(client_id, c->self_public_key))
@@ -159,21 +129,22 @@ int send_ping_response(Net_Crypto *c, IP_Port ipp, uint8_t *client_id, uint64_t
     random_nonce(pk + 1 + CLIENT_ID_SIZE); // Generate random nonce
 
     // Encrypt ping_id using recipient privkey
-    rc = encrypt_data(client_id,
-                      c->self_secret_key,
-                      pk + 1 + CLIENT_ID_SIZE,
-                      (uint8_t *) &ping_id, sizeof(ping_id),
-                      pk + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES);
+    get_shared_key(c, shared_key, client_id);
+    rc = encrypt_data_fast(shared_key,
+                           pk + 1 + CLIENT_ID_SIZE,
+                           (uint8_t *) &ping_id, sizeof(ping_id),
+                           pk + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES);
 
     if (rc != sizeof(ping_id) + ENCRYPTION_PADDING)
         return 1;
 
-    return sendpacket(c->lossless_udp->net->sock, ipp, pk, sizeof(pk));
+    return sendpacket(c->lossless_udp->net, ipp, pk, sizeof(pk));
 }
 
 int handle_ping_request(void *object, IP_Port source, uint8_t *packet, uint32_t length)
 {
     DHT *dht = object;
+    uint8_t    shared_key[crypto_box_BEFORENMBYTES];
     int        rc;
     uint64_t   ping_id;
 
@@ -184,12 +155,12 @@ int handle_ping_request(void *object, IP_Port source, uint8_t *packet, uint32_t
         return 1;
 
     // Decrypt ping_id
-    rc = decrypt_data(packet + 1,
-                      dht->c->self_secret_key,
-                      packet + 1 + CLIENT_ID_SIZE,
-                      packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
-                      sizeof(ping_id) + ENCRYPTION_PADDING,
-                      (uint8_t *) &ping_id);
+    get_shared_key(dht->c, shared_key, packet + 1);
+    rc = decrypt_data_fast(shared_key,
+                           packet + 1 + CLIENT_ID_SIZE,
+                           packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
+                           sizeof(ping_id) + ENCRYPTION_PADDING,
+                           (uint8_t *) &ping_id);
 
     if (rc != sizeof(ping_id))
         return 1;
@@ -204,6 +175,7 @@ int handle_ping_request(void *object, IP_Port source, uint8_t *packet, uint32_t
 int handle_ping_response(void *object, IP_Port source, uint8_t *packet, uint32_t length)
 {
     DHT *dht = object;
+    uint8_t   shared_key[crypto_box_BEFORENMBYTES];
     int       rc;
     uint64_t  ping_id;
 
@@ -214,21 +186,26 @@ int handle_ping_response(void *object, IP_Port source, uint8_t *packet, uint32_t
         return 1;
 
     // Decrypt ping_id
-    rc = decrypt_data(packet + 1,
-                      dht->c->self_secret_key,
-                      packet + 1 + CLIENT_ID_SIZE,
-                      packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
-                      sizeof(ping_id) + ENCRYPTION_PADDING,
-                      (uint8_t *) &ping_id);
+    get_shared_key(dht->c, shared_key, packet + 1);
+    rc = decrypt_data_fast(shared_key,
+                           packet + 1 + CLIENT_ID_SIZE,
+                           packet + 1 + CLIENT_ID_SIZE + crypto_box_NONCEBYTES,
+                           sizeof(ping_id) + ENCRYPTION_PADDING,
+                           (uint8_t *) &ping_id);
 
     if (rc != sizeof(ping_id))
         return 1;
 
     /* Make sure ping_id is correct. */
-    if (!is_pinging(dht->ping, source, ping_id))
+    uint64_t sent_time = ping_sent_time(dht->ping, source, ping_id);
+
+    if (sent_time == 0 || !ip_isset(source.ip))
         return 1;
 
+    ++dht->c->lossless_udp->net->stats.ping_responses;
+
     // Associate source ip with client_id
     addto_lists(dht, source, packet + 1);
+    DHT_node_responded(dht, packet + 1, sent_time);
     return 0;
 }
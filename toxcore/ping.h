@@ -9,8 +9,10 @@
 
 void *new_ping(void);
 void kill_ping(void *ping);
+int ping_set_capacity(void *ping, uint32_t capacity);
 uint64_t add_ping(void *ping, IP_Port ipp);
 bool is_pinging(void *ping, IP_Port ipp, uint64_t ping_id);
+uint64_t ping_sent_time(void *ping, IP_Port ipp, uint64_t ping_id);
 int send_ping_request(void *ping, Net_Crypto *c, IP_Port ipp, uint8_t *client_id);
 int send_ping_response(Net_Crypto *c, IP_Port ipp, uint8_t *client_id, uint64_t ping_id);
 int handle_ping_request(void *object, IP_Port source, uint8_t *packet, uint32_t length);
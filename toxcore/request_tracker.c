@@ -0,0 +1,198 @@
+/* request_tracker.c
+ *
+ * The requests (pings, get nodes...) we sent and are waiting on a response for.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "request_tracker.h"
+
+static uint32_t ip_port_hash(Request_Tracker *tracker, IP_Port ip_port)
+{
+    /* Responses can come from anywhere so mix the address with our random seed. */
+    return ipport_hash(ip_port, tracker->seed) & (tracker->num_heads - 1);
+}
+
+static int alloc_tracker(Request_Tracker *tracker, uint32_t capacity)
+{
+    uint32_t num_heads = 16, i;
+
+    if (capacity == 0)
+        return -1;
+
+    while (num_heads < capacity)
+        num_heads *= 2;
+
+    tracker->entries = malloc(capacity * sizeof(Request_Entry));
+    tracker->heads = malloc(num_heads * sizeof(int32_t));
+
+    if (tracker->entries == NULL || tracker->heads == NULL) {
+        free(tracker->entries);
+        free(tracker->heads);
+        return -1;
+    }
+
+    for (i = 0; i < num_heads; ++i)
+        tracker->heads[i] = -1;
+
+    tracker->capacity = capacity;
+    tracker->num_heads = num_heads;
+    tracker->start = 0;
+    tracker->num = 0;
+    return 0;
+}
+
+int request_tracker_init(Request_Tracker *tracker, uint32_t capacity, uint32_t timeout)
+{
+    memset(tracker, 0, sizeof(Request_Tracker));
+    tracker->seed = random_int();
+    tracker->timeout = timeout;
+    return alloc_tracker(tracker, capacity);
+}
+
+void request_tracker_free(Request_Tracker *tracker)
+{
+    free(tracker->entries);
+    free(tracker->heads);
+    tracker->entries = NULL;
+    tracker->heads = NULL;
+    tracker->capacity = 0;
+    tracker->num = 0;
+}
+
+/* Take the oldest request out of the tracker. */
+static void remove_oldest(Request_Tracker *tracker)
+{
+    int32_t index = tracker->start;
+    int32_t *link = &tracker->heads[ip_port_hash(tracker, tracker->entries[index].ip_port)];
+
+    while (*link != index)
+        link = &tracker->entries[*link].next;
+
+    *link = tracker->entries[index].next;
+    tracker->start = (tracker->start + 1) % tracker->capacity;
+    --tracker->num;
+}
+
+static void remove_timeouts(Request_Tracker *tracker)
+{
+    uint64_t temp_time = unix_time();
+
+    while (tracker->num != 0
+            && tracker->entries[tracker->start].timestamp + tracker->timeout <= temp_time)
+        remove_oldest(tracker);
+}
+
+static Request_Entry *insert_entry(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id, uint64_t timestamp,
+                                   uint64_t sent_time)
+{
+    if (tracker->num == tracker->capacity)
+        remove_oldest(tracker);
+
+    uint32_t index = (tracker->start + tracker->num) % tracker->capacity;
+    uint32_t hash = ip_port_hash(tracker, ip_port);
+    Request_Entry *entry = &tracker->entries[index];
+
+    entry->ip_port = ip_port;
+    entry->ping_id = ping_id;
+    entry->timestamp = timestamp;
+    entry->sent_time = sent_time;
+    entry->next = tracker->heads[hash];
+    entry->answered = 0;
+    tracker->heads[hash] = index;
+    ++tracker->num;
+    return entry;
+}
+
+int request_tracker_set_capacity(Request_Tracker *tracker, uint32_t capacity)
+{
+    Request_Tracker old = *tracker;
+    uint32_t i;
+
+    if (alloc_tracker(tracker, capacity) == -1) {
+        *tracker = old;
+        return -1;
+    }
+
+    /* Oldest first so that the newest are kept if there are too many. */
+    for (i = 0; i < old.num; ++i) {
+        Request_Entry *entry = &old.entries[(old.start + i) % old.capacity];
+        Request_Entry *copy = insert_entry(tracker, entry->ip_port, entry->ping_id, entry->timestamp, entry->sent_time);
+        copy->answered = entry->answered;
+    }
+
+    request_tracker_free(&old);
+    return 0;
+}
+
+uint64_t request_tracker_add(Request_Tracker *tracker, IP_Port ip_port)
+{
+    uint64_t ping_id;
+
+    remove_timeouts(tracker);
+
+    do {
+        ping_id = ((uint64_t)random_int() << 32) | random_int();
+    } while (ping_id == 0);
+
+    insert_entry(tracker, ip_port, ping_id, unix_time(), current_time());
+    return ping_id;
+}
+
+/* return the request to ip_port with ping_id (any if 0), NULL if there is none.
+ * The answered ones are skipped if skip_answered is set.
+ */
+static Request_Entry *find_entry(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id, int skip_answered)
+{
+    int32_t i;
+
+    remove_timeouts(tracker);
+
+    for (i = tracker->heads[ip_port_hash(tracker, ip_port)]; i != -1; i = tracker->entries[i].next) {
+        Request_Entry *entry = &tracker->entries[i];
+
+        if (ipport_equal(entry->ip_port, ip_port) && (ping_id == 0 || entry->ping_id == ping_id)
+                && !(skip_answered && entry->answered))
+            return entry;
+    }
+
+    return NULL;
+}
+
+int request_tracker_find(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id)
+{
+    return find_entry(tracker, ip_port, ping_id, 1) != NULL;
+}
+
+int request_tracker_take(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id, uint8_t kind,
+                         uint64_t *sent_time)
+{
+    if (ping_id == 0 || kind >= 8)
+        return 0;
+
+    Request_Entry *entry = find_entry(tracker, ip_port, ping_id, 0);
+
+    if (entry == NULL || entry->answered & (1 << kind))
+        return 0;
+
+    int first = entry->answered == 0;
+    entry->answered |= 1 << kind;
+    *sent_time = entry->sent_time;
+    return first ? 1 : 2;
+}
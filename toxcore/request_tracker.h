@@ -0,0 +1,92 @@
+/* request_tracker.h
+ *
+ * The requests (pings, get nodes...) we sent and are waiting on a response for.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REQUEST_TRACKER_H
+#define REQUEST_TRACKER_H
+
+#include "network.h"
+
+typedef struct {
+    IP_Port  ip_port;
+    uint64_t ping_id;
+    uint64_t timestamp;
+    uint64_t sent_time; /* current_time() when it was sent, for the round trip time. */
+    int32_t  next; /* Next request in the same hash chain, -1 if none. */
+    uint8_t  answered; /* Bit kind set once a response of that kind was taken. */
+} Request_Entry;
+
+/* The requests are kept in a ring, oldest first, so the ones that timed out are taken
+ * off the front. A hash by ip_port chains them so responses are checked in O(1).
+ */
+typedef struct {
+    Request_Entry *entries; /* The ring. */
+    uint32_t capacity;
+    uint32_t start; /* Oldest request. */
+    uint32_t num;
+
+    int32_t *heads; /* First request of each hash chain, -1 if none. */
+    uint32_t num_heads; /* Always a power of two. */
+    uint32_t seed;
+
+    uint32_t timeout; /* In seconds. */
+} Request_Tracker;
+
+/* Track up to capacity requests at once, without a response they are forgotten after
+ * timeout seconds.
+ *  return 0 on success.
+ *  return -1 on failure (out of memory).
+ */
+int request_tracker_init(Request_Tracker *tracker, uint32_t capacity, uint32_t timeout);
+
+void request_tracker_free(Request_Tracker *tracker);
+
+/* Change how many requests are tracked at once, keeping the newest ones.
+ *  return 0 on success.
+ *  return -1 on failure (the tracker is left as it was).
+ */
+int request_tracker_set_capacity(Request_Tracker *tracker, uint32_t capacity);
+
+/* Add a request sent to ip_port. If the tracker is full the oldest request is forgotten.
+ *  return the (random, never 0) ping_id of the request.
+ */
+uint64_t request_tracker_add(Request_Tracker *tracker, IP_Port ip_port);
+
+/* ping_id 0 matches any request to ip_port.
+ *  return 1 if there is a request to ip_port with ping_id that has not timed out or been answered.
+ *  return 0 if not.
+ */
+int request_tracker_find(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id);
+
+/* Take the response of kind (0 to 7) to the request to ip_port with ping_id. Kinds are for the
+ * requests answered with several packets, the others use 0. A request is answered once per
+ * kind: duplicate or replayed responses don't find it anymore.
+ * sent_time is set to the current_time() at which the request was sent.
+ *  return 1 if it is the first response to the request.
+ *  return 2 if the request already had a response of another kind.
+ *  return 0 if there is no such request that has not timed out and waits for that kind of
+ *  response (or ping_id is 0).
+ */
+int request_tracker_take(Request_Tracker *tracker, IP_Port ip_port, uint64_t ping_id, uint8_t kind,
+                         uint64_t *sent_time);
+
+#endif
@@ -0,0 +1,151 @@
+/* shared_key_cache.c
+ *
+ * Cache of the shared keys (crypto_box_beforenm()) between our secret key and the public keys
+ * of the peers we exchange packets with.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "shared_key_cache.h"
+
+int shared_key_cache_init(Shared_Key_Cache *cache, uint32_t capacity)
+{
+    memset(cache, 0, sizeof(Shared_Key_Cache));
+    cache->newest = -1;
+    cache->oldest = -1;
+    key_index_init(&cache->index);
+
+    if (capacity == 0)
+        return 0;
+
+    cache->keys = malloc(capacity * sizeof(Shared_Key));
+
+    if (cache->keys == NULL)
+        return -1;
+
+    cache->capacity = capacity;
+    return 0;
+}
+
+void shared_key_cache_free(Shared_Key_Cache *cache)
+{
+    if (cache->keys != NULL)
+        memset(cache->keys, 0, cache->capacity * sizeof(Shared_Key));
+
+    free(cache->keys);
+    key_index_free(&cache->index);
+    cache->keys = NULL;
+    cache->capacity = 0;
+    cache->num = 0;
+    cache->newest = -1;
+    cache->oldest = -1;
+}
+
+void shared_key_cache_clear(Shared_Key_Cache *cache)
+{
+    if (cache->keys != NULL)
+        memset(cache->keys, 0, cache->capacity * sizeof(Shared_Key));
+
+    key_index_free(&cache->index);
+    cache->num = 0;
+    cache->newest = -1;
+    cache->oldest = -1;
+}
+
+static void unlink_key(Shared_Key_Cache *cache, int32_t i)
+{
+    Shared_Key *key = &cache->keys[i];
+
+    if (key->prev == -1)
+        cache->newest = key->next;
+    else
+        cache->keys[key->prev].next = key->next;
+
+    if (key->next == -1)
+        cache->oldest = key->prev;
+    else
+        cache->keys[key->next].prev = key->prev;
+}
+
+static void link_newest(Shared_Key_Cache *cache, int32_t i)
+{
+    Shared_Key *key = &cache->keys[i];
+
+    key->prev = -1;
+    key->next = cache->newest;
+
+    if (cache->newest == -1)
+        cache->oldest = i;
+    else
+        cache->keys[cache->newest].prev = i;
+
+    cache->newest = i;
+}
+
+int shared_key_cache_has(Shared_Key_Cache *cache, uint8_t *public_key)
+{
+    return key_index_find(&cache->index, public_key) != -1;
+}
+
+void shared_key_cache_add(Shared_Key_Cache *cache, uint8_t *public_key, uint8_t *shared_key)
+{
+    int32_t i;
+
+    if (cache->capacity == 0 || key_index_find(&cache->index, public_key) != -1)
+        return;
+
+    if (cache->num < cache->capacity) {
+        i = cache->num++;
+    } else {
+        i = cache->oldest;
+        unlink_key(cache, i);
+        key_index_remove(&cache->index, cache->keys[i].public_key, i);
+    }
+
+    if (key_index_add(&cache->index, public_key, i) == -1) {
+        /* Out of memory, start over rather than lose track of the entry. */
+        shared_key_cache_clear(cache);
+        return;
+    }
+
+    memcpy(cache->keys[i].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(cache->keys[i].shared_key, shared_key, crypto_box_BEFORENMBYTES);
+    link_newest(cache, i);
+}
+
+void shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, uint8_t *secret_key, uint8_t *public_key)
+{
+    int32_t i = key_index_find(&cache->index, public_key);
+
+    if (i != -1) {
+        ++cache->hits;
+
+        if (i != cache->newest) {
+            unlink_key(cache, i);
+            link_newest(cache, i);
+        }
+
+        memcpy(shared_key, cache->keys[i].shared_key, crypto_box_BEFORENMBYTES);
+        return;
+    }
+
+    ++cache->misses;
+    crypto_box_beforenm(shared_key, public_key, secret_key);
+    shared_key_cache_add(cache, public_key, shared_key);
+}
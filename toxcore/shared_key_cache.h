@@ -0,0 +1,81 @@
+/* shared_key_cache.h
+ *
+ * Cache of the shared keys (crypto_box_beforenm()) between our secret key and the public keys
+ * of the peers we exchange packets with.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SHARED_KEY_CACHE_H
+#define SHARED_KEY_CACHE_H
+
+#include "key_index.h"
+
+/* Default number of shared keys kept. */
+#define SHARED_KEY_CACHE_SIZE 256
+
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    int32_t prev; /* More recently used entry, -1 if none. */
+    int32_t next; /* Less recently used entry, -1 if none. */
+} Shared_Key;
+
+/* The entries are in a list from the most to the least recently used one, which is the one
+ * replaced when the cache is full.
+ */
+typedef struct {
+    Shared_Key *keys;
+    uint32_t    capacity;
+    uint32_t    num;
+    int32_t     newest;
+    int32_t     oldest;
+    Key_Index   index; /* Index of keys by public_key. */
+
+    uint64_t    hits;
+    uint64_t    misses;
+} Shared_Key_Cache;
+
+/* Keep at most capacity shared keys, 0 to keep none.
+ *  return 0 on success.
+ *  return -1 on failure (out of memory).
+ */
+int shared_key_cache_init(Shared_Key_Cache *cache, uint32_t capacity);
+
+void shared_key_cache_free(Shared_Key_Cache *cache);
+
+/* Forget every shared key, the hit and miss counters are kept.
+ * Call it when the secret key changes.
+ */
+void shared_key_cache_clear(Shared_Key_Cache *cache);
+
+/* return 1 if the shared key for public_key is in the cache.
+ * return 0 if not.
+ */
+int shared_key_cache_has(Shared_Key_Cache *cache, uint8_t *public_key);
+
+/* Add a shared key computed elsewhere (with the same secret key), as the most recently used one. */
+void shared_key_cache_add(Shared_Key_Cache *cache, uint8_t *public_key, uint8_t *shared_key);
+
+/* Put the shared key between secret_key and public_key in shared_key.
+ * The secret_key must be the same for every call until shared_key_cache_clear().
+ */
+void shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, uint8_t *secret_key, uint8_t *public_key);
+
+#endif
@@ -0,0 +1,96 @@
+/* stats.h
+ *
+ * Counters and histograms of what the core is doing, see DHT_get_stats() and tox_get_stats().
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#define STATS_HISTOGRAM_BUCKETS 16
+
+/* buckets[0] counts the values that are 0, buckets[i] the ones from 2^(i - 1) to 2^i - 1
+ * and the last bucket everything bigger.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} Stats_Histogram;
+
+/* All the counters only go up, from when the Networking_Core they are in was created.
+ * They are written by the thread running the instance only, so they are plain integers: read
+ * them from that thread (tox_get_stats() takes care of it when tox runs in a thread of its own).
+ * Everything after the counters is filled in when the stats are read.
+ * Keep in sync with Tox_Stats in tox.h.
+ */
+typedef struct {
+    /* network.c */
+    uint64_t packets_received[256]; /* By first byte, including the ones with no handler. */
+    uint64_t bytes_received;
+    uint64_t packets_dropped; /* No handler for them or too big. */
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t send_errors;
+
+    /* Lossless_UDP.c */
+    uint64_t data_sent; /* New data packets. */
+    uint64_t data_resent; /* Data packets sent again because the other asked for them. */
+    uint64_t handshakes_refused; /* Over the per IP limit. */
+    uint64_t connections_timed_out;
+    Stats_Histogram connection_rtt; /* Milliseconds. */
+
+    /* net_crypto.c */
+    uint64_t decrypt_failures; /* Data packets of established connections that did not decrypt. */
+
+    /* DHT.c and ping.c */
+    uint64_t pings_sent;
+    uint64_t ping_responses;
+    uint64_t pings_missed; /* Nodes of the routing table that did not answer a ping. */
+    Stats_Histogram dht_rtt; /* Milliseconds, for pings and get nodes requests. */
+
+    /* DHT.c hole punching */
+    uint64_t punch_runs; /* Attempts, one per NAT ping answer while not punching. */
+    uint64_t punch_pings;
+    uint64_t punch_successes; /* Attempts the friend answered. */
+    Stats_Histogram punch_time; /* Milliseconds from the first burst to the answer. */
+
+    /* Current values. */
+    uint32_t dht_nodes; /* In the routing table. */
+    uint32_t dht_good_nodes; /* Of those, the ones heard from recently. */
+    uint32_t dht_friends;
+    uint32_t connections; /* Lossless_UDP ones. */
+} Stats;
+
+static inline void stats_histogram_add(Stats_Histogram *histogram, uint32_t value)
+{
+    uint32_t i = 0;
+
+    while (i < STATS_HISTOGRAM_BUCKETS - 1 && value >= (1U << i))
+        ++i;
+
+    ++histogram->count;
+    histogram->sum += value;
+    ++histogram->buckets[i];
+}
+
+#endif
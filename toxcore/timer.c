@@ -0,0 +1,180 @@
+/* timer.c
+ *
+ * A min-heap of deadlines, each one belonging to a small integer id.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+void timer_heap_init(Timer_Heap *timers)
+{
+    memset(timers, 0, sizeof(Timer_Heap));
+}
+
+void timer_heap_free(Timer_Heap *timers)
+{
+    free(timers->heap);
+    free(timers->positions);
+    memset(timers, 0, sizeof(Timer_Heap));
+}
+
+static void place(Timer_Heap *timers, uint32_t index, Timer timer)
+{
+    timers->heap[index] = timer;
+    timers->positions[timer.id] = index + 1;
+}
+
+static void sift_up(Timer_Heap *timers, uint32_t index)
+{
+    Timer timer = timers->heap[index];
+
+    while (index != 0) {
+        uint32_t parent = (index - 1) / 2;
+
+        if (timers->heap[parent].deadline <= timer.deadline)
+            break;
+
+        place(timers, index, timers->heap[parent]);
+        index = parent;
+    }
+
+    place(timers, index, timer);
+}
+
+static void sift_down(Timer_Heap *timers, uint32_t index)
+{
+    Timer timer = timers->heap[index];
+
+    while (1) {
+        uint32_t child = index * 2 + 1;
+
+        if (child >= timers->length)
+            break;
+
+        if (child + 1 < timers->length && timers->heap[child + 1].deadline < timers->heap[child].deadline)
+            ++child;
+
+        if (timer.deadline <= timers->heap[child].deadline)
+            break;
+
+        place(timers, index, timers->heap[child]);
+        index = child;
+    }
+
+    place(timers, index, timer);
+}
+
+/* Make room for id in positions and for one more timer in heap. */
+static int timer_reserve(Timer_Heap *timers, uint32_t id)
+{
+    if (id >= timers->num_positions) {
+        uint32_t num = timers->num_positions ? timers->num_positions : 8;
+
+        while (num <= id)
+            num *= 2;
+
+        uint32_t *positions = realloc(timers->positions, num * sizeof(uint32_t));
+
+        if (positions == NULL)
+            return -1;
+
+        memset(positions + timers->num_positions, 0, (num - timers->num_positions) * sizeof(uint32_t));
+        timers->positions = positions;
+        timers->num_positions = num;
+    }
+
+    if (timers->length == timers->capacity) {
+        uint32_t capacity = timers->capacity ? timers->capacity * 2 : 8;
+        Timer *heap = realloc(timers->heap, capacity * sizeof(Timer));
+
+        if (heap == NULL)
+            return -1;
+
+        timers->heap = heap;
+        timers->capacity = capacity;
+    }
+
+    return 0;
+}
+
+int timer_set(Timer_Heap *timers, uint32_t id, uint64_t deadline)
+{
+    if (id < timers->num_positions && timers->positions[id] != 0) {
+        uint32_t index = timers->positions[id] - 1;
+        uint64_t old = timers->heap[index].deadline;
+        timers->heap[index].deadline = deadline;
+
+        if (deadline < old)
+            sift_up(timers, index);
+        else
+            sift_down(timers, index);
+
+        return 0;
+    }
+
+    if (timer_reserve(timers, id) == -1)
+        return -1;
+
+    Timer timer = {deadline, id};
+    place(timers, timers->length, timer);
+    ++timers->length;
+    sift_up(timers, timers->length - 1);
+    return 0;
+}
+
+void timer_unset(Timer_Heap *timers, uint32_t id)
+{
+    if (id >= timers->num_positions || timers->positions[id] == 0)
+        return;
+
+    uint32_t index = timers->positions[id] - 1;
+    timers->positions[id] = 0;
+    --timers->length;
+
+    if (index == timers->length)
+        return;
+
+    /* Move the last timer into the hole and restore the heap order around it. */
+    uint32_t moved = timers->heap[timers->length].id;
+    place(timers, index, timers->heap[timers->length]);
+    sift_up(timers, index);
+    sift_down(timers, timers->positions[moved] - 1);
+}
+
+uint64_t timer_next(Timer_Heap *timers)
+{
+    if (timers->length == 0)
+        return ~0;
+
+    return timers->heap[0].deadline;
+}
+
+int timer_pop(Timer_Heap *timers, uint64_t time)
+{
+    if (timers->length == 0 || timers->heap[0].deadline > time)
+        return -1;
+
+    uint32_t id = timers->heap[0].id;
+    timer_unset(timers, id);
+    return id;
+}
@@ -0,0 +1,69 @@
+/* timer.h
+ *
+ * A min-heap of deadlines, each one belonging to a small integer id (a connection number for example).
+ * Lets the main loops only touch the things that are due instead of scanning everything every tick.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t deadline;
+    uint32_t id;
+} Timer;
+
+typedef struct {
+    Timer    *heap;
+    uint32_t  length;
+    uint32_t  capacity;
+
+    /* positions[id] is the index of the timer of id in heap plus one, 0 if id has no timer. */
+    uint32_t *positions;
+    uint32_t  num_positions;
+} Timer_Heap;
+
+void timer_heap_init(Timer_Heap *timers);
+
+void timer_heap_free(Timer_Heap *timers);
+
+/* Set the timer of id to deadline (replaces the previous one if there is one).
+ *  return 0 on success.
+ *  return -1 on failure (out of memory).
+ */
+int timer_set(Timer_Heap *timers, uint32_t id, uint64_t deadline);
+
+/* Remove the timer of id if there is one. */
+void timer_unset(Timer_Heap *timers, uint32_t id);
+
+/* return the earliest deadline.
+ * return ~0 if there are no timers.
+ */
+uint64_t timer_next(Timer_Heap *timers);
+
+/* Remove the earliest timer if its deadline is at or before time.
+ *  return its id.
+ *  return -1 if no timer is due.
+ */
+int timer_pop(Timer_Heap *timers, uint64_t time);
+
+#endif
@@ -22,6 +22,12 @@
  */
 
 #include "Messenger.h"
+#include "tox_thread.h"
+
+/* Once tox_start_thread() was called the calls that only change something are queued for the
+ * network thread (tox_thread_post()), the others wait for it with tox_thread_lock().
+ */
+
 /*
  * returns a FRIEND_ADDRESS_SIZE byte address to give to others.
  * Format: [client_id (32 bytes)][nospam number (4 bytes)][checksum (2 bytes)]
@@ -30,7 +36,9 @@
 void tox_getaddress(void *tox, uint8_t *address)
 {
     Messenger *m = tox;
+    tox_thread_lock(m);
     getaddress(m, address);
+    tox_thread_unlock(m);
 }
 
 /*
@@ -52,7 +60,10 @@ void tox_getaddress(void *tox, uint8_t *address)
 int tox_addfriend(void *tox, uint8_t *address, uint8_t *data, uint16_t length)
 {
     Messenger *m = tox;
-    return m_addfriend(m, address, data, length);
+    tox_thread_lock(m);
+    int ret = m_addfriend(m, address, data, length);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Add a friend without sending a friendrequest.
@@ -62,7 +73,10 @@ int tox_addfriend(void *tox, uint8_t *address, uint8_t *data, uint16_t length)
 int tox_addfriend_norequest(void *tox, uint8_t *client_id)
 {
     Messenger *m = tox;
-    return m_addfriend_norequest(m, client_id);
+    tox_thread_lock(m);
+    int ret = m_addfriend_norequest(m, client_id);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* return the friend id associated to that client id.
@@ -71,7 +85,10 @@ int tox_addfriend_norequest(void *tox, uint8_t *client_id)
 int tox_getfriend_id(void *tox, uint8_t *client_id)
 {
     Messenger *m = tox;
-    return getfriend_id(m, client_id);
+    tox_thread_lock(m);
+    int ret = getfriend_id(m, client_id);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Copies the public key associated to that friend id into client_id buffer.
@@ -82,14 +99,20 @@ int tox_getfriend_id(void *tox, uint8_t *client_id)
 int tox_getclient_id(void *tox, int friend_id, uint8_t *client_id)
 {
     Messenger *m = tox;
-    return getclient_id(m, friend_id, client_id);
+    tox_thread_lock(m);
+    int ret = getclient_id(m, friend_id, client_id);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Remove a friend. */
 int tox_delfriend(void *tox, int friendnumber)
 {
     Messenger *m = tox;
-    return m_delfriend(m, friendnumber);
+    tox_thread_lock(m);
+    int ret = m_delfriend(m, friendnumber);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* return 4 if friend is online.
@@ -101,7 +124,22 @@ int tox_delfriend(void *tox, int friendnumber)
 int tox_friendstatus(void *tox, int friendnumber)
 {
     Messenger *m = tox;
-    return m_friendstatus(m, friendnumber);
+    tox_thread_lock(m);
+    int ret = m_friendstatus(m, friendnumber);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+/* Queue a message for the network thread. Only the length can be checked here, the message
+ * is dropped if the friend isn't online by the time the thread sends it.
+ */
+static uint32_t post_message(Messenger *m, int friendnumber, uint32_t theid, uint8_t *message, uint32_t length)
+{
+    if (length >= MAX_DATA_SIZE - sizeof(theid)
+            || tox_thread_post(m, TOX_COMMAND_SENDMESSAGE, friendnumber, theid, message, length) == -1)
+        return 0;
+
+    return theid;
 }
 
 /* Send a text chat message to an online friend.
@@ -116,12 +154,20 @@ int tox_friendstatus(void *tox, int friendnumber)
 uint32_t tox_sendmessage(void *tox, int friendnumber, uint8_t *message, uint32_t length)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL)
+        return post_message(m, friendnumber, tox_thread_message_id(m), message, length);
+
     return m_sendmessage(m, friendnumber, message, length);
 }
 
 uint32_t tox_sendmessage_withid(void *tox, int friendnumber, uint32_t theid, uint8_t *message, uint32_t length)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL)
+        return post_message(m, friendnumber, theid, message, length);
+
     return m_sendmessage_withid(m, friendnumber, theid, message, length);
 }
 
@@ -132,9 +178,53 @@ uint32_t tox_sendmessage_withid(void *tox, int friendnumber, uint32_t theid, uin
 int tox_sendaction(void *tox, int friendnumber, uint8_t *action, uint32_t length)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        if (length >= MAX_DATA_SIZE
+                || tox_thread_post(m, TOX_COMMAND_SENDACTION, friendnumber, 0, action, length) == -1)
+            return 0;
+
+        return 1;
+    }
+
     return m_sendaction(m, friendnumber, action, length);
 }
 
+uint32_t tox_sendmessage_multi(void *tox, int *friendnumbers, uint32_t num, uint8_t *message, uint32_t length,
+                               uint32_t *ids)
+{
+    Messenger *m = tox;
+    uint32_t i, sent = 0;
+
+    if (m->thread == NULL)
+        return m_sendmessage_multi(m, friendnumbers, num, message, length, ids);
+
+    for (i = 0; i < num; ++i) {
+        ids[i] = post_message(m, friendnumbers[i], tox_thread_message_id(m), message, length);
+        sent += ids[i] != 0;
+    }
+
+    return sent;
+}
+
+uint32_t tox_sendaction_multi(void *tox, int *friendnumbers, uint32_t num, uint8_t *action, uint32_t length,
+                              uint8_t *accepted)
+{
+    Messenger *m = tox;
+    uint32_t i, sent = 0;
+
+    if (m->thread == NULL)
+        return m_sendaction_multi(m, friendnumbers, num, action, length, accepted);
+
+    for (i = 0; i < num; ++i) {
+        accepted[i] = length < MAX_DATA_SIZE
+                      && tox_thread_post(m, TOX_COMMAND_SENDACTION, friendnumbers[i], 0, action, length) == 0;
+        sent += accepted[i];
+    }
+
+    return sent;
+}
+
 /* Set our nickname.
  * name must be a string of maximum MAX_NAME_LENGTH length.
  * length must be at least 1 byte.
@@ -145,6 +235,14 @@ int tox_sendaction(void *tox, int friendnumber, uint8_t *action, uint32_t length
 int tox_setname(void *tox, uint8_t *name, uint16_t length)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        if (length > MAX_NAME_LENGTH || length == 0)
+            return -1;
+
+        return tox_thread_post(m, TOX_COMMAND_SETNAME, -1, 0, name, length);
+    }
+
     return setname(m, name, length);
 }
 
@@ -158,7 +256,10 @@ int tox_setname(void *tox, uint8_t *name, uint16_t length)
 uint16_t tox_getselfname(void *tox, uint8_t *name, uint16_t nlen)
 {
     Messenger *m = tox;
-    return getself_name(m, name, nlen);
+    tox_thread_lock(m);
+    uint16_t ret = getself_name(m, name, nlen);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Get name of friendnumber and put it in name.
@@ -169,7 +270,10 @@ uint16_t tox_getselfname(void *tox, uint8_t *name, uint16_t nlen)
 int tox_getname(void *tox, int friendnumber, uint8_t *name)
 {
     Messenger *m = tox;
-    return getname(m, friendnumber, name);
+    tox_thread_lock(m);
+    int ret = getname(m, friendnumber, name);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* set our user status
@@ -178,12 +282,28 @@ int tox_getname(void *tox, int friendnumber, uint8_t *name)
 int tox_set_statusmessage(void *tox, uint8_t *status, uint16_t length)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        if (length > MAX_STATUSMESSAGE_LENGTH)
+            return -1;
+
+        return tox_thread_post(m, TOX_COMMAND_STATUSMESSAGE, -1, 0, status, length);
+    }
+
     return m_set_statusmessage(m, status, length);
 }
 
 int tox_set_userstatus(void *tox, USERSTATUS status)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        if (status >= USERSTATUS_INVALID)
+            return -1;
+
+        return tox_thread_post(m, TOX_COMMAND_USERSTATUS, -1, status, NULL, 0);
+    }
+
     return m_set_userstatus(m, status);
 }
 
@@ -193,7 +313,10 @@ int tox_set_userstatus(void *tox, USERSTATUS status)
 int tox_get_statusmessage_size(void *tox, int friendnumber)
 {
     Messenger *m = tox;
-    return m_get_statusmessage_size(m, friendnumber);
+    tox_thread_lock(m);
+    int ret = m_get_statusmessage_size(m, friendnumber);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Copy friendnumber's status message into buf, truncating if size is over maxlen.
@@ -203,13 +326,19 @@ int tox_get_statusmessage_size(void *tox, int friendnumber)
 int tox_copy_statusmessage(void *tox, int friendnumber, uint8_t *buf, uint32_t maxlen)
 {
     Messenger *m = tox;
-    return m_copy_statusmessage(m, friendnumber, buf, maxlen);
+    tox_thread_lock(m);
+    int ret = m_copy_statusmessage(m, friendnumber, buf, maxlen);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 int tox_copy_self_statusmessage(void *tox, uint8_t *buf, uint32_t maxlen)
 {
     Messenger *m = tox;
-    return m_copy_self_statusmessage(m, buf, maxlen);
+    tox_thread_lock(m);
+    int ret = m_copy_self_statusmessage(m, buf, maxlen);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Return one of USERSTATUS values.
@@ -220,13 +349,19 @@ int tox_copy_self_statusmessage(void *tox, uint8_t *buf, uint32_t maxlen)
 USERSTATUS tox_get_userstatus(void *tox, int friendnumber)
 {
     Messenger *m = tox;
-    return m_get_userstatus(m, friendnumber);
+    tox_thread_lock(m);
+    USERSTATUS ret = m_get_userstatus(m, friendnumber);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 USERSTATUS tox_get_selfuserstatus(void *tox)
 {
     Messenger *m = tox;
-    return m_get_self_userstatus(m);
+    tox_thread_lock(m);
+    USERSTATUS ret = m_get_self_userstatus(m);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 
@@ -236,9 +371,23 @@ USERSTATUS tox_get_selfuserstatus(void *tox)
 void tox_set_sends_receipts(void *tox, int friendnumber, int yesno)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_post(m, TOX_COMMAND_SENDS_RECEIPTS, friendnumber, yesno, NULL, 0);
+        return;
+    }
+
     m_set_sends_receipts(m, friendnumber, yesno);
 }
 
+void tox_set_coalescing(void *tox, uint32_t latency)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    m_set_coalescing(m, latency);
+    tox_thread_unlock(m);
+}
+
 
 /* Set the function that will be executed when a friend request is received.
  *  Function format is function(uint8_t * public_key, uint8_t * data, uint16_t length)
@@ -246,6 +395,12 @@ void tox_set_sends_receipts(void *tox, int friendnumber, int yesno)
 void tox_callback_friendrequest(void *tox, void (*function)(uint8_t *, uint8_t *, uint16_t, void *), void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_FRIENDREQUEST, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_friendrequest(m, function, userdata);
 }
 
@@ -257,6 +412,12 @@ void tox_callback_friendmessage(void *tox, void (*function)(Messenger *tox, int,
                                 void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_FRIENDMESSAGE, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_friendmessage(m, function, userdata);
 }
 
@@ -266,6 +427,12 @@ void tox_callback_friendmessage(void *tox, void (*function)(Messenger *tox, int,
 void tox_callback_action(void *tox, void (*function)(Messenger *tox, int, uint8_t *, uint16_t, void *), void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_ACTION, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_action(m, function, userdata);
 }
 
@@ -277,6 +444,12 @@ void tox_callback_namechange(void *tox, void (*function)(Messenger *tox, int, ui
                              void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_NAMECHANGE, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_namechange(m, function, userdata);
 }
 
@@ -288,6 +461,12 @@ void tox_callback_statusmessage(void *tox, void (*function)(Messenger *tox, int,
                                 void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_STATUSMESSAGE, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_statusmessage(m, function, userdata);
 }
 
@@ -297,6 +476,12 @@ void tox_callback_statusmessage(void *tox, void (*function)(Messenger *tox, int,
 void tox_callback_userstatus(void *tox, void (*function)(Messenger *tox, int, USERSTATUS, void *), void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_USERSTATUS, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_userstatus(m, function, userdata);
 }
 
@@ -312,6 +497,12 @@ void tox_callback_userstatus(void *tox, void (*function)(Messenger *tox, int, US
 void tox_callback_read_receipt(void *tox, void (*function)(Messenger *tox, int, uint32_t, void *), void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_READ_RECEIPT, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_read_receipt(m, function, userdata);
 }
 
@@ -328,15 +519,131 @@ void tox_callback_read_receipt(void *tox, void (*function)(Messenger *tox, int,
 void tox_callback_connectionstatus(void *tox, void (*function)(Messenger *tox, int, uint8_t, void *), void *userdata)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_CONNECTIONSTATUS, (void (*)(void))function, userdata);
+        return;
+    }
+
     m_callback_connectionstatus(m, function, userdata);
 }
 
+int tox_set_send_watermarks(void *tox, int friendnumber, uint32_t low, uint32_t high)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    int ret = m_set_send_watermarks(m, friendnumber, low, high);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+uint32_t tox_sendqueue(void *tox, int friendnumber)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    uint32_t ret = m_sendqueue(m, friendnumber);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+void tox_callback_writable(void *tox, void (*function)(Messenger *tox, int, void *), void *userdata)
+{
+    Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_callback(m, TOX_EVENT_WRITABLE, (void (*)(void))function, userdata);
+        return;
+    }
+
+    m_callback_writable(m, function, userdata);
+}
+
+int tox_new_filesender(void *tox, int friendnumber, uint64_t filesize, uint8_t *filename, uint16_t filename_length)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    int ret = new_filesender(m, friendnumber, filesize, filename, filename_length);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+int tox_file_set_source(void *tox, int friendnumber, uint8_t filenumber, int fd, file_read_callback function,
+                        void *userdata)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    int ret = file_set_source(m, friendnumber, filenumber, fd, function, userdata);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+int tox_file_control(void *tox, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+                     uint8_t *data, uint16_t length)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    int ret = file_control(m, friendnumber, send_receive, filenumber, message_id, data, length);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+uint64_t tox_file_dataremaining(void *tox, int friendnumber, uint8_t filenumber, uint8_t send_receive)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    uint64_t ret = file_dataremaining(m, friendnumber, filenumber, send_receive);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+/* The file callbacks stay with the thread running Messenger, see tox.h. */
+void tox_callback_file_sendrequest(void *tox, void (*function)(Messenger *tox, int, uint8_t, uint64_t, uint8_t *,
+                                   uint16_t, void *), void *userdata)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    m_callback_file_sendrequest(m, function, userdata);
+    tox_thread_unlock(m);
+}
+
+void tox_callback_file_control(void *tox, void (*function)(Messenger *tox, int, uint8_t, uint8_t, uint8_t, uint8_t *,
+                               uint16_t, void *), void *userdata)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    m_callback_file_control(m, function, userdata);
+    tox_thread_unlock(m);
+}
+
+void tox_callback_file_data(void *tox, void (*function)(Messenger *tox, int, uint8_t, uint64_t, uint8_t *, uint16_t,
+                            void *), void *userdata)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    m_callback_file_data(m, function, userdata);
+    tox_thread_unlock(m);
+}
+
+void tox_ip_init_v4(IP *ip, uint32_t addr)
+{
+    ip_init_v4(ip, addr);
+}
+
 /* Use this function to bootstrap the client.
  *  Sends a get nodes request to the given node with ip port and public_key.
  */
 void tox_bootstrap(void *tox, IP_Port ip_port, uint8_t *public_key)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        uint8_t data[sizeof(IP_Port) + crypto_box_PUBLICKEYBYTES];
+        memcpy(data, &ip_port, sizeof(IP_Port));
+        memcpy(data + sizeof(IP_Port), public_key, crypto_box_PUBLICKEYBYTES);
+        tox_thread_post(m, TOX_COMMAND_BOOTSTRAP, -1, 0, data, sizeof(data));
+        return;
+    }
+
     DHT_bootstrap(m->dht, ip_port, public_key);
 }
 
@@ -346,7 +653,36 @@ void tox_bootstrap(void *tox, IP_Port ip_port, uint8_t *public_key)
 int tox_isconnected(void *tox)
 {
     Messenger *m = tox;
-    return DHT_isconnected(m->dht);
+    tox_thread_lock(m);
+    int ret = DHT_isconnected(m->dht);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+void tox_get_stats(void *tox, Stats *stats)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    DHT_get_stats(m->dht, stats);
+    tox_thread_unlock(m);
+}
+
+void tox_set_phase_timing(void *tox, uint8_t enable, uint32_t slow_tick,
+                          void (*function)(Messenger *tox, uint64_t *, void *), void *userdata)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    m_set_phase_timing(m, enable, slow_tick, function, userdata);
+    tox_thread_unlock(m);
+}
+
+uint64_t tox_get_phase_times(void *tox, uint64_t *times)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    uint64_t ret = m_get_phase_times(m, times);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Run this at startup.
@@ -364,6 +700,7 @@ void *tox_new(void)
 void tox_kill(void *tox)
 {
     Messenger *m = tox;
+    tox_thread_kill(m);
     cleanupMessenger(m);
 }
 
@@ -371,29 +708,90 @@ void tox_kill(void *tox)
 void tox_do(void *tox)
 {
     Messenger *m = tox;
+
+    if (m->thread != NULL) {
+        tox_thread_do(m);
+        return;
+    }
+
     doMessenger(m);
 }
 
+int tox_start_thread(void *tox)
+{
+    Messenger *m = tox;
+    return tox_thread_start(m);
+}
+
+int tox_get_fd(void *tox)
+{
+    Messenger *m = tox;
+
+    if (m->thread != NULL)
+        return tox_thread_get_fd(m);
+
+    return m->net->sock;
+}
+
+uint32_t tox_do_interval(void *tox)
+{
+    Messenger *m = tox;
+
+    if (m->thread != NULL)
+        return TOX_THREAD_INTERVAL;
+
+    return doMessenger_interval(m);
+}
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* returns the size of the messenger data (for saving). */
 uint32_t tox_size(void *tox)
 {
     Messenger *m = tox;
-    return Messenger_size(m);
+    tox_thread_lock(m);
+    uint32_t ret = Messenger_size(m);
+    tox_thread_unlock(m);
+    return ret;
 }
 
 /* Save the messenger in data (must be allocated memory of size Messenger_size()). */
 void tox_save(void *tox, uint8_t *data)
 {
     Messenger *m = tox;
+    tox_thread_lock(m);
     Messenger_save(m, data);
+    tox_thread_unlock(m);
+}
+
+/* returns the size of the changes to the friend list since the last save, 0 if there are none. */
+uint32_t tox_changes_size(void *tox)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    uint32_t ret = Messenger_changes_size(m);
+    tox_thread_unlock(m);
+    return ret;
+}
+
+/* Save the changes to the friend list since the last tox_save() or tox_save_changes() in data
+ * (must be allocated memory of size tox_changes_size()).
+ */
+void tox_save_changes(void *tox, uint8_t *data)
+{
+    Messenger *m = tox;
+    tox_thread_lock(m);
+    Messenger_save_changes(m, data);
+    tox_thread_unlock(m);
 }
 
 /* Load the messenger from data of size length. */
 int tox_load(void *tox, uint8_t *data, uint32_t length)
 {
     Messenger *m = tox;
-    return Messenger_load(m, data, length);
+    tox_thread_lock(m);
+    int ret = Messenger_load(m, data, length);
+    tox_thread_unlock(m);
+    return ret;
 }
 
@@ -37,19 +37,70 @@ extern "C" {
 #define TOX_FRIEND_ADDRESS_SIZE (TOX_CLIENT_ID_SIZE + sizeof(uint32_t) + sizeof(uint16_t))
 
 
+/* IPv6 address in network order, IPv4 addresses are mapped into it (::ffff:a.b.c.d): set those
+ * with tox_ip_init_v4().
+ */
 typedef union {
-    uint8_t c[4];
-    uint16_t s[2];
-    uint32_t i;
+    uint8_t c[16];
+    uint16_t s[8];
+    uint32_t i[4];
+    uint64_t l[2];
 } tox_IP;
 
 typedef struct {
     tox_IP ip;
-    uint16_t port;
+    uint16_t port; /* In network order. */
     /* Not used for anything right now. */
     uint16_t padding;
 } tox_IP_Port;
 
+/* Set ip to the IPv4 address addr (network order, what inet_addr() returns). */
+void tox_ip_init_v4(tox_IP *ip, uint32_t addr);
+
+#define TOX_STATS_HISTOGRAM_BUCKETS 16
+
+/* buckets[0] counts the values that are 0, buckets[i] the ones from 2^(i - 1) to 2^i - 1
+ * and the last bucket everything bigger.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[TOX_STATS_HISTOGRAM_BUCKETS];
+} Tox_Stats_Histogram;
+
+/* See tox_get_stats(), the counters only go up. */
+typedef struct {
+    uint64_t packets_received[256]; /* By first byte, including the ones with no handler. */
+    uint64_t bytes_received;
+    uint64_t packets_dropped; /* No handler for them or too big. */
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t send_errors;
+
+    uint64_t data_sent; /* New data packets of connections. */
+    uint64_t data_resent; /* Data packets sent again because the other asked for them. */
+    uint64_t handshakes_refused; /* Over the per IP limit. */
+    uint64_t connections_timed_out;
+    Tox_Stats_Histogram connection_rtt; /* Milliseconds. */
+
+    uint64_t decrypt_failures; /* Data packets of established connections that did not decrypt. */
+
+    uint64_t pings_sent;
+    uint64_t ping_responses;
+    uint64_t pings_missed; /* Nodes of the routing table that did not answer a ping. */
+    Tox_Stats_Histogram dht_rtt; /* Milliseconds, for pings and get nodes requests. */
+
+    uint64_t punch_runs; /* Hole punching attempts, one per NAT ping answer while not punching. */
+    uint64_t punch_pings;
+    uint64_t punch_successes; /* Attempts the friend answered. */
+    Tox_Stats_Histogram punch_time; /* Milliseconds from the first burst to the answer. */
+
+    uint32_t dht_nodes; /* In the routing table. */
+    uint32_t dht_good_nodes; /* Of those, the ones heard from recently. */
+    uint32_t dht_friends;
+    uint32_t connections;
+} Tox_Stats;
+
 /* Status definitions. */
 enum {
     TOX_NOFRIEND,
@@ -155,6 +206,21 @@ uint32_t tox_sendmessage_withid(Tox *tox, int friendnumber, uint32_t theid, uint
  */
 int tox_sendaction(Tox *tox, int friendnumber, uint8_t *action, uint32_t length);
 
+/* Send the same text chat message to the num friends in friendnumbers, cheaper than calling
+ * tox_sendmessage() for each of them: the packet is built once and reused.
+ *  ids[i] is set to the message id sent to friendnumbers[i], 0 if it was not put into its send queue.
+ *  returns the number of friends it was put into the send queue of.
+ */
+uint32_t tox_sendmessage_multi(Tox *tox, int *friendnumbers, uint32_t num, uint8_t *message, uint32_t length,
+                               uint32_t *ids);
+
+/* Same as tox_sendmessage_multi() for an action.
+ *  accepted[i] is set to 1 if it was put into the send queue of friendnumbers[i], 0 if not.
+ *  returns the number of friends it was put into the send queue of.
+ */
+uint32_t tox_sendaction_multi(Tox *tox, int *friendnumbers, uint32_t num, uint8_t *action, uint32_t length,
+                              uint8_t *accepted);
+
 /* Set our nickname.
  * name must be a string of maximum MAX_NAME_LENGTH length.
  * length must be at least 1 byte.
@@ -216,6 +282,13 @@ TOX_USERSTATUS tox_get_selfuserstatus(Tox *tox);
  */
 void tox_set_sends_receipts(Tox *tox, int friendnumber, int yesno);
 
+/* Let what is sent to a friend wait up to latency microseconds for more, so that small
+ * messages, actions, receipts and status updates sent close together go out as one packet.
+ * 0 (the default) sends everything right away. Friends need a version that understands
+ * these packets, the ones that don't drop them.
+ */
+void tox_set_coalescing(Tox *tox, uint32_t latency);
+
 /* Set the function that will be executed when a friend request is received.
  *  Function format is function(uint8_t * public_key, uint8_t * data, uint16_t length)
  */
@@ -274,6 +347,101 @@ void tox_callback_read_receipt(Tox *tox, void (*function)(Tox *tox, int, uint32_
  */
 void tox_callback_connectionstatus(Tox *tox, void (*function)(Tox *tox, int, uint8_t, void *), void *userdata);
 
+/* Set when tox_sendmessage() and tox_sendaction() to friendnumber start failing, and when they
+ * work again. They fail once high packets wait in the friend's send queue (0, the default, for when it's
+ * full). After one failed, the writable callback is called as soon as no more than low
+ * packets wait (0, the default, for half the queue).
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_set_send_watermarks(Tox *tox, int friendnumber, uint32_t low, uint32_t high);
+
+/* return the number of packets waiting in the send queue of friendnumber to be received. */
+uint32_t tox_sendqueue(Tox *tox, int friendnumber);
+
+/* Set the callback for when a friend whose send queue refused a message or an action can be
+ * sent to again.
+ *  function(Tox *tox, int friendnumber, void *userdata)
+ */
+void tox_callback_writable(Tox *tox, void (*function)(Tox *tox, int, void *), void *userdata);
+
+/* FILE SENDING AND RECEIVING
+ *
+ * Files go through their own packets: the data is read from its source (a file descriptor or
+ * a callback) only when the friend's send queue has room for it. Transfers end with a
+ * TOX_FILECONTROL_KILL callback when the friend goes offline, send the file again and accept it
+ * with the position to start from to resume. The file callbacks are called from the thread
+ * doing the work (the network thread after tox_start_thread()) and must not call any tox function.
+ */
+
+#define TOX_MAX_CONCURRENT_FILE_PIPES 16
+
+enum {
+    TOX_FILECONTROL_ACCEPT, /* Start, or resume after a pause. */
+    TOX_FILECONTROL_PAUSE,
+    TOX_FILECONTROL_KILL,
+    TOX_FILECONTROL_FINISHED /* Sent once all of a file was sent. */
+};
+
+/* Puts at most length bytes of the file from position in data.
+ *  return the number of bytes, 0 if there are no more, -1 if there is nothing yet.
+ */
+typedef int (*tox_file_read_callback)(Tox *tox, int friendnumber, uint8_t filenumber, uint64_t position,
+                                      uint8_t *data, uint16_t length, void *userdata);
+
+/* Offer friendnumber a file of filesize bytes named filename.
+ *  return the file number on success.
+ *  return -1 on failure.
+ */
+int tox_new_filesender(Tox *tox, int friendnumber, uint64_t filesize, uint8_t *filename, uint16_t filename_length);
+
+/* Set where the data of file filenumber we send to friendnumber comes from: it is read with
+ * pread() from fd if it's not -1, otherwise it is asked to function whenever there is room
+ * to send.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_file_set_source(Tox *tox, int friendnumber, uint8_t filenumber, int fd, tox_file_read_callback function,
+                        void *userdata);
+
+/* Send a TOX_FILECONTROL_* for file filenumber of friendnumber.
+ * send_receive is 0 for a file we send, 1 for one we receive.
+ * When accepting a file we receive, data can be the position to start from (8 bytes, network
+ * order).
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_file_control(Tox *tox, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+                     uint8_t *data, uint16_t length);
+
+/* return the number of bytes of the file left to send or receive.
+ * return 0 if there is no such transfer.
+ */
+uint64_t tox_file_dataremaining(Tox *tox, int friendnumber, uint8_t filenumber, uint8_t send_receive);
+
+/* Set the callback for file send requests.
+ *  function(Tox *tox, int friendnumber, uint8_t filenumber, uint64_t filesize, uint8_t *filename,
+ *           uint16_t filename_length, void *userdata)
+ */
+void tox_callback_file_sendrequest(Tox *tox, void (*function)(Tox *tox, int, uint8_t, uint64_t, uint8_t *, uint16_t,
+                                   void *), void *userdata);
+
+/* Set the callback for file controls.
+ *  function(Tox *tox, int friendnumber, uint8_t send_receive, uint8_t filenumber, uint8_t message_id,
+ *           uint8_t *data, uint16_t length, void *userdata)
+ * send_receive is the same as in tox_file_control(). Once all of a file we send was sent, it is
+ * called with send_receive 0 and TOX_FILECONTROL_FINISHED.
+ */
+void tox_callback_file_control(Tox *tox, void (*function)(Tox *tox, int, uint8_t, uint8_t, uint8_t, uint8_t *,
+                               uint16_t, void *), void *userdata);
+
+/* Set the callback for file data.
+ *  function(Tox *tox, int friendnumber, uint8_t filenumber, uint64_t position, uint8_t *data, uint16_t length,
+ *           void *userdata)
+ */
+void tox_callback_file_data(Tox *tox, void (*function)(Tox *tox, int, uint8_t, uint64_t, uint8_t *, uint16_t,
+                            void *), void *userdata);
+
 /* Use this function to bootstrap the client.
  *  Sends a get nodes request to the given node with ip port and public_key.
  */
@@ -284,6 +452,36 @@ void tox_bootstrap(Tox *tox, tox_IP_Port ip_port, uint8_t *public_key);
  */
 int tox_isconnected(Tox *tox);
 
+/* Fill stats with the counters of this instance since tox_new() and its current sizes. */
+void tox_get_stats(Tox *tox, Tox_Stats *stats);
+
+/* Phases of a tox_do() run, see tox_set_phase_timing(). */
+enum {
+    TOX_PHASE_NETWORK,
+    TOX_PHASE_DHT,
+    TOX_PHASE_LOSSLESS_UDP,
+    TOX_PHASE_NET_CRYPTO,
+    TOX_PHASE_INBOUND,
+    TOX_PHASE_FRIENDS,
+    TOX_PHASE_LAN_DISCOVERY,
+    TOX_PHASE_FLUSH,
+    TOX_PHASES
+};
+
+/* Time the phases of each tox_do() run (enable 1) or stop (enable 0), it is off by default.
+ * When a run takes slow_tick microseconds or more, function(tox, times, userdata) is called at
+ * its end with the microseconds each phase took (TOX_PHASES of them). It is called from the
+ * thread doing the work (the network thread after tox_start_thread()) and must not call any
+ * tox function. function can be NULL.
+ */
+void tox_set_phase_timing(Tox *tox, uint8_t enable, uint32_t slow_tick,
+                          void (*function)(Tox *tox, uint64_t *, void *), void *userdata);
+
+/* Copy the microseconds spent in each phase while timing was on to times (TOX_PHASES of them).
+ *  return the number of timed runs.
+ */
+uint64_t tox_get_phase_times(Tox *tox, uint64_t *times);
+
 /* Run this at startup.
  *  returns allocated instance of tox on success.
  *  returns 0 if there are problems.
@@ -297,6 +495,38 @@ void tox_kill(Tox *tox);
 /* The main loop that needs to be run at least 20 times per second. */
 void tox_do(Tox *tox);
 
+/* Event driven alternative to calling tox_do() in a tight loop:
+ * run tox_do(), then wait (select/poll/epoll) until tox_get_fd() is readable
+ * or tox_do_interval() milliseconds have passed, and repeat.
+ */
+
+/* return the UDP socket tox uses. */
+int tox_get_fd(Tox *tox);
+
+/* return the number of milliseconds before tox_do() has to be called again.
+ * Call it right after tox_do().
+ */
+uint32_t tox_do_interval(Tox *tox);
+
+/* Run tox in a thread of its own instead of in tox_do(), so that other threads can use it.
+ * Once it returns 0:
+ *  - Any thread can call the tox functions.
+ *  - tox_sendmessage(), tox_sendmessage_withid(), tox_sendaction(), the _multi() versions,
+ *    tox_setname(), tox_set_statusmessage(), tox_set_userstatus(), tox_set_sends_receipts() and tox_bootstrap()
+ *    are queued for the thread and return right away, they only fail on bad arguments.
+ *    Messages and actions wait in the queue while the friend's send queue is full, they are
+ *    dropped if the friend isn't online. Message ids are unique for this tox, not per friend.
+ *  - The other functions wait for the thread to be done with tox (at most one tox_do() run) and
+ *    see the effects of the queued calls the same thread made before.
+ *  - The callbacks are called from tox_do(), which does nothing else now. It must not be called
+ *    by more than one thread at a time; set the callbacks from that thread too.
+ *    tox_get_fd() is readable when there are callbacks waiting, and tox_do_interval() is long.
+ * Not available on Windows or without pthreads.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_start_thread(Tox *tox);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* returns the size of the messenger data (for saving). */
@@ -305,7 +535,20 @@ uint32_t tox_size(Tox *tox);
 /* Save the messenger in data (must be allocated memory of size Messenger_size()). */
 void tox_save(Tox *tox, uint8_t *data);
 
-/* Load the messenger from data of size length. */
+/* returns the size of the changes to the friend list since the last save, 0 if there are none. */
+uint32_t tox_changes_size(Tox *tox);
+
+/* Save the changes to the friend list since the last tox_save() or tox_save_changes() in data
+ * (must be allocated memory of size tox_changes_size()).
+ * Append them to the saved data instead of saving everything again, tox_load() applies them.
+ */
+void tox_save_changes(Tox *tox, uint8_t *data);
+
+/* Load the messenger from data of size length.
+ * data is only read, it can be the saved file mapped in memory.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
 int tox_load(Tox *tox, uint8_t *data, uint32_t length);
 
 
@@ -0,0 +1,548 @@
+/* tox_thread.c
+ *
+ * Running a Messenger in a thread of its own, for tox_start_thread().
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tox_thread.h"
+
+#if defined(HAVE_PTHREAD) && !defined(WIN32)
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "mpsc_queue.h"
+
+/* Milliseconds between tries of a blocked send. */
+#define BLOCKED_INTERVAL 50
+
+/* A command for the network thread or an event for tox_thread_do(). */
+typedef struct {
+    MPSC_Node node; /* Must be first. */
+    uint8_t   type;
+    int       friendnumber;
+    uint32_t  number;
+    uint32_t  length;
+    uint8_t   data[];
+} Tox_Call;
+
+typedef struct {
+    void (*function)(void);
+    void *userdata;
+} Tox_Callback;
+
+typedef struct {
+    Messenger   *m;
+    pthread_t    thread;
+
+    /* Whoever holds lock owns m and pops commands. */
+    pthread_mutex_t lock;
+    uint8_t      stop;
+
+    MPSC_Queue   commands;
+    MPSC_Queue   events;
+
+    /* Send that didn't fit in the send queue of the friend, run before the others. */
+    Tox_Call    *blocked;
+
+    /* events_fds[0] is readable when there are events, see tox_thread_get_fd(). */
+    int          events_fds[2];
+
+    uint32_t     message_id;
+
+    /* Only used by the thread calling tox_thread_do(). */
+    Tox_Callback callbacks[TOX_EVENT_NUM];
+} Tox_Thread;
+
+static Tox_Call *new_call(uint8_t type, int friendnumber, uint32_t number, uint8_t *data, uint32_t length)
+{
+    Tox_Call *call = malloc(sizeof(Tox_Call) + length);
+
+    if (call == NULL)
+        return NULL;
+
+    call->type = type;
+    call->friendnumber = friendnumber;
+    call->number = number;
+    call->length = length;
+
+    if (length != 0)
+        memcpy(call->data, data, length);
+
+    return call;
+}
+
+/* return -1 if a send to friendnumber that failed must be tried again later.
+ * return 0 if it must be dropped.
+ */
+static int send_failed(Messenger *m, int friendnumber)
+{
+    /* The arguments were checked before queueing, a friend that is online has a full queue. */
+    if (m_friendstatus(m, friendnumber) == FRIEND_ONLINE)
+        return -1;
+
+    return 0;
+}
+
+/*  return 0 if the call is done.
+ *  return -1 if it can't be done yet.
+ */
+static int run_call(Messenger *m, Tox_Call *call)
+{
+    switch (call->type) {
+        case TOX_COMMAND_SENDMESSAGE:
+            if (m_sendmessage_withid(m, call->friendnumber, call->number, call->data, call->length) == 0)
+                return send_failed(m, call->friendnumber);
+
+            break;
+
+        case TOX_COMMAND_SENDACTION:
+            if (m_sendaction(m, call->friendnumber, call->data, call->length) == 0)
+                return send_failed(m, call->friendnumber);
+
+            break;
+
+        case TOX_COMMAND_SETNAME:
+            setname(m, call->data, call->length);
+            break;
+
+        case TOX_COMMAND_STATUSMESSAGE:
+            m_set_statusmessage(m, call->data, call->length);
+            break;
+
+        case TOX_COMMAND_USERSTATUS:
+            m_set_userstatus(m, call->number);
+            break;
+
+        case TOX_COMMAND_SENDS_RECEIPTS:
+            m_set_sends_receipts(m, call->friendnumber, call->number);
+            break;
+
+        case TOX_COMMAND_BOOTSTRAP: {
+            IP_Port ip_port;
+            memcpy(&ip_port, call->data, sizeof(IP_Port));
+            DHT_bootstrap(m->dht, ip_port, call->data + sizeof(IP_Port));
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Run the commands in the queue, in order, with the lock held. */
+static void run_commands(Tox_Thread *thread)
+{
+    Tox_Call *call = thread->blocked;
+
+    thread->blocked = NULL;
+
+    while (call != NULL || (call = (Tox_Call *)mpsc_queue_pop(&thread->commands)) != NULL) {
+        if (run_call(thread->m, call) == -1) {
+            thread->blocked = call;
+            return;
+        }
+
+        free(call);
+        call = NULL;
+    }
+}
+
+static void handle_wakeup(void *object)
+{
+    run_commands(object);
+}
+
+static void push_event(Tox_Thread *thread, uint8_t type, int friendnumber, uint32_t number, uint8_t *data,
+                       uint32_t length)
+{
+    uint8_t byte = 0;
+    Tox_Call *call = new_call(type, friendnumber, number, data, length);
+
+    if (call == NULL)
+        return;
+
+    mpsc_queue_push(&thread->events, &call->node);
+
+    /* Nothing to do if it fails: the pipe is full so tox_get_fd() is readable already. */
+    if (write(thread->events_fds[1], &byte, 1) == -1)
+        return;
+}
+
+/* The callbacks of m while the thread runs, they queue the events for tox_thread_do(). */
+
+static void queue_friendrequest(uint8_t *public_key, uint8_t *data, uint16_t length, void *userdata)
+{
+    uint8_t temp[crypto_box_PUBLICKEYBYTES + MAX_DATA_SIZE];
+
+    if (length > MAX_DATA_SIZE)
+        return;
+
+    memcpy(temp, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(temp + crypto_box_PUBLICKEYBYTES, data, length);
+    push_event(userdata, TOX_EVENT_FRIENDREQUEST, -1, 0, temp, crypto_box_PUBLICKEYBYTES + length);
+}
+
+static void queue_friendmessage(Messenger *m, int friendnumber, uint8_t *message, uint16_t length, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_FRIENDMESSAGE, friendnumber, 0, message, length);
+}
+
+static void queue_action(Messenger *m, int friendnumber, uint8_t *action, uint16_t length, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_ACTION, friendnumber, 0, action, length);
+}
+
+static void queue_namechange(Messenger *m, int friendnumber, uint8_t *name, uint16_t length, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_NAMECHANGE, friendnumber, 0, name, length);
+}
+
+static void queue_statusmessage(Messenger *m, int friendnumber, uint8_t *status, uint16_t length, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_STATUSMESSAGE, friendnumber, 0, status, length);
+}
+
+static void queue_userstatus(Messenger *m, int friendnumber, USERSTATUS status, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_USERSTATUS, friendnumber, status, NULL, 0);
+}
+
+static void queue_read_receipt(Messenger *m, int friendnumber, uint32_t receipt, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_READ_RECEIPT, friendnumber, receipt, NULL, 0);
+}
+
+static void queue_connectionstatus(Messenger *m, int friendnumber, uint8_t status, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_CONNECTIONSTATUS, friendnumber, status, NULL, 0);
+}
+
+static void queue_writable(Messenger *m, int friendnumber, void *userdata)
+{
+    push_event(userdata, TOX_EVENT_WRITABLE, friendnumber, 0, NULL, 0);
+}
+
+static void *network_thread(void *arg)
+{
+    Tox_Thread *thread = arg;
+    Messenger *m = thread->m;
+
+    pthread_mutex_lock(&thread->lock);
+
+    while (!thread->stop) {
+        run_commands(thread);
+        doMessenger(m);
+        uint32_t interval = doMessenger_interval(m);
+
+        /* Acks free up room in the send queues, but not always before a packet arrives. */
+        if (thread->blocked != NULL && interval > BLOCKED_INTERVAL)
+            interval = BLOCKED_INTERVAL;
+
+        pthread_mutex_unlock(&thread->lock);
+
+        /* tox_thread_post() and tox_thread_unlock() cut this short. */
+        networking_wait(m->net, interval);
+
+        pthread_mutex_lock(&thread->lock);
+    }
+
+    pthread_mutex_unlock(&thread->lock);
+    return NULL;
+}
+
+static void set_callback(Tox_Thread *thread, uint8_t type, void (*function)(void), void *userdata)
+{
+    thread->callbacks[type].function = function;
+    thread->callbacks[type].userdata = userdata;
+}
+
+static void free_calls(MPSC_Queue *queue)
+{
+    MPSC_Node *node;
+
+    while ((node = mpsc_queue_pop(queue)) != NULL)
+        free(node);
+}
+
+int tox_thread_start(Messenger *m)
+{
+    if (m->thread != NULL)
+        return -1;
+
+    Tox_Thread *thread = calloc(1, sizeof(Tox_Thread));
+
+    if (thread == NULL)
+        return -1;
+
+    thread->m = m;
+    mpsc_queue_init(&thread->commands);
+    mpsc_queue_init(&thread->events);
+
+    if (pthread_mutex_init(&thread->lock, NULL) != 0) {
+        free(thread);
+        return -1;
+    }
+
+    if (pipe(thread->events_fds) == -1) {
+        pthread_mutex_destroy(&thread->lock);
+        free(thread);
+        return -1;
+    }
+
+    fcntl(thread->events_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(thread->events_fds[1], F_SETFL, O_NONBLOCK);
+
+    if (networking_set_wakeup_handler(m->net, &handle_wakeup, thread) == -1)
+        goto error;
+
+    /* tox_thread_do() calls these from now on. */
+    if (m->fr.handle_friendrequest_isset)
+        set_callback(thread, TOX_EVENT_FRIENDREQUEST, (void (*)(void))m->fr.handle_friendrequest,
+                     m->fr.handle_friendrequest_userdata);
+
+    set_callback(thread, TOX_EVENT_FRIENDMESSAGE, (void (*)(void))m->friend_message, m->friend_message_userdata);
+    set_callback(thread, TOX_EVENT_ACTION, (void (*)(void))m->friend_action, m->friend_action_userdata);
+    set_callback(thread, TOX_EVENT_NAMECHANGE, (void (*)(void))m->friend_namechange, m->friend_namechange_userdata);
+    set_callback(thread, TOX_EVENT_STATUSMESSAGE, (void (*)(void))m->friend_statusmessagechange,
+                 m->friend_statusmessagechange_userdata);
+    set_callback(thread, TOX_EVENT_USERSTATUS, (void (*)(void))m->friend_userstatuschange,
+                 m->friend_userstatuschange_userdata);
+    set_callback(thread, TOX_EVENT_READ_RECEIPT, (void (*)(void))m->read_receipt, m->read_receipt_userdata);
+    set_callback(thread, TOX_EVENT_CONNECTIONSTATUS, (void (*)(void))m->friend_connectionstatuschange,
+                 m->friend_connectionstatuschange_userdata);
+    set_callback(thread, TOX_EVENT_WRITABLE, (void (*)(void))m->friend_writable, m->friend_writable_userdata);
+
+    m_callback_friendrequest(m, &queue_friendrequest, thread);
+    m_callback_friendmessage(m, &queue_friendmessage, thread);
+    m_callback_action(m, &queue_action, thread);
+    m_callback_namechange(m, &queue_namechange, thread);
+    m_callback_statusmessage(m, &queue_statusmessage, thread);
+    m_callback_userstatus(m, &queue_userstatus, thread);
+    m_callback_read_receipt(m, &queue_read_receipt, thread);
+    m_callback_connectionstatus(m, &queue_connectionstatus, thread);
+    m_callback_writable(m, &queue_writable, thread);
+
+    m->thread = thread;
+
+    if (pthread_create(&thread->thread, NULL, &network_thread, thread) != 0) {
+        m->thread = NULL;
+        goto error;
+    }
+
+    return 0;
+
+error:
+    networking_set_wakeup_handler(m->net, NULL, thread);
+    close(thread->events_fds[0]);
+    close(thread->events_fds[1]);
+    pthread_mutex_destroy(&thread->lock);
+    free(thread);
+    return -1;
+}
+
+void tox_thread_kill(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+
+    if (thread == NULL)
+        return;
+
+    pthread_mutex_lock(&thread->lock);
+    thread->stop = 1;
+    pthread_mutex_unlock(&thread->lock);
+    networking_wakeup(m->net);
+    pthread_join(thread->thread, NULL);
+
+    networking_set_wakeup_handler(m->net, NULL, thread);
+    free(thread->blocked);
+    free_calls(&thread->commands);
+    free_calls(&thread->events);
+    close(thread->events_fds[0]);
+    close(thread->events_fds[1]);
+    pthread_mutex_destroy(&thread->lock);
+    free(thread);
+    m->thread = NULL;
+}
+
+void tox_thread_lock(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+
+    if (thread == NULL)
+        return;
+
+    pthread_mutex_lock(&thread->lock);
+    run_commands(thread);
+}
+
+void tox_thread_unlock(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+
+    if (thread == NULL)
+        return;
+
+    pthread_mutex_unlock(&thread->lock);
+    networking_wakeup(m->net);
+}
+
+int tox_thread_post(Messenger *m, uint8_t type, int friendnumber, uint32_t number, uint8_t *data,
+                    uint32_t length)
+{
+    Tox_Thread *thread = m->thread;
+    Tox_Call *call = new_call(type, friendnumber, number, data, length);
+
+    if (call == NULL)
+        return -1;
+
+    mpsc_queue_push(&thread->commands, &call->node);
+    networking_wakeup(m->net);
+    return 0;
+}
+
+uint32_t tox_thread_message_id(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+    uint32_t id;
+
+    do {
+        id = __sync_add_and_fetch(&thread->message_id, 1);
+    } while (id == 0);
+
+    return id;
+}
+
+void tox_thread_callback(Messenger *m, uint8_t type, void (*function)(void), void *userdata)
+{
+    set_callback(m->thread, type, function, userdata);
+}
+
+void tox_thread_do(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+    uint8_t bytes[64];
+    Tox_Call *call;
+
+    /* Empty the pipe first: an event pushed after this makes it readable again. */
+    while (read(thread->events_fds[0], bytes, sizeof(bytes)) > 0);
+
+    while ((call = (Tox_Call *)mpsc_queue_pop(&thread->events)) != NULL) {
+        Tox_Callback *callback = &thread->callbacks[call->type];
+
+        if (callback->function == NULL) {
+            free(call);
+            continue;
+        }
+
+        switch (call->type) {
+            case TOX_EVENT_FRIENDREQUEST:
+                ((void (*)(uint8_t *, uint8_t *, uint16_t, void *))callback->function)(call->data,
+                        call->data + crypto_box_PUBLICKEYBYTES, call->length - crypto_box_PUBLICKEYBYTES,
+                        callback->userdata);
+                break;
+
+            case TOX_EVENT_FRIENDMESSAGE:
+            case TOX_EVENT_ACTION:
+            case TOX_EVENT_NAMECHANGE:
+            case TOX_EVENT_STATUSMESSAGE:
+                ((void (*)(Messenger *, int, uint8_t *, uint16_t, void *))callback->function)(m, call->friendnumber,
+                        call->data, call->length, callback->userdata);
+                break;
+
+            case TOX_EVENT_USERSTATUS:
+                ((void (*)(Messenger *, int, USERSTATUS, void *))callback->function)(m, call->friendnumber,
+                        call->number, callback->userdata);
+                break;
+
+            case TOX_EVENT_READ_RECEIPT:
+                ((void (*)(Messenger *, int, uint32_t, void *))callback->function)(m, call->friendnumber,
+                        call->number, callback->userdata);
+                break;
+
+            case TOX_EVENT_CONNECTIONSTATUS:
+                ((void (*)(Messenger *, int, uint8_t, void *))callback->function)(m, call->friendnumber,
+                        call->number, callback->userdata);
+                break;
+
+            case TOX_EVENT_WRITABLE:
+                ((void (*)(Messenger *, int, void *))callback->function)(m, call->friendnumber, callback->userdata);
+                break;
+        }
+
+        free(call);
+    }
+}
+
+int tox_thread_get_fd(Messenger *m)
+{
+    Tox_Thread *thread = m->thread;
+    return thread->events_fds[0];
+}
+
+#else
+
+int tox_thread_start(Messenger *m)
+{
+    return -1;
+}
+
+void tox_thread_kill(Messenger *m)
+{
+}
+
+void tox_thread_lock(Messenger *m)
+{
+}
+
+void tox_thread_unlock(Messenger *m)
+{
+}
+
+/* The others are only called once tox_thread_start() succeeded. */
+
+int tox_thread_post(Messenger *m, uint8_t type, int friendnumber, uint32_t number, uint8_t *data,
+                    uint32_t length)
+{
+    return -1;
+}
+
+uint32_t tox_thread_message_id(Messenger *m)
+{
+    return 0;
+}
+
+void tox_thread_callback(Messenger *m, uint8_t type, void (*function)(void), void *userdata)
+{
+}
+
+void tox_thread_do(Messenger *m)
+{
+}
+
+int tox_thread_get_fd(Messenger *m)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,104 @@
+/* tox_thread.h
+ *
+ * Running a Messenger in a thread of its own, for tox_start_thread().
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TOX_THREAD_H
+#define TOX_THREAD_H
+
+#include "Messenger.h"
+
+/* Milliseconds tox_do_interval() returns once the thread runs, tox_get_fd() tells when
+ * there is something for tox_do() before that.
+ */
+#define TOX_THREAD_INTERVAL 1000
+
+/* Calls queued for the network thread, see tox_thread_post(). */
+enum {
+    TOX_COMMAND_SENDMESSAGE, /* friendnumber, number is the message id, data is the message. */
+    TOX_COMMAND_SENDACTION, /* friendnumber, data is the action. */
+    TOX_COMMAND_SETNAME, /* data is the name. */
+    TOX_COMMAND_STATUSMESSAGE, /* data is the status message. */
+    TOX_COMMAND_USERSTATUS, /* number is the USERSTATUS. */
+    TOX_COMMAND_SENDS_RECEIPTS, /* friendnumber, number is yesno. */
+    TOX_COMMAND_BOOTSTRAP /* data is the IP_Port followed by the public key. */
+};
+
+/* Callbacks tox_do() calls, see tox_thread_callback(). */
+enum {
+    TOX_EVENT_FRIENDREQUEST,
+    TOX_EVENT_FRIENDMESSAGE,
+    TOX_EVENT_ACTION,
+    TOX_EVENT_NAMECHANGE,
+    TOX_EVENT_STATUSMESSAGE,
+    TOX_EVENT_USERSTATUS,
+    TOX_EVENT_READ_RECEIPT,
+    TOX_EVENT_CONNECTIONSTATUS,
+    TOX_EVENT_WRITABLE,
+    TOX_EVENT_NUM
+};
+
+/* Start a thread that runs doMessenger() for m when needed.
+ * The callbacks set so far are moved to the thread, from now on they are called by
+ * tox_thread_do() instead of by doMessenger().
+ * Fails if something else uses the wakeup handler of the networking (crypto_workers_start()).
+ * Not available on Windows or without pthreads.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_thread_start(Messenger *m);
+
+/* Stop the thread if there is one, calls and events still queued are dropped. */
+void tox_thread_kill(Messenger *m);
+
+/* Get m for the calling thread: wait for the network thread to be done with it, then run the
+ * calls the calling thread queued before, so that it sees their effects.
+ * Does nothing if there is no thread.
+ */
+void tox_thread_lock(Messenger *m);
+
+/* Give m back to the network thread and make it check whether it has something to do. */
+void tox_thread_unlock(Messenger *m);
+
+/* Queue a call for the network thread, from any thread. The data is copied.
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int tox_thread_post(Messenger *m, uint8_t type, int friendnumber, uint32_t number, uint8_t *data,
+                    uint32_t length);
+
+/* return a new message id for TOX_COMMAND_SENDMESSAGE, never 0. */
+uint32_t tox_thread_message_id(Messenger *m);
+
+/* Set the function tox_thread_do() calls for events of type. function has the type of the
+ * matching tox_callback_*() argument.
+ */
+void tox_thread_callback(Messenger *m, uint8_t type, void (*function)(void), void *userdata);
+
+/* Call the callbacks of the queued events, in the calling thread.
+ * Only one thread at a time may call it.
+ */
+void tox_thread_do(Messenger *m);
+
+/* return a file descriptor that is readable whenever there are events for tox_thread_do(). */
+int tox_thread_get_fd(Messenger *m);
+
+#endif